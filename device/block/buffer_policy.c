@@ -0,0 +1,190 @@
+#include <buffer_policy.h>
+#include <ide_buffer.h>
+#include <hashtable.h>
+#include <memory.h>
+#include <debug.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// ------------------------------ LRU ------------------------------
+// 最简单的策略，所有空闲块按最后一次 brelse 的时间排成一个队列
+// 一次顺序扫描（hexdump /dev/sda、解压大文件）就会把整个缓存冲刷一遍
+
+static struct dlist lru_queue;
+
+static void lru_init(void) {
+	dlist_init(&lru_queue);
+}
+
+static void lru_insert(struct buffer_head* bh UNUSED) {
+}
+
+static void lru_pin(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+}
+
+static void lru_unpin(struct buffer_head* bh) {
+	dlist_push_back(&lru_queue, &bh->lru_tag);
+}
+
+static void lru_evict(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+}
+
+static void lru_demote(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+	dlist_push_front(&lru_queue, &bh->lru_tag);
+}
+
+static uint32_t lru_victim_queues(struct dlist** queues) {
+	queues[0] = &lru_queue;
+	return 1;
+}
+
+struct buffer_policy buffer_policy_lru = {
+	.name = "lru",
+	.init = lru_init,
+	.insert = lru_insert,
+	.pin = lru_pin,
+	.unpin = lru_unpin,
+	.evict = lru_evict,
+	.demote = lru_demote,
+	.victim_queues = lru_victim_queues,
+};
+
+// ------------------------------ 2Q ------------------------------
+// 新块先进入 A1in，只被访问过一次的块（顺序扫描产生的块）在 A1in 里就会被淘汰
+// 从 A1in 淘汰的块只在幽灵队列 A1out 中留下 key，不占数据内存
+// 如果一个块在 A1out 中还没被挤掉时又被访问了，说明它是真正的热块，直接进入 Am
+// Am 按 LRU 管理，只有 A1in 不超过自己的份额时才从 Am 中淘汰
+// 在 A1in 中的重复命中不会把块提升到 Am，短时间内的连续访问（例如一次读操作多次 bread 同一个块）不能说明它是热块
+
+#define TWOQ_A1IN 0
+#define TWOQ_AM 1
+
+// A1in 最多占缓存字节数的 1/TWOQ_KIN_RATIO
+#define TWOQ_KIN_RATIO 4
+// A1out 中最多记住的块数
+#define TWOQ_GHOST_NR 2048
+// 幽灵块的个数有上限，桶数一开始就给够，平均链长不超过 2，哈希表不会扩容
+// 淘汰块时（可能在 shrinker 中）不能再去申请内存换表
+#define TWOQ_GHOST_HASH_SIZE (TWOQ_GHOST_NR / 2)
+
+// 幽灵块，只记录块的 key
+struct twoq_ghost {
+	uint32_t lba;
+	struct disk* dev;
+	uint32_t size;
+	bool used;
+	struct dlist_elem hash_tag;
+};
+
+static struct dlist a1in_queue, am_queue;
+// 两个队列（包括当前被引用、暂时不在队列上的块）各自占用的字节数
+static uint32_t a1in_bytes, am_bytes;
+// A1out 是一个环形数组，满了之后覆盖最老的记录
+static struct twoq_ghost* ghosts;
+static uint32_t ghost_next;
+static struct hashtable ghost_table;
+
+static uint32_t ghost_hash(void* arg) {
+	struct twoq_ghost* key = (struct twoq_ghost*)arg;
+	return ((((uint32_t)key->dev >> 4) ^ key->lba)) * HASH_GOLDEN_RATIO_32;
+}
+
+static uint32_t ghost_elem_hash(struct dlist_elem* pelem) {
+	return ghost_hash(member_to_entry(struct twoq_ghost, hash_tag, pelem));
+}
+
+static bool ghost_condition(struct dlist_elem* pelem, void* arg) {
+	struct twoq_ghost* key = (struct twoq_ghost*)arg;
+	struct twoq_ghost* g = member_to_entry(struct twoq_ghost, hash_tag, pelem);
+	return g->dev == key->dev && g->lba == key->lba && g->size == key->size;
+}
+
+static void twoq_init(void) {
+	dlist_init(&a1in_queue);
+	dlist_init(&am_queue);
+	a1in_bytes = am_bytes = 0;
+	ghosts = kmalloc(TWOQ_GHOST_NR * sizeof(struct twoq_ghost));
+	if (ghosts == NULL) {
+		PANIC("twoq_init: fail to kmalloc ghosts");
+	}
+	ghost_next = 0;
+	hash_init(&ghost_table, TWOQ_GHOST_HASH_SIZE, ghost_hash, ghost_elem_hash, ghost_condition);
+}
+
+static void twoq_insert(struct buffer_head* bh) {
+	struct twoq_ghost key = {bh->b_blocknr, bh->b_dev, bh->b_size, false, {NULL, NULL}};
+	struct dlist_elem* de = hash_find(&ghost_table, &key);
+	if (de != NULL) {
+		// 在 A1out 中命中，说明它被淘汰后不久又被访问了
+		struct twoq_ghost* g = member_to_entry(struct twoq_ghost, hash_tag, de);
+		hash_remove(&ghost_table, &g->hash_tag);
+		g->used = false;
+		bh->b_queue = TWOQ_AM;
+		am_bytes += bh->b_size;
+	} else {
+		bh->b_queue = TWOQ_A1IN;
+		a1in_bytes += bh->b_size;
+	}
+}
+
+static void twoq_pin(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+}
+
+static void twoq_unpin(struct buffer_head* bh) {
+	dlist_push_back(bh->b_queue == TWOQ_AM ? &am_queue : &a1in_queue, &bh->lru_tag);
+}
+
+static void twoq_evict(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+	if (bh->b_queue == TWOQ_AM) {
+		am_bytes -= bh->b_size;
+		return;
+	}
+	a1in_bytes -= bh->b_size;
+
+	// 记入 A1out，覆盖掉最老的记录
+	struct twoq_ghost* g = &ghosts[ghost_next];
+	ghost_next = (ghost_next + 1) % TWOQ_GHOST_NR;
+	if (g->used) {
+		hash_remove(&ghost_table, &g->hash_tag);
+	}
+	g->lba = bh->b_blocknr;
+	g->dev = bh->b_dev;
+	g->size = bh->b_size;
+	g->used = true;
+	hash_insert(&ghost_table, g, &g->hash_tag);
+}
+
+// 挪到所在队列的队首，Am 中的块不会因为一次流式读就被降回 A1in
+static void twoq_demote(struct buffer_head* bh) {
+	dlist_remove(&bh->lru_tag);
+	dlist_push_front(bh->b_queue == TWOQ_AM ? &am_queue : &a1in_queue, &bh->lru_tag);
+}
+
+static uint32_t twoq_victim_queues(struct dlist** queues) {
+	// A1in 超过了自己的份额就先淘汰 A1in，否则先淘汰 Am
+	// 另一个队列排在后面，优先的队列里没有可以淘汰的块时用它兜底
+	if (a1in_bytes * TWOQ_KIN_RATIO > a1in_bytes + am_bytes) {
+		queues[0] = &a1in_queue;
+		queues[1] = &am_queue;
+	} else {
+		queues[0] = &am_queue;
+		queues[1] = &a1in_queue;
+	}
+	return 2;
+}
+
+struct buffer_policy buffer_policy_2q = {
+	.name = "2q",
+	.init = twoq_init,
+	.insert = twoq_insert,
+	.pin = twoq_pin,
+	.unpin = twoq_unpin,
+	.evict = twoq_evict,
+	.demote = twoq_demote,
+	.victim_queues = twoq_victim_queues,
+};
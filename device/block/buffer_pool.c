@@ -0,0 +1,174 @@
+#include <ide_buffer.h>
+#include <fs_types.h>
+#include <memory.h>
+#include <buddy.h>
+#include <sync.h>
+#include <debug.h>
+#include <string.h>
+#include <global.h>
+
+// buffer_head 和缓存块数据区的专用对象池
+// 缓存未命中时不再 kmalloc 两次，淘汰时也不再 kfree 两次，稳态下 getblk 和 blk_evict 都不会进入内核内存分配器
+// 数据区按块大小分成几个 slab，每个 slab 由整页组成，每页切成 PG_SIZE / size 个槽
+// 槽的大小等于块大小，并且槽不会跨页，DMA 时每个块仍然只需要一个 PRD 条目
+// 空闲槽的链表节点直接放在槽自己的内存里
+// 每页还剩多少个空闲槽记录在该页 struct page 的 slab_cnt 中，与 kmalloc 的 arena 相同
+
+// 512B/1KB/2KB/4KB 四种块大小
+#define DATA_SLAB_NR 4
+
+struct data_slab {
+    uint32_t size;          // 槽的大小
+    uint32_t slots_per_page;
+    struct dlist free_slots;
+    uint32_t nr_pages;      // 该 slab 占用的页数
+};
+
+static struct data_slab data_slabs[DATA_SLAB_NR];
+// 空闲的 buffer_head，用 hash_tag 串起来
+// 和数据槽一样，每页还剩多少个空闲的 buffer_head 记在该页的 slab_cnt 中，整页空闲时由 shrink 还给内核
+#define BHS_PER_PAGE (PG_SIZE / sizeof(struct buffer_head))
+static struct dlist free_bhs;
+// 保护上面所有的结构
+// 持有这把锁时不能申请内存，申请内存可能触发 shrinker，而 shrinker 淘汰块时会回到 bh_free 来拿这把锁
+static struct lock pool_lock;
+
+static struct data_slab* size_to_slab(uint32_t size) {
+    uint32_t idx = 0;
+    while (((uint32_t)SECTOR_SIZE << idx) < size) {
+        idx++;
+    }
+    ASSERT(idx < DATA_SLAB_NR && ((uint32_t)SECTOR_SIZE << idx) == size);
+    return &data_slabs[idx];
+}
+
+static struct page* slot_page(void* slot) {
+    return ADDR_TO_PAGE(global_pages, addr_v2p(PAGE_ALIGN_DOWN((uint32_t)slot)));
+}
+
+// 把新申请到的一页切成 buffer_head，挂到空闲链表上
+static void carve_bh_page(void* page) {
+    struct buffer_head* bh = page;
+    for (uint32_t i = 0; i < BHS_PER_PAGE; i++) {
+        dlist_push_back(&free_bhs, &bh[i].hash_tag);
+    }
+    struct page* pg = slot_page(page);
+    pg->slab_desc = NULL;
+    pg->slab_large = false;
+    pg->slab_cnt = BHS_PER_PAGE;
+}
+
+// 把新申请到的一页切成数据槽，挂到 slab 的空闲链表上
+static void carve_data_page(struct data_slab* slab, void* page) {
+    for (uint32_t i = 0; i < slab->slots_per_page; i++) {
+        dlist_push_back(&slab->free_slots, (struct dlist_elem*)((uint8_t*)page + i * slab->size));
+    }
+    struct page* pg = slot_page(page);
+    pg->slab_desc = NULL;
+    pg->slab_large = false;
+    pg->slab_cnt = slab->slots_per_page;
+    slab->nr_pages++;
+}
+
+void buffer_pool_init(void) {
+    lock_init(&pool_lock);
+    dlist_init(&free_bhs);
+    for (int i = 0; i < DATA_SLAB_NR; i++) {
+        data_slabs[i].size = SECTOR_SIZE << i;
+        data_slabs[i].slots_per_page = PG_SIZE / data_slabs[i].size;
+        data_slabs[i].nr_pages = 0;
+        dlist_init(&data_slabs[i].free_slots);
+    }
+}
+
+// 取出一个 buffer_head 和一个 size 字节的数据槽，b_data 和 b_size 已经填好，其他字段全部为 0
+// 池子空了就向内核申请一页，内核内存耗尽时返回 NULL
+struct buffer_head* bh_alloc(uint32_t size) {
+    struct data_slab* slab = size_to_slab(size);
+
+    lock_acquire(&pool_lock);
+    while (dlist_empty(&free_bhs) || dlist_empty(&slab->free_slots)) {
+        bool need_bh = dlist_empty(&free_bhs);
+        lock_release(&pool_lock);
+        void* page = get_kernel_pages(1);
+        if (page == NULL) return NULL;
+        lock_acquire(&pool_lock);
+        // 放开锁期间别人可能已经补充过了，多出来的这一页留着下次用
+        if (need_bh) {
+            carve_bh_page(page);
+        } else {
+            carve_data_page(slab, page);
+        }
+    }
+
+    struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, dlist_pop_front(&free_bhs));
+    slot_page(bh)->slab_cnt--;
+    void* data = dlist_pop_front(&slab->free_slots);
+    slot_page(data)->slab_cnt--;
+    lock_release(&pool_lock);
+
+    memset(bh, 0, sizeof(struct buffer_head));
+    bh->b_data = data;
+    bh->b_size = size;
+    return bh;
+}
+
+// 把 buffer_head 和它的数据槽还给池子，页先留着给下一次未命中用，内存紧张时再由 shrink 还给内核
+void bh_free(struct buffer_head* bh) {
+    struct data_slab* slab = size_to_slab(bh->b_size);
+    lock_acquire(&pool_lock);
+    // 刚释放的槽放在队首，下一次优先复用，它的 cache line 可能还是热的
+    dlist_push_front(&slab->free_slots, (struct dlist_elem*)bh->b_data);
+    slot_page(bh->b_data)->slab_cnt++;
+    dlist_push_front(&free_bhs, &bh->hash_tag);
+    slot_page(bh)->slab_cnt++;
+    lock_release(&pool_lock);
+}
+
+// 把所有槽都空闲的数据页和 buffer_head 页还给内核，返回释放的字节数
+// 内核内存紧张时由 ide 缓存的 shrinker 调用，调用者持有 lru_lock
+// 这里持有 pool_lock 去等内核内存池的锁，而持有内核内存池锁的进程只能通过 shrinker 走到 bh_free，
+// 它在 shrinker 里拿不到 lru_lock 就会放弃，所以不会互相等待
+uint32_t buffer_pool_shrink(void) {
+    uint32_t freed = 0;
+    lock_acquire(&pool_lock);
+    for (int i = 0; i < DATA_SLAB_NR; i++) {
+        struct data_slab* slab = &data_slabs[i];
+        struct dlist_elem* pelem = slab->free_slots.head.next;
+        while (pelem != &slab->free_slots.tail) {
+            struct page* pg = slot_page(pelem);
+            if (pg->slab_cnt != slab->slots_per_page) {
+                pelem = pelem->next;
+                continue;
+            }
+            // 整页都是空闲槽，把这一页的所有槽从链表上摘下来
+            uint8_t* page = (uint8_t*)PAGE_ALIGN_DOWN((uint32_t)pelem);
+            for (uint32_t j = 0; j < slab->slots_per_page; j++) {
+                dlist_remove((struct dlist_elem*)(page + j * slab->size));
+            }
+            mfree_page(PF_KERNEL, page, 1);
+            slab->nr_pages--;
+            freed += PG_SIZE;
+            // 后继节点可能也在刚刚释放的页里，从头重新扫描
+            pelem = slab->free_slots.head.next;
+        }
+    }
+
+    struct dlist_elem* pelem = free_bhs.head.next;
+    while (pelem != &free_bhs.tail) {
+        if (slot_page(pelem)->slab_cnt != BHS_PER_PAGE) {
+            pelem = pelem->next;
+            continue;
+        }
+        // 整页的 buffer_head 都是空闲的，一起摘下来
+        struct buffer_head* bh = (struct buffer_head*)PAGE_ALIGN_DOWN((uint32_t)pelem);
+        for (uint32_t j = 0; j < BHS_PER_PAGE; j++) {
+            dlist_remove(&bh[j].hash_tag);
+        }
+        mfree_page(PF_KERNEL, bh, 1);
+        freed += PG_SIZE;
+        pelem = free_bhs.head.next;
+    }
+    lock_release(&pool_lock);
+    return freed;
+}
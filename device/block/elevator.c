@@ -0,0 +1,151 @@
+#include <elevator.h>
+#include <ide.h>
+#include <timer.h>
+#include <debug.h>
+
+// 请求按 lba 排好序放在 sort 队列里，每次从上一条命令结束的位置向后找第一个请求（C-LOOK），
+// 扫到最后一个之后回到最小的 lba 重新开始，磁头只朝一个方向移动，交错读写的进程不会让磁头来回跑
+// 同时每个请求都有一个期限，fifo 队首的请求超时后就不再排队，保证每个请求都能在有限时间内完成
+// 新请求入队时如果与队列中的请求首尾相接，就并入它，一条命令把这几个请求一起完成
+
+void elv_init(struct elevator* e) {
+	for (int dir = 0; dir < 2; dir++) {
+		dlist_init(&e->sort[dir]);
+		dlist_init(&e->fifo[dir]);
+	}
+	dlist_init(&e->flushes);
+	e->next_lba = 0;
+	e->seq = 0;
+	e->writes_starved = 0;
+}
+
+// 序号会回绕，用差值比较先后
+static bool seq_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static bool can_merge(struct request* head, struct request* rq) {
+	return head->op == rq->op
+		&& head->cmd_secs + rq->cmd_secs <= head->disk->max_secs
+		&& head->cmd_vecs + rq->cmd_vecs <= ELV_MAX_MERGE_VECS;
+}
+
+// 把 rq 放进磁盘的调度队列，能和队列中的请求合并就直接并进去
+void elv_add(struct disk* hd, struct request* rq) {
+	struct elevator* e = &hd->elv;
+	rq->merge_next = NULL;
+	rq->merge_tail = rq;
+	rq->cmd_secs = rq->sec_cnt;
+	rq->cmd_vecs = rq->vec_cnt;
+	rq->seq = e->seq++;
+	if (rq->op == REQ_FLUSH) {
+		dlist_push_back(&e->flushes, &rq->queue_tag);
+		return;
+	}
+
+	uint8_t dir = rq->op;
+	rq->deadline = ticks + (dir == REQ_READ ? ELV_READ_EXPIRE : ELV_WRITE_EXPIRE);
+
+	// 找到第一个 lba 比 rq 大的请求 next，rq 应该插在它和它前面的 prev 之间
+	struct dlist* sort = &e->sort[dir];
+	struct dlist_elem* pelem = sort->head.next;
+	while (pelem != &sort->tail && (member_to_entry(struct request, queue_tag, pelem))->lba < rq->lba) {
+		pelem = pelem->next;
+	}
+	struct request* next = pelem != &sort->tail ? member_to_entry(struct request, queue_tag, pelem) : NULL;
+	struct request* prev = pelem->prev != &sort->head ? member_to_entry(struct request, queue_tag, pelem->prev) : NULL;
+
+	// 向后合并：rq 紧接在 prev 这条命令的后面
+	if (prev != NULL && prev->lba + prev->cmd_secs == rq->lba && can_merge(prev, rq)) {
+		prev->merge_tail->merge_next = rq;
+		prev->merge_tail = rq;
+		prev->cmd_secs += rq->cmd_secs;
+		prev->cmd_vecs += rq->cmd_vecs;
+		hd->stats.merges++;
+		return;
+	}
+	// 向前合并：next 这条命令紧接在 rq 的后面，rq 成为新的命令头
+	// 命令继承 next 在 fifo 中的位置、序号和期限，它们都不比 rq 晚
+	if (next != NULL && rq->lba + rq->cmd_secs == next->lba && can_merge(next, rq)) {
+		rq->merge_next = next;
+		rq->merge_tail = next->merge_tail;
+		rq->cmd_secs += next->cmd_secs;
+		rq->cmd_vecs += next->cmd_vecs;
+		rq->seq = next->seq;
+		rq->deadline = next->deadline;
+		rq->start = next->start;
+		dlist_insert_front(&next->queue_tag, &rq->queue_tag);
+		dlist_remove(&next->queue_tag);
+		dlist_insert_front(&next->fifo_tag, &rq->fifo_tag);
+		dlist_remove(&next->fifo_tag);
+		hd->stats.merges++;
+		return;
+	}
+
+	if (next != NULL) {
+		dlist_insert_front(&next->queue_tag, &rq->queue_tag);
+	} else {
+		dlist_push_back(sort, &rq->queue_tag);
+	}
+	dlist_push_back(&e->fifo[dir], &rq->fifo_tag);
+}
+
+// 在 dir 方向上选出下一条命令
+static struct request* elv_pick(struct elevator* e, uint8_t dir) {
+	// 最老的请求已经超时，不再让它排队
+	struct request* oldest = member_to_entry(struct request, fifo_tag, e->fifo[dir].head.next);
+	if ((int32_t)(ticks - oldest->deadline) >= 0) {
+		return oldest;
+	}
+	// C-LOOK：上一条命令结束位置之后的第一个请求，没有就回到最小的 lba
+	struct dlist* sort = &e->sort[dir];
+	struct dlist_elem* pelem = sort->head.next;
+	while (pelem != &sort->tail) {
+		struct request* rq = member_to_entry(struct request, queue_tag, pelem);
+		if (rq->lba >= e->next_lba) {
+			return rq;
+		}
+		pelem = pelem->next;
+	}
+	return member_to_entry(struct request, queue_tag, sort->head.next);
+}
+
+// 从调度队列中取出下一条要发给磁盘的命令，队列为空时返回 NULL
+// 返回的是命令头，合并进来的请求挂在它的 merge_next 上
+struct request* elv_next(struct disk* hd) {
+	struct elevator* e = &hd->elv;
+	bool has_read = !dlist_empty(&e->fifo[REQ_READ]);
+	bool has_write = !dlist_empty(&e->fifo[REQ_WRITE]);
+
+	// FLUSH CACHE 只覆盖在它之前完成的写，所以要等之前提交的写全部发出去
+	// ide 通道同一时刻只执行一条命令，发出去的写此时都已经完成了；ahci、virtio-blk 这样能同时执行多条命令的驱动要自己等它们完成
+	bool flush_blocked = false;
+	if (!dlist_empty(&e->flushes)) {
+		struct request* flush = member_to_entry(struct request, queue_tag, e->flushes.head.next);
+		struct request* oldest_write = has_write ? member_to_entry(struct request, fifo_tag, e->fifo[REQ_WRITE].head.next) : NULL;
+		if (oldest_write == NULL || !seq_before(oldest_write->seq, flush->seq)) {
+			dlist_remove(&flush->queue_tag);
+			return flush;
+		}
+		// 有进程在等 fsync，先把挡在前面的写发完
+		flush_blocked = true;
+	}
+
+	if (!has_read && !has_write) {
+		return NULL;
+	}
+	uint8_t dir;
+	if (has_read && !flush_blocked && (!has_write || e->writes_starved < ELV_WRITES_STARVED)) {
+		dir = REQ_READ;
+		if (has_write) e->writes_starved++;
+	} else {
+		dir = REQ_WRITE;
+		e->writes_starved = 0;
+	}
+
+	struct request* rq = elv_pick(e, dir);
+	dlist_remove(&rq->queue_tag);
+	dlist_remove(&rq->fifo_tag);
+	e->next_lba = rq->lba + rq->cmd_secs;
+	return rq;
+}
@@ -29,6 +29,12 @@ int32_t ext_lba_base = 0;
 uint8_t p_no=0,l_no=0;
 // list of the partition table in extended partition
 struct dlist partition_list;
+// 系统中所有的磁盘，ide 磁盘在前，其他驱动（ahci 等）发现的磁盘按注册顺序排在后面
+struct dlist disk_list;
+// 下一个留给非 ide 磁盘的编号
+static uint32_t next_disk_idx = CHANNEL_NUM * DEVICE_NUM_PER_CHANNEL;
+// 正在轮询中推进命令，这时完成的命令记为轮询完成
+static bool ide_polling = false;
 
 struct partition_table_entry{
 	uint8_t bootable;
@@ -58,8 +64,11 @@ static void swap_pairs_bytes(const char* dst,char* buf,uint32_t len);
 static uint32_t identify_disk(struct disk* hd);
 static void partition_scan(struct disk* hd,uint32_t ext_lba);
 static bool partition_info(struct dlist_elem* pelem,void* arg UNUSED);
+static void ide_rq_intr(struct ide_channel* chan, uint8_t status, uint8_t dma_status);
+static void ide_start_io(struct disk* hd);
+static void ide_poll(struct disk* hd);
 
-static void ide_set_multiple_mode(struct disk* hd, uint8_t sec_per_block) {
+static bool ide_set_multiple_mode(struct disk* hd, uint8_t sec_per_block) {
     select_disk(hd);
     outb(reg_sect_cnt(hd->my_channel), sec_per_block);
     
@@ -75,39 +84,44 @@ static void ide_set_multiple_mode(struct disk* hd, uint8_t sec_per_block) {
     if (status & 0x01) { // 只检查 ERR 位
         uint8_t err = inb(reg_error(hd->my_channel));
         printk("Warning: disk %s Multiple Mode Fail. Err:0x%x\n", hd->name, err);
-    } else {
-        printk("Disk %s: Multiple Mode enabled, %d sectors per block.\n", hd->name, sec_per_block);
+        return false;
     }
+    printk("Disk %s: Multiple Mode enabled, %d sectors per block.\n", hd->name, sec_per_block);
+    return true;
 }
 
-// DMA 中断本质上还是磁盘中断，和 PIO 用的同一个接口
-void intr_handler_hd(uint8_t irq_no){
-	ASSERT(irq_no==0x2e||irq_no==0x2f);
-	uint8_t ch_no = irq_no-0x2e;
-	struct ide_channel* channel = &channels[ch_no];
-	ASSERT(channel->irq_no==irq_no);
-	
-	// channel->expecting_intr will be true
-	// after running cmd_out
-	if(!channel->expecting_intr){
-		return;
+// 通道上的命令走完了当前这一步，磁盘已经或者马上就会发出中断
+// 轮询可能抢先处理掉这一步并且让磁盘开始了下一步，之后才到的旧中断要靠它识别出来丢掉
+// 只看 BSY 不够：PIO 的数据步要等磁盘置上 DRQ，最后一步（写完最后一块、FLUSH 完成）要等 DRDY 并且 DRQ 已经清除
+static bool ide_step_done(struct ide_channel* channel) {
+	struct request* rq = channel->cur_rq;
+	// 读备用状态寄存器不会清除磁盘的中断
+	uint8_t status = inb(reg_alt_status(channel));
+	if (status & BIT_ALT_STAT_BSY) {
+		return false;
+	}
+	if (status & BIT_STAT_ERR) {
+		return true;
 	}
+	if (rq->op == REQ_FLUSH) {
+		return (status & BIT_ALT_STAT_DRDY) && !(status & BIF_ALT_STAT_DRQ);
+	}
+	if (channel->dma_enabled) {
+		return ide_dma_done(channel);
+	}
+	// 读：下一块数据准备好了；写：还有数据要写时磁盘在要下一块，写完最后一块后磁盘空闲下来
+	if (rq->op == REQ_READ || rq->secs_done < rq->cmd_secs) {
+		return status & BIF_ALT_STAT_DRQ;
+	}
+	return (status & BIT_ALT_STAT_DRDY) && !(status & BIF_ALT_STAT_DRQ);
+}
 
-	// DMA 状态检查
-    // 即使是 PIO 模式，读这个寄存器也是安全的
-    uint8_t dma_status = inb(channel->bmba + BM_STATUS_REG_OFFSE);
-	
+// 磁盘走完了一步，中断处理程序和轮询都从这里推进通道上的命令
+static void ide_channel_intr(struct ide_channel* channel) {
 	channel->expecting_intr = false;
 
-	// 如果 DMA 状态寄存器的中断位置 1，说明这是 DMA 传输完成
-	if (dma_status & BM_STATUS_INT) {
-		// 先停止 DMA 引擎 (Start 位清零)
-		uint8_t cmd = inb(channel->bmba + BM_COMMAND_REG_OFFSE);
-		outb(channel->bmba + BM_COMMAND_REG_OFFSE, cmd & ~BM_CMD_START);
-
-		// 再清除 DMA 中断位和错误位 (写 1 清除)
-		outb(channel->bmba + BM_STATUS_REG_OFFSE, dma_status | BM_STATUS_INT | BM_STATUS_ERROR);
-	}
+	// DMA 状态检查，传输完成时停止 DMA 引擎
+	uint8_t dma_status = ide_dma_finish(channel);
 
 	// read the status reg to signal the disk controller 
 	// that the I/O operation has done,
@@ -115,13 +129,50 @@ void intr_handler_hd(uint8_t irq_no){
 	// 读取磁盘状态寄存器 (ACK 中断)
 	// 这一步是 ATA 协议要求的，读取 status 寄存器会通知硬盘中断已被处理
 	// 如果不读这个，硬盘会一直拉高 IRQ 线，导致 CPU 被卡死
-	inb(reg_status(channel));
+	uint8_t status = inb(reg_status(channel));
+
+	if (channel->cur_rq != NULL) {
+		// 请求队列发出的命令，由中断处理程序推进或完成它，然后发出下一个请求
+		ide_rq_intr(channel, status, dma_status);
+		return;
+	}
 
 	// Awake the thread.
 	// Instead of running instantly, the thead will be put into the ready queue
 	sema_signal(&channel->wait_disk);
 }
 
+// DMA 中断本质上还是磁盘中断，和 PIO 用的同一个接口
+void intr_handler_hd(uint8_t irq_no){
+	ASSERT(irq_no==0x2e||irq_no==0x2f);
+	uint8_t ch_no = irq_no-0x2e;
+	struct ide_channel* channel = &channels[ch_no];
+	ASSERT(channel->irq_no==irq_no);
+	
+	// channel->expecting_intr will be true
+	// after running cmd_out
+	if(!channel->expecting_intr){
+		return;
+	}
+	// 这一步已经被轮询处理过了，磁盘还在执行下一步
+	if (channel->cur_rq != NULL && !ide_step_done(channel)) {
+		return;
+	}
+	ide_channel_intr(channel);
+}
+
+// 代替中断检查通道上的命令，磁盘走完了当前这一步就直接处理，调用者已经关中断
+// 磁盘的中断仍然会到来，那时 expecting_intr 已经清除，或者 ide_step_done 会发现它不属于磁盘现在的这一步
+static void ide_poll(struct disk* hd) {
+	struct ide_channel* channel = hd->my_channel;
+	if (channel->cur_rq == NULL || !channel->expecting_intr || !ide_step_done(channel)) {
+		return;
+	}
+	ide_polling = true;
+	ide_channel_intr(channel);
+	ide_polling = false;
+}
+
 void ide_init(){
 	printk("ide_init start\n");
 
@@ -129,6 +180,7 @@ void ide_init(){
 	memset(channels,0,CHANNEL_NUM*sizeof(struct ide_channel));
 	
 	dlist_init(&partition_list);
+	dlist_init(&disk_list);
 	// get the disk number from BIOS
 	uint8_t hd_cnt = *((uint8_t*)(BIOS_DISK_NUM_ADDR));
 	ASSERT(hd_cnt>0);
@@ -157,7 +209,8 @@ void ide_init(){
 
 		channel->expecting_intr = false;
 
-		lock_init(&channel->lock);
+		channel->cur_rq = NULL;
+		channel->next_dev = 0;
 
 		// the sema is initialized to 0
 		// so that the thread can be blocked by using this sema
@@ -173,48 +226,25 @@ void ide_init(){
 		while (dev_no<DISK_NUM_IN_CHANNEL){
 			// obtain the memory address that the channel has reserved for the disk
 			struct disk* hd = &channel->devices[dev_no];
-			
-			dlist_init(&hd->dirty_lists[0]);
-			dlist_init(&hd->dirty_lists[1]);
-			lock_init(&hd->lists_lock);
-			hd->active_dirty_idx = 0;
-
+			disk_init(hd);
 			hd->my_channel = channel;
 			hd->dev_no = dev_no;
+			hd->start_io = ide_start_io;
+			hd->poll = ide_poll;
+			hd->poll_spins = IDE_POLL_SPINS_MAX;
 
-			// 分配逻辑设备号给磁盘
-			int hd_idx = channel_no * 2 + dev_no;
-            hd->i_rdev = MAKEDEV(3, hd_idx * 16);
-
-			memset(hd->name,0,sizeof(hd->name));
-			
 			uint32_t sectors = identify_disk(hd);
 			if(sectors==0){ // 如果读出来扇区数是0，说明此处没设备，那么直接进行下一轮循环，
-				goto next_round;
+				dev_no++;
+				continue;
 			}
 			hd->total_sectors = sectors;
 
-			sprintf(hd->name,"sd%c",'a'+channel_no*2+dev_no);
-
-			// 初始化全盘分区的基本信息
-			memset(&hd->all_disk_part, 0, sizeof(struct partition));
-			sprintf(hd->all_disk_part.name, "%s", hd->name); // 例如名字就是 "sda"
-			hd->all_disk_part.my_disk = hd;
-			hd->all_disk_part.start_lba = 0;
-			// identify_disk 时拿到的总扇区数 
-			hd->all_disk_part.sec_cnt = sectors; 
-			hd->all_disk_part.i_rdev = hd->i_rdev; // 比如 0x30000
-
-			// 将全盘分区也挂载到全局分区链表中
-			// 这样 get_part_by_rdev 就能通过链表自动找到它
-			dlist_push_back(&partition_list, &hd->all_disk_part.part_tag);
-
-			ide_set_multiple_mode(hd, SECTORS_PER_OP_BLOCK); // 注入设置
-			partition_scan(hd,0);
-next_round:
-			ext_lba_base = 0;
-			p_no=0;
-			l_no=0;
+			// 设置失败时退回到每次中断只传一个扇区的 READ/WRITE SECTOR(S)
+			if (hd->multi_secs > 1 && !ide_set_multiple_mode(hd, hd->multi_secs)) {
+				hd->multi_secs = 1;
+			}
+			disk_register(hd, channel_no * DISK_NUM_IN_CHANNEL + dev_no);
 			dev_no++;
 		}
 		dev_no=0;
@@ -242,6 +272,67 @@ next_round:
 	printk("ide_init done\n");
 }
 
+// 初始化缓存和调度器在磁盘上使用的字段，驱动在探测磁盘之前调用
+void disk_init(struct disk* hd) {
+	hd->dirty_tree = RB_ROOT_INIT;
+	lock_init(&hd->dirty_lock);
+	dlist_init(&hd->dirty_list);
+	hd->dirty_bytes = 0;
+	hd->wb_thread = NULL;
+	hd->throttle_waiters = 0;
+	sema_init(&hd->throttle_wait, 0);
+	lock_init(&hd->wb_lock);
+	lock_init(&hd->flush_lock);
+	hd->wb_seq = hd->flushed_seq = 0;
+	hd->wb_error = 0;
+	hd->wb_batch = NULL;
+	hd->wb_vec = NULL;
+	hd->wb_rqs = NULL;
+	hd->whole_disk_writable = false;
+	elv_init(&hd->elv);
+	memset(hd->name,0,sizeof(hd->name));
+}
+
+// 为 ide 以外的驱动分配一个磁盘编号，编号用完时返回 -1
+int32_t disk_alloc_idx(void) {
+	if (next_disk_idx >= MAX_DISK_CNT) {
+		return -1;
+	}
+	return next_disk_idx++;
+}
+
+// 驱动已经填好了 total_sectors、max_secs 和 start_io，磁盘可以接受请求了
+// 这里给磁盘起名字、分配设备号，然后扫描分区表，把磁盘和它的分区挂到全局链表上
+// 驱动可以在 disk_init 之后自己起名字（比如 ram0），没有名字的磁盘按编号叫 sdX
+void disk_register(struct disk* hd, uint32_t disk_idx) {
+	ASSERT(disk_idx < MAX_DISK_CNT && hd->start_io != NULL && hd->max_secs > 0);
+	// 分配逻辑设备号给磁盘
+	hd->i_rdev = MAKEDEV(3, disk_idx * 16);
+	if (hd->name[0] == '\0') {
+		sprintf(hd->name,"sd%c",'a'+disk_idx);
+	}
+
+	// 初始化全盘分区的基本信息
+	memset(&hd->all_disk_part, 0, sizeof(struct partition));
+	sprintf(hd->all_disk_part.name, "%s", hd->name); // 例如名字就是 "sda"
+	hd->all_disk_part.my_disk = hd;
+	hd->all_disk_part.start_lba = 0;
+	// identify_disk 时拿到的总扇区数 
+	hd->all_disk_part.sec_cnt = hd->total_sectors; 
+	hd->all_disk_part.i_rdev = hd->i_rdev; // 比如 0x30000
+	hd->all_disk_part.blk_size = SECTOR_SIZE;
+
+	// 将全盘分区也挂载到全局分区链表中
+	// 这样 get_part_by_rdev 就能通过链表自动找到它
+	dlist_push_back(&partition_list, &hd->all_disk_part.part_tag);
+	dlist_push_back(&disk_list, &hd->disk_tag);
+
+	ext_lba_base = 0;
+	p_no=0;
+	l_no=0;
+	partition_scan(hd,0);
+}
+
 void select_disk(struct disk* hd){
 	uint8_t reg_device = BIT_DEV_MBS|BIT_DEV_LBA;
 	if(hd->dev_no==1){
@@ -251,17 +342,37 @@ void select_disk(struct disk* hd){
 	outb(reg_dev(hd->my_channel),reg_device);
 }
 
-void select_sector(struct disk* hd,uint32_t lba,uint8_t sec_cnt){
-	if (lba > max_lba) {
+// 设置起始 lba 和扇区数，返回是否需要用 LBA48 的 EXT 命令
+// 支持 LBA48 的磁盘也只在 LBA28 放不下时才用 EXT 命令，LBA28 少写几次端口
+bool select_sector(struct disk* hd,uint32_t lba,uint32_t sec_cnt){
+	if (lba >= hd->total_sectors || sec_cnt > hd->total_sectors - lba) {
         // struct task_struct* cur = get_running_task_struct();
         // printk("\n[IDE Error] Task:%s, CWD_Inode:0x%x, LBA:0x%x\n", 
         //         cur->name, cur->pwd->i_no, lba);
         // 若 CWD_Inode 还是旧的，则 sys_mount 的重置没生效
 		printk("select_sector: lba is 0x%x\n", lba);
-        ASSERT(lba <= max_lba);
+        ASSERT(lba < hd->total_sectors);
     }
+	ASSERT(sec_cnt > 0 && sec_cnt <= hd->max_secs);
 	struct ide_channel* channel = hd->my_channel;
 
+	if (hd->lba48 && (lba + sec_cnt > LBA28_MAX_SECTORS || sec_cnt > MAX_SECS_PER_CMD)) {
+		// LBA48 的每个寄存器都是两级的，先写高字节，再写低字节
+		// 扇区数是 16 位，lba 是 48 位，我们的 lba 只有 32 位，更高的 16 位总是 0
+		outb(reg_sect_cnt(channel),sec_cnt>>8);
+		outb(reg_lba_l(channel),lba>>24);
+		outb(reg_lba_m(channel),0);
+		outb(reg_lba_h(channel),0);
+		outb(reg_sect_cnt(channel),sec_cnt);
+		outb(reg_lba_l(channel),lba);
+		outb(reg_lba_m(channel),lba>>8);
+		outb(reg_lba_h(channel),lba>>16);
+		// lba 不再放在 DEV 寄存器里，只需要 LBA 位和主从位
+		outb(reg_dev(channel),BIT_DEV_MBS|BIT_DEV_LBA|(hd->dev_no==1?BIT_DEV_DEV:0));
+		return true;
+	}
+
+	// 写 0 表示 256 个扇区
 	outb(reg_sect_cnt(channel),sec_cnt);
 
 	// LBA is 28bits
@@ -271,12 +382,22 @@ void select_sector(struct disk* hd,uint32_t lba,uint8_t sec_cnt){
 	outb(reg_lba_h(channel),lba>>16);
 	// LBA 23~27 bits should be wrote to DEV reg
 	outb(reg_dev(channel),BIT_DEV_MBS|BIT_DEV_LBA|(hd->dev_no==1?BIT_DEV_DEV:0)|lba>>24);
+	return false;
+}
+
+// 写命令或者传完一块数据后，磁盘要过 400ns 才会置上 BSY，在这之前读到的状态是旧的
+// 读一次备用状态寄存器至少要 100ns，读四次就够了
+static void ide_settle(struct ide_channel* channel) {
+	for (int i = 0; i < 4; i++) {
+		inb(reg_alt_status(channel));
+	}
 }
 
 void cmd_out(struct ide_channel* channel,uint8_t cmd){
 	// the disk starts working after write cmd to cmd-reg
 	channel->expecting_intr = true;
 	outb(reg_cmd(channel),cmd);
+	ide_settle(channel);
 }
 
 static void read_from_sector(struct disk* hd,void* buf,uint8_t sec_cnt){
@@ -320,96 +441,461 @@ static bool busy_wait(struct disk* hd){
 	return false;
 }
 
-static void ide_read_pio(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-	lock_acquire(&hd->my_channel->lock);
+// 按顺序在 io_vec 数组中搬运 sec_cnt 个扇区，并推进 vec_idx/vec_off 游标
+// 一次中断准备好的扇区可能横跨好几个缓存块，所以这里要逐段拆开 insw/outsw
+static void pio_transfer_vec(struct disk* hd, struct io_vec* vec, uint32_t* vec_idx, uint32_t* vec_off, uint32_t sec_cnt, bool is_write) {
+	while (sec_cnt > 0) {
+		struct io_vec* cur = &vec[*vec_idx];
+		uint32_t secs = (cur->len - *vec_off) / SECTOR_SIZE;
+		if (secs > sec_cnt) {
+			secs = sec_cnt;
+		}
+		void* addr = (void*)((uint32_t)cur->base + *vec_off);
+		if (is_write) {
+			write2sector(hd, addr, secs);
+		} else {
+			read_from_sector(hd, addr, secs);
+		}
+		*vec_off += secs * SECTOR_SIZE;
+		sec_cnt -= secs;
+		if (*vec_off == cur->len) {
+			(*vec_idx)++;
+			*vec_off = 0;
+		}
+	}
+}
 
-    // 告知起始地址和总扇区数
-    select_sector(hd, lba, sec_cnt); 
-    
-    // 发送多扇区读指令
-    cmd_out(hd->my_channel, CMD_READ_MULTIPLE);
-
-    uint32_t secs_done = 0;
-    while(secs_done < sec_cnt) {
-        // 标记期待中断并睡眠
-        hd->my_channel->expecting_intr = true;
-        sema_wait(&hd->my_channel->wait_disk); 
-
-        // 计算本次中断触发后，硬盘缓冲区里准备好了多少扇区
-        // 如果剩余扇区数大于 Block 因子，则说明缓冲区里有整整一 Block
-        // 如果是最后一次中断，则读取剩下的所有扇区
-        uint32_t left_secs = sec_cnt - secs_done;
-        uint32_t secs_to_read = (left_secs < SECTORS_PER_OP_BLOCK) ? left_secs : SECTORS_PER_OP_BLOCK;
-
-        // 一口气用 insw 抽走这些数据
-        read_from_sector(hd, (void*)((uint32_t)buf + secs_done * SECTOR_SIZE), secs_to_read);
-        
-        secs_done += secs_to_read;
-    }
+// 计算 io_vec 数组一共覆盖了多少个扇区
+static uint32_t io_vec_sectors(struct io_vec* vec, uint32_t vec_cnt) {
+	uint32_t sec_cnt = 0;
+	for (uint32_t i = 0; i < vec_cnt; i++) {
+		ASSERT(vec[i].len % SECTOR_SIZE == 0);
+		sec_cnt += vec[i].len / SECTOR_SIZE;
+	}
+	return sec_cnt;
+}
 
-    lock_release(&hd->my_channel->lock);
+// 记录一条读写命令，start 是提交命令时的 ticks
+static void disk_account(struct disk* hd, bool is_write, uint32_t sec_cnt, uint32_t start) {
+	struct disk_stats* st = &hd->stats;
+	if (is_write) {
+		st->write_cmds++;
+		st->write_sectors += sec_cnt;
+	} else {
+		st->read_cmds++;
+		st->read_sectors += sec_cnt;
+	}
+	// 延迟落在哪个桶里：0 个 tick 放在第 0 个桶，[2^(i-1), 2^i) 个 tick 放在第 i 个桶
+	uint32_t lat = ticks - start;
+	uint32_t idx = 0;
+	while (lat != 0 && idx < BLK_LAT_BUCKETS - 1) {
+		lat >>= 1;
+		idx++;
+	}
+	st->lat_hist[idx]++;
 }
 
-static void ide_write_pio(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+// 中断上下文中不能像 busy_wait 那样睡眠，只能轮询
+// PIO 写命令发出后，磁盘通常在几微秒内就会准备好接收数据（BSY=0, DRQ=1）
+static bool pio_wait_drq(struct ide_channel* chan) {
+	for (uint32_t spin = 0; spin < PIO_DRQ_SPINS; spin++) {
+		// 读备用状态寄存器不会清除磁盘的中断
+		uint8_t status = inb(reg_alt_status(chan));
+		if (status & BIT_ALT_STAT_BSY) continue;
+		return !(status & BIT_STAT_ERR) && (status & BIF_ALT_STAT_DRQ);
+	}
+	return false;
+}
 
-	if (lba >= 0xC0000000) {
-		printk("ide_write LBA=0x%x\n",lba);
-		PANIC("Pointer leaked into LBA!");
+// PIO 写的下一块数据：等磁盘要数据，然后一口气用 outsw 写进磁盘的缓冲区
+// 磁盘把这一块写完后发出中断，中断处理程序再写下一块
+static bool pio_write_block(struct ide_channel* chan, struct request* rq) {
+	if (!pio_wait_drq(chan)) {
+		return false;
 	}
+	uint32_t left_secs = rq->cmd_secs - rq->secs_done;
+	uint32_t secs = (left_secs < rq->disk->multi_secs) ? left_secs : rq->disk->multi_secs;
+	pio_transfer_vec(rq->disk, chan->cmd_vec, &rq->vec_idx, &rq->vec_off, secs, true);
+	rq->secs_done += secs;
+	ide_settle(chan);
+	chan->expecting_intr = true;
+	return true;
+}
 
+static uint8_t pio_cmd(struct disk* hd, bool is_write, bool ext) {
+	if (hd->multi_secs > 1) {
+		if (is_write) return ext ? CMD_WRITE_MULTIPLE_EXT : CMD_WRITE_MULTIPLE;
+		return ext ? CMD_READ_MULTIPLE_EXT : CMD_READ_MULTIPLE;
+	}
+	if (is_write) return ext ? CMD_WRITE_SECTOR_EXT : CMD_WRITE_SECTOR;
+	return ext ? CMD_READ_SECTOR_EXT : CMD_READ_SECTOR;
+}
 
-    lock_acquire(&hd->my_channel->lock);
+// 合并过的命令由几个请求的 io_vec 首尾相接拼成，拼到通道的 merge_vec 里
+static void ide_build_cmd_vec(struct ide_channel* chan, struct request* rq) {
+	if (rq->merge_next == NULL) {
+		chan->cmd_vec = rq->vec;
+		chan->cmd_vec_cnt = rq->vec_cnt;
+		return;
+	}
+	uint32_t cnt = 0;
+	for (struct request* r = rq; r != NULL; r = r->merge_next) {
+		memcpy(&chan->merge_vec[cnt], r->vec, r->vec_cnt * sizeof(struct io_vec));
+		cnt += r->vec_cnt;
+	}
+	ASSERT(cnt == rq->cmd_vecs);
+	chan->cmd_vec = chan->merge_vec;
+	chan->cmd_vec_cnt = cnt;
+}
 
-    // 告知起始地址和总扇区数
-    select_sector(hd, lba, sec_cnt);
-    
-    // 发送多扇区写指令
-    cmd_out(hd->my_channel, CMD_WRITE_MULTIPLE);
-
-    uint32_t secs_done = 0;
-    while (secs_done < sec_cnt) {
-        // 在开始写入第一块之前，必须确认硬盘已经准备好接收数据（BSY=0, DRQ=1）
-        if (!busy_wait(hd)) {
-            PANIC("ide_write: busy_wait timeout before write!");
-        }
+// 把请求发给磁盘，发出去之后由中断推进
+// 调用者已经关中断，并且把 rq 设成了通道的 cur_rq；返回 false 说明磁盘没能接受这条命令
+static bool ide_issue(struct ide_channel* chan, struct request* rq) {
+	struct disk* hd = rq->disk;
+	if (rq->op == REQ_FLUSH) {
+		select_disk(hd);
+		// 磁盘把缓存写完后才会发中断，这可能要花很长时间
+		cmd_out(chan, hd->lba48 ? CMD_FLUSH_CACHE_EXT : CMD_FLUSH_CACHE);
+		return true;
+	}
+	bool is_write = rq->op == REQ_WRITE;
+	ide_build_cmd_vec(chan, rq);
+	rq->secs_done = 0;
+	rq->vec_idx = rq->vec_off = 0;
+	if (chan->dma_enabled) {
+		ide_dma_start(hd, rq->lba, chan->cmd_vec, chan->cmd_vec_cnt, rq->cmd_secs, is_write);
+		return true;
+	}
+	// 告知起始地址和总扇区数，然后发送多扇区读写指令
+	// 不支持多扇区模式的磁盘用 READ/WRITE SECTOR(S)，每个扇区一次中断
+	bool ext = select_sector(hd, rq->lba, rq->cmd_secs);
+	cmd_out(chan, pio_cmd(hd, is_write, ext));
+	// 读的数据准备好后磁盘会发中断；写则要先把第一块数据交给磁盘，它才会开始干活
+	return is_write ? pio_write_block(chan, rq) : true;
+}
 
-        // 计算本次要写入多少扇区（通常是 16 个，最后一次可能少于 16）
-        uint32_t left_secs = sec_cnt - secs_done;
-        uint32_t secs_to_write = (left_secs < SECTORS_PER_OP_BLOCK) ? left_secs : SECTORS_PER_OP_BLOCK;
+// 记账并通知命令中的每一个请求的提交者，rq 是命令头，此时已经不在通道上了
+// 所有磁盘驱动都用它完成命令，调用者已经关中断
+void ide_complete(struct request* rq, int32_t status) {
+	if (ide_polling) {
+		rq->disk->stats.polled_cmds++;
+	} else {
+		rq->disk->stats.intr_cmds++;
+	}
+	ide_end_cmd(rq, status);
+}
 
-        // 这里的 write2sector 内部会调用 outsw，一口气把数据刷进硬盘缓冲区
-        write2sector(hd, (void*)((uint32_t)buf + secs_done * SECTOR_SIZE), secs_to_write);
+// 同 ide_complete，但不算作轮询或者中断完成的命令
+// 给在提交时就同步完成命令的驱动（RAM 磁盘）使用，调用者已经关中断
+void ide_end_cmd(struct request* rq, int32_t status) {
+	if (rq->op == REQ_FLUSH) {
+		rq->disk->stats.flush_cmds++;
+	} else {
+		disk_account(rq->disk, rq->op == REQ_WRITE, rq->cmd_secs, rq->start);
+	}
+	while (rq != NULL) {
+		// end_io 返回后 rq 可能已经被释放了，先取出下一个
+		struct request* next = rq->merge_next;
+		rq->status = status;
+		rq->end_io(rq);
+		rq = next;
+	}
+}
 
-        // 写入一个 Block 后，硬盘会开始处理物理落盘，处理完后会发中断
-        hd->my_channel->expecting_intr = true;
-        sema_wait(&hd->my_channel->wait_disk);
+// 两个磁盘轮流取，一个磁盘上的请求再多也不会让另一个磁盘饿死
+static struct request* ide_next_cmd(struct ide_channel* chan) {
+	for (int i = 0; i < DEVICE_NUM_PER_CHANNEL; i++) {
+		struct disk* hd = &chan->devices[chan->next_dev];
+		chan->next_dev = (chan->next_dev + 1) % DEVICE_NUM_PER_CHANNEL;
+		struct request* rq = elv_next(hd);
+		if (rq != NULL) {
+			return rq;
+		}
+	}
+	return NULL;
+}
 
-        secs_done += secs_to_write;
-    }
+// 通道空闲时从调度器取出下一条命令发给磁盘，调用者已经关中断
+static void ide_start_next(struct ide_channel* chan) {
+	while (chan->cur_rq == NULL) {
+		struct request* rq = ide_next_cmd(chan);
+		if (rq == NULL) {
+			return;
+		}
+		chan->cur_rq = rq;
+		if (!ide_issue(chan, rq)) {
+			printk("ide: disk %s not ready for write at lba 0x%x\n", rq->disk->name, rq->lba);
+			chan->expecting_intr = false;
+			chan->cur_rq = NULL;
+			ide_complete(rq, -EIO);
+		}
+	}
+}
+
+static void ide_start_io(struct disk* hd) {
+	ide_start_next(hd->my_channel);
+}
+
+// 通道上正在执行的请求产生了中断，status 和 dma_status 是中断处理程序读到的状态
+static void ide_rq_intr(struct ide_channel* chan, uint8_t status, uint8_t dma_status) {
+	struct request* rq = chan->cur_rq;
+	int32_t err = 0;
+	if (status & BIT_STAT_ERR) {
+		printk("ide: disk %s op %d fail at lba 0x%x, err:0x%x\n", rq->disk->name, rq->op, rq->lba, inb(reg_error(chan)));
+		err = -EIO;
+	} else if (rq->op == REQ_FLUSH) {
+		// FLUSH CACHE 完成
+	} else if (chan->dma_enabled) {
+		// DMA 一次中断就是整条命令完成
+		if (dma_status & BM_STATUS_ERROR) {
+			printk("ide: disk %s DMA fail at lba 0x%x\n", rq->disk->name, rq->lba);
+			err = -EIO;
+		}
+	} else if (rq->op == REQ_READ) {
+		// 计算本次中断触发后，硬盘缓冲区里准备好了多少扇区
+		// 如果剩余扇区数大于 Block 因子，则说明缓冲区里有整整一 Block
+		// 如果是最后一次中断，则读取剩下的所有扇区
+		uint32_t left_secs = rq->cmd_secs - rq->secs_done;
+		uint32_t secs = (left_secs < rq->disk->multi_secs) ? left_secs : rq->disk->multi_secs;
+		// 一口气用 insw 抽走这些数据
+		pio_transfer_vec(rq->disk, chan->cmd_vec, &rq->vec_idx, &rq->vec_off, secs, false);
+		rq->secs_done += secs;
+		if (rq->secs_done < rq->cmd_secs) {
+			ide_settle(chan);
+			chan->expecting_intr = true;
+			return;
+		}
+	} else if (rq->secs_done < rq->cmd_secs) {
+		// PIO 写完了一块，接着写下一块
+		if (pio_write_block(chan, rq)) {
+			return;
+		}
+		printk("ide: disk %s not ready for write at lba 0x%x\n", rq->disk->name, rq->lba + rq->secs_done);
+		err = -EIO;
+	}
+
+	// 先让磁盘开始下一个请求，再通知提交者，磁盘不用等 end_io 执行完
+	chan->cur_rq = NULL;
+	ide_start_next(chan);
+	ide_complete(rq, err);
+}
+
+// 检查请求并初始化驱动使用的字段，请求超出磁盘的范围时返回 false
+static bool ide_prep(struct request* rq) {
+	struct disk* hd = rq->disk;
+	ASSERT(hd->start_io != NULL && rq->end_io != NULL);
+	if (rq->op == REQ_FLUSH) {
+		rq->sec_cnt = 0;
+		rq->vec_cnt = 0;
+	} else {
+		rq->sec_cnt = io_vec_sectors(rq->vec, rq->vec_cnt);
+		ASSERT(rq->sec_cnt > 0 && rq->sec_cnt <= hd->max_secs && rq->vec_cnt <= IDE_MAX_VECS);
+		for (uint32_t i = 0; i < rq->vec_cnt; i++) {
+			ASSERT((uint32_t)rq->vec[i].base >= KERNEL_PAGE_OFFSET);
+		}
+		if (rq->lba >= hd->total_sectors || rq->sec_cnt > hd->total_sectors - rq->lba) {
+			printk("%s: access beyond end of device, lba 0x%x, %d sectors\n", hd->name, rq->lba, rq->sec_cnt);
+			return false;
+		}
+	}
+	rq->status = 0;
+	rq->start = ticks;
+	return true;
+}
 
-    lock_release(&hd->my_channel->lock);
+// 没能交给调度器的请求直接以 -EIO 完成，调用者已经关中断
+static void ide_reject(struct request* rq) {
+	rq->status = -EIO;
+	rq->end_io(rq);
 }
 
-void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    struct ide_channel* chan = hd->my_channel;
-	ASSERT(chan!=NULL);
-	// chan->dma_enabled = false;
-	if(chan->dma_enabled) {
-		ide_read_dma(hd, lba, buf, sec_cnt);
+// 把请求交给磁盘的调度器，磁盘能接受新命令时立即发出，不等待它完成
+// 可以在进程上下文中调用，也可以在别的请求的 end_io 中调用
+void ide_submit(struct request* rq) {
+	bool ok = ide_prep(rq);
+	enum intr_status old = intr_disable();
+	if (ok) {
+		elv_add(rq->disk, rq);
+		rq->disk->start_io(rq->disk);
 	} else {
-		ide_read_pio(hd, lba, buf, sec_cnt);
+		ide_reject(rq);
 	}
+	intr_set_status(old);
+}
+
+void rq_batch_init(struct rq_batch* batch) {
+	batch->pending = 1;
+	batch->status = 0;
+	sema_init(&batch->done, 0);
+	batch->plugged = false;
+	dlist_init(&batch->plug_list);
+	batch->end_io = NULL;
+	batch->private = NULL;
 }
 
-void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-	struct ide_channel* chan = hd->my_channel;
-	ASSERT(chan!=NULL);
-	// chan->dma_enabled = false;
-	if(chan->dma_enabled) {
-		ide_write_dma(hd, lba, buf, sec_cnt);
+static void rq_batch_end_io(struct request* rq) {
+	struct rq_batch* batch = rq->private;
+	if (rq->status != 0) {
+		batch->status = rq->status;
+	}
+	if (--batch->pending == 0) {
+		if (batch->end_io != NULL) {
+			batch->end_io(batch);
+		} else {
+			sema_signal(&batch->done);
+		}
+	}
+}
+
+// 提交一个属于 batch 的请求，rq 的 end_io 和 private 会被覆盖
+// batch 被 plug 时请求先攒在 batch 里，等 unplug 时再交给调度器
+void rq_batch_submit(struct rq_batch* batch, struct request* rq) {
+	rq->end_io = rq_batch_end_io;
+	rq->private = batch;
+	// pending 也会在中断中被修改
+	enum intr_status old = intr_disable();
+	batch->pending++;
+	if (batch->plugged) {
+		if (ide_prep(rq)) {
+			dlist_push_back(&batch->plug_list, &rq->queue_tag);
+		} else {
+			ide_reject(rq);
+		}
 	} else {
-		ide_write_pio(hd, lba, buf, sec_cnt);
+		ide_submit(rq);
+	}
+	intr_set_status(old);
+}
+
+void rq_batch_plug(struct rq_batch* batch) {
+	batch->plugged = true;
+}
+
+// 把攒着的请求一次性交给调度器，全部入队之后才开始发命令
+void rq_batch_unplug(struct rq_batch* batch) {
+	batch->plugged = false;
+	if (dlist_empty(&batch->plug_list)) {
+		return;
+	}
+	enum intr_status old = intr_disable();
+	while (!dlist_empty(&batch->plug_list)) {
+		struct request* rq = member_to_entry(struct request, queue_tag, dlist_pop_front(&batch->plug_list));
+		elv_add(rq->disk, rq);
+	}
+	struct dlist_elem* pelem = disk_list.head.next;
+	while (pelem != &disk_list.tail) {
+		struct disk* hd = member_to_entry(struct disk, disk_tag, pelem);
+		hd->start_io(hd);
+		pelem = pelem->next;
+	}
+	intr_set_status(old);
+}
+
+// 等 batch 中的所有请求完成，返回 0 或者其中某个请求的错误码
+// 提交者持有的那 1 个计数保证最后一个请求提交之前 pending 不会降到 0
+int32_t rq_batch_wait(struct rq_batch* batch) {
+	rq_batch_unplug(batch);
+	enum intr_status old = intr_disable();
+	bool done = --batch->pending == 0;
+	intr_set_status(old);
+	if (!done) {
+		sema_wait(&batch->done);
+	}
+	return batch->status;
+}
+
+// 异步的 batch 提交完所有请求之后调用，放掉提交者持有的计数，不等请求完成就返回
+// 请求都已经完成（或者一个请求也没有提交）时 end_io 直接在这里被调用，此时已经关中断
+void rq_batch_commit(struct rq_batch* batch) {
+	ASSERT(batch->end_io != NULL);
+	rq_batch_unplug(batch);
+	enum intr_status old = intr_disable();
+	if (--batch->pending == 0) {
+		batch->end_io(batch);
+	}
+	intr_set_status(old);
+}
+
+// 自旋轮询磁盘，等 batch 中的请求全部完成，超出预算就放弃，交给 rq_batch_wait 睡眠等中断
+// 预算跟着最近几次轮询实际用的次数走：磁盘快的时候不会空转太久才放弃，轮询总是等不到时也很快退回到中断
+static void ide_poll_wait(struct disk* hd, struct rq_batch* batch) {
+	uint32_t budget = hd->poll_spins;
+	for (uint32_t spin = 1; spin <= budget; spin++) {
+		// 每次只关一小会儿中断，时钟中断和别的磁盘的中断照常处理
+		enum intr_status old = intr_disable();
+		hd->poll(hd);
+		bool done = batch->pending == 1;
+		intr_set_status(old);
+		if (done) {
+			// 留出一倍的余量，和原来的预算平均一下
+			uint32_t want = (budget + spin * 2) / 2;
+			hd->poll_spins = want < IDE_POLL_SPINS_MIN ? IDE_POLL_SPINS_MIN : (want > IDE_POLL_SPINS_MAX ? IDE_POLL_SPINS_MAX : want);
+			return;
+		}
+	}
+	hd->stats.poll_timeouts++;
+	hd->poll_spins = budget / 2 < IDE_POLL_SPINS_MIN ? IDE_POLL_SPINS_MIN : budget / 2;
+}
+
+// 同 rq_batch_wait，batch 里的请求都发给 hd 时使用，sec_cnt 是它们一共的扇区数
+// 小批量自旋轮询完成，省掉中断和两次进程切换；大批量的传输时间远远超过这些开销，睡眠等中断
+int32_t rq_batch_wait_disk(struct rq_batch* batch, struct disk* hd, uint32_t sec_cnt) {
+	rq_batch_unplug(batch);
+	if (hd->poll != NULL && sec_cnt <= IDE_POLL_MAX_SECS) {
+		ide_poll_wait(hd, batch);
+	}
+	return rq_batch_wait(batch);
+}
+
+// 同步读写：提交一个请求然后等它完成
+// 成功返回 0，出错（包括超出磁盘范围）返回 -EIO，由调用者决定怎么处理
+static int32_t ide_rw_sync(struct disk* hd, uint8_t op, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt) {
+	struct request rq = { .disk = hd, .op = op, .lba = lba, .vec = vec, .vec_cnt = vec_cnt };
+	struct rq_batch batch;
+	rq_batch_init(&batch);
+	rq_batch_submit(&batch, &rq);
+	int32_t err = rq_batch_wait_disk(&batch, hd, rq.sec_cnt);
+	if (err != 0) {
+		printk("ide: disk %s %s error at lba 0x%x\n", hd->name, op == REQ_WRITE ? "write" : "read", lba);
+	}
+	return err;
+}
+
+// 从 lba 开始读取连续扇区，数据按顺序分散到 vec 描述的各段内存中
+// 缓存层用它把未命中的块直接读进各自的 b_data，省掉一次中转拷贝
+int32_t ide_read_vec(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt) {
+	return ide_rw_sync(hd, REQ_READ, lba, vec, vec_cnt);
+}
+
+int32_t ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+	struct io_vec vec = { .base = buf, .len = sec_cnt * SECTOR_SIZE };
+	return ide_read_vec(hd, lba, &vec, 1);
+}
+
+// 把 vec 描述的各段内存按顺序写到从 lba 开始的连续扇区上
+// 写回线程用它直接把一串连续的脏块写回磁盘，不需要先拼到一块中转缓冲区里
+int32_t ide_write_vec(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt) {
+	return ide_rw_sync(hd, REQ_WRITE, lba, vec, vec_cnt);
+}
+
+int32_t ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+	struct io_vec vec = { .base = buf, .len = sec_cnt * SECTOR_SIZE };
+	return ide_write_vec(hd, lba, &vec, 1);
+}
+
+// 让磁盘把写缓存中的数据写到盘片上
+// 写命令完成只说明数据进了磁盘的写缓存，掉电仍然会丢，只有 FLUSH CACHE 完成后之前的写才算真正持久化
+// 调度器保证 FLUSH CACHE 在它之前提交的写全部完成之后才发出，因此它覆盖这些写
+int32_t ide_flush(struct disk* hd) {
+	struct request rq = { .disk = hd, .op = REQ_FLUSH };
+	struct rq_batch batch;
+	rq_batch_init(&batch);
+	rq_batch_submit(&batch, &rq);
+	int32_t err = rq_batch_wait(&batch);
+	if (err != 0) {
+		printk("ide_flush: disk %s flush cache fail\n", hd->name);
 	}
+	return err;
 }
 
 static void swap_pairs_bytes(const char* dst,char* buf,uint32_t len){
@@ -427,7 +913,8 @@ static uint32_t identify_disk(struct disk* hd){
 
 	uint8_t status = inb(reg_status(hd->my_channel));
 	// 如果状态是 0x00，通常意味着该位置没有设备，直接返回
-    if (status == 0) {
+	// 0xff 是没有控制器时总线上浮空的值，BIOS 报告的磁盘数包含 ahci 磁盘时第二个通道可能根本不存在
+    if (status == 0 || status == 0xff) {
         return 0; 
     }
 
@@ -451,15 +938,45 @@ static uint32_t identify_disk(struct disk* hd){
 	memset(buf,0,sizeof(buf));
 	swap_pairs_bytes(&id_info[md_start],buf,md_len);
 	printk("\t\tMODULE: %s\n",buf);
-	uint32_t sectors = *(uint32_t*)&id_info[60*2];
-	printk("\t\tSECTORS: %d\n",sectors);
-	printk("\t\tCAPACITY: %dMB\n",sectors*512/1024/1024);
+	uint16_t* id_word = (uint16_t*)id_info;
+	uint32_t sectors = *(uint32_t*)&id_word[60];
+
+	// word 83 和 86 的 bit 10：支持和开启了 48 位地址，此时 word 100~103 是 48 位的总扇区数
+	// 我们的 lba 只有 32 位，超过 2TB 的部分用不到
+	hd->lba48 = (id_word[83] & (1 << 10)) && (id_word[86] & (1 << 10));
+	if (hd->lba48) {
+		uint32_t lba48_sectors = *(uint32_t*)&id_word[100];
+		if (id_word[102] != 0 || id_word[103] != 0) {
+			lba48_sectors = 0xffffffff;
+		}
+		if (lba48_sectors > sectors) {
+			sectors = lba48_sectors;
+		}
+	}
+	hd->max_secs = hd->lba48 ? MAX_SECS_PER_CMD_EXT : MAX_SECS_PER_CMD;
+
+	// word 47 的低 8 位是 READ/WRITE MULTIPLE 每次中断最多传输的扇区数，0 表示不支持
+	// SET MULTIPLE 只接受 2 的幂，取不超过它的最大的 2 的幂
+	uint32_t multi_max = id_word[47] & 0xff;
+	hd->multi_secs = 1;
+	while (hd->multi_secs * 2 <= multi_max) {
+		hd->multi_secs *= 2;
+	}
+
+	printk("\t\tSECTORS: %d%s\n",sectors,hd->lba48?" (LBA48)":"");
+	printk("\t\tCAPACITY: %dMB\n",sectors/2048);
 	return sectors;
 }
 
 static void partition_scan(struct disk* hd,uint32_t ext_lba){
 	struct boot_sector* bs = kmalloc(sizeof(struct boot_sector));
-	bread_multi(hd,ext_lba,bs,1);
+	if (bs == NULL) return;
+	// 分区表读不出来就当作没有分区，整盘设备仍然可以使用
+	if (partition_read(&hd->all_disk_part,ext_lba,bs,1) != 0) {
+		printk("partition_scan: %s can't read partition table at lba 0x%x\n",hd->name,ext_lba);
+		kfree(bs);
+		return;
+	}
 	uint8_t part_idx = 0;
 	struct partition_table_entry* p = bs->partition_table;
 
@@ -476,6 +993,7 @@ static void partition_scan(struct disk* hd,uint32_t ext_lba){
 				hd->prim_parts[p_no].start_lba = ext_lba+p->start_lba;
 				hd->prim_parts[p_no].sec_cnt = p->sec_cnt;
 				hd->prim_parts[p_no].my_disk = hd;
+				hd->prim_parts[p_no].blk_size = SECTOR_SIZE;
 				
 				// 分配逻辑设备号：母盘设备号 + (1~4)
                 hd->prim_parts[p_no].i_rdev = hd->i_rdev + p_no + 1;
@@ -490,6 +1008,7 @@ static void partition_scan(struct disk* hd,uint32_t ext_lba){
 				hd->logic_parts[l_no].start_lba = ext_lba + p->start_lba;
 				hd->logic_parts[l_no].sec_cnt = p->sec_cnt;
 				hd->logic_parts[l_no].my_disk = hd;
+				hd->logic_parts[l_no].blk_size = SECTOR_SIZE;
 				
 				// 分配设备号：母盘设备号 + (5~12)
                 hd->logic_parts[l_no].i_rdev = hd->i_rdev + l_no + 5;
@@ -497,7 +1016,10 @@ static void partition_scan(struct disk* hd,uint32_t ext_lba){
 				dlist_push_back(&partition_list,&hd->logic_parts[l_no].part_tag);
 				sprintf(hd->logic_parts[l_no].name,"%s%d",hd->name,l_no+5);
 				l_no++;
-				if(l_no>=8) return;
+				if(l_no>=8){
+					kfree(bs);
+					return;
+				}
 			}
 		}
 		p++;
@@ -522,6 +1044,11 @@ void sys_readraw(const char* disk_name, uint32_t lba, const char* filename, uint
         printk("unknown disk name!\n");
         return;
     }
+    // 读的是整盘设备，不能和块大小不同的分区重叠
+    if (blk_size_conflict(&disk->all_disk_part, lba, DIV_ROUND_UP(file_size, SECTOR_SIZE))) {
+        printk("sys_readraw: lba 0x%x is in a partition in use!\n", lba);
+        return;
+    }
 
     // 动态计算缓冲区大小
     uint32_t max_buf_size = PG_SIZE*4;
@@ -558,7 +1085,10 @@ void sys_readraw(const char* disk_name, uint32_t lba, const char* filename, uint
         // 本次从磁盘读取的扇区数（必须是整数个扇区）
         uint32_t secs_to_read = DIV_ROUND_UP(bytes_to_write, SECTOR_SIZE);
 
-        bread_multi(disk, current_lba, buf, secs_to_read);
+        if (partition_read(&disk->all_disk_part, current_lba, buf, secs_to_read) != 0) {
+            printk("sys_readraw: read error at lba 0x%x!\n", current_lba);
+            break;
+        }
 
         if (sys_write(fd, buf, bytes_to_write) == -1) {
             printk("sys_readraw: write error!\n");
@@ -577,6 +1107,18 @@ void sys_readraw(const char* disk_name, uint32_t lba, const char* filename, uint
 // file VFS 文件结构
 // buf 用户缓冲区
 // count 读取字节数
+// O_DIRECT 打开的块设备，绕过缓存在用户缓冲区和磁盘之间直接传输
+// 文件位置、长度和缓冲区都必须按扇区对齐，调用者已经把 count 截断到分区末尾
+static int32_t ide_dev_direct_io(struct partition* part, struct file* file, char* buf, uint32_t count, bool is_write) {
+    if (file->fd_pos % SECTOR_SIZE || count % SECTOR_SIZE || (uint32_t)buf % SECTOR_SIZE) {
+        return -EINVAL;
+    }
+    int32_t ret = bdirect_io(part, PART_LBA(part, file->fd_pos / SECTOR_SIZE), buf, count / SECTOR_SIZE, is_write);
+    if (ret < 0) return ret;
+    file->fd_pos += count;
+    return (int32_t)count;
+}
+
 static int32_t ide_dev_read(struct inode* inode, struct file* file, char* buf, int count) {
     ASSERT(file->fd_inode==inode);
 	printk("inode->i_rdev:%x\n",inode->i_rdev);
@@ -591,60 +1133,53 @@ static int32_t ide_dev_read(struct inode* inode, struct file* file, char* buf, i
     if (file->fd_pos + count > part_size_bytes) {
         count = part_size_bytes - file->fd_pos;
     }
+    // 整盘设备不能读写块大小和它不同的分区，否则同一个扇区会在缓存里有两份
+    if (blk_size_conflict(part, PART_LBA(part, file->fd_pos / SECTOR_SIZE), DIV_ROUND_UP(file->fd_pos % SECTOR_SIZE + count, SECTOR_SIZE))) {
+        return -EBUSY;
+    }
+
+    if (file->fd_flag & O_DIRECT) {
+        return ide_dev_direct_io(part, file, buf, count, false);
+    }
 
     uint8_t* dst = (uint8_t*)buf;
     uint32_t bytes_left = count;
 
-	// 5个字节一个扇区00111对应 offset_in_sec != 0分支
-	// 11100 对应 bytes_left < SECTOR_SIZE 分支
-	// 00110 对应两者同时成立的分支
-	// 00111 11111 11111 11100 
-	// 00000 00110 00000 00000
+	// 不再区分对齐与非对齐的读取，每一轮都用 bread_gang 拿到覆盖读取范围的缓存块
+	// 然后直接从缓存块拷到用户缓冲区，未命中的块由 bread_gang 一次 io 读进缓存，整个过程只拷贝一次
+	struct buffer_head* bhs[MAX_GANG_BLKS];
+	uint32_t spb = part->blk_size / SECTOR_SIZE;
     while (bytes_left > 0) {
-        // uint32_t lba = part->start_lba + (file->fd_pos / SECTOR_SIZE);
-        // 使用相对 lba 地址 bread 和 partition_read 内部会处理成绝对地址
-		uint32_t lba = file->fd_pos / SECTOR_SIZE;
+        // 使用绝对 lba 地址，bread_gang 不会帮我们转换
+		uint32_t lba = PART_LBA(part, file->fd_pos / SECTOR_SIZE);
         uint32_t offset_in_sec = file->fd_pos % SECTOR_SIZE;
 
-        // 先处理非对齐读取（处理起始位置不在 512 字节边界，或者最后一个扇区剩余长度不足一扇区）
-        if (offset_in_sec != 0 || bytes_left < SECTOR_SIZE) {
-            // if (!io_buf) io_buf = kmalloc(SECTOR_SIZE);
-            
-            // 由于并不足一扇区，一次就处理一扇区
-            // bread_multi(part->my_disk, lba, io_buf, 1);
-			struct buffer_head* bh = bread(part, lba);
-			uint8_t* io_buf = bh ->b_data;
-            
-			// 从第一个有效字节偏移地址往高地址走（从左往右走），剩下的字节数
-            uint32_t left_in_sec = SECTOR_SIZE - offset_in_sec;
-
-            // bytes_left 用于判断当前的情况是最开始的其实位置不在 512 字节边界
-			// 还是最后一个扇区待读的数据不足 512 字节
-			// 若 bytes_left >= left_in_sec ，则说明是前一种情况，起始位置不在 512 字节边界，本次读取的数据大小是 left_in_sec
-			// 若 bytes_left < left_in_sec 则说是后一种情况，最后一个扇区待读数据不足 512 字节，本次读取的数据大小是 bytes_left
-			uint32_t chunk_size = (bytes_left < left_in_sec) ? bytes_left : left_in_sec;
-            
-            memcpy(dst, io_buf + offset_in_sec, chunk_size);
-			brelse(bh);
-            
-            file->fd_pos += chunk_size;
-            bytes_left -= chunk_size;
-            dst += chunk_size;
-        } else { // 对齐读取（光标在边界，且剩余长度至少有一个整扇区）
-            // 计算目前能进行的最大批量读取扇区数
-            uint32_t secs_to_read = bytes_left / SECTOR_SIZE;
-
-            // bread_multi(part->my_disk, lba, dst, secs_to_read);
-            partition_read(part, lba, dst, secs_to_read);
-            
-            uint32_t total_size = secs_to_read * SECTOR_SIZE;
-            file->fd_pos += total_size;
-            bytes_left -= total_size;
-            dst += total_size;
-        }
+		// 本轮涉及的扇区数，最多只能跨越 MAX_GANG_BLKS 个缓存块
+		uint32_t secs = DIV_ROUND_UP(offset_in_sec + bytes_left, SECTOR_SIZE);
+		uint32_t gang_secs = MAX_GANG_BLKS * spb - (lba - part->start_lba) % spb;
+		if (secs > gang_secs) secs = gang_secs;
+
+		uint32_t blk_cnt = bread_gang(part, lba, secs, bhs);
+		// 读出错时返回已经读到的部分，一点都没读到才报错
+		if (blk_cnt == 0) return bytes_left == (uint32_t)count ? -EIO : (int32_t)(count - bytes_left);
+		uint32_t chunk_left = secs * SECTOR_SIZE - offset_in_sec;
+		if (chunk_left > bytes_left) chunk_left = bytes_left;
+		// 第一个块里可能有一部分在读取位置之前
+		uint32_t off = bh_sector_data(bhs[0], lba) - bhs[0]->b_data + offset_in_sec;
+		for (uint32_t i = 0; i < blk_cnt; i++) {
+			uint32_t n = bhs[i]->b_size - off;
+			if (n > chunk_left) n = chunk_left;
+			memcpy(dst, bhs[i]->b_data + off, n);
+			off = 0;
+
+			file->fd_pos += n;
+			bytes_left -= n;
+			chunk_left -= n;
+			dst += n;
+		}
+		brelse_gang(bhs, blk_cnt);
     }
 
-    // if (io_buf) kfree(io_buf);
     return (int32_t)count;
 }
 
@@ -653,17 +1188,17 @@ static int32_t ide_dev_read(struct inode* inode, struct file* file, char* buf, i
 static int32_t ide_dev_write(struct inode* inode, struct file* file, char* buf, int count) {
     ASSERT(file->fd_inode==inode);
     
+    struct partition* part = get_part_by_rdev(inode->i_rdev);
+
     uint32_t minor = MINOR(inode->i_rdev);
     // 拦截整盘写操作 (sda, sdb 等)
-    // 根据生产逻辑设备号的逻辑，0, 16, 32... 是整盘
-    if (minor % 16 == 0) {
+    // 根据生产逻辑设备号的逻辑，0, 16, 32... 是整盘，没有分区表的磁盘可以放开
+    if (minor % 16 == 0 && !part->my_disk->whole_disk_writable) {
         // 打印警告，方便调试时发现为什么写失败
         printk("ide_dev_write: Write denied on whole disk device (minor %d)!\n", minor);
         return -EPERM; // 返回错误，表示禁止写入
     }
 
-    struct partition* part = get_part_by_rdev(inode->i_rdev);
-
     uint32_t part_size_bytes = part->sec_cnt * SECTOR_SIZE;
 
     // 边界检查
@@ -672,6 +1207,13 @@ static int32_t ide_dev_write(struct inode* inode, struct file* file, char* buf,
     if (file->fd_pos + count > part_size_bytes) {
         count = part_size_bytes - file->fd_pos;
     }
+    if (blk_size_conflict(part, PART_LBA(part, file->fd_pos / SECTOR_SIZE), DIV_ROUND_UP(file->fd_pos % SECTOR_SIZE + count, SECTOR_SIZE))) {
+        return -EBUSY;
+    }
+
+    if (file->fd_flag & O_DIRECT) {
+        return ide_dev_direct_io(part, file, buf, count, true);
+    }
 
     const uint8_t* src = (const uint8_t*)buf;
     uint32_t bytes_left = count;
@@ -689,7 +1231,8 @@ static int32_t ide_dev_write(struct inode* inode, struct file* file, char* buf,
 
             // Read，先把旧数据读出来
             struct buffer_head* bh = bread(part, lba);
-			uint8_t* io_buf = bh->b_data; // 用于处理非对齐部分
+			if (bh == NULL) break;
+			uint8_t* io_buf = bh_sector_data(bh, PART_LBA(part, lba)); // 用于处理非对齐部分
 
             // Modify，覆盖 io_buf 中的特定部分
             uint32_t left_in_sec = SECTOR_SIZE - offset_in_sec;
@@ -708,8 +1251,8 @@ static int32_t ide_dev_write(struct inode* inode, struct file* file, char* buf,
             // 计算目前能进行的最大批量对齐写入扇区数
             uint32_t secs_to_write = bytes_left / SECTOR_SIZE;
 
-            // 直接批量写入
-            partition_write(part, lba, (void*)src, secs_to_write);
+            // 直接批量写入，有块的旧数据读不出来时不知道写进去了多少，按都没写处理
+            if (partition_write(part, lba, (void*)src, secs_to_write) != 0) break;
 
             uint32_t total_size = secs_to_write * SECTOR_SIZE;
             file->fd_pos += total_size;
@@ -719,7 +1262,9 @@ static int32_t ide_dev_write(struct inode* inode, struct file* file, char* buf,
     }
 
     // if (io_buf) kfree(io_buf);
-    return (int32_t)count;
+    // 读写出错时返回已经写进去的部分，一点都没写进去才报错
+    if (bytes_left != 0 && bytes_left == (uint32_t)count) return -EIO;
+    return (int32_t)(count - bytes_left);
 }
 
 static int32_t ide_ioctl(struct inode * inode, struct file* filp, uint32_t cmd, uint32_t arg) {
@@ -745,6 +1290,11 @@ static int32_t ide_ioctl(struct inode * inode, struct file* filp, uint32_t cmd,
             *(uint64_t*)arg = (uint64_t)part->sec_cnt * 512;
             return 0;
 
+        case BLKSTAT:
+            // iostat 用来采样缓存和磁盘的统计
+            ide_buffer_get_stats(part->my_disk, (struct blk_stats*)arg);
+            return 0;
+
         default:
             // 如果收到了不认识的命令（比如 TTY 的命令发到了硬盘上）
             return -EINVAL;
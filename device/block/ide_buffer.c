@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio-kernel.h>
+#include <stdio.h>
 #include <debug.h>
 #include <sync.h>
 #include <hashtable.h>
@@ -10,21 +11,64 @@
 #include <memory.h>
 #include <timer.h>
 #include <thread.h>
+#include <buddy.h>
+#include <swap.h>
+#include <errno.h>
 
-// 单次合并写入的最大扇区数
-#define MAX_SYNC_COUNT SECTORS_PER_OP_BLOCK
+static struct ide_buffer global_ide_buffer; 
 
-extern struct task_struct* sync_thread;
+// 异步预读请求
+// 读文件的进程只负责把请求放进队列，由 _readahead 线程在后台拿到缓存块并提交 io，不等 io 完成
+struct ra_request {
+    struct partition* part;
+    uint32_t lba;       // 绝对 lba
+    uint32_t sec_cnt;
+};
 
-static struct ide_buffer global_ide_buffer; 
+// 预读队列的长度，队列满了就直接丢弃新的请求，预读只是一个优化，丢了也不影响正确性
+#define RA_QUEUE_SIZE 32
+
+// 一个 gang 的异步预读 io
+// 提交时持有 gang 中所有块的引用和要读的块的 io 锁，整批 io 完成时在中断里把读到的块标记为有效并放开 io 锁
+// 然后挂到 ra_done 上，由 _readahead 线程放掉块的引用
+struct ra_io {
+    struct rq_batch batch;
+    struct buffer_head* bhs[MAX_GANG_BLKS];
+    uint32_t blk_cnt;
+    bool mine[MAX_GANG_BLKS];                 // 由这次 io 来读的块
+    struct request rqs[MAX_GANG_BLKS];
+    struct io_vec vec[MAX_GANG_BLKS];
+    uint32_t rq_cnt;
+    struct dlist_elem tag;                    // 挂在 ra_free 或者 ra_done 上
+};
+
+// 同时在路上的预读 io 数，用完了就等前面的完成，请求留在队列里
+#define RA_IO_NR 8
 
-// 使用磁盘和lba可以唯一确定一个块
+static struct ra_request ra_queue[RA_QUEUE_SIZE];
+static uint32_t ra_head, ra_tail; // ra_head 处取出，ra_tail 处放入
+static struct lock ra_lock;       // 保护 ra_queue
+static struct semaphore ra_pending; // 新的预读请求和完成的预读 io 都会让它加一
+static struct dlist ra_free;      // 只有 _readahead 线程访问
+static struct dlist ra_done;      // 在中断中被修改，访问时要关中断
+
+// 内核内存紧张时回收缓存块
+static uint32_t ide_buffer_shrink(uint32_t bytes);
+static void wakeup_all_writeback(void);
+static void wake_throttled(struct disk* dev);
+static struct shrinker ide_buffer_shrinker = { .shrink = ide_buffer_shrink };
+
+// 使用磁盘和块起始 lba 可以唯一确定一个块
 // 由于每一个磁盘都会在内存中分配一个disk镜像
 // 因此每一个磁盘数据结构的地址具有唯一性
 // 我们可以用它来进行哈希。
+// 块大小也是 key 的一部分，不同大小的块互不命中
+// set_blocksize 会淘汰分区范围内所有大小的块，之后整盘设备也不能再访问块大小和它不同的分区（见 blk_size_conflict）
+// 这样同一个扇区不会以两种块大小同时被缓存，缓存里的块在磁盘上互不重叠
 struct buffer_key{
     uint32_t lba;
     struct disk* disk;
+    uint32_t size;
 };
 
 // 缓冲区buffer计算函数
@@ -39,208 +83,656 @@ static uint32_t buffer_hash(void* arg) {
     return val * HASH_GOLDEN_RATIO_32;
 }
 
+static uint32_t buffer_elem_hash(struct dlist_elem* pelem) {
+    struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, pelem);
+    struct buffer_key bk = {bh->b_blocknr, bh->b_dev, bh->b_size};
+    return buffer_hash(&bk);
+}
+
 static bool buffer_condition(struct dlist_elem* pelem,void* arg){
     struct buffer_key* bk = (struct buffer_key*)arg;
     struct buffer_head* bh = member_to_entry(struct buffer_head,hash_tag,pelem);
-    return bh->b_dev == bk->disk&&bh->b_blocknr == bk->lba;
+    return bh->b_dev == bk->disk&&bh->b_blocknr == bk->lba&&bh->b_size == bk->size;
 }
 
-// arg 传入的是待插入的 pelem 指针本身
-static bool _cb_bh_lba_condition(struct dlist_elem* pelem, void* arg) {
-    struct dlist_elem* new_elem = (struct dlist_elem*)arg;
-    
-    // 从 tag 还原回 buffer_head
-    struct buffer_head* bh_in_list = member_to_entry(struct buffer_head, dirty_tag, pelem);
-    struct buffer_head* bh_new     = member_to_entry(struct buffer_head, dirty_tag, new_elem);
-    
-    // 如果当前链表中的块 LBA 大于新块，说明找到了插入位置
-    return bh_in_list->b_blocknr > bh_new->b_blocknr;
+// key 所在哈希桶对应的桶锁
+// 哈希表的桶数总是 BUFFER_LOCK_NR 的倍数（都是 2 的幂），所以无论哈希表怎么扩容缩容
+// hash % BUFFER_LOCK_NR 与 (hash % 桶数) % BUFFER_LOCK_NR 总是相同的，迁移中的块在新旧两张表里也由同一把锁保护
+static struct lock* bucket_lock(struct buffer_key* bk) {
+    return &global_ide_buffer.bucket_locks[buffer_hash(bk) % BUFFER_LOCK_NR];
+}
+
+static struct lock* bh_lock(struct buffer_head* bh) {
+    struct buffer_key bk = {bh->b_blocknr, bh->b_dev, bh->b_size};
+    return bucket_lock(&bk);
+}
+
+// 按 b_blocknr 升序把脏块插入所属磁盘的脏块树，O(log n)
+// 缓存里的块互不重叠，树里不会有两个起始 lba 相同的块
+// 调用者需要持有 dirty_lock
+static void dirty_tree_insert(struct buffer_head* bh) {
+    struct rb_root* root = &bh->b_dev->dirty_tree;
+    struct rb_node** link = &root->rb_node;
+    struct rb_node* parent = NULL;
+    while (*link) {
+        parent = *link;
+        struct buffer_head* tmp = member_to_entry(struct buffer_head, dirty_node, parent);
+        ASSERT(bh->b_blocknr != tmp->b_blocknr);
+        link = bh->b_blocknr < tmp->b_blocknr ? &parent->rb_left : &parent->rb_right;
+    }
+    rb_link_node(&bh->dirty_node, parent, link);
+    rb_insert_color(&bh->dirty_node, root);
+}
+
+// 在脏块树中找第一个 b_blocknr >= lba 的块，找不到返回 NULL
+// 调用者需要持有 dirty_lock
+static struct buffer_head* dirty_tree_lower_bound(struct disk* dev, uint32_t lba) {
+    struct rb_node* node = dev->dirty_tree.rb_node;
+    struct buffer_head* found = NULL;
+    while (node) {
+        struct buffer_head* tmp = member_to_entry(struct buffer_head, dirty_node, node);
+        if (tmp->b_blocknr >= lba) {
+            found = tmp;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return found;
+}
+
+// 把块标记为脏并挂到脏块树和 dirty_list 上，调用者需要持有这个块的引用
+// 已经是脏块时不更新时间戳，过期时间从第一次变脏算起，持续被修改的块也会按时写回
+static void mark_buffer_dirty(struct buffer_head* bh) {
+    struct disk* dev = bh->b_dev;
+    lock_acquire(&dev->dirty_lock);
+    if (!bh->b_dirty) {
+        bh->b_dirty = true;
+        bh->b_dirtied_at = ticks;
+        dirty_tree_insert(bh);
+        dlist_push_back(&dev->dirty_list, &bh->dirty_tag);
+        dev->dirty_bytes += bh->b_size;
+    }
+    lock_release(&dev->dirty_lock);
+}
+
+// 把块从脏块树和 dirty_list 上摘下来并标记为非脏，调用者需要持有 dirty_lock
+// 写回之前在锁内调用，io 期间如果有人再次修改它，它会重新变脏，写回线程之后会再次发现它
+static void clear_buffer_dirty(struct buffer_head* bh) {
+    if (!bh->b_dirty) return;
+    rb_erase(&bh->dirty_node, &bh->b_dev->dirty_tree);
+    dlist_remove(&bh->dirty_tag);
+    bh->b_dev->dirty_bytes -= bh->b_size;
+    bh->b_dirty = false;
 }
 
 void ide_buffer_init(){
     printk("ide_buffer_init...\n");
 
     
-    lock_init(&global_ide_buffer.lock);
-    lock_acquire(&global_ide_buffer.lock);
-    global_ide_buffer.buf_blk_size = SECTOR_SIZE; 
-    global_ide_buffer.max_blk_num = (mem_bytes_total / BUFFER_RATE)/global_ide_buffer.buf_blk_size; 
+    lock_init(&global_ide_buffer.lru_lock);
+    for (int i = 0; i < BUFFER_LOCK_NR; i++) {
+        lock_init(&global_ide_buffer.bucket_locks[i]);
+    }
+    // 缓存的内存全部来自内核内存池，最多让它占用内核内存池的一半，剩下的留给 PCB、页表等内核数据结构
+    global_ide_buffer.cap_size = kernel_pool.pool_size / 2;
+    global_ide_buffer.max_size = mem_bytes_total / BUFFER_RATE;
+    if (global_ide_buffer.max_size > global_ide_buffer.cap_size) {
+        global_ide_buffer.max_size = global_ide_buffer.cap_size;
+    }
+    global_ide_buffer.min_size = global_ide_buffer.max_size / 4;
+    global_ide_buffer.cur_size = 0;
     global_ide_buffer.cur_blk_num = 0;
+    global_ide_buffer.waiters = 0;
+    sema_init(&global_ide_buffer.free_wait, 0);
     
-    dlist_init(&global_ide_buffer.lru_list);
+    buffer_pool_init();
+    global_ide_buffer.policy = &BUFFER_POLICY;
+    global_ide_buffer.policy->init();
 
-    hash_init(&global_ide_buffer.hash_table,HASH_SIZE,buffer_hash,buffer_condition);
-    
-    lock_release(&global_ide_buffer.lock);
-    printk("max buffer num: %d\n",global_ide_buffer.max_blk_num);
+    hash_init_striped(&global_ide_buffer.hash_table, HASH_SIZE, BUFFER_LOCK_NR, buffer_hash, buffer_elem_hash, buffer_condition);
+
+    lock_init(&ra_lock);
+    sema_init(&ra_pending, 0);
+    ra_head = ra_tail = 0;
+    dlist_init(&ra_free);
+    dlist_init(&ra_done);
+
+    register_shrinker(&ide_buffer_shrinker);
+    printk("max buffer size: %dKB, policy: %s\n",global_ide_buffer.max_size / 1024, global_ide_buffer.policy->name);
     printk("ide_buffer_init done\n");
 }
 
-// 从 LRU 中找到一个可用的缓存块
+// 按照替换策略给出的淘汰顺序遍历所有可以淘汰的块，调用者需要持有 lru_lock
+// 返回一个块之前就已经走到了下一个节点，调用者可以放心地淘汰刚拿到的块
+struct victim_iter {
+    struct dlist* queues[BUFFER_MAX_QUEUES];
+    uint32_t queue_nr;
+    uint32_t idx;
+    struct dlist_elem* pelem;
+};
+
+static void victim_iter_init(struct victim_iter* it) {
+    it->queue_nr = global_ide_buffer.policy->victim_queues(it->queues);
+    it->idx = 0;
+    it->pelem = it->queues[0]->head.next;
+}
+
+static struct buffer_head* victim_iter_next(struct victim_iter* it) {
+    while (it->pelem == &it->queues[it->idx]->tail) {
+        if (++it->idx == it->queue_nr) return NULL;
+        it->pelem = it->queues[it->idx]->head.next;
+    }
+    struct buffer_head* bh = member_to_entry(struct buffer_head, lru_tag, it->pelem);
+    it->pelem = it->pelem->next;
+    return bh;
+}
+
+// 找到一个可以淘汰的缓存块，调用者需要持有 lru_lock
+// 策略的队列上都是没有被引用的块，一般队首的块就可以直接淘汰
+// 找到时返回的块的桶锁已经被拿到手，调用者用完后需要释放
+// 这里是从队列出发去拿桶锁，与正常的拿锁顺序相反，所以只能 try，拿不到就跳过这个块
 static struct buffer_head* find_victim(void){
-    
-    struct dlist_elem* pelem = global_ide_buffer.lru_list.head.next;
-    struct buffer_head* victim = NULL;
-
-    while (pelem != &global_ide_buffer.lru_list.tail) {
-        struct buffer_head* tmp = member_to_entry(struct buffer_head, lru_tag, pelem);
-        
-        // 只有没有进程使用的块才可以被驱逐
-        // 只要有引用，不管脏不脏，无论如何都不能释放
+    struct victim_iter it;
+    struct buffer_head* tmp;
+
+    victim_iter_init(&it);
+    while ((tmp = victim_iter_next(&it)) != NULL) {
+        struct lock* blk_lock = bh_lock(tmp);
+        if (!lock_try_acquire(blk_lock)) continue;
+        // 拿桶锁之前别人可能刚刚引用了它，还没来得及从队列上摘下来，拿到桶锁后再确认一次
         if (tmp->b_ref_count == 0) {
-            victim = tmp;
-            break; 
+            return tmp;
         }
-        pelem = pelem->next;
+        lock_release(blk_lock);
     }
 
-    return victim;
+    return NULL;
 }
 
-// 从缓存中驱逐一个缓存块
+// 从缓存中驱逐一个缓存块，调用者需要持有 lru_lock 和这个块的桶锁
 static bool blk_evict(struct buffer_head* victim) {
-
-    if (!victim) {
-        // 如果翻遍了 LRU 都没有 ref_count == 0 的块，
-        // 说明此时系统压力过大，所有缓存都在被并发使用。
-        // 这时可以考虑暂时突破 MAX_BUFFER_NUM，或者 PANIC。
-        PANIC("blk_evict: buffer exhausted!\n");
-        return false;
-    } 
-
     // 安全检查
-    // 理论上被选为牺牲者的块 ref_count 必须为 0
+    // 找不到牺牲者的情况由调用者处理（扩容或者睡眠等待），理论上被选为牺牲者的块 ref_count 必须为 0
+    ASSERT(victim != NULL);
     ASSERT(victim->b_ref_count == 0);
 
     // 我们在函数外部进行了写回淘汰，因此此处直接淘汰就行
     // 从追踪结构中摘除
     // 这样之后 getblk 就彻底找不到这个块了
     hash_remove(&global_ide_buffer.hash_table, &victim->hash_tag);
-    dlist_remove(&victim->lru_tag);
+    global_ide_buffer.policy->evict(victim);
 
-    // 一定要及时把所有的 tag 都移除相应的队列
-    if(dlist_is_linked(&victim->dirty_tag)){
-        dlist_remove(&victim->dirty_tag);
-    }
+    // 脏块一定已经在外面写回了，干净的块不会在脏块树上
+    ASSERT(!victim->b_dirty && !rb_is_linked(&victim->dirty_node));
 
-    // 彻底销毁内存对象
-    // 先释放数据区，再释放管理结构
-    kfree(victim->b_data);
-    kfree(victim);
-
-    // 更新全局统计计数
+    // 更新全局统计计数，必须在 kfree 之前读 b_size
+    global_ide_buffer.cur_size -= victim->b_size;
     global_ide_buffer.cur_blk_num--;
+
+    // 还给对象池，数据槽和管理结构都留着给下一次未命中用
+    bh_free(victim);
     return true;
 }
 
-static struct buffer_head* getblk(struct disk* dev, uint32_t lba) {
-    struct buffer_key bk = {lba, dev};
-    
-    // 缓存命中
-    lock_acquire(&global_ide_buffer.lock);
-    struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &bk);
-    if (de) {
-        struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, de);
-        bh->b_ref_count++;
-        dlist_remove(&bh->lru_tag);
-        dlist_push_back(&global_ide_buffer.lru_list, &bh->lru_tag);
-        lock_release(&global_ide_buffer.lock);
-        return bh;
+// 引用计数刚降为 0 的块挂回替换策略的队列，调用者需要持有它的桶锁和 lru_lock
+static void bh_unpin(struct buffer_head* bh) {
+    global_ide_buffer.policy->unpin(bh);
+    if (global_ide_buffer.waiters > 0) {
+        global_ide_buffer.waiters--;
+        sema_signal(&global_ide_buffer.free_wait);
+    }
+}
+
+// 释放一个引用，调用者需要持有这个块的桶锁
+// 引用计数降为 0 时这个块就可以被淘汰了，如果有进程在 getblk 中等待可用的块，唤醒其中一个
+// waiters 必须在 lru_lock 内检查，等待者是在 lru_lock 内扫描完 LRU 之后才增加 waiters 的
+// 如果不拿锁，引用计数恰好在它扫描之后降为 0 的这次唤醒就会丢失
+static void bh_put(struct buffer_head* bh) {
+    if (bh->b_ref_count == 0) {
+        // 如果计数已经是0了还在释放，说明上层逻辑有严重Bug
+        PANIC("brelse: buffer_head ref_count is already 0!\n");
+    }
+    bh->b_ref_count--;
+    if (bh->b_ref_count == 0) {
+        lock_acquire(&global_ide_buffer.lru_lock);
+        bh_unpin(bh);
+        lock_release(&global_ide_buffer.lru_lock);
+    }
+}
+
+// 增加一个引用，调用者需要持有这个块的桶锁
+// 引用计数从 0 变成 1 时把它从替换策略的队列上摘下来
+static void bh_get(struct buffer_head* bh) {
+    bh->b_ref_count++;
+    if (bh->b_ref_count == 1) {
+        lock_acquire(&global_ide_buffer.lru_lock);
+        global_ide_buffer.policy->pin(bh);
+        lock_release(&global_ide_buffer.lru_lock);
+    }
+}
+
+static void writeback_range(struct disk* dev, uint32_t start_lba, uint32_t end_lba);
+
+// 找出牺牲者在磁盘上前后相连的脏块，连同它自己不超过一条命令的长度，返回这一段的 [start, end)
+// 向前最多找半条命令，剩下的长度留给后面，顺序写入的数据通常是牺牲者后面的块更新
+// 调用者需要持有 dirty_lock，victim 必须是脏的
+static void dirty_cluster(struct buffer_head* victim, uint32_t* start, uint32_t* end) {
+    uint32_t secs = victim->b_size / SECTOR_SIZE;
+    struct buffer_head* first = victim;
+    struct buffer_head* last = victim;
+    struct rb_node* node;
+    while ((node = rb_prev(&first->dirty_node)) != NULL) {
+        struct buffer_head* prev = member_to_entry(struct buffer_head, dirty_node, node);
+        uint32_t n = prev->b_size / SECTOR_SIZE;
+        if (prev->b_blocknr + n != first->b_blocknr || secs + n > MAX_SECS_PER_CMD / 2) break;
+        secs += n;
+        first = prev;
+    }
+    while ((node = rb_next(&last->dirty_node)) != NULL) {
+        struct buffer_head* next = member_to_entry(struct buffer_head, dirty_node, node);
+        uint32_t n = next->b_size / SECTOR_SIZE;
+        if (next->b_blocknr != last->b_blocknr + last->b_size / SECTOR_SIZE || secs + n > MAX_SECS_PER_CMD) break;
+        secs += n;
+        last = next;
+    }
+    *start = first->b_blocknr;
+    *end = last->b_blocknr + last->b_size / SECTOR_SIZE;
+}
+
+// 把一个脏的牺牲者写回磁盘，写回后如果它仍然空闲就淘汰掉
+// 牺牲者前后连续的脏块很可能马上也会被淘汰，顺便用同一条命令一起写回，不再一个块一个块地同步写
+// 调用时需要持有 lru_lock 和它的桶锁，io 前两把锁都会被释放，返回时不持有任何锁
+// 持有 lru_lock 时不能去等 dirty_lock，所以淘汰干净块的 blk_evict 不碰脏块树，脏块都走这里
+static void writeback_and_evict(struct buffer_head* victim) {
+    struct lock* blk_lock = bh_lock(victim);
+    struct disk* dev = victim->b_dev;
+
+    // io 期间持有一个引用，防止别的进程也把它选为牺牲者
+    victim->b_ref_count++;
+    global_ide_buffer.policy->pin(victim);
+    // wb_lock 和 dirty_lock 都排在缓存锁前面，必须先放开
+    lock_release(&global_ide_buffer.lru_lock);
+    lock_release(blk_lock);
+
+    // 放开锁之后它可能已经被写回线程写回了
+    lock_acquire(&dev->dirty_lock);
+    bool dirty = victim->b_dirty;
+    uint32_t start = 0, end = 0;
+    if (dirty) {
+        dirty_cluster(victim, &start, &end);
+    }
+    lock_release(&dev->dirty_lock);
+
+    if (dirty) {
+        // 整段连续的脏块一条命令写完
+        writeback_range(dev, start, end);
+
+        // 拿不到某个块的桶锁时 writeback_range 会截断批次，牺牲者可能还没写，单独把它写回
+        // 从脏块树上摘下到写完都持有 wb_lock，fsync 拿到 wb_lock 时这次写回一定已经完成了
+        lock_acquire(&dev->wb_lock);
+        lock_acquire(&dev->dirty_lock);
+        dirty = victim->b_dirty;
+        clear_buffer_dirty(victim);
+        lock_release(&dev->dirty_lock);
+        if (dirty) {
+            int32_t err = ide_write(dev, victim->b_blocknr, victim->b_data, victim->b_size / SECTOR_SIZE);
+            if (err != 0) dev->wb_error = err;
+            dev->wb_seq++;
+        }
+        lock_release(&dev->wb_lock);
+    }
+
+    lock_acquire(blk_lock);
+    lock_acquire(&global_ide_buffer.lru_lock);
+    bh_put(victim);
+    // io 期间有人引用或者修改了它，就放它一马
+    if (victim->b_ref_count == 0 && !victim->b_dirty) {
+        blk_evict(victim);
+    }
+    lock_release(&global_ide_buffer.lru_lock);
+    lock_release(blk_lock);
+}
+
+// 根据内核内存池的空闲情况重新计算缓存的目标容量，调用者需要持有 lru_lock
+// 内核内存池保留 1/4 的空闲内存给其他内核数据结构
+// 空闲内存多于保留量时，缓存可以扩张到多出部分的一半；少于保留量时，缓存让出差额
+// 结果限制在 [min_size, cap_size] 之间
+static void buffer_adjust_size(void) {
+    uint32_t free = buddy_free_bytes(&kernel_pool);
+    uint32_t reserve = kernel_pool.pool_size / 4;
+    uint32_t cur = global_ide_buffer.cur_size;
+    uint32_t target;
+    if (free >= reserve) {
+        target = cur + (free - reserve) / 2;
+    } else {
+        target = cur > reserve - free ? cur - (reserve - free) : 0;
+    }
+
+    if (target < global_ide_buffer.min_size) target = global_ide_buffer.min_size;
+    if (target > global_ide_buffer.cap_size) target = global_ide_buffer.cap_size;
+    global_ide_buffer.max_size = target;
+}
+
+// 内核内存池分配失败时的回收回调，按替换策略的顺序淘汰干净且没有引用的块，返回还给内核的字节数
+// 调用者可能持有内核内存池的锁，而别的进程可能正持有 lru_lock 等待内核内存池的锁（blk_evict 中的 kfree）
+// 所以这里只尝试拿 lru_lock，拿不到就放弃，不能睡眠等待
+static uint32_t ide_buffer_shrink(uint32_t bytes) {
+    if (!lock_try_acquire(&global_ide_buffer.lru_lock)) {
+        return 0;
     }
 
-    // 压力预警，当负载达到 80% 了，进行后台刷脏，但是不阻塞当前进程 
-    if (global_ide_buffer.cur_blk_num > (global_ide_buffer.max_blk_num * 8 / 10)) {
-        // 唤醒后台 sync 线程
-        if(sync_thread->status == TASK_WAITING){
-            thread_unblock(sync_thread);
+    uint32_t evicted = 0;
+    struct victim_iter it;
+    struct buffer_head* bh;
+    victim_iter_init(&it);
+    while (evicted < bytes && global_ide_buffer.cur_size > global_ide_buffer.min_size &&
+           (bh = victim_iter_next(&it)) != NULL) {
+        // 脏块需要先写回，在内存分配的路径上不能做 io，留给 写回线程
+        if (bh->b_ref_count != 0 || bh->b_dirty) continue;
+        struct lock* blk_lock = bh_lock(bh);
+        if (!lock_try_acquire(blk_lock)) continue;
+        if (bh->b_ref_count == 0 && !bh->b_dirty) {
+            evicted += bh->b_size;
+            blk_evict(bh);
         }
+        lock_release(blk_lock);
+    }
+    // 淘汰的块只是回到了对象池，整页空闲的数据页才能真正还给内核
+    uint32_t freed = buffer_pool_shrink();
+
+    // 压低目标容量，防止缓存马上又涨回来
+    global_ide_buffer.max_size = global_ide_buffer.cur_size > global_ide_buffer.min_size ?
+                                 global_ide_buffer.cur_size : global_ide_buffer.min_size;
+    lock_release(&global_ide_buffer.lru_lock);
+    return freed;
+}
+
+// 将绝对 lba 向下对齐到所在缓存块的起始 lba
+// 块的对齐以分区起点为基准，因为文件系统的块号都是相对于分区起点计算的
+static uint32_t blk_start_lba(struct partition* part, uint32_t lba) {
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    return lba - (lba - part->start_lba) % spb;
+}
+
+// part 上 [start_lba, start_lba + sec_cnt)（绝对地址）所在的块是否和同一个磁盘上块大小不同的分区重叠
+// 整盘设备和它的分区覆盖同一段扇区，分区挂载文件系统或者用作交换分区之后块大小就和整盘设备不同了
+// 这时再通过整盘设备读写这段扇区，同一个扇区就会以两种块大小各缓存一份，互相看不到对方的修改
+// 所以这样的访问一律拒绝，由调用者返回 -EBUSY；块大小相同时两边用的是同一个缓存块，不受影响
+bool blk_size_conflict(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    if (sec_cnt == 0) return false;
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    uint32_t first_lba = blk_start_lba(part, start_lba);
+    uint32_t end_lba = first_lba + DIV_ROUND_UP(start_lba + sec_cnt - first_lba, spb) * spb;
+    // partition_list 只在初始化阶段增长，遍历时不需要拿锁
+    struct dlist_elem* pelem = partition_list.head.next;
+    while (pelem != &partition_list.tail) {
+        struct partition* p = member_to_entry(struct partition, part_tag, pelem);
+        pelem = pelem->next;
+        if (p == part || p->my_disk != part->my_disk || p->blk_size == part->blk_size) continue;
+        if (p->start_lba < end_lba && first_lba < p->start_lba + p->sec_cnt) return true;
+    }
+    return false;
+}
+
+// 在缓存块与调用者缓冲区之间拷贝 [start_lba, end_lba) 与该块重叠的那部分扇区
+// to_cache 为 true 时从 buf 拷到缓存块，否则从缓存块拷到 buf
+// buf 对应的是 start_lba 这个扇区
+static void bh_copy_range(struct buffer_head* bh, uint32_t start_lba, uint32_t end_lba, uint8_t* buf, bool to_cache) {
+    uint32_t blk_end = bh->b_blocknr + bh->b_size / SECTOR_SIZE;
+    uint32_t lo = bh->b_blocknr > start_lba ? bh->b_blocknr : start_lba;
+    uint32_t hi = blk_end < end_lba ? blk_end : end_lba;
+    if (lo >= hi) return;
+
+    uint8_t* cache = bh_sector_data(bh, lo);
+    uint8_t* user = buf + (lo - start_lba) * SECTOR_SIZE;
+    if (to_cache) {
+        memcpy(cache, user, (hi - lo) * SECTOR_SIZE);
+    } else {
+        memcpy(user, cache, (hi - lo) * SECTOR_SIZE);
+    }
+}
+
+// 换表会动所有的桶，必须拿齐所有的桶锁，按下标顺序拿，调用者不能持有任何缓存的锁
+// 换表之后块的迁移由之后每次访问对应桶锁的操作逐步完成
+static void buffer_hash_resize(void) {
+    for (int i = 0; i < BUFFER_LOCK_NR; i++) {
+        lock_acquire(&global_ide_buffer.bucket_locks[i]);
+    }
+    // 拿锁期间别人可能已经换过了
+    if (hash_resize_needed(&global_ide_buffer.hash_table)) {
+        hash_resize(&global_ide_buffer.hash_table);
+    }
+    for (int i = BUFFER_LOCK_NR - 1; i >= 0; i--) {
+        lock_release(&global_ide_buffer.bucket_locks[i]);
+    }
+}
+
+// 给 bytes 字节的新块腾出空间，调用者需要持有 lru_lock，返回时仍然持有
+// 超过硬水位时在当前进程中同步淘汰，淘汰脏块时会先写回，写回期间会放开 lru_lock
+static void buffer_reserve(uint32_t bytes) {
+    // 没有命中，先根据当前的空闲内存调整一下目标容量，空闲内存多时缓存可以继续扩张
+    buffer_adjust_size();
+
+    // 压力预警，当负载超过软水位了，进行后台刷脏，但是不阻塞当前进程 
+    if (global_ide_buffer.cur_size > (global_ide_buffer.max_size / 10 * BUFFER_SOFT_WMARK)) {
+        // 唤醒有脏数据的磁盘的写回线程
+        wakeup_all_writeback();
     }
 
     // 慢速路径 (回收与分配) 
-    // 如果缓存达到了 90% 满了，则直接在当前进程中阻塞回收
-    // 我们在第二次拿锁插入时，并没有检查 cur_blk_num
+    // 如果缓存超过了硬水位，则直接在当前进程中阻塞回收
+    // 我们在第二次拿锁插入时，并没有检查 cur_size
     // 虽然我们已经执行了 blk_evict，但在释放锁去 kmalloc 的间隙
     // 如果有多个进程同时并发地执行 getblk 分配不同的块，它们可能会同时穿过 while 循环，然后各自申请内存
-    // 最后在插入阶段依次增加 cur_blk_num。
-    // 这会导致 cur_blk_num 暂时性地超过 max_blk_num
-    // 为了减少这种情况出现的概率，我们的阻塞回收阈值设置在 90% 
+    // 最后在插入阶段依次增加 cur_size。
+    // 这会导致 cur_size 暂时性地超过 max_size
+    // 为了减少这种情况出现的概率，我们的阻塞回收阈值设置在硬水位 
     // 这样的话不容易超过最大限制，即使超过了其实也没事，因为我们下面的 blk_evict 是用 while 执行的
     // 那些超过的部分都会被刷走
-    while (global_ide_buffer.cur_blk_num >= (global_ide_buffer.max_blk_num * 9 / 10)) {
+    while (global_ide_buffer.cur_size + bytes > (global_ide_buffer.max_size / 10 * BUFFER_HARD_WMARK)) {
         struct buffer_head* victim = find_victim();
         if (!victim) {
-            // 若全员处于引用中
-            // 可以选择 sleep 等待别人 brelse
-            // 或者暂时允许超过 max 限制（动态伸缩）
-            // 但是目前我们先 panic 来组织这种情况
-            PANIC("blk_evict: buffer exhausted!\n");
-            break; 
+            // 全员处于引用中
+            // 只要还没到容量上限，就暂时突破目标容量，等这些块被 brelse 后再慢慢淘汰
+            if (global_ide_buffer.cur_size + bytes <= global_ide_buffer.cap_size) {
+                break;
+            }
+            // 已经到了上限，只能睡眠等待别人 brelse
+            // 醒来后重新检查，等待期间别人可能已经创建了我们要的块，插入时的 double check 会处理这种情况
+            global_ide_buffer.waiters++;
+            lock_release(&global_ide_buffer.lru_lock);
+            sema_wait(&global_ide_buffer.free_wait);
+            lock_acquire(&global_ide_buffer.lru_lock);
+            continue;
         }
 
         // 如果 victim 是脏的，那么我们得给他写回后再淘汰它
+        // 引用计数为 0 的块没有人能修改它，所以在桶锁内读 b_dirty 不需要 dirty_lock
         if (victim->b_dirty) {
-            // 必须先摘除节点，防止 sync_thread 碰到它，出现竞态问题
-            // 因为 sync_thread 也会进行脏块的刷盘操作
-            // 此处对一个脏块进行刷盘后，如果不及时将其移出脏队列的话
-            // 待会儿 sync_thread 又会对这个脏块进行 sync
-            // 但是此处的 blk_evict 已经将相应的脏块给 kfree 了
-            // blk_evict 里面不会将相应的脏块移出 dirty 队列，只会将其移出 lru 队列和 hash 表
-            // 因此待会儿 sync_thread 又会去访问这个空的数据块！
-            // 出现稀奇古怪的问题
-            lock_acquire(&victim->b_dev->lists_lock);
-            dlist_remove(&victim->dirty_tag); // 彻底从脏链表剥离
-            lock_release(&victim->b_dev->lists_lock);
-
-            // 在 IO 前释放全局锁，否则整个系统缓存都会卡死在磁盘 IO 上
-            lock_release(&global_ide_buffer.lock);
-            ide_write(victim->b_dev, victim->b_blocknr, victim->b_data, 1);
-            lock_acquire(&global_ide_buffer.lock);
-            
-            victim->b_dirty = false;
-            // 此时它已经不在任何链表了，可以直接 blk_evict
-            blk_evict(victim); 
+            global_ide_buffer.stats.dirty_evictions++;
+            writeback_and_evict(victim);
+            lock_acquire(&global_ide_buffer.lru_lock);
             continue;
         }
 
+        // blk_evict 之后 victim 就被释放了，先记下它的桶锁
+        struct lock* victim_lock = bh_lock(victim);
         blk_evict(victim);
+        lock_release(victim_lock);
+        global_ide_buffer.stats.evictions++;
     }
-    lock_release(&global_ide_buffer.lock);
+}
 
-    // 在锁外申请内存，降低锁竞争
-    struct buffer_head* new_bh = kmalloc(sizeof(struct buffer_head));
-    new_bh->b_data = kmalloc(global_ide_buffer.buf_blk_size);
-    if(new_bh == NULL || new_bh->b_data == NULL){
-        // 此处先直接 panic 简单处理
-        // 正常情况下，我们可以在此处先执行一次 evict，腾出些内存再尝试重新 malloc
-        PANIC("getblk: fail to kmalloc!");
+// 把 cnt 个 key 涉及到的桶锁下标去重后按升序排好，返回锁的个数
+// 同时持有多把桶锁时必须按下标从小到大拿，与 buffer_hash_resize 一致
+static uint32_t collect_bucket_locks(struct buffer_key* keys, uint32_t cnt, uint8_t* idx) {
+    uint32_t nr = 0;
+    for (uint32_t i = 0; i < cnt; i++) {
+        uint8_t li = buffer_hash(&keys[i]) % BUFFER_LOCK_NR;
+        // 插入排序，最多只有 MAX_GANG_BLKS 个元素
+        uint32_t j = nr;
+        while (j > 0 && idx[j - 1] > li) j--;
+        if (j > 0 && idx[j - 1] == li) continue;
+        for (uint32_t k = nr; k > j; k--) {
+            idx[k] = idx[k - 1];
+        }
+        idx[j] = li;
+        nr++;
     }
+    return nr;
+}
 
-    // 插入 (Double Check) 
-    lock_acquire(&global_ide_buffer.lock);
+static void bucket_locks_acquire(uint8_t* idx, uint32_t nr) {
+    for (uint32_t i = 0; i < nr; i++) {
+        lock_acquire(&global_ide_buffer.bucket_locks[idx[i]]);
+    }
+}
 
-    de = hash_find(&global_ide_buffer.hash_table, &bk);
-    if (de) {
-        // 别人抢先创建了，自杀并返回现有的
-        kfree(new_bh->b_data); kfree(new_bh);
-        struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, de);
-        bh->b_ref_count++;
-        lock_release(&global_ide_buffer.lock);
-        return bh;
+static void bucket_locks_release(uint8_t* idx, uint32_t nr) {
+    for (uint32_t i = nr; i > 0; i--) {
+        lock_release(&global_ide_buffer.bucket_locks[idx[i - 1]]);
     }
-    
-    // 初始化属性并挂载
-    new_bh->b_dev = dev;
-    new_bh->b_blocknr = lba;
-    new_bh->b_ref_count = 1;
-    new_bh->b_dirty = false;
-    new_bh->b_valid = false; // 由于没有存有真实的数据，是新申请的，所以没有有效数据，valid为false
-    hash_insert(&global_ide_buffer.hash_table,(void*)(&bk),&new_bh->hash_tag);
-    dlist_push_back(&global_ide_buffer.lru_list,&new_bh->lru_tag);
-    global_ide_buffer.cur_blk_num++;
+}
+
+// 给 bhs 中所有非空的块各加一个引用，调用者需要持有它们的桶锁
+// 引用计数从 0 变成 1 的块在同一次 lru_lock 内一起从替换策略的队列上摘下来
+static void bh_get_batch(struct buffer_head** bhs, uint32_t cnt) {
+    bool lru_locked = false;
+    for (uint32_t i = 0; i < cnt; i++) {
+        if (bhs[i] == NULL) continue;
+        if (bhs[i]->b_ref_count++ == 0) {
+            if (!lru_locked) {
+                lock_acquire(&global_ide_buffer.lru_lock);
+                lru_locked = true;
+            }
+            global_ide_buffer.policy->pin(bhs[i]);
+        }
+    }
+    if (lru_locked) lock_release(&global_ide_buffer.lru_lock);
+}
+
+// 批量版本的 getblk，找到或者创建从 first_lba 开始连续的 blk_cnt 个块，每个块都持有一个引用
+// 涉及到的桶锁按下标顺序一起拿，每把锁只拿一次，命中的块在一次 lru_lock 内全部从替换策略的队列上摘下
+// 未命中的块一起腾空间、一起从对象池申请，再在一轮拿锁中一起插入
+// 所以无论范围内有多少个块，拿锁的轮数都是常数
+// 新建的块 b_valid 为 false
+// 成功返回 0，内核内存耗尽申请不到新块时返回 -ENOMEM，此时不持有任何块的引用
+static int32_t getblk_range(struct disk* dev, uint32_t first_lba, uint32_t size, uint32_t blk_cnt, struct buffer_head** bhs) {
+    ASSERT(blk_cnt > 0 && blk_cnt <= MAX_GANG_BLKS);
+    uint32_t spb = size / SECTOR_SIZE;
+    struct buffer_key keys[MAX_GANG_BLKS];
+    uint8_t lock_idx[MAX_GANG_BLKS];
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        keys[i].lba = first_lba + i * spb;
+        keys[i].disk = dev;
+        keys[i].size = size;
+    }
+    uint32_t lock_nr = collect_bucket_locks(keys, blk_cnt, lock_idx);
+
+    // 第一轮，查找所有的块，命中的块直接加引用
+    uint32_t miss_mask = 0;
+    uint32_t miss_nr = 0;
+    bucket_locks_acquire(lock_idx, lock_nr);
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &keys[i]);
+        if (de) {
+            bhs[i] = member_to_entry(struct buffer_head, hash_tag, de);
+        } else {
+            bhs[i] = NULL;
+            miss_mask |= 1u << i;
+            miss_nr++;
+        }
+    }
+    bh_get_batch(bhs, blk_cnt);
+    bucket_locks_release(lock_idx, lock_nr);
+    global_ide_buffer.stats.hits += blk_cnt - miss_nr;
+    if (miss_mask == 0) {
+        return 0;
+    }
+
+    // 所有未命中的块一起腾空间
+    lock_acquire(&global_ide_buffer.lru_lock);
+    global_ide_buffer.stats.misses += miss_nr;
+    buffer_reserve(miss_nr * size);
+    lock_release(&global_ide_buffer.lru_lock);
 
-    lock_release(&global_ide_buffer.lock);
+    // 在锁外申请，降低锁竞争
+    // 稳态下刚刚淘汰的块会被原样还给对象池，这里直接从池子里拿，不会进入内核内存分配器
+    struct buffer_head* new_bhs[MAX_GANG_BLKS];
+    bool nomem = false;
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        new_bhs[i] = (miss_mask & (1u << i)) ? bh_alloc(size) : NULL;
+        if ((miss_mask & (1u << i)) && new_bhs[i] == NULL) nomem = true;
+    }
+    // 申请到的块还给对象池，命中的块放掉引用
+    if (nomem) {
+        for (uint32_t i = 0; i < blk_cnt; i++) {
+            if (new_bhs[i]) bh_free(new_bhs[i]);
+            if (bhs[i]) brelse(bhs[i]);
+        }
+        return -ENOMEM;
+    }
+
+    // 插入 (Double Check)
+    // 放开锁期间别人可能抢先创建了其中一些块，这些块直接用现有的，新申请的还给对象池
+    struct buffer_head* raced[MAX_GANG_BLKS];
+    uint32_t created = 0;
+    bucket_locks_acquire(lock_idx, lock_nr);
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        raced[i] = NULL;
+        if (new_bhs[i] == NULL) continue;
+        struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &keys[i]);
+        if (de) {
+            bhs[i] = raced[i] = member_to_entry(struct buffer_head, hash_tag, de);
+            continue;
+        }
+        // 初始化属性并挂载
+        struct buffer_head* new_bh = new_bhs[i];
+        new_bh->b_dev = dev;
+        new_bh->b_blocknr = keys[i].lba;
+        new_bh->b_size = size;
+        new_bh->b_ref_count = 1;
+        new_bh->b_dirty = false;
+        new_bh->b_valid = false; // 由于没有存有真实的数据，是新申请的，所以没有有效数据，valid为false
+        lock_init(&new_bh->b_io_lock);
+        rb_clear_node(&new_bh->dirty_node);
+        // 上面刚在同一把桶锁下确认过不存在，直接插入，不需要再扫一遍桶
+        hash_add(&global_ide_buffer.hash_table, &keys[i], &new_bh->hash_tag);
+        bhs[i] = new_bh;
+        new_bhs[i] = NULL;
+        created |= 1u << i;
+    }
+    bh_get_batch(raced, blk_cnt);
+    // 交给替换策略之前不能放开桶锁，否则别的进程 brelse 时会把一个策略还不认识的块挂到队列上
+    if (created) {
+        lock_acquire(&global_ide_buffer.lru_lock);
+        for (uint32_t i = 0; i < blk_cnt; i++) {
+            if (!(created & (1u << i))) continue;
+            global_ide_buffer.policy->insert(bhs[i]);
+            global_ide_buffer.cur_size += size;
+            global_ide_buffer.cur_blk_num++;
+        }
+        lock_release(&global_ide_buffer.lru_lock);
+    }
+    bucket_locks_release(lock_idx, lock_nr);
+
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        if (new_bhs[i]) bh_free(new_bhs[i]);
+    }
 
-    return new_bh;
+    // 块数变化较大时换一张大小合适的哈希表，这里的判断不加锁，只是粗略的
+    if (hash_resize_needed(&global_ide_buffer.hash_table)) {
+        buffer_hash_resize();
+    }
+    return 0;
+}
+
+// 内存不足时返回 NULL
+static struct buffer_head* getblk(struct disk* dev, uint32_t lba, uint32_t size) {
+    struct buffer_head* bh;
+    if (getblk_range(dev, lba, size, 1, &bh) != 0) return NULL;
+    return bh;
 }
 
 void brelse(struct buffer_head* bh){
@@ -249,20 +741,15 @@ void brelse(struct buffer_head* bh){
         return;
     }
 
-    lock_acquire(&global_ide_buffer.lock);
-    
-    if(bh->b_ref_count > 0){
-        bh->b_ref_count--;
-    }else{
-        // 如果计数已经是0了还在释放，说明上层逻辑有严重Bug
-        PANIC("brelse: buffer_head ref_count is already 0!\n");
-    }
+    struct lock* blk_lock = bh_lock(bh);
+    lock_acquire(blk_lock);
+    bh_put(bh);
     // 此时我们不移动 LRU 链表，也不移除 Hash。
     // 因为在 getblk 中，命中时会把块移到队尾，
     // 而没命中时会从队首寻找 ref_count == 0 的块。
     // 这样自然实现了：经常被 bread/brelse 的块留在队尾，
     // 而释放后长期没人碰的块会慢慢“沉降”到队首被回收。
-    lock_release(&global_ide_buffer.lock);
+    lock_release(blk_lock);
 }
 
 // bread 的零拷贝版本，用户不需要传入缓冲区，而是直接操作缓冲区中的内存副本
@@ -272,255 +759,881 @@ void brelse(struct buffer_head* bh){
 // 目前最主要就是给 ext2_write_inode 和 ext2_read_inode 来用，因为他们会被调用用来读取 inode，并且一般只读一个扇区，使用该函数可以提速
 // 我们目前的延迟写回中， inode 的缓存仍然是直写缓存，每次操作进行完毕后都直接调用 write_inode 写回
 // 将延迟写回的任务全部放到 ide 层上来做
-struct buffer_head* _bread(struct disk* dev, uint32_t lba) {
+// 返回的缓存块是包含 lba 的那个完整的分区块，扇区数据用 bh_sector_data(bh, lba) 定位
+// 把无效的块读进来，调用者持有这个块的引用，不持有任何缓存的锁
+// 别人正在读这个块时睡在 io 锁上，拿到锁后块多半已经有效了，不需要再读一次
+// 读盘出错时块保持无效，返回 -EIO，之后再访问它的进程会重新读一次
+static int32_t bh_fill(struct buffer_head* bh) {
+    int32_t err = 0;
+    lock_acquire(&bh->b_io_lock);
+    if (!bh->b_valid) {
+        // ide_read 是阻塞且开中断的，此处可能会引发进程切换
+        err = ide_read(bh->b_dev, bh->b_blocknr, bh->b_data, bh->b_size / SECTOR_SIZE);
+        bh->b_valid = (err == 0); // 当前的数据就是最新数据，valid 置为 true
+    } else {
+        global_ide_buffer.stats.read_dedups++;
+    }
+    lock_release(&bh->b_io_lock);
+    return err;
+}
+
+struct buffer_head* _bread(struct partition* part, uint32_t lba) {
+    struct disk* dev = part->my_disk;
+    uint32_t blk_lba = blk_start_lba(part, lba);
+
     // 获取块，getblk 内部处理了引用计数 ref_count++
-    struct buffer_head* bh = getblk(dev, lba);
+    struct buffer_head* bh = getblk(dev, blk_lba, part->blk_size);
+    if (bh == NULL) return NULL;
     
-    // 如果数据无效，直接读盘到缓存区
-    if (!bh->b_valid) {
-        // getblk 已经拿到了全局锁，但 ide_read 是阻塞且开中断的
-        // 此处可能会引发进程切换
-        ide_read(dev, lba, bh->b_data, 1);
-        bh->b_valid = true; // 当前的数据就是最新数据，valid 置为 true
-        bh->b_dirty = false; 
+    // 如果数据无效，直接读盘到缓存区，读不出来就放掉引用，返回 NULL
+    if (!bh->b_valid && bh_fill(bh) != 0) {
+        brelse(bh);
+        return NULL;
     }
     
     // 返回结构体指针，用户通过 bh->b_data 访问数据
     return bh;
 }
 
-// 由于多扇区的读写会涉及到多个 buffer_head，目前的架构当中不太好针对这种情况实现零拷贝
-// 因此多扇区读的部分还是依然先使用有拷贝的实现
-void bread_multi(struct disk* dev, uint32_t start_lba, void* out_buf, uint32_t sec_cnt) {
+// 批量版本的零拷贝 bread
+// 返回覆盖 [start_lba, start_lba + sec_cnt) 的所有缓存块，每个块都已经增加了引用计数，用完后需要 brelse_gang
+// 区间不要求与块边界对齐，首尾块可能只有一部分落在区间内，调用者用 bh_sector_data 定位具体扇区
+// 区间最多只能跨越 MAX_GANG_BLKS 个块，bhs 数组至少要能放下这么多个指针
+// 未命中的连续块会合并成一次分散读，磁盘数据直接 DMA 到各个块的 b_data 中，不经过任何中转缓冲区
+// 有块读不出来或者内存不足拿不到块时放掉所有块的引用并返回 0，调用者把它当作 -EIO
+uint32_t bread_gang(struct partition* part, uint32_t start_lba, uint32_t sec_cnt, struct buffer_head** bhs) {
+    struct disk* dev = part->my_disk;
+    uint32_t size = part->blk_size;
+    uint32_t spb = size / SECTOR_SIZE;
+    uint32_t first_lba = blk_start_lba(part, start_lba);
+    uint32_t blk_cnt = DIV_ROUND_UP(start_lba + sec_cnt - first_lba, spb);
+    ASSERT(sec_cnt > 0 && blk_cnt <= MAX_GANG_BLKS);
+
+    // 先把所有块都拿到手并持有引用，防止它们在 io 期间被驱逐
+    // 命中的块也可能是无效的（被直接写作废的块），下面按 b_valid 决定要读哪些块
+    if (getblk_range(dev, first_lba, size, blk_cnt, bhs) != 0) return 0;
+
+    // 先不睡眠地拿下所有无效块的 io 锁，拿到的块由我们来读
+    // 拿不到的块别人正在读，等我们自己的 io 发出去之后再去等它们，不持有 io 锁睡眠，也就不会和别人互相等待
+    bool mine[MAX_GANG_BLKS];
+    bool busy = false;
+    for (uint32_t i = 0; i < blk_cnt; i++) {
+        mine[i] = false;
+        if (bhs[i]->b_valid) continue;
+        if (!lock_try_acquire(&bhs[i]->b_io_lock)) {
+            busy = true;
+            continue;
+        }
+        // 拿锁之前别人可能刚刚读完
+        if (bhs[i]->b_valid) {
+            lock_release(&bhs[i]->b_io_lock);
+            continue;
+        }
+        mine[i] = true;
+    }
+
+    struct io_vec vec[MAX_GANG_BLKS];
+    int32_t err = 0;
     uint32_t i = 0;
-    while (i < sec_cnt) {
-        // 先尝试在哈希表中查找（必须持有全局锁）
-        struct buffer_head* bh = getblk(dev, start_lba + i);
-        
-        if (bh->b_valid) { 
-            // bh->b_valid 为 true 说明是缓存命中的，不是新申请的，可以直接使用，不用 io
-            memcpy((uint8_t*)out_buf + i * SECTOR_SIZE, bh->b_data, SECTOR_SIZE);
-            // getblk 中会增加计数，所以此处我们用完后需要释放一下
-            brelse(bh);
+    while (i < blk_cnt) {
+        if (!mine[i]) {
             i++;
-        } else {
-            // bh->b_valid 为 false 说明这是一个新申请的 bh，没有有效数据，需要发起磁盘 io
-            // 尝试向后合并 IO
-            // 至少我们当前的这个块肯定是没命中的，因此 bulk_cnt 初始为 1
-            uint32_t bulk_cnt = 1; 
-            // 释放掉这个还没填数据的 bh，我们一会儿批量处理它
-            brelse(bh); 
-
-            // 向后看还有多少个块也是不命中的，直到遇到命中的或者到结尾
-            lock_acquire(&global_ide_buffer.lock);
-            while (i + bulk_cnt < sec_cnt) {
-                struct buffer_key bk = {start_lba + i + bulk_cnt, dev};
-                
-                struct dlist_elem* bh_hash_tag = hash_find(&global_ide_buffer.hash_table,(void*)&bk);
-                // 如果哈希表里找不到，说明可以合并读取
-                if(!bh_hash_tag){
-                    bulk_cnt++;
-                } else {
-                    // 如果找到了，说明内存里已经有这个块了，停止合并
-                    // 下一轮循环时，进入 while 后 getblk 得到的 bh 的 valid 就为 true 了
+            continue;
+        }
+        // 向后合并所有连续的、由我们来读的块，一次 io 全部读进来
+        // 一个 gang 最多 16 个 4KB 的块，也就是 128 个扇区，不会超过任何磁盘单条命令的上限
+        uint32_t run = 0;
+        while (i + run < blk_cnt && mine[i + run]) {
+            vec[run].base = bhs[i + run]->b_data;
+            vec[run].len = size;
+            run++;
+        }
+        int32_t run_err = ide_read_vec(dev, bhs[i]->b_blocknr, vec, run);
+        if (run_err != 0) err = run_err;
+        for (uint32_t j = i; j < i + run; j++) {
+            bhs[j]->b_valid = (run_err == 0);
+            lock_release(&bhs[j]->b_io_lock);
+        }
+        i += run;
+    }
+
+    // 等别人的读完成，直接复用它们的结果
+    if (busy) {
+        for (i = 0; i < blk_cnt; i++) {
+            if (!mine[i] && !bhs[i]->b_valid && bh_fill(bhs[i]) != 0) {
+                err = -EIO;
+            }
+        }
+    }
+    if (err != 0) {
+        brelse_gang(bhs, blk_cnt);
+        return 0;
+    }
+    return blk_cnt;
+}
+
+// 与 getblk_range 一样，涉及到的桶锁按下标顺序各拿一次，引用计数降为 0 的块在一次 lru_lock 内一起挂回队列
+void brelse_gang(struct buffer_head** bhs, uint32_t cnt) {
+    ASSERT(cnt <= MAX_GANG_BLKS);
+    if (cnt == 0) return;
+    struct buffer_key keys[MAX_GANG_BLKS];
+    uint8_t lock_idx[MAX_GANG_BLKS];
+    for (uint32_t i = 0; i < cnt; i++) {
+        keys[i].lba = bhs[i]->b_blocknr;
+        keys[i].disk = bhs[i]->b_dev;
+        keys[i].size = bhs[i]->b_size;
+    }
+    uint32_t lock_nr = collect_bucket_locks(keys, cnt, lock_idx);
+
+    bool lru_locked = false;
+    bucket_locks_acquire(lock_idx, lock_nr);
+    for (uint32_t i = 0; i < cnt; i++) {
+        if (bhs[i]->b_ref_count == 0) {
+            PANIC("brelse_gang: buffer_head ref_count is already 0!\n");
+        }
+        if (--bhs[i]->b_ref_count == 0) {
+            if (!lru_locked) {
+                lock_acquire(&global_ide_buffer.lru_lock);
+                lru_locked = true;
+            }
+            bh_unpin(bhs[i]);
+        }
+    }
+    if (lru_locked) lock_release(&global_ide_buffer.lru_lock);
+    bucket_locks_release(lock_idx, lock_nr);
+}
+
+// 有拷贝的多扇区读，数据从缓存块直接拷到调用者的缓冲区，只拷贝一次
+// 未命中的块由 bread_gang 直接读进缓存，不再需要先读到临时缓冲区再拷进缓存
+// [start_lba, start_lba + sec_cnt) 不要求与分区的块边界对齐，首尾不完整的块只拷贝重叠的部分
+// 成功返回 0，读盘出错返回 -EIO，出错之前已经拷贝的部分留在 out_buf 里
+int32_t bread_multi(struct partition* part, uint32_t start_lba, void* out_buf, uint32_t sec_cnt) {
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    uint32_t end_lba = start_lba + sec_cnt;
+    uint32_t lba = start_lba;
+    struct buffer_head* bhs[MAX_GANG_BLKS];
+
+    while (lba < end_lba) {
+        // 每一轮最多处理 MAX_GANG_BLKS 个块
+        uint32_t gang_end = blk_start_lba(part, lba) + MAX_GANG_BLKS * spb;
+        uint32_t cnt = (gang_end < end_lba ? gang_end : end_lba) - lba;
+        uint32_t blk_cnt = bread_gang(part, lba, cnt, bhs);
+        if (blk_cnt == 0) return -EIO;
+        for (uint32_t i = 0; i < blk_cnt; i++) {
+            bh_copy_range(bhs[i], start_lba, end_lba, out_buf, false);
+        }
+        brelse_gang(bhs, blk_cnt);
+        lba += cnt;
+    }
+    return 0;
+}
+
+// 提交一个异步预读请求，把 [start_lba, start_lba + sec_cnt) 读进缓存，调用者不会被阻塞
+void breada(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    if (sec_cnt == 0 || blk_size_conflict(part, start_lba, sec_cnt)) return;
+    lock_acquire(&ra_lock);
+    if ((ra_tail + 1) % RA_QUEUE_SIZE == ra_head) {
+        // 队列满了，说明磁盘已经忙不过来了，直接丢掉
+        lock_release(&ra_lock);
+        return;
+    }
+    ra_queue[ra_tail].part = part;
+    ra_queue[ra_tail].lba = start_lba;
+    ra_queue[ra_tail].sec_cnt = sec_cnt;
+    ra_tail = (ra_tail + 1) % RA_QUEUE_SIZE;
+    lock_release(&ra_lock);
+    sema_signal(&ra_pending);
+}
+
+// 预读 io 全部完成，在中断上下文中执行
+static void ra_end_io(struct rq_batch* batch) {
+    struct ra_io* io = batch->private;
+    for (uint32_t i = 0; i < io->rq_cnt; i++) {
+        struct request* rq = &io->rqs[i];
+        // 一个请求就是一个块，它的 vec 在 io->vec 中的下标和块在 bhs 中的下标相同
+        struct buffer_head* bh = io->bhs[rq->vec - io->vec];
+        // 读失败的块保持无效，之后访问它的进程会重新读一次
+        bh->b_valid = (rq->status == 0);
+        lock_release_disowned(&bh->b_io_lock);
+    }
+    dlist_push_back(&ra_done, &io->tag);
+    sema_signal(&ra_pending);
+}
+
+// 把 gang 中的块读进缓存，提交之后立即返回
+// 已经有效的块不用读，拿不到 io 锁的块别人正在读，其余的块由这次 io 来读
+static void ra_submit(struct ra_io* io, struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    struct disk* dev = part->my_disk;
+    uint32_t size = part->blk_size;
+    uint32_t spb = size / SECTOR_SIZE;
+    uint32_t first_lba = blk_start_lba(part, start_lba);
+    io->blk_cnt = DIV_ROUND_UP(start_lba + sec_cnt - first_lba, spb);
+    // 内存不足时放弃这次预读，下面一个请求都不提交，ra_end_io 照常把 io 交回给 ra_reap
+    if (getblk_range(dev, first_lba, size, io->blk_cnt, io->bhs) != 0) io->blk_cnt = 0;
+
+    for (uint32_t i = 0; i < io->blk_cnt; i++) {
+        struct buffer_head* bh = io->bhs[i];
+        io->mine[i] = false;
+        if (bh->b_valid || !lock_try_acquire(&bh->b_io_lock)) continue;
+        if (bh->b_valid) {
+            lock_release(&bh->b_io_lock);
+            continue;
+        }
+        // io 锁交给 ra_end_io 在中断里放开，等这个块的进程会一直睡到 io 完成
+        lock_disown(&bh->b_io_lock);
+        io->mine[i] = true;
+    }
+
+    // 每个块一个请求，plug 住整批请求，commit 时调度器把连续的块合并成一条命令
+    rq_batch_init(&io->batch);
+    io->batch.end_io = ra_end_io;
+    io->batch.private = io;
+    rq_batch_plug(&io->batch);
+    io->rq_cnt = 0;
+    for (uint32_t i = 0; i < io->blk_cnt; i++) {
+        if (!io->mine[i]) continue;
+        io->vec[i].base = io->bhs[i]->b_data;
+        io->vec[i].len = size;
+        struct request* rq = &io->rqs[io->rq_cnt++];
+        *rq = (struct request){ .disk = dev, .op = REQ_READ, .lba = io->bhs[i]->b_blocknr, .vec = &io->vec[i], .vec_cnt = 1 };
+        rq_batch_submit(&io->batch, rq);
+    }
+    // 一个块都不用读时 ra_end_io 在这里直接被调用
+    rq_batch_commit(&io->batch);
+}
+
+// 放掉已经完成的预读 io 持有的块引用，把它们放回 ra_free
+static void ra_reap(void) {
+    while (1) {
+        enum intr_status old = intr_disable();
+        struct dlist_elem* pelem = dlist_empty(&ra_done) ? NULL : dlist_pop_front(&ra_done);
+        intr_set_status(old);
+        if (pelem == NULL) return;
+        struct ra_io* io = member_to_entry(struct ra_io, tag, pelem);
+        brelse_gang(io->bhs, io->blk_cnt);
+        dlist_push_back(&ra_free, &io->tag);
+    }
+}
+
+// 预读线程，从预读队列中取出请求，按 gang 拿到缓存块并提交异步 io，不等 io 完成就去处理下一个请求
+// io 完成后再回来放掉块的引用，同时最多有 RA_IO_NR 个 gang 在路上
+// 已经在缓存中的块不会发起 io，所以重复的预读请求代价很小
+void readahead_ide_buffer(void* arg UNUSED) {
+    // 内核线程的栈只有一页，ra_io 放不下
+    struct ra_io* ios = kmalloc(RA_IO_NR * sizeof(struct ra_io));
+    if (ios == NULL) PANIC("readahead_ide_buffer: fail to malloc ra_io");
+    for (int i = 0; i < RA_IO_NR; i++) {
+        dlist_push_back(&ra_free, &ios[i].tag);
+    }
+
+    struct ra_request req;
+    req.sec_cnt = 0; // 手上还没有处理完的请求
+    while (1) {
+        // 每次醒来都把能做的事情做完，多出来的计数只会让循环空转一次
+        sema_wait(&ra_pending);
+        ra_reap();
+        while (!dlist_empty(&ra_free)) {
+            if (req.sec_cnt == 0) {
+                lock_acquire(&ra_lock);
+                if (ra_head == ra_tail) {
+                    lock_release(&ra_lock);
                     break;
                 }
-                // 防止单次 IO 太大
-                // 我们设置的最大一次性 io 的扇区数是 16，因此我们将其作为上界
-                if (bulk_cnt >= SECTORS_PER_OP_BLOCK) break; 
+                req = ra_queue[ra_head];
+                ra_head = (ra_head + 1) % RA_QUEUE_SIZE;
+                lock_release(&ra_lock);
             }
-            lock_release(&global_ide_buffer.lock);
-
-            // 发起一次大批量 IO (读到用户缓冲区)
-            ide_read(dev, start_lba + i, (uint8_t*)out_buf + i * SECTOR_SIZE, bulk_cnt);
-
-            // 既然读完了，顺便把这些块同步进缓存
-            for (uint32_t j = 0; j < bulk_cnt; j++) {
-                struct buffer_head* tmp_bh = getblk(dev, start_lba + i + j);
-                // 只有拿到的是无效块时才拷贝（防止在 ide_read 期间别的进程填了数据）
-                if (!tmp_bh->b_valid) {
-                    memcpy(tmp_bh->b_data, (uint8_t*)out_buf + (i + j) * SECTOR_SIZE, SECTOR_SIZE);
-                    tmp_bh->b_valid = true;
-                }
-                brelse(tmp_bh);
+            // 每次提交一个 gang，ra_io 用完了就等前面的 io 完成，它们完成时会再唤醒我们
+            uint32_t spb = req.part->blk_size / SECTOR_SIZE;
+            uint32_t gang_end = blk_start_lba(req.part, req.lba) + MAX_GANG_BLKS * spb;
+            uint32_t end_lba = req.lba + req.sec_cnt;
+            uint32_t cnt = (gang_end < end_lba ? gang_end : end_lba) - req.lba;
+            struct ra_io* io = member_to_entry(struct ra_io, tag, dlist_pop_front(&ra_free));
+            ra_submit(io, req.part, req.lba, cnt);
+            req.lba += cnt;
+            req.sec_cnt -= cnt;
+        }
+    }
+}
+
+// 把 [start_lba, start_lba + sec_cnt) 范围内干净且没有被引用的缓存块丢掉
+// 用于 POSIX_FADV_DONTNEED，脏块和正在使用的块保持不变
+void bdrop(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    uint32_t end_lba = start_lba + sec_cnt;
+    for (uint32_t lba = blk_start_lba(part, start_lba); lba < end_lba; lba += spb) {
+        struct buffer_key bk = {lba, part->my_disk, part->blk_size};
+        struct lock* blk_lock = bucket_lock(&bk);
+        lock_acquire(blk_lock);
+        struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &bk);
+        if (de != NULL) {
+            struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, de);
+            if (bh->b_ref_count == 0 && !bh->b_dirty) {
+                lock_acquire(&global_ide_buffer.lru_lock);
+                blk_evict(bh);
+                lock_release(&global_ide_buffer.lru_lock);
             }
-            i += bulk_cnt;
         }
+        lock_release(blk_lock);
     }
 }
 
-void sync_ide_buffer(void *arg UNUSED) {
-    // 预分配一个足够大的临时缓冲区，避免在循环里频繁申请内存
-    // 大小为 SECTORS_PER_OP_BLOCK * 512
-    uint32_t io_buffer_sec_cnt = (MAX_SYNC_COUNT>global_ide_buffer.max_blk_num)?(global_ide_buffer.max_blk_num):MAX_SYNC_COUNT;
-    uint8_t* io_buffer = kmalloc(io_buffer_sec_cnt * SECTOR_SIZE);
-    if (io_buffer == NULL) PANIC("sync: fail to malloc io_buffer");
+// 把 [start_lba, start_lba + sec_cnt) 范围内干净且没有被引用的缓存块挪到替换策略的冷端
+// 用于流式读的 drop-behind，与 bdrop 不同，块仍然留在缓存里，只是下一次腾空间时先淘汰它们
+// 别的进程之后再访问这些块时，它们会随着 brelse 重新回到热端，所以不会误伤共享的热块
+// 脏块挪到冷端会让 getblk 同步写回，留在原处交给写回线程
+void bdemote(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    uint32_t end_lba = start_lba + sec_cnt;
+    for (uint32_t lba = blk_start_lba(part, start_lba); lba < end_lba; lba += spb) {
+        struct buffer_key bk = {lba, part->my_disk, part->blk_size};
+        struct lock* blk_lock = bucket_lock(&bk);
+        lock_acquire(blk_lock);
+        struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &bk);
+        if (de != NULL) {
+            struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, de);
+            if (bh->b_ref_count == 0 && !bh->b_dirty) {
+                lock_acquire(&global_ide_buffer.lru_lock);
+                global_ide_buffer.policy->demote(bh);
+                lock_release(&global_ide_buffer.lru_lock);
+                global_ide_buffer.stats.demotions++;
+            }
+        }
+        lock_release(blk_lock);
+    }
+}
+
+// 直接写之后缓存中的旧数据就过期了
+// 没人用的干净块直接淘汰；正在被引用的干净块标记为无效，下一次 bread 时会重新读盘
+// 仍然是脏的块说明在直接写期间又有人通过缓存写了它，两者的先后本来就不确定，留给写回线程
+// 调用者已经用 blk_size_conflict 检查过，范围内的块只可能是 part->blk_size 大小的
+static void binvalidate(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    uint32_t spb = part->blk_size / SECTOR_SIZE;
+    uint32_t end_lba = start_lba + sec_cnt;
+    for (uint32_t lba = blk_start_lba(part, start_lba); lba < end_lba; lba += spb) {
+        struct buffer_key bk = {lba, part->my_disk, part->blk_size};
+        struct lock* blk_lock = bucket_lock(&bk);
+        lock_acquire(blk_lock);
+        struct dlist_elem* de = hash_find(&global_ide_buffer.hash_table, &bk);
+        if (de != NULL) {
+            struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, de);
+            if (bh->b_ref_count == 0 && !bh->b_dirty) {
+                lock_acquire(&global_ide_buffer.lru_lock);
+                blk_evict(bh);
+                lock_release(&global_ide_buffer.lru_lock);
+            } else if (!bh->b_dirty) {
+                // 正在读盘的块可能读到的是直接写之前的旧数据，要等它读完再作废
+                // 持有引用防止它在等待期间被淘汰，拿 io 锁之前先放开桶锁
+                bh_get(bh);
+                lock_release(blk_lock);
+                lock_acquire(&bh->b_io_lock);
+                if (!bh->b_dirty) bh->b_valid = false;
+                lock_release(&bh->b_io_lock);
+                brelse(bh);
+                continue;
+            }
+        }
+        lock_release(blk_lock);
+    }
+}
+
+// 把 pin 住的用户缓冲区 [buf, buf + len) 逐页映射到内核地址，每页一段 io_vec，返回段数
+// buf 按扇区对齐，所以每一段的长度都是扇区大小的整数倍
+static uint32_t map_pinned_pages(void* buf, uint32_t len, struct page** pages, struct io_vec* vec) {
+    uint32_t vaddr = (uint32_t)buf;
+    uint32_t cnt = 0;
+    while (len > 0) {
+        uint32_t offset = vaddr & (PG_SIZE - 1);
+        uint32_t chunk = PG_SIZE - offset < len ? PG_SIZE - offset : len;
+        uint32_t paddr = (uint32_t)(pages[cnt] - global_pages) << 12;
+        vec[cnt].base = (uint8_t*)kmap(paddr) + offset;
+        vec[cnt].len = chunk;
+        cnt++;
+        vaddr += chunk;
+        len -= chunk;
+    }
+    return cnt;
+}
+
+// O_DIRECT，绕过缓存直接在缓冲区 buf 和磁盘 [start_lba, start_lba + sec_cnt)（绝对地址）之间传输
+// 有 DMA 时数据直接从用户页搬到磁盘，不经过缓存块，也不会把缓存里的热数据挤出去
+// 缓存里可能有这段范围的脏块，无论读写都要先把它们写回：读要读到最新的数据，写要防止它们之后覆盖掉新数据
+// buf 必须按扇区对齐，由调用者检查；成功返回 0，buf 不是合法的用户缓冲区时返回 -EFAULT，读写出错返回 -EIO
+// 范围和块大小不同的分区重叠时返回 -EBUSY，否则直接写之后作废不掉另一种块大小的旧缓存
+int32_t bdirect_io(struct partition* part, uint32_t start_lba, void* buf, uint32_t sec_cnt, bool is_write) {
+    struct disk* dev = part->my_disk;
+    // 一条命令最多 MAX_SECS_PER_CMD 个扇区，buf 按扇区对齐时最多跨越这么多页
+    struct page* pages[MAX_SECS_PER_CMD * SECTOR_SIZE / PG_SIZE + 1];
+    struct io_vec vec[MAX_SECS_PER_CMD * SECTOR_SIZE / PG_SIZE + 1];
+    bool user = (uint32_t)buf < KERNEL_PAGE_OFFSET;
+
+    if (blk_size_conflict(part, start_lba, sec_cnt)) return -EBUSY;
+    int32_t err = 0;
+    bflush(part, start_lba, sec_cnt);
+    while (sec_cnt > 0) {
+        uint32_t secs = sec_cnt < MAX_SECS_PER_CMD ? sec_cnt : MAX_SECS_PER_CMD;
+        uint32_t len = secs * SECTOR_SIZE;
+        // 内核缓冲区不会被换出，不需要 pin
+        int32_t pg_cnt = 0;
+        uint32_t vec_cnt = 1;
+        vec[0].base = buf;
+        vec[0].len = len;
+        if (user) {
+            pg_cnt = pin_user_pages((uint32_t)buf, len, !is_write, pages);
+            if (pg_cnt < 0) return -EFAULT;
+            // 请求可能在别的进程的上下文中开始和完成，那时的页表里不一定有这些用户地址
+            // 把 pin 住的页映射到内核地址上再交给 ide，内核部分的页表在所有进程中都是同一份
+            vec_cnt = map_pinned_pages(buf, len, pages, vec);
+        }
+        if (is_write) {
+            err = ide_write_vec(dev, start_lba, vec, vec_cnt);
+            // 写失败时磁盘上可能已经写了一部分，缓存里的旧数据同样不能再用
+            binvalidate(part, start_lba, secs);
+        } else {
+            err = ide_read_vec(dev, start_lba, vec, vec_cnt);
+        }
+        if (user) {
+            for (uint32_t i = 0; i < vec_cnt; i++) {
+                kunmap(vec[i].base);
+            }
+            unpin_user_pages(pages, pg_cnt);
+        }
+        if (err != 0) return err;
+
+        start_lba += secs;
+        sec_cnt -= secs;
+        buf = (uint8_t*)buf + len;
+    }
+    return 0;
+}
 
+// 把 dev 上 [start_lba, end_lba) 范围内的脏块写回磁盘，连续的脏块合并成一次 io
+// 返回时，调用之前就已经变脏的块都已经写到了磁盘上（可能还在磁盘的写缓存里）
+// 调用时不能持有任何缓存的锁
+static void writeback_range(struct disk* dev, uint32_t start_lba, uint32_t end_lba) {
+    // 脏块树本身就是按 lba 有序的，直接沿着树的中序取出一批脏块，不需要再排序
+    // 一批里的块不要求连续，整批请求一起提交，只等一次
+    // 每一批写完后从上一批的末尾继续向后找，整个范围只扫一遍
+    // 扫描期间新产生的、lba 比游标小的脏块留到下一轮，避免被持续写入的进程一直拖住
+    uint32_t cursor = start_lba;
     while (1) {
-        for (int c_no = 0; c_no < CHANNEL_NUM; c_no++) {
-            for (int d_no = 0; d_no < DEVICE_NUM_PER_CHANNEL; d_no++) {
-                struct disk* dev = &channels[c_no].devices[d_no];
-                if (dev->name[0] == '\0'|| dev->i_rdev == 0 || dlist_empty(&dev->dirty_lists[dev->active_dirty_idx])) continue;
-                lock_acquire(&dev->lists_lock);
-                
-                // 切换活跃索引，让 bwrite 开始往另一个队列写数据
-                // 现在的旧队列进行排序和同步
-                int old_idx = dev->active_dirty_idx;
-                // 0 变 1，1 变 0
-                dev->active_dirty_idx = 1 - old_idx;
-
-                lock_release(&dev->lists_lock);
-
-                if (dlist_empty(&dev->dirty_lists[old_idx])){
-                    continue;
-                }
-                // 在锁外重构顺序，以便于合并 io
-                struct dlist sorted_list;
-                dlist_init(&sorted_list);
-                
-                lock_acquire(&global_ide_buffer.lock);    
-                while (!dlist_empty(&dev->dirty_lists[old_idx])) {
-                    // 将旧队列中的节点弹出，然后按需插入 sorted_list 中
-                    // 这个操作的复杂度较高，可能会达到 O(n^2)
-                    struct dlist_elem* pelem = dlist_pop_front(&dev->dirty_lists[old_idx]);
-                    struct buffer_head* bh = member_to_entry(struct buffer_head, dirty_tag, pelem);
-                    // 添加计数，防止被 evict
-                    // 不知道为什么，在此处增加 b_ref_count 的计数的话
-                    // 基准测试的速度反而还会快 2 秒左右，这可能是因为此处可以合并写回，速度更快一些
-                    // 如果不添加计数的话，该块可能会被 evict 出去，evict 在驱逐脏块时，首先会进行一次写回
-                    // 然后回到这里后，又会对这个块进行一次写回，不添加计数的话可能会引入 evict 里面那次额外的同步
-                    // 因此速度会变慢，变慢都不要紧，两次同步可能还会导致额外的一致性问题，最好此处还是加一下
-                    // 这个操作的本质其实是一个缓存锁定操作
-                    bh->b_ref_count++; 
-                    // 使用 insert_order 逻辑，但在私有链表上运行
-                    dlist_insert_order(&sorted_list, _cb_bh_lba_condition, &bh->dirty_tag);
-                }
-                lock_release(&global_ide_buffer.lock);
-
-                // 使用排序后的队列进行 io，速度比不排序直接 io 时可能会提升一倍左右
-                while (!dlist_empty(&sorted_list)) {
-                    struct buffer_head* batch[MAX_SYNC_COUNT];
-                    int count = 0;
-                    uint32_t start_lba;
-
-                    lock_acquire(&global_ide_buffer.lock);
-                    if (dlist_empty(&sorted_list)) {
-                        lock_release(&global_ide_buffer.lock);
-                        break;
-                    }
-
-                    // 提取连续脏块
-                    struct dlist_elem* pelem = dlist_pop_front(&sorted_list);
-                    struct buffer_head* bh = member_to_entry(struct buffer_head, dirty_tag, pelem);
-                    batch[count++] = bh;
-                    start_lba = bh->b_blocknr;
-
-                    while (count < MAX_SYNC_COUNT && !dlist_empty(&sorted_list)) {
-                        
-                        struct dlist_elem* next_pelem = sorted_list.head.next;
-                        struct buffer_head* next_bh = member_to_entry(struct buffer_head, dirty_tag, next_pelem);
-
-                        if (next_bh->b_blocknr == batch[count-1]->b_blocknr + 1) {
-                            dlist_pop_front(&sorted_list);
-                            batch[count++] = next_bh;
-                        } else {
-                            break;
-                        }
-                    }
-
-                    // 先在锁内标记为非脏（防止丢失 IO 期间产生的新修改）
-                    // 如果在 ide_write 期间，有进程又改了这个块，它会重新调用 dirty 把这个块再次挂进 dirty_list。
-                    // 这样 sync_thread 在下一轮循环中会再次发现它，保证数据最终一定落盘。
-                    for (int i = 0; i < count; i++) {
-                        batch[i]->b_dirty = false;
-                        // 如果有引用等待，可以在这里处理
-                    }
-                    lock_release(&global_ide_buffer.lock);
-
-                    // 内存拼接，将零散的缓存块数据拷贝到连续的 io_buffer
-                    for (int i = 0; i < count; i++) {
-                        memcpy(io_buffer + i * SECTOR_SIZE, batch[i]->b_data, SECTOR_SIZE);
-                    }
-
-                    // 批量 IO，一次性写入磁盘
-                    ide_write(dev, start_lba, io_buffer, count);
-                    lock_acquire(&global_ide_buffer.lock);
-                    for (int i = 0; i < count; i++) {
-                        // brelse(batch[i]); 
-                        batch[i]->b_ref_count--;
-                    }
-                    lock_release(&global_ide_buffer.lock);
-                    // printk("\nsync_thread: write %d sectors to dev: 0x%x LBA:0x%x",count, dev->i_rdev, start_lba);
-                }
+        int count = 0;
+        uint32_t sec_cnt = 0; // 本批次累计的扇区数
+
+        // 即使范围内已经没有脏块也要拿一次 wb_lock，等别人正在进行的写回完成
+        lock_acquire(&dev->wb_lock);
+        if (dev->wb_batch == NULL) {
+            // 脏块直接以分散/聚集的方式写回，每个缓存块对应一段 io_vec（DMA 时就是一个 PRD 条目）
+            // 一批最多 IDE_MAX_VECS 个块，每个块一个请求
+            // 内核线程的栈只有一页，这几个数组比较大，所以每个磁盘申请一次，之后一直复用
+            dev->wb_batch = kmalloc(IDE_MAX_VECS * sizeof(struct buffer_head*));
+            dev->wb_vec = kmalloc(IDE_MAX_VECS * sizeof(struct io_vec));
+            dev->wb_rqs = kmalloc(IDE_MAX_VECS * sizeof(struct request));
+            if (dev->wb_batch == NULL || dev->wb_vec == NULL || dev->wb_rqs == NULL) PANIC("writeback_range: fail to malloc batch");
+        }
+        struct buffer_head** batch = dev->wb_batch;
+        struct io_vec* vec = dev->wb_vec;
+        struct request* rqs = dev->wb_rqs;
+
+        // 只拿这个磁盘的 dirty_lock，别的磁盘上的缓存命中和写回都不受影响
+        lock_acquire(&dev->dirty_lock);
+        struct buffer_head* bh = dirty_tree_lower_bound(dev, cursor);
+        if (bh == NULL || bh->b_blocknr >= end_lba) {
+            lock_release(&dev->dirty_lock);
+            lock_release(&dev->wb_lock);
+            break;
+        }
+
+        // 提取范围内的脏块
+        while (bh != NULL && bh->b_blocknr < end_lba && count < IDE_MAX_VECS) {
+            // 添加计数，防止被 evict
+            // 如果不添加计数的话，该块可能会被 evict 出去，evict 在驱逐脏块时，首先会进行一次写回
+            // 两次同步可能还会导致额外的一致性问题，这个操作的本质其实是一个缓存锁定操作
+            // 引用计数由桶锁保护，而这里已经持有 dirty_lock，与正常的拿锁顺序相反，只能 try
+            // 拿不到就在这里截断这一批，剩下的块留给下一批
+            struct lock* blk_lock = bh_lock(bh);
+            if (!lock_try_acquire(blk_lock)) break;
+            bh_get(bh);
+            lock_release(blk_lock);
+
+            struct rb_node* next = rb_next(&bh->dirty_node);
+            // 先在锁内标记为非脏（防止丢失 IO 期间产生的新修改）
+            // 如果在 ide_write 期间，有进程又改了这个块，它会重新把这个块再次挂进脏块树。
+            // 这样写回线程在下一轮循环中会再次发现它，保证数据最终一定落盘。
+            clear_buffer_dirty(bh);
+            batch[count++] = bh;
+            sec_cnt += bh->b_size / SECTOR_SIZE;
+            bh = next ? member_to_entry(struct buffer_head, dirty_node, next) : NULL;
+        }
+        lock_release(&dev->dirty_lock);
+
+        if (count == 0) {
+            // 第一个块的桶锁就被别人占着，让出 cpu 等它放开后再试
+            lock_release(&dev->wb_lock);
+            thread_yield();
+            continue;
+        }
+
+        // 每个块是一个请求，整批提交之前先 plug 住，unplug 时调度器一次看到整批请求
+        // 磁盘上连续的块在调度器里合并成一条命令，直接从各个缓存块聚集写入磁盘
+        // 块大小不同的块也可以合并，只要它们在磁盘上是连续的
+        struct rq_batch rb;
+        rq_batch_init(&rb);
+        rq_batch_plug(&rb);
+        uint32_t runs = 0;
+        for (int i = 0; i < count; i++) {
+            if (i == 0 || batch[i]->b_blocknr != batch[i - 1]->b_blocknr + batch[i - 1]->b_size / SECTOR_SIZE) runs++;
+            vec[i].base = batch[i]->b_data;
+            vec[i].len = batch[i]->b_size;
+            rqs[i] = (struct request){ .disk = dev, .op = REQ_WRITE, .lba = batch[i]->b_blocknr, .vec = &vec[i], .vec_cnt = 1 };
+            rq_batch_submit(&rb, &rqs[i]);
+        }
+
+        // 写失败的块已经不在脏块树上了，数据只能丢掉，记下错误留给下一次 fsync 报告
+        int32_t err = rq_batch_wait_disk(&rb, dev, sec_cnt);
+        if (err != 0) dev->wb_error = err;
+        dev->wb_seq++;
+        global_ide_buffer.stats.wb_runs += runs;
+        global_ide_buffer.stats.wb_blocks += count;
+        global_ide_buffer.stats.wb_sectors += sec_cnt;
+        cursor = batch[count - 1]->b_blocknr + batch[count - 1]->b_size / SECTOR_SIZE;
+        // 拿 wb_lock 的进程都不持有缓存的锁，这里 brelse 去拿桶锁不会互相等待
+        for (int i = 0; i < count; i++) {
+            brelse(batch[i]);
+        }
+        lock_release(&dev->wb_lock);
+        wake_throttled(dev);
+    }
+}
+
+// 所有磁盘上脏数据的总字节数
+// 各个磁盘的计数由各自的 dirty_lock 保护，这里不拿锁，只是一个估计值，用来判断要不要刷脏和限流已经足够了
+static uint32_t dirty_bytes_total(void) {
+    // disk_list 只在初始化阶段增长，遍历时不需要拿锁
+    uint32_t total = 0;
+    struct dlist_elem* pelem = disk_list.head.next;
+    while (pelem != &disk_list.tail) {
+        total += (member_to_entry(struct disk, disk_tag, pelem))->dirty_bytes;
+        pelem = pelem->next;
+    }
+    return total;
+}
+
+// 脏数据是否超过了缓存目标容量的 ratio%
+static bool dirty_exceeded(uint32_t ratio) {
+    return dirty_bytes_total() > global_ide_buffer.max_size / 100 * ratio;
+}
+
+// 唤醒磁盘的写回线程
+// 即使被 thread_unblock 强制唤醒也没事
+// 因为 sys_milsleep 中的 thread_block 后有一个将进程移出睡眠队列的操作
+// 可以保证被唤醒后的进程不在睡眠队列中
+static void wakeup_writeback(struct disk* dev) {
+    if (dev->wb_thread != NULL && dev->wb_thread->status == TASK_WAITING) {
+        thread_unblock(dev->wb_thread);
+    }
+}
+
+static void wakeup_all_writeback(void) {
+    struct dlist_elem* pelem = disk_list.head.next;
+    while (pelem != &disk_list.tail) {
+        struct disk* dev = member_to_entry(struct disk, disk_tag, pelem);
+        if (dev->dirty_bytes != 0) {
+            wakeup_writeback(dev);
+        }
+        pelem = pelem->next;
+    }
+}
+
+// 唤醒所有因为脏数据太多而被限流的写进程，让它们重新检查一遍
+static void wake_throttled(struct disk* dev) {
+    lock_acquire(&dev->dirty_lock);
+    while (dev->throttle_waiters > 0) {
+        dev->throttle_waiters--;
+        sema_signal(&dev->throttle_wait);
+    }
+    lock_release(&dev->dirty_lock);
+}
+
+// 写进程产生脏数据之后调用，脏数据超过 DIRTY_RATIO 时睡眠，直到写回线程把它降下来
+// 写进程只等自己磁盘的写回线程，超出的部分如果都在别的磁盘上，等自己的磁盘是没有用的，直接放行
+// 调用时不能持有任何缓存的锁
+static void balance_dirty(struct disk* dev) {
+    while (dev->wb_thread != NULL && dirty_exceeded(DIRTY_RATIO)) {
+        lock_acquire(&dev->dirty_lock);
+        if (dev->dirty_bytes == 0) {
+            lock_release(&dev->dirty_lock);
+            break;
+        }
+        dev->throttle_waiters++;
+        lock_release(&dev->dirty_lock);
+        wakeup_writeback(dev);
+        sema_wait(&dev->throttle_wait);
+    }
+}
+
+// 写回所有已经过期的脏块
+// dirty_list 按变脏的先后排列，从队首开始，每个过期的块连同它后面连续的脏块一起写回，最多一条命令的长度
+static void writeback_expired(struct disk* dev) {
+    uint32_t expire_ticks = DIRTY_EXPIRE_MS / mil_seconds_per_intr;
+    struct buffer_head* last = NULL;
+    uint32_t last_dirtied_at = 0;
+    while (1) {
+        lock_acquire(&dev->dirty_lock);
+        if (dlist_empty(&dev->dirty_list)) {
+            lock_release(&dev->dirty_lock);
+            return;
+        }
+        struct buffer_head* bh = member_to_entry(struct buffer_head, dirty_tag, dev->dirty_list.head.next);
+        uint32_t dirtied_at = bh->b_dirtied_at;
+        uint32_t lba = bh->b_blocknr;
+        lock_release(&dev->dirty_lock);
+
+        // 队首还没过期，后面的就更不会过期了
+        // 队首没有变化说明上一次没能写掉它（同一个 lba 上有两个不同大小的脏块），留到下一轮
+        if (ticks - dirtied_at < expire_ticks || (bh == last && dirtied_at == last_dirtied_at)) {
+            return;
+        }
+        last = bh;
+        last_dirtied_at = dirtied_at;
+        writeback_range(dev, lba, lba + dev->max_secs);
+    }
+}
+
+// 每个磁盘一个写回线程
+// 平时每 DIRTY_WRITEBACK_MS 醒来一次，只写回变脏超过 DIRTY_EXPIRE_MS 的块
+// 脏数据超过 DIRTY_BACKGROUND_RATIO 时把整个磁盘写一遍，直到降到比例以下才休眠
+static void disk_writeback(void* arg) {
+    struct disk* dev = arg;
+    while (1) {
+        if (dev->dirty_bytes != 0 && dirty_exceeded(DIRTY_BACKGROUND_RATIO)) {
+            writeback_range(dev, 0, 0xffffffff);
+            // 脏块都被别人引用着写不掉时也要放出被限流的进程，让它们重新检查
+            wake_throttled(dev);
+            if (dev->dirty_bytes != 0 && dirty_exceeded(DIRTY_BACKGROUND_RATIO)) {
+                thread_yield();
+                continue;
             }
+        } else {
+            writeback_expired(dev);
+            wake_throttled(dev);
         }
+        sys_milsleep(DIRTY_WRITEBACK_MS);
+    }
+}
+
+// 填写 BLKSTAT 的返回值，dev 是设备文件所在的磁盘
+// 只是一次快照，各个计数器之间不保证严格一致
+void ide_buffer_get_stats(struct disk* dev, struct blk_stats* st) {
+    st->cache = global_ide_buffer.stats;
+    st->disk = dev->stats;
+    st->cache_bytes = global_ide_buffer.cur_size;
+    st->cache_max_bytes = global_ide_buffer.max_size;
+    st->dirty_bytes = dev->dirty_bytes;
+}
+
+// 为每个磁盘启动写回线程，需要在 ide_init 之后调用
+// 名称前面带下划线 _ 表示是一个内核线程
+void ide_writeback_init(void) {
+    char name[TASK_NAME_LEN];
+    struct dlist_elem* pelem = disk_list.head.next;
+    while (pelem != &disk_list.tail) {
+        struct disk* dev = member_to_entry(struct disk, disk_tag, pelem);
+        sprintf(name, "_wb_%s", dev->name);
+        dev->wb_thread = thread_start(name, 32, disk_writeback, dev);
+        pelem = pelem->next;
+    }
+}
+
+// 同步写回 [start_lba, start_lba + sec_cnt) 范围内的脏块（lba 是绝对地址），供 fsync 使用
+// 返回时数据可能还在磁盘的写缓存里，需要持久化时还要再调用 bflush_cache
+void bflush(struct partition* part, uint32_t start_lba, uint32_t sec_cnt) {
+    if (sec_cnt == 0) return;
+    // 起始块可能从范围之前开始
+    writeback_range(part->my_disk, blk_start_lba(part, start_lba), start_lba + sec_cnt);
+}
+
+// 让磁盘把写缓存里的数据写到盘片上，覆盖调用之前完成的所有写回
+// 组提交：多个进程同时调用时，排在后面的进程如果发现前面的 FLUSH CACHE 已经覆盖了自己的写回，就不用再发一次
+// 之前的写回在这个磁盘上失败过时返回 -EIO，错误报告一次之后就清掉
+// FLUSH CACHE 失败时同样返回 -EIO，flushed_seq 不前进，下一个调用者会重新发一次
+int32_t bflush_cache(struct disk* dev) {
+    lock_acquire(&dev->wb_lock);
+    int32_t wb_err = dev->wb_error;
+    dev->wb_error = 0;
+    lock_release(&dev->wb_lock);
 
-        // printk("sync_thread: sync disk done!\n");
-        // 定期休眠
-        // 即使被 thread_unblock 强制唤醒也没事
-        // 因为 sys_milsleep 中的 thread_block 后有一个将进程移出睡眠队列的操作
-        // 可以保证被唤醒后的进程不在睡眠队列中
-        sys_milsleep(5000); 
+    // 调用者自己的写回都已经完成并计入了 wb_seq
+    uint32_t need = dev->wb_seq;
+    lock_acquire(&dev->flush_lock);
+    // 序号会回绕，用差值比较
+    if ((int32_t)(dev->flushed_seq - need) >= 0) {
+        lock_release(&dev->flush_lock);
+        return wb_err;
     }
+    // 在发命令之前取序号，命令执行期间才完成的写回不一定被覆盖
+    uint32_t seq = dev->wb_seq;
+    int32_t err = ide_flush(dev);
+    if (err == 0) dev->flushed_seq = seq;
+    lock_release(&dev->flush_lock);
+    return wb_err != 0 ? wb_err : err;
 }
 
 // 针对零拷贝的 bread 设计的零拷贝的 write
 void bwrite(struct buffer_head* bh) {
     if (bh == NULL) return;
     
-    lock_acquire(&global_ide_buffer.lock);
-    if (!bh->b_dirty) {
-        bh->b_dirty = true;
-        // 这里的 bh->b_dev 已经在 bread 的 getblk 时填好了
-        // dlist_insert_order(&bh->b_dev->dirty_list, _cb_bh_lba_condition, &bh->dirty_tag);
-
-        // 不要在在此处进行 dlist_insert_order，这太费时间了，在叠加 swap 的情况下可能会引发严重的竞态问题
-        // 我们直接在此处进行 O(1) 级别的 push_back，在 sync 的时候再进行重整排序，之后在进行写入 
-        lock_acquire(&bh->b_dev->lists_lock);
-        // 获取活跃队列，将数据压到活跃队列中
-        int32_t active_idx = bh->b_dev->active_dirty_idx;
-        dlist_push_back(&bh->b_dev->dirty_lists[active_idx], &bh->dirty_tag);
-        lock_release(&bh->b_dev->lists_lock);
-    }
-    lock_release(&global_ide_buffer.lock);
+    // 这里的 bh->b_dev 已经在 bread 的 getblk 时填好了
+    // 脏块树的插入是 O(log n) 的，sync 的时候直接按顺序遍历，不需要再排序
+    mark_buffer_dirty(bh);
+    balance_dirty(bh->b_dev);
 }
 
 // 完全异步的 io 操作
 // 全量延迟写
-void bwrite_multi(struct disk* dev, uint32_t start_lba, void* src_buf, uint32_t sec_cnt) {
-    for (uint32_t i = 0; i < sec_cnt; i++) {
-        uint32_t current_lba = start_lba + i;
-        // 没命中就申请一个，命中了就增加引用
-        // getblk 内部会处理缓存的负载
-        struct buffer_head* bh = getblk(dev, current_lba);
-        
-        // 既然是全块覆盖写，不需要 read 磁盘。直接 memcpy
-        memcpy(bh->b_data, (uint8_t*)src_buf + (i * SECTOR_SIZE), SECTOR_SIZE);
-        
-        bh->b_valid = true;  // 数据已经是最新的了
-        lock_acquire(&global_ide_buffer.lock);
-        if (!bh->b_dirty) {
-            bh->b_dirty = true;
-            // 加入脏队列，按照 lba 升序插入，以便后续合并
-            // dlist_insert_order(&dev->dirty_list, _cb_bh_lba_condition, &bh->dirty_tag);
-
-            
-            // 不要在在此处进行 dlist_insert_order，这太费时间了，在叠加 swap 的情况下可能会引发严重的竞态问题
-            // 我们直接在此处进行 O(1) 级别的 push_back，在 sync 的时候再进行重整排序，之后在进行写入 
-            lock_acquire(&dev->lists_lock);
-            int32_t active_idx = dev->active_dirty_idx;
-            // 获取活跃队列，将数据压到活跃队列中
-            dlist_push_back(&dev->dirty_lists[active_idx], &bh->dirty_tag); 
-            lock_release(&dev->lists_lock);
-        }
-        lock_release(&global_ide_buffer.lock);
-        brelse(bh); // 只是减少引用，数据还在缓存里，等 sync 线程处理
-    }
-}
-
-// 直接唤醒 sync 线程来异步清理
+// 首尾不完整的块需要先把旧数据读进来（读-改-写），否则会破坏块内其他扇区的数据
+// 旧数据读不出来的块不写，最后返回 -EIO，其余的块照常写入
+// 内存不足拿不到块时返回 -ENOMEM，之后的部分不再写
+int32_t bwrite_multi(struct partition* part, uint32_t start_lba, void* src_buf, uint32_t sec_cnt) {
+    struct disk* dev = part->my_disk;
+    uint32_t size = part->blk_size;
+    uint32_t spb = size / SECTOR_SIZE;
+    uint32_t end_lba = start_lba + sec_cnt;
+    int32_t err = 0;
+
+    struct buffer_head* bhs[MAX_GANG_BLKS];
+
+    uint32_t blk_lba = blk_start_lba(part, start_lba);
+    while (blk_lba < end_lba) {
+        // 每一轮最多处理 MAX_GANG_BLKS 个块，没命中的就申请，命中了就增加引用
+        // getblk_range 内部会处理缓存的负载
+        uint32_t blk_cnt = DIV_ROUND_UP(end_lba - blk_lba, spb);
+        if (blk_cnt > MAX_GANG_BLKS) blk_cnt = MAX_GANG_BLKS;
+        if (getblk_range(dev, blk_lba, size, blk_cnt, bhs) != 0) {
+            err = -ENOMEM;
+            break;
+        }
+
+        for (uint32_t i = 0; i < blk_cnt; i++) {
+            struct buffer_head* bh = bhs[i];
+            bool full = (bh->b_blocknr >= start_lba && bh->b_blocknr + spb <= end_lba);
+            // 无效的块可能正有人在读盘，读完会覆盖我们写进去的数据，所以要在 io 锁内写
+            // 有效的块不会再被读盘覆盖，直接写就行
+            bool io_locked = !bh->b_valid;
+            if (io_locked) {
+                lock_acquire(&bh->b_io_lock);
+                if (!full && !bh->b_valid && ide_read(dev, bh->b_blocknr, bh->b_data, spb) != 0) {
+                    // 只覆盖了块的一部分，并且块里没有有效数据，需要先读盘
+                    lock_release(&bh->b_io_lock);
+                    err = -EIO;
+                    continue;
+                }
+            }
+            // 全块覆盖写时不需要 read 磁盘。直接 memcpy
+            bh_copy_range(bh, start_lba, end_lba, src_buf, true);
+
+            bh->b_valid = true;  // 数据已经是最新的了
+            // 加入脏块树，按照 lba 升序排列，以便后续合并
+            mark_buffer_dirty(bh);
+            if (io_locked) lock_release(&bh->b_io_lock);
+        }
+        brelse_gang(bhs, blk_cnt); // 只是减少引用，数据还在缓存里，等写回线程处理
+        blk_lba += blk_cnt * spb;
+    }
+    balance_dirty(dev);
+    return err;
+}
+
+// 在 buckets 的每个桶里找 dev 上与 [start_lba, end_lba) 有重叠的块，不论块大小
+// 有被引用的块返回 -EBUSY，有脏块返回 1，都没有返回 0，调用者需要持有所有的桶锁
+static int32_t overlap_check(struct dlist* buckets, uint32_t bucket_nr, struct disk* dev, uint32_t start_lba, uint32_t end_lba) {
+    int32_t ret = 0;
+    for (uint32_t i = 0; i < bucket_nr; i++) {
+        struct dlist_elem* pelem = buckets[i].head.next;
+        while (pelem != &buckets[i].tail) {
+            struct buffer_head* bh = member_to_entry(struct buffer_head, hash_tag, pelem);
+            pelem = pelem->next;
+            if (bh->b_dev != dev || bh->b_blocknr >= end_lba || bh->b_blocknr + bh->b_size / SECTOR_SIZE <= start_lba) {
+                continue;
+            }
+            if (bh->b_ref_count != 0) return -EBUSY;
+            if (bh->b_dirty) ret = 1;
+        }
+    }
+    return ret;
+}
+
+// 修改分区在缓存中的块大小
+// 挂载文件系统时调用，使缓存块与文件系统块一一对应，一个 1KB 的 ext2 块只需要一个 buffer_head
+// 不同大小的块互不命中，同一个扇区不能以两种块大小同时留在缓存里，否则读到的可能是另一个块里的旧数据
+// 因此修改前要把与分区有重叠的块（不论大小，包括整盘设备或者相邻分区留下的块）全部写回并淘汰
+// 有块正在被引用时无法淘汰，返回 -EBUSY，块大小保持不变，调用者不能持有任何缓存的锁
+int32_t set_blocksize(struct partition* part, uint32_t size) {
+    if (size < SECTOR_SIZE || size > MAX_BLK_SIZE || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    if (part->blk_size == size) {
+        return 0;
+    }
+
+    struct disk* dev = part->my_disk;
+    uint32_t part_end = part->start_lba + part->sec_cnt;
+    // 从分区起点之前开始的块最多往前伸出 MAX_BLK_SIZE 减一个扇区
+    uint32_t max_spb = MAX_BLK_SIZE / SECTOR_SIZE;
+    uint32_t scan_start = part->start_lba >= max_spb - 1 ? part->start_lba - (max_spb - 1) : 0;
+
+    struct hashtable* ht = &global_ide_buffer.hash_table;
+    while (1) {
+        writeback_range(dev, scan_start, part_end);
+
+        // 拿齐所有的桶锁，遍历期间哈希表不会迁移，也不会有块被引用或者新建
+        for (int i = 0; i < BUFFER_LOCK_NR; i++) {
+            lock_acquire(&global_ide_buffer.bucket_locks[i]);
+        }
+        int32_t ret = overlap_check(ht->buckets, ht->bucket_nr, dev, part->start_lba, part_end);
+        if (ret >= 0 && ht->old_buckets != NULL) {
+            int32_t old_ret = overlap_check(ht->old_buckets, ht->old_bucket_nr, dev, part->start_lba, part_end);
+            if (old_ret != 0) ret = old_ret;
+        }
+        if (ret == 0) break;
+        for (int i = BUFFER_LOCK_NR - 1; i >= 0; i--) {
+            lock_release(&global_ide_buffer.bucket_locks[i]);
+        }
+        if (ret < 0) {
+            printk("set_blocksize: %s is busy\n", part->name);
+            return ret;
+        }
+        // 写回之后又有人写了，再写回一次
+    }
+
+    // 没有被引用的块都在替换策略的队列上，所以从队列出发就能找到所有重叠的块
+    // 已经持有所有的桶锁，不需要 try
+    lock_acquire(&global_ide_buffer.lru_lock);
+    struct victim_iter it;
+    struct buffer_head* bh;
+    victim_iter_init(&it);
+    while ((bh = victim_iter_next(&it)) != NULL) {
+        if (bh->b_dev == dev && bh->b_blocknr < part_end && bh->b_blocknr + bh->b_size / SECTOR_SIZE > part->start_lba) {
+            blk_evict(bh);
+        }
+    }
+    part->blk_size = size;
+    lock_release(&global_ide_buffer.lru_lock);
+    for (int i = BUFFER_LOCK_NR - 1; i >= 0; i--) {
+        lock_release(&global_ide_buffer.bucket_locks[i]);
+    }
+    return 0;
+}
+
+// 把所有磁盘上的脏块写回并让磁盘刷新写缓存，返回时之前写入的数据都已经持久化
+// 不等写回线程，直接在调用者的上下文里写回，写完才返回
+// sync 没有返回值，写回的错误留在磁盘上，交给之后的 fsync 报告
 void sys_sync(){
-    if(sync_thread->status == TASK_WAITING){
-        thread_unblock(sync_thread);
+    struct dlist_elem* pelem = disk_list.head.next;
+    while (pelem != &disk_list.tail) {
+        struct disk* dev = member_to_entry(struct disk, disk_tag, pelem);
+        writeback_range(dev, 0, 0xffffffff);
+        bflush_cache(dev);
+        pelem = pelem->next;
     }
-}
\ No newline at end of file
+}
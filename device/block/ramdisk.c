@@ -0,0 +1,133 @@
+#include <ramdisk.h>
+#include <ide.h>
+#include <stdio-kernel.h>
+#include <stdio.h>
+#include <debug.h>
+#include <string.h>
+#include <global.h>
+#include <memory.h>
+#include <buddy.h>
+#include <fs_types.h>
+
+static struct ramdisk ramdisks[RAMDISK_MAX_CNT];
+
+// 在磁盘的第 off 个字节和 buf 之间拷贝 len 个字节，跨越块边界时分几次拷
+static void ramdisk_copy(struct ramdisk* rd, uint32_t off, uint8_t* buf, uint32_t len, bool is_write) {
+	while (len > 0) {
+		uint8_t* chunk = rd->chunks[off / RAMDISK_CHUNK_SIZE];
+		uint32_t chunk_off = off % RAMDISK_CHUNK_SIZE;
+		uint32_t n = RAMDISK_CHUNK_SIZE - chunk_off;
+		if (n > len) n = len;
+		if (is_write) {
+			memcpy(chunk + chunk_off, buf, n);
+		} else {
+			memcpy(buf, chunk + chunk_off, n);
+		}
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+// 合并过的命令由几个首尾相接的请求组成，按顺序拷贝它们的 io_vec
+static void ramdisk_do_cmd(struct ramdisk* rd, struct request* rq) {
+	bool is_write = rq->op == REQ_WRITE;
+	uint32_t off = rq->lba * SECTOR_SIZE;
+	for (struct request* r = rq; r != NULL; r = r->merge_next) {
+		for (uint32_t i = 0; i < r->vec_cnt; i++) {
+			ramdisk_copy(rd, off, r->vec[i].base, r->vec[i].len, is_write);
+			off += r->vec[i].len;
+		}
+	}
+}
+
+// 磁盘的 start_io，调用者已经关中断
+// 内存拷贝不用等待，直接在这里把调度器里的命令全部做完，一条命令最多 512KB，关中断的时间和发一条 DMA 命令差不多
+// 提交者在 ide_submit 返回时请求就已经完成了，同步读写不会睡眠
+static void ramdisk_start_io(struct disk* hd) {
+	struct ramdisk* rd = hd->driver_data;
+	if (rd->busy) {
+		return;
+	}
+	rd->busy = true;
+	struct request* rq;
+	while ((rq = elv_next(hd)) != NULL) {
+		// FLUSH 不用做任何事，越界的请求 ide_submit 已经拒绝了
+		if (rq->op != REQ_FLUSH) {
+			ramdisk_do_cmd(rd, rq);
+		}
+		ide_end_cmd(rq, 0);
+	}
+	rd->busy = false;
+}
+
+// 创建第 n 个 RAM 磁盘，数据页来自内核的直接映射区，开机时全是 0
+static bool ramdisk_create(int n, uint32_t size_mb) {
+	struct ramdisk* rd = &ramdisks[n];
+	uint32_t bytes = size_mb * 1024 * 1024;
+	rd->chunk_cnt = DIV_ROUND_UP(bytes, RAMDISK_CHUNK_SIZE);
+	// 至少给内核的其他数据（页表、PCB、磁盘缓存）留一半
+	if (rd->chunk_cnt * RAMDISK_CHUNK_SIZE > buddy_free_bytes(&kernel_pool) / 2) {
+		printk("ramdisk: not enough kernel memory for ram%d (%dMB)\n", n, size_mb);
+		return false;
+	}
+	rd->chunks = kmalloc(rd->chunk_cnt * sizeof(uint8_t*));
+	if (rd->chunks == NULL) {
+		printk("ramdisk: not enough kernel memory for ram%d (%dMB)\n", n, size_mb);
+		return false;
+	}
+	uint32_t got = 0;
+	while (got < rd->chunk_cnt) {
+		rd->chunks[got] = get_kernel_pages(RAMDISK_CHUNK_PAGES);
+		// 内存碎片太多时可能凑不出连续的块
+		if (rd->chunks[got] == NULL) {
+			printk("ramdisk: not enough kernel memory for ram%d (%dMB)\n", n, size_mb);
+			goto fail;
+		}
+		got++;
+	}
+	int32_t disk_idx = disk_alloc_idx();
+	if (disk_idx < 0) {
+		printk("ramdisk: too many disks, ram%d ignored\n", n);
+		goto fail;
+	}
+	rd->busy = false;
+
+	struct disk* hd = &rd->disk;
+	disk_init(hd);
+	sprintf(hd->name, "ram%d", n);
+	hd->my_channel = NULL;
+	hd->dev_no = n;
+	hd->total_sectors = bytes / SECTOR_SIZE;
+	hd->lba48 = true;
+	hd->max_secs = MAX_SECS_PER_CMD_EXT;
+	hd->multi_secs = 1;
+	hd->start_io = ramdisk_start_io;
+	hd->driver_data = rd;
+	// 没有分区表，partition_scan 读到的第 0 个扇区全是 0，只会有全盘分区，mkfs 要直接写 /dev/ramN
+	hd->whole_disk_writable = true;
+	disk_register(hd, disk_idx);
+	printk("ramdisk: %s, %dMB\n", hd->name, size_mb);
+	return true;
+
+fail:
+	// 把已经拿到的块还回去
+	while (got > 0) {
+		got--;
+		mfree_page(PF_KERNEL, rd->chunks[got], RAMDISK_CHUNK_PAGES);
+	}
+	kfree(rd->chunks);
+	rd->chunks = NULL;
+	return false;
+}
+
+// 在 ide 和 pci 磁盘之后创建 RAM 磁盘，它们不会抢走原来的根分区
+// 要在启动写回线程和创建设备文件之前调用
+void ramdisk_init() {
+	ASSERT(RAMDISK_CNT <= RAMDISK_MAX_CNT);
+	for (int n = 0; n < RAMDISK_CNT; n++) {
+		if (!ramdisk_create(n, RAMDISK_SIZE_MB)) {
+			break;
+		}
+	}
+}
@@ -0,0 +1,548 @@
+#include <ahci.h>
+#include <pci.h>
+#include <ide.h>
+#include <memory.h>
+#include <stdio-kernel.h>
+#include <debug.h>
+#include <string.h>
+#include <errno.h>
+
+// 等待端口寄存器状态变化时最多轮询的次数，每次读 MMIO 寄存器大约 1 微秒
+// 中断处理程序里也要等端口停下来，不能睡眠，所以统一用轮询
+#define AHCI_SPINS 1000000
+
+static int ahci_probe(struct pci_dev* dev);
+
+// 只匹配 AHCI 编程接口的 SATA 控制器，ProgIF 为 0 的 SATA 控制器工作在 IDE 兼容模式，交给 ide 驱动
+static const struct pci_device_id ahci_pci_ids[] = {
+    {
+        .vendor_id = 0xFFFFFFFF,
+        .device_id = 0xFFFFFFFF,
+        .class_code = 0x010601,   // Base: 01 (Storage), Sub: 06 (SATA), ProgIF: 01 (AHCI 1.0)
+        .class_mask = 0xFFFFFF
+    },
+    {0}
+};
+
+static struct pci_driver ahci_pci_driver = {
+    .name = "AHCI_Driver",
+    .id_table = ahci_pci_ids,
+    .probe = ahci_probe,
+    .remove = NULL,
+};
+
+static struct ahci_host* ahci_hosts[AHCI_MAX_HOSTS];
+static uint32_t ahci_host_cnt = 0;
+
+// 等寄存器中 mask 的各位全部变成 0（set 为 false）或者出现（set 为 true）
+static bool ahci_spin(volatile uint32_t* reg, uint32_t mask, bool set) {
+    for (uint32_t spin = 0; spin < AHCI_SPINS; spin++) {
+        if (((*reg & mask) != 0) == set) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 让端口停止处理命令列表，停下来之后 PxCI 和 PxSACT 都会被控制器清零
+static bool ahci_port_stop(volatile struct hba_port* regs) {
+    regs->cmd &= ~HBA_PxCMD_ST;
+    return ahci_spin(&regs->cmd, HBA_PxCMD_CR, false);
+}
+
+// 磁盘卡在 BSY 或者 DRQ 时只能通过 COMRESET 让它重新开始
+// 把 PxSCTL.DET 置 1 至少 1 毫秒，然后清零，等链路重新建立
+static bool ahci_port_reset(volatile struct hba_port* regs) {
+    regs->sctl = (regs->sctl & ~0xf) | 1;
+    for (uint32_t spin = 0; spin < AHCI_SPINS / 100; spin++) {
+        (void)regs->ssts;
+    }
+    regs->sctl &= ~0xf;
+    bool ok = true;
+    uint32_t spin = 0;
+    while (HBA_PxSSTS_DET(regs->ssts) != HBA_DET_PRESENT) {
+        if (++spin == AHCI_SPINS) {
+            ok = false;
+            break;
+        }
+    }
+    regs->serr = 0xffffffff;
+    return ok && ahci_spin(&regs->tfd, BIT_ALT_STAT_BSY | BIF_ALT_STAT_DRQ, false);
+}
+
+// 把命令中各个请求的 io_vec 翻译成 PRD 表，物理地址首尾相接的片段合并成一项，返回项数
+// 一条命令最多 512KB，远小于一项能描述的 4MB，合并时不用检查上限
+static uint32_t ahci_fill_prdt(struct hba_cmd_table* tbl, struct request* rq) {
+    uint32_t n = 0;
+    for (struct request* r = rq; r != NULL; r = r->merge_next) {
+        for (uint32_t i = 0; i < r->vec_cnt; i++) {
+            uint32_t vaddr = (uint32_t)r->vec[i].base;
+            uint32_t bytes_left = r->vec[i].len;
+            while (bytes_left > 0) {
+                // vec 里是内核虚拟地址，一页之内的物理地址才保证连续
+                uint32_t chunk = PG_SIZE - (vaddr & 0xfff);
+                if (chunk > bytes_left) chunk = bytes_left;
+                uint32_t paddr = addr_v2p(vaddr);
+
+                struct hba_prdt_entry* prev = n > 0 ? &tbl->prdt[n - 1] : NULL;
+                if (prev != NULL && prev->dba + prev->dbc + 1 == paddr) {
+                    prev->dbc += chunk;
+                } else {
+                    ASSERT(n < AHCI_PRDT_ENTRIES);
+                    struct hba_prdt_entry* e = &tbl->prdt[n++];
+                    e->dba = paddr;
+                    e->dbau = 0;
+                    e->rsv0 = 0;
+                    e->dbc = chunk - 1;
+                    e->rsv1 = 0;
+                    e->i = 0;
+                }
+                vaddr += chunk;
+                bytes_left -= chunk;
+            }
+        }
+    }
+    return n;
+}
+
+static void ahci_fill_lba(struct fis_reg_h2d* fis, uint32_t lba) {
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    // 我们的 lba 只有 32 位
+    fis->lba4 = 0;
+    fis->lba5 = 0;
+}
+
+// 把命令填进命令槽 slot，然后发给磁盘
+// 调用者已经关中断，slot 是空闲的
+static void ahci_issue(struct ahci_port* port, uint32_t slot, struct request* rq) {
+    struct disk* hd = port->disk;
+    struct hba_cmd_header* hdr = &port->cmd_list[slot];
+    struct hba_cmd_table* tbl = port->cmd_tables[slot];
+    struct fis_reg_h2d* fis = (struct fis_reg_h2d*)tbl->cfis;
+    bool is_write = rq->op == REQ_WRITE;
+    bool queued = false;
+
+    memset(fis, 0, sizeof(struct fis_reg_h2d));
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_CMD;
+    uint32_t prdtl = 0;
+    if (rq->op == REQ_FLUSH) {
+        fis->command = hd->lba48 ? CMD_FLUSH_CACHE_EXT : CMD_FLUSH_CACHE;
+    } else {
+        prdtl = ahci_fill_prdt(tbl, rq);
+        ahci_fill_lba(fis, rq->lba);
+        fis->device = BIT_DEV_LBA;
+        if (port->ncq) {
+            // NCQ 命令的扇区数放在 feature 寄存器里，扇区数寄存器的高 5 位是命令槽号（tag）
+            // 磁盘按 tag 报告完成，我们让 tag 和命令槽号相同
+            fis->command = is_write ? CMD_WRITE_FPDMA_QUEUED : CMD_READ_FPDMA_QUEUED;
+            fis->featurel = rq->cmd_secs;
+            fis->featureh = rq->cmd_secs >> 8;
+            fis->countl = slot << 3;
+            queued = true;
+        } else if (hd->lba48) {
+            fis->command = is_write ? CMD_DMA_WRITE_EXT : CMD_DMA_READ_EXT;
+            fis->countl = rq->cmd_secs;
+            fis->counth = rq->cmd_secs >> 8;
+        } else {
+            // LBA28 的 24~27 位放在 device 寄存器里，扇区数写 0 表示 256 个扇区
+            fis->command = is_write ? CMD_DMA_WRITE : CMD_DMA_READ;
+            fis->device |= (rq->lba >> 24) & 0xf;
+            fis->lba3 = 0;
+            fis->countl = rq->cmd_secs;
+        }
+    }
+
+    memset(hdr, 0, sizeof(struct hba_cmd_header));
+    hdr->cfl = sizeof(struct fis_reg_h2d) / sizeof(uint32_t);
+    hdr->write = is_write;
+    hdr->prdtl = prdtl;
+    hdr->ctba = addr_v2p((uint32_t)tbl);
+
+    port->slot_rq[slot] = rq;
+    port->issued |= 1U << slot;
+    // NCQ 命令要先在 PxSACT 中登记，再写 PxCI
+    if (queued) {
+        port->regs->sact = 1U << slot;
+    }
+    port->regs->ci = 1U << slot;
+}
+
+// 从调度器取出命令填满空闲的命令槽，是磁盘的 start_io，调用者已经关中断
+static void ahci_start_io(struct disk* hd) {
+    struct ahci_port* port = hd->driver_data;
+    uint32_t all_slots = port->slot_cnt == 32 ? 0xffffffff : (1U << port->slot_cnt) - 1;
+    // FLUSH CACHE 不是 NCQ 命令，不能和其他命令同时执行
+    // 调度器保证它之前提交的写都已经发出，这里再等发出去的命令全部完成，它执行期间也不再发新命令
+    while (port->flush_rq == NULL) {
+        uint32_t free_slots = all_slots & ~port->issued;
+        if (free_slots == 0) {
+            return;
+        }
+        struct request* rq = elv_next(hd);
+        if (rq == NULL) {
+            return;
+        }
+        if (rq->op == REQ_FLUSH) {
+            port->flush_rq = rq;
+            break;
+        }
+        uint32_t slot = 0;
+        while (!(free_slots & (1U << slot))) {
+            slot++;
+        }
+        ahci_issue(port, slot, rq);
+    }
+    if (port->issued == 0) {
+        ahci_issue(port, 0, port->flush_rq);
+    }
+}
+
+// 完成 done 中各个命令槽上的命令，err 为 0 表示成功
+// 先让磁盘开始执行新的命令，再通知提交者
+static void ahci_complete_slots(struct ahci_port* port, uint32_t done, int32_t err) {
+    struct request* finished[AHCI_MAX_SLOTS];
+    uint32_t cnt = 0;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (!(done & (1U << slot))) continue;
+        struct request* rq = port->slot_rq[slot];
+        port->slot_rq[slot] = NULL;
+        if (rq == port->flush_rq) {
+            port->flush_rq = NULL;
+        }
+        finished[cnt++] = rq;
+    }
+    port->issued &= ~done;
+    ahci_start_io(port->disk);
+    for (uint32_t i = 0; i < cnt; i++) {
+        ide_complete(finished[i], err);
+    }
+}
+
+// 出错之后端口停止处理命令列表，我们不去读磁盘的错误日志找出具体是哪一条命令失败了
+// 而是把所有发出去的命令都作为失败完成，重新启动端口之后再发新的命令
+static void ahci_port_error(struct ahci_port* port, uint32_t is) {
+    volatile struct hba_port* regs = port->regs;
+    printk("ahci: disk %s error, IS:0x%x TFD:0x%x SERR:0x%x\n", port->disk->name, is, regs->tfd, regs->serr);
+    uint32_t failed = port->issued;
+
+    if (!ahci_port_stop(regs)) {
+        printk("ahci: disk %s port %d does not stop\n", port->disk->name, port->port_no);
+    }
+    regs->serr = 0xffffffff;
+    regs->is = 0xffffffff;
+    if ((regs->tfd & (BIT_ALT_STAT_BSY | BIF_ALT_STAT_DRQ)) && !ahci_port_reset(regs)) {
+        printk("ahci: disk %s port %d reset fail\n", port->disk->name, port->port_no);
+    }
+    regs->cmd |= HBA_PxCMD_ST;
+
+    ahci_complete_slots(port, failed, -EIO);
+}
+
+static void ahci_port_intr(struct ahci_port* port) {
+    volatile struct hba_port* regs = port->regs;
+    uint32_t is = regs->is;
+    regs->is = is;
+    if (is & HBA_PxIS_ERROR) {
+        ahci_port_error(port, is);
+        return;
+    }
+    // NCQ 命令被磁盘接受后 PxCI 就清零了，直到 Set Device Bits FIS 清掉 PxSACT 才算完成
+    // 非 NCQ 命令不登记 PxSACT，PxCI 清零就是完成
+    uint32_t done = port->issued & ~(regs->ci | regs->sact);
+    if (done != 0) {
+        ahci_complete_slots(port, done, 0);
+    }
+}
+
+// 一个中断号上可能有几个控制器，也可能有别的 PCI 设备，逐个检查 IS 看是不是我们的中断
+// 8259A 是边沿触发的，处理期间新产生的中断不会再来一次，所以要一直处理到 IS 为 0
+static void intr_handler_ahci(uint8_t irq_no) {
+    for (uint32_t h = 0; h < ahci_host_cnt; h++) {
+        struct ahci_host* host = ahci_hosts[h];
+        if (host->irq_no != irq_no) continue;
+        uint32_t is;
+        while ((is = host->abar->is) != 0) {
+            for (uint32_t p = 0; p < AHCI_MAX_PORTS; p++) {
+                if ((is & (1U << p)) && host->ports[p] != NULL) {
+                    ahci_port_intr(host->ports[p]);
+                }
+            }
+            // 先清端口的中断状态，再清全局的
+            host->abar->is = is;
+        }
+    }
+}
+
+// 初始化阶段用命令槽 0 执行一条不排队的命令，轮询等它完成，此时端口的中断还没有打开
+static bool ahci_exec_polled(struct ahci_port* port, uint8_t command, void* buf, uint32_t len) {
+    struct hba_cmd_header* hdr = &port->cmd_list[0];
+    struct hba_cmd_table* tbl = port->cmd_tables[0];
+    struct fis_reg_h2d* fis = (struct fis_reg_h2d*)tbl->cfis;
+    memset(fis, 0, sizeof(struct fis_reg_h2d));
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_CMD;
+    fis->command = command;
+
+    memset(hdr, 0, sizeof(struct hba_cmd_header));
+    hdr->cfl = sizeof(struct fis_reg_h2d) / sizeof(uint32_t);
+    hdr->ctba = addr_v2p((uint32_t)tbl);
+    if (buf != NULL) {
+        tbl->prdt[0].dba = addr_v2p((uint32_t)buf);
+        tbl->prdt[0].dbau = 0;
+        tbl->prdt[0].dbc = len - 1;
+        tbl->prdt[0].i = 0;
+        hdr->prdtl = 1;
+    }
+
+    volatile struct hba_port* regs = port->regs;
+    regs->is = 0xffffffff;
+    regs->ci = 1;
+    bool done = ahci_spin(&regs->ci, 1, false);
+    if (!done || (regs->is & HBA_PxIS_TFES)) {
+        printk("ahci: port %d command 0x%x fail, TFD:0x%x\n", port->port_no, command, regs->tfd);
+        regs->is = 0xffffffff;
+        return false;
+    }
+    return true;
+}
+
+// 用 IDENTIFY 的结果填写磁盘的参数，和 ide 的 identify_disk 含义一样
+static bool ahci_identify(struct ahci_port* port, struct disk* hd) {
+    uint16_t* id_word = get_kernel_pages(1);
+    if (id_word == NULL) {
+        return false;
+    }
+    if (!ahci_exec_polled(port, CMD_IDENTIFY, id_word, SECTOR_SIZE)) {
+        mfree_page(PF_KERNEL, id_word, 1);
+        return false;
+    }
+
+    uint32_t sectors = *(uint32_t*)&id_word[60];
+    hd->lba48 = (id_word[83] & (1 << 10)) && (id_word[86] & (1 << 10));
+    if (hd->lba48) {
+        uint32_t lba48_sectors = *(uint32_t*)&id_word[100];
+        if (id_word[102] != 0 || id_word[103] != 0) {
+            lba48_sectors = 0xffffffff;
+        }
+        if (lba48_sectors > sectors) {
+            sectors = lba48_sectors;
+        }
+    }
+    hd->total_sectors = sectors;
+    // NCQ 的扇区数在 16 位的 feature 寄存器里，和 LBA48 的命令一样
+    hd->max_secs = hd->lba48 ? MAX_SECS_PER_CMD_EXT : MAX_SECS_PER_CMD;
+    hd->multi_secs = 1;
+
+    // word 76 的 bit 8：支持 NCQ，此时 word 75 的低 5 位是队列深度减 1
+    uint32_t slot_cnt = 1;
+    if ((port->host->cap & HBA_CAP_SNCQ) && (id_word[76] & (1 << 8)) && hd->lba48) {
+        slot_cnt = (id_word[75] & 0x1f) + 1;
+        if (slot_cnt > HBA_CAP_NCS(port->host->cap)) {
+            slot_cnt = HBA_CAP_NCS(port->host->cap);
+        }
+    }
+    port->ncq = slot_cnt > 1;
+    port->slot_cnt = slot_cnt;
+    mfree_page(PF_KERNEL, id_word, 1);
+    return sectors != 0;
+}
+
+// 端口初始化失败时停下两个引擎，释放已经申请的命令列表、命令表和磁盘
+static void ahci_port_free(struct ahci_port* port) {
+    volatile struct hba_port* regs = port->regs;
+    regs->ie = 0;
+    ahci_port_stop(regs);
+    regs->cmd &= ~HBA_PxCMD_FRE;
+    ahci_spin(&regs->cmd, HBA_PxCMD_FR, false);
+    regs->clb = 0;
+    regs->fb = 0;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (port->cmd_tables[slot] != NULL) {
+            mfree_page(PF_KERNEL, port->cmd_tables[slot], AHCI_CMD_TABLE_PAGES);
+        }
+    }
+    if (port->cmd_list != NULL) {
+        mfree_page(PF_KERNEL, port->cmd_list, 1);
+    }
+    if (port->disk != NULL) {
+        kfree(port->disk);
+    }
+    kfree(port);
+}
+
+// 初始化一个端口，端口上连着 SATA 磁盘时返回它，否则返回 NULL
+static struct ahci_port* ahci_port_init(struct ahci_host* host, uint8_t port_no) {
+    volatile struct hba_port* regs = &host->abar->ports[port_no];
+    // 支持逐个启动磁盘的控制器上电后不会自动启动磁盘
+    if (host->cap & HBA_CAP_SSS) {
+        regs->cmd |= HBA_PxCMD_SUD | HBA_PxCMD_POD;
+    }
+    if (HBA_PxSSTS_DET(regs->ssts) != HBA_DET_PRESENT) {
+        return NULL;
+    }
+
+    // 修改命令列表和接收 FIS 区域的地址之前，两个引擎都要停下来
+    if (!ahci_port_stop(regs)) {
+        printk("ahci: port %d does not stop\n", port_no);
+        return NULL;
+    }
+    regs->cmd &= ~HBA_PxCMD_FRE;
+    if (!ahci_spin(&regs->cmd, HBA_PxCMD_FR, false)) {
+        printk("ahci: port %d FIS receive does not stop\n", port_no);
+        return NULL;
+    }
+
+    struct ahci_port* port = kmalloc(sizeof(struct ahci_port));
+    if (port == NULL) {
+        printk("ahci: port %d out of memory\n", port_no);
+        return NULL;
+    }
+    port->host = host;
+    port->regs = regs;
+    port->port_no = port_no;
+    // 命令列表 1KB，接收 FIS 区域 256 字节，放在同一页里，页对齐也就满足了它们的对齐要求
+    port->cmd_list = get_kernel_pages(1);
+    if (port->cmd_list == NULL) {
+        goto fail;
+    }
+    uint32_t page_phys = addr_v2p((uint32_t)port->cmd_list);
+    regs->clb = page_phys;
+    regs->clbu = 0;
+    regs->fb = page_phys + 0x400;
+    regs->fbu = 0;
+    regs->ie = 0;
+    regs->serr = 0xffffffff;
+    regs->is = 0xffffffff;
+    regs->cmd |= HBA_PxCMD_FRE;
+
+    if (!ahci_spin(&regs->tfd, BIT_ALT_STAT_BSY | BIF_ALT_STAT_DRQ, false) || regs->sig != SATA_SIG_ATA) {
+        // ATAPI 光驱、端口倍增器等设备我们不支持
+        printk("ahci: port %d ignored, SIG:0x%x TFD:0x%x\n", port_no, regs->sig, regs->tfd);
+        ahci_port_free(port);
+        return NULL;
+    }
+    regs->cmd |= HBA_PxCMD_ST;
+
+    struct disk* hd = kmalloc(sizeof(struct disk));
+    if (hd == NULL) {
+        goto fail;
+    }
+    disk_init(hd);
+    hd->my_channel = NULL;
+    hd->dev_no = port_no;
+    hd->start_io = ahci_start_io;
+    hd->driver_data = port;
+    port->disk = hd;
+    port->cmd_tables[0] = get_kernel_pages(AHCI_CMD_TABLE_PAGES);
+    if (port->cmd_tables[0] == NULL) {
+        goto fail;
+    }
+    if (!ahci_identify(port, hd)) {
+        printk("ahci: port %d identify fail\n", port_no);
+        ahci_port_free(port);
+        return NULL;
+    }
+    for (uint32_t slot = 1; slot < port->slot_cnt; slot++) {
+        port->cmd_tables[slot] = get_kernel_pages(AHCI_CMD_TABLE_PAGES);
+        if (port->cmd_tables[slot] == NULL) {
+            goto fail;
+        }
+    }
+    port->issued = 0;
+    port->flush_rq = NULL;
+
+    // 命令完成和出错时发中断
+    regs->ie = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_ERROR;
+    return port;
+
+fail:
+    printk("ahci: port %d out of memory\n", port_no);
+    ahci_port_free(port);
+    return NULL;
+}
+
+static int ahci_probe(struct pci_dev* dev) {
+    printk("AHCI Driver: Probing device 0x%x:0x%x.%d\n", dev->bus, dev->slot, dev->func);
+    if (ahci_host_cnt == AHCI_MAX_HOSTS) {
+        return -1;
+    }
+
+    // BAR5 是 ABAR，必须是内存映射的
+    uint32_t bar5 = pci_read_config(dev->bus, dev->slot, dev->func, PCI_BAR5_OFFSET);
+    uint32_t irq_line = pci_read_config(dev->bus, dev->slot, dev->func, PCI_INTERRUPT_LINE_OFFSET) & 0xff;
+    if ((bar5 & PCI_BAR_IO) || (bar5 & 0xFFFFFFF0) == 0) {
+        printk("AHCI Error: BAR5 0x%x is not a memory BAR.\n", bar5);
+        return -1;
+    }
+    // 我们只有 8259A，中断线必须是 BIOS 分配好的 0~15 之一
+    if (irq_line >= 16) {
+        printk("AHCI Error: no legacy IRQ assigned.\n");
+        return -1;
+    }
+    dev->bar[5] = bar5;
+    dev->irq_line = irq_line;
+
+    // 允许设备响应 MMIO、发起 DMA，并且允许它发出 INTx 中断
+    uint32_t cmd = pci_read_config(dev->bus, dev->slot, dev->func, PCI_CMD_REG_OFFSET);
+    cmd = (cmd | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER) & ~PCI_COMMAND_INTERRUPT_DISABLE;
+    pci_write_config(dev->bus, dev->slot, dev->func, PCI_CMD_REG_OFFSET, cmd);
+
+    struct ahci_host* host = kmalloc(sizeof(struct ahci_host));
+    if (host == NULL) {
+        printk("AHCI Error: out of memory.\n");
+        return -1;
+    }
+    host->abar = ioremap(bar5 & 0xFFFFFFF0, AHCI_ABAR_SIZE);
+    if (host->abar == NULL) {
+        printk("AHCI Error: cannot map ABAR 0x%x.\n", bar5);
+        kfree(host);
+        return -1;
+    }
+    host->irq_no = 0x20 + irq_line;
+    // 切换到 AHCI 模式，初始化端口期间先不让控制器发中断
+    host->abar->ghc |= HBA_GHC_AE;
+    host->abar->ghc &= ~HBA_GHC_IE;
+    host->cap = host->abar->cap;
+    printk("AHCI: version 0x%x, %d slots, NCQ %s, IRQ %d\n", host->abar->vs,
+            HBA_CAP_NCS(host->cap), (host->cap & HBA_CAP_SNCQ) ? "yes" : "no", irq_line);
+
+    uint32_t pi = host->abar->pi;
+    for (uint8_t p = 0; p < AHCI_MAX_PORTS; p++) {
+        if (pi & (1U << p)) {
+            host->ports[p] = ahci_port_init(host, p);
+        }
+    }
+
+    ahci_hosts[ahci_host_cnt++] = host;
+    host->abar->is = 0xffffffff;
+    host->abar->ghc |= HBA_GHC_IE;
+    // 中断线可能和别的 PCI 设备共用
+    if (pci_request_irq(irq_line, intr_handler_ahci) != 0) {
+        printk("AHCI Error: cannot use IRQ %d.\n", irq_line);
+        host->abar->ghc &= ~HBA_GHC_IE;
+        return -1;
+    }
+
+    // 扫描分区表要读盘，必须在中断打开之后
+    for (uint8_t p = 0; p < AHCI_MAX_PORTS; p++) {
+        struct ahci_port* port = host->ports[p];
+        if (port == NULL) continue;
+        int32_t disk_idx = disk_alloc_idx();
+        if (disk_idx < 0) {
+            printk("AHCI: too many disks, port %d ignored\n", p);
+            continue;
+        }
+        disk_register(port->disk, disk_idx);
+        printk("AHCI: port %d is %s, %dMB%s, queue depth %d\n", p, port->disk->name,
+                port->disk->total_sectors / 2048, port->disk->lba48 ? " (LBA48)" : "", port->slot_cnt);
+    }
+    return 0;
+}
+
+void ahci_pci_driver_init() {
+    dlist_push_back(&pci_drivers_list, &ahci_pci_driver.driver_tag);
+}
@@ -95,45 +95,49 @@ static int ide_dma_probe(struct pci_dev* dev) {
     return 0; // 返回 0 表示初始化成功
 }
 
-// 将虚拟地址缓冲区映射到 PRD 表中
+// 将一组虚拟地址缓冲区映射到 PRD 表中
 // chan 渠道结构体
-// buf 缓冲区虚拟地址
-// size 传输字节数
+// vec 缓冲区数组，每一段都是连续的虚拟地址，段与段之间不必相邻
+// vec_cnt 缓冲区段数
 // is_write 是否为写操作
-static void ide_dma_setup(struct ide_channel* chan, void* buf, uint32_t size, bool is_write) {
-    uint32_t vaddr = (uint32_t)buf;
-    uint32_t bytes_left = size;
+// 各段按顺序首尾相接地对应磁盘上连续的扇区，这样缓存块就不需要先拼到一块中转缓冲区里
+static void ide_dma_setup(struct ide_channel* chan, struct io_vec* vec, uint32_t vec_cnt, bool is_write) {
     int prd_idx = 0;
 
-    while (bytes_left > 0) {
-        // 计算当前物理页内剩余的可读/写长度
-        uint32_t offset = vaddr & 0xFFF; // 页面内偏移
-        uint32_t page_left = PG_SIZE - offset; // 物理页剩下的空间
-        uint32_t chunk_size = (bytes_left < page_left) ? bytes_left : page_left;
-
-        // 获取当前虚拟地址对应的物理地址
-        uint32_t paddr = addr_v2p(vaddr);
-
-        // 填充一个 PRD 条目
-        chan->prd_table[prd_idx].paddr = paddr;
-        // IDE 规范规定 0 表示 64KB，这里 chunk_size 最大只有 4KB，所以没问题
-        chan->prd_table[prd_idx].size = (uint16_t)chunk_size;
-        // 暂时清零 flags
-        // 默认标记为 0，如果是最后一个条目则设为 0x80 (EOT)
-        chan->prd_table[prd_idx].flags = 0;
-
-        // 更新步进
-        bytes_left -= chunk_size;
-        vaddr += chunk_size;
-        prd_idx++;
-
-        // 防止 PRD 表溢出（通常一页能放 512 个 PRD 条目，足够用了）
-        // 为了防止出现这样的情况损害系统，我们先直接 PANIC
-        if (prd_idx >= 512) {
-            PANIC("IDE Error: Too many PRD entries needed!\n");
-            break;
+    for (uint32_t vec_idx = 0; vec_idx < vec_cnt; vec_idx++) {
+        uint32_t vaddr = (uint32_t)vec[vec_idx].base;
+        uint32_t bytes_left = vec[vec_idx].len;
+
+        while (bytes_left > 0) {
+            // 计算当前物理页内剩余的可读/写长度
+            uint32_t offset = vaddr & 0xFFF; // 页面内偏移
+            uint32_t page_left = PG_SIZE - offset; // 物理页剩下的空间
+            uint32_t chunk_size = (bytes_left < page_left) ? bytes_left : page_left;
+
+            // 防止 PRD 表溢出（通常一页能放 512 个 PRD 条目，足够用了）
+            // 为了防止出现这样的情况损害系统，我们先直接 PANIC
+            if (prd_idx >= 512) {
+                PANIC("IDE Error: Too many PRD entries needed!\n");
+            }
+
+            // 获取当前虚拟地址对应的物理地址
+            uint32_t paddr = addr_v2p(vaddr);
+
+            // 填充一个 PRD 条目
+            chan->prd_table[prd_idx].paddr = paddr;
+            // IDE 规范规定 0 表示 64KB，这里 chunk_size 最大只有 4KB，所以没问题
+            chan->prd_table[prd_idx].size = (uint16_t)chunk_size;
+            // 暂时清零 flags
+            // 默认标记为 0，如果是最后一个条目则设为 0x80 (EOT)
+            chan->prd_table[prd_idx].flags = 0;
+
+            // 更新步进
+            bytes_left -= chunk_size;
+            vaddr += chunk_size;
+            prd_idx++;
         }
     }
+    ASSERT(prd_idx > 0);
 
     // 标记 PRD 表结束
     // EOT 是最后两个字节的最高位，即 0x8000
@@ -151,88 +155,53 @@ static void ide_dma_setup(struct ide_channel* chan, void* buf, uint32_t size, bo
     outb(chan->bmba + BM_STATUS_REG_OFFSE, status | BM_STATUS_INT | BM_STATUS_ERROR);
 }
 
-void ide_read_dma(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    // printk("dma read\n");
+// 在通道上启动一次 DMA 传输，不等待它完成
+// 由请求队列在关中断时调用，此时通道一定是空闲的，同一时刻只有一个请求在用这张 PRD 表
+// 传输完成后磁盘发出中断，由 intr_handler_hd（或者轮询的提交者）停止 DMA 引擎、检查状态并完成请求
+void ide_dma_start(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt, uint32_t sec_cnt, bool is_write) {
     struct ide_channel* chan = hd->my_channel;
-    
-    // 锁定通道，防止多个进程同时竞争同一组寄存器
-    lock_acquire(&chan->lock);
 
     // 准备 PRDT 表、设置方向、清除状态位
-    // 读操作，所以 is_write 为 false
-    ide_dma_setup(chan, buf, sec_cnt * SECTOR_SIZE, false);
+    // 写操作时 vec 指向的数据必须已经准备好，因为一旦 BM_START 开启，DMA 控制器会立刻读取内存
+    ide_dma_setup(chan, vec, vec_cnt, is_write);
 
     // 设置 LBA 地址和扇区数，同时选择 disk
-    select_sector(hd, lba, sec_cnt); 
-    
-    // 向磁盘控制器发送 DMA 读命令 (0xC8)
-    // 此时磁盘会开始把数据从盘片读入它内部的 Buffer
-    cmd_out(hd->my_channel, CMD_DMA_READ);
+    bool ext = select_sector(hd, lba, sec_cnt);
+
+    // 向磁盘控制器发送 DMA 读命令 (0xC8) 或写命令 (0xCA)，LBA48 时用对应的 EXT 命令
+    if (is_write) {
+        cmd_out(chan, ext ? CMD_DMA_WRITE_EXT : CMD_DMA_WRITE);
+    } else {
+        cmd_out(chan, ext ? CMD_DMA_READ_EXT : CMD_DMA_READ);
+    }
 
     // 正式开启 PCI Bus Master DMA
     // 这一步必须在发送命令之后，因为磁盘需要时间准备 DMARQ 信号
+    // 每当我们发送 start 后，DMA 控制器都会从头扫描 prdt
     uint8_t bm_cmd = inb(chan->bmba + BM_COMMAND_REG_OFFSE);
-    // 发送 start 命令开始传输
-    // 每当我们发送 start 后，DMA 控制器都会从头扫描 prdt 
     outb(chan->bmba + BM_COMMAND_REG_OFFSE, bm_cmd | BM_CMD_START);
-
-    // 阻塞当前进程，等待中断唤醒
-    // DMA 会在后台静默搬运数据，CPU 此时可以去跑其他任务
-    chan->expecting_intr = true;
-    sema_wait(&chan->wait_disk);
-
-    // 中断处理程序执行完成后，进程在这里醒来
-    // 检查 DMA 状态，看是否发生错误
-    uint8_t status = inb(chan->bmba + BM_STATUS_REG_OFFSE);
-    if (status & BM_STATUS_ERROR) {
-        printk("IDE Error: DMA read failed at LBA 0x%x\n", lba);
-        // 同样，如果有问题我们先 PANIC 防止系统被破坏
-        // 真的出现具体的问题了我们再来处理
-        PANIC("DMA Error");
-    }
-
-    // 必须关闭 DMA 引擎，将 start 命令取消就行
-    outb(chan->bmba + BM_COMMAND_REG_OFFSE, inb(chan->bmba + BM_COMMAND_REG_OFFSE) & ~BM_CMD_START);
-
-    // 释放通道锁
-    lock_release(&chan->lock);
 }
 
-void ide_write_dma(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    // printk("dma write\n");
-    struct ide_channel* chan = hd->my_channel;
-    
-    lock_acquire(&chan->lock);
-
-    // 准备 PRDT 表，is_write 设为 true
-    // 这里的 buf 指向的数据必须已经准备好，
-    // 因为一旦下一步 BM_START 开启，DMA 控制器会立刻读取内存
-    ide_dma_setup(chan, buf, sec_cnt * SECTOR_SIZE, true);
-
-    // 告知硬盘我们要写的 LBA 地址
-    select_sector(hd, lba, sec_cnt); 
-
-    // 发送 DMA 写命令 (0xCA)
-    cmd_out(chan, CMD_DMA_WRITE);
-
-    // 开启总线主控开启传输
-    uint8_t bm_cmd = inb(chan->bmba + BM_COMMAND_REG_OFFSE);
-    outb(chan->bmba + BM_COMMAND_REG_OFFSE, bm_cmd | BM_CMD_START);
-
-    // 阻塞等待
-    chan->expecting_intr = true;
-    sema_wait(&chan->wait_disk);
+// DMA 传输是否已经结束：磁盘发出中断时控制器就会置上 INT 位，出错时也一样
+// 读状态寄存器不会清除任何东西，轮询时用它判断能不能收尾
+bool ide_dma_done(struct ide_channel* chan) {
+    return inb(chan->bmba + BM_STATUS_REG_OFFSE) & BM_STATUS_INT;
+}
 
-    // 检查错误
-    uint8_t status = inb(chan->bmba + BM_STATUS_REG_OFFSE);
-    if (status & BM_STATUS_ERROR) {
-        PANIC("DMA Write Error");
+// 传输结束后停止 DMA 引擎并清除中断位和错误位，返回清除之前的状态，由中断处理程序或者轮询调用
+// 即使是 PIO 模式，读这个寄存器也是安全的
+uint8_t ide_dma_finish(struct ide_channel* chan) {
+    uint8_t dma_status = inb(chan->bmba + BM_STATUS_REG_OFFSE);
+    // 如果 DMA 状态寄存器的中断位置 1，说明这是 DMA 传输完成
+    if (dma_status & BM_STATUS_INT) {
+        // 先停止 DMA 引擎 (Start 位清零)
+        uint8_t cmd = inb(chan->bmba + BM_COMMAND_REG_OFFSE);
+        outb(chan->bmba + BM_COMMAND_REG_OFFSE, cmd & ~BM_CMD_START);
+
+        // 再清除 DMA 中断位和错误位 (写 1 清除)
+        outb(chan->bmba + BM_STATUS_REG_OFFSE, dma_status | BM_STATUS_INT | BM_STATUS_ERROR);
     }
-
-    // 停止 DMA 引擎
-    outb(chan->bmba + BM_COMMAND_REG_OFFSE, inb(chan->bmba + BM_COMMAND_REG_OFFSE) & ~BM_CMD_START);
-
-    lock_release(&chan->lock);
+    return dma_status;
 }
 
 void ide_pci_driver_init() {
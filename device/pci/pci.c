@@ -5,11 +5,17 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <ide_dma.h>
+#include <ahci.h>
+#include <virtio_blk.h>
 #include <memory.h>
+#include <interrupt.h>
 
 
 struct dlist pci_drivers_list; // 全局已注册驱动链表
 
+// 每条 8259A 中断线上挂着的 PCI 设备中断处理函数
+static pci_irq_handler pci_irq_handlers[16][PCI_IRQ_SHARED_MAX];
+
 /*
 32 位地址格式：
     位 (Bits)       宽度        含义    
@@ -59,6 +65,39 @@ void pci_bind_driver(struct pci_dev* dev) {
     }
 }
 
+// 共用中断线的设备都注册在这条线上，中断来了就逐个调用，由它们自己判断是不是自己的中断
+static void pci_intr_dispatch(uint8_t vec_no) {
+    pci_irq_handler* handlers = pci_irq_handlers[vec_no - 0x20];
+    for (int i = 0; i < PCI_IRQ_SHARED_MAX && handlers[i] != NULL; i++) {
+        handlers[i](vec_no);
+    }
+}
+
+// 把设备的中断处理函数挂到 BIOS 分配给它的中断线 irq_line 上，然后打开这条线的屏蔽
+// 成功返回 0，中断线不可用或者这条线上的设备太多时返回 -1
+int pci_request_irq(uint8_t irq_line, pci_irq_handler handler) {
+    if (irq_line >= 16) {
+        return -1;
+    }
+    pci_irq_handler* handlers = pci_irq_handlers[irq_line];
+    int i = 0;
+    while (i < PCI_IRQ_SHARED_MAX && handlers[i] != NULL) {
+        i++;
+    }
+    if (i == PCI_IRQ_SHARED_MAX) {
+        printk("PCI: too many devices share IRQ %d\n", irq_line);
+        return -1;
+    }
+    enum intr_status old = intr_disable();
+    handlers[i] = handler;
+    if (i == 0) {
+        register_handler(0x20 + irq_line, pci_intr_dispatch);
+    }
+    intr_set_status(old);
+    pic_enable_irq(irq_line);
+    return 0;
+}
+
 // 读取 PCI 配置空间的一个 32 位数据
 uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
     // 构造 32 位的地址
@@ -124,6 +163,7 @@ void pci_check_device(uint8_t bus, uint8_t slot) {
 
 // pci_init 在 ide_init 之后调用，它里面有 dma 的初始化逻辑，他作为我们磁盘 io 的一个增强包
 // 如果可以 dma，那么就用dma，不可以那就还用 pio
+// ahci 控制器和 virtio-blk 设备上的磁盘也在这里发现，它们排在 ide 磁盘的后面
 void pci_init() {
     printk("PCI init start\n");
     dlist_init(&pci_drivers_list);
@@ -133,6 +173,8 @@ void pci_init() {
     // 我们目前的设备还不是很多，先这么硬编码初始化逻辑吧
     // 以后如果设备多了再实现从文件系统中运行时加载
     ide_pci_driver_init(); 
+    ahci_pci_driver_init();
+    virtio_blk_pci_driver_init();
     // network_pci_driver_init();
 
     // 扫描总线
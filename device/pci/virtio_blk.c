@@ -0,0 +1,447 @@
+#include <virtio_blk.h>
+#include <pci.h>
+#include <ide.h>
+#include <io.h>
+#include <memory.h>
+#include <stdio-kernel.h>
+#include <debug.h>
+#include <string.h>
+#include <errno.h>
+
+// 设备没有给出 size_max 时每段的上限，一条命令最多 512KB，实际上不会碰到
+#define VIRTIO_BLK_DEFAULT_SIZE_MAX 0x400000
+
+static int virtio_blk_probe(struct pci_dev* dev);
+
+static const struct pci_device_id virtio_blk_pci_ids[] = {
+    {
+        .vendor_id = VIRTIO_PCI_VENDOR,
+        .device_id = VIRTIO_BLK_PCI_DEVICE,
+        .class_code = 0,
+        .class_mask = 0
+    },
+    {0}
+};
+
+static struct pci_driver virtio_blk_pci_driver = {
+    .name = "VirtIO_Block_Driver",
+    .id_table = virtio_blk_pci_ids,
+    .probe = virtio_blk_probe,
+    .remove = NULL,
+};
+
+static struct virtio_blk* vblk_devs[VIRTIO_BLK_MAX_DEVS];
+static uint32_t vblk_dev_cnt = 0;
+
+// 从空闲链表中取一个描述符，调用者保证还有空闲的
+static uint16_t vblk_alloc_desc(struct virtio_blk* vb) {
+    uint16_t id = vb->free_head;
+    vb->free_head = vb->desc[id].next;
+    vb->free_cnt--;
+    return id;
+}
+
+static void vblk_free_desc(struct virtio_blk* vb, uint16_t id) {
+    vb->desc[id].next = vb->free_head;
+    vb->free_head = id;
+    vb->free_cnt++;
+}
+
+// 把从 head 开始的整条描述符链还回空闲链表
+static void vblk_free_chain(struct virtio_blk* vb, uint16_t head) {
+    uint16_t id = head;
+    vb->free_cnt++;
+    while (vb->desc[id].flags & VRING_DESC_F_NEXT) {
+        id = vb->desc[id].next;
+        vb->free_cnt++;
+    }
+    vb->desc[id].next = vb->free_head;
+    vb->free_head = head;
+}
+
+// 把以 head 开头的请求放进 avail 环，设备要等 vblk_notify 之后才会去看
+static void vblk_push_avail(struct virtio_blk* vb, uint16_t head) {
+    vb->avail->ring[vb->avail->idx % vb->num] = head;
+    // 先写好环里的内容，再让设备看到新的 idx
+    virtio_barrier();
+    vb->avail->idx++;
+    vb->inflight++;
+}
+
+// 通知设备 avail 环里有新请求，一批请求只需要写一次端口
+static void vblk_notify(struct virtio_blk* vb) {
+    virtio_barrier();
+    if (!(vb->used->flags & VRING_USED_F_NO_NOTIFY)) {
+        outw(vb->iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    }
+}
+
+// 请求的第一个描述符：设备读取的请求头
+static uint16_t vblk_begin_req(struct virtio_blk* vb, struct request* rq, uint32_t type, uint32_t sector) {
+    uint16_t head = vblk_alloc_desc(vb);
+    struct virtio_blk_req* req = &vb->reqs[head];
+    req->hdr.type = type;
+    req->hdr.reserved = 0;
+    req->hdr.sector = sector;
+    req->status = 0xff;
+    req->rq = rq;
+    vb->desc[head].addr = addr_v2p((uint32_t)&req->hdr);
+    vb->desc[head].len = sizeof(struct virtio_blk_outhdr);
+    vb->desc[head].flags = 0;
+    return head;
+}
+
+// 请求的最后一个描述符：设备写入的状态字节，接在 last 后面
+static void vblk_end_req(struct virtio_blk* vb, uint16_t head, uint16_t last) {
+    uint16_t id = vblk_alloc_desc(vb);
+    vb->desc[last].flags |= VRING_DESC_F_NEXT;
+    vb->desc[last].next = id;
+    vb->desc[id].addr = addr_v2p((uint32_t)&vb->reqs[head].status);
+    vb->desc[id].len = 1;
+    vb->desc[id].flags = VRING_DESC_F_WRITE;
+    vblk_push_avail(vb, head);
+}
+
+// 开始发送一条新的读写命令，合并进来的请求的 io_vec 拼成一个数组
+static void vblk_begin_cmd(struct virtio_blk* vb, struct request* rq) {
+    if (rq->merge_next == NULL) {
+        vb->cmd_vec = rq->vec;
+        vb->cmd_vec_cnt = rq->vec_cnt;
+    } else {
+        uint32_t cnt = 0;
+        for (struct request* r = rq; r != NULL; r = r->merge_next) {
+            memcpy(&vb->merge_vec[cnt], r->vec, r->vec_cnt * sizeof(struct io_vec));
+            cnt += r->vec_cnt;
+        }
+        ASSERT(cnt == rq->cmd_vecs);
+        vb->cmd_vec = vb->merge_vec;
+        vb->cmd_vec_cnt = cnt;
+    }
+    rq->secs_done = 0;
+    rq->vec_idx = rq->vec_off = 0;
+    rq->parts = 0;
+    vb->cur_rq = rq;
+}
+
+// 把命令的游标向后移动 bytes 字节
+static void vblk_advance(struct virtio_blk* vb, struct request* rq, uint32_t bytes) {
+    while (bytes > 0) {
+        uint32_t left = vb->cmd_vec[rq->vec_idx].len - rq->vec_off;
+        uint32_t n = left < bytes ? left : bytes;
+        rq->vec_off += n;
+        bytes -= n;
+        if (rq->vec_off == vb->cmd_vec[rq->vec_idx].len) {
+            rq->vec_idx++;
+            rq->vec_off = 0;
+        }
+    }
+}
+
+// 把 cur_rq 从游标开始的一部分作为一个请求发出去
+// 数据段受 seg_max 和空闲描述符数的限制，放不下的部分留给下一个请求，每个请求都是整数个扇区
+// 调用者保证至少有 4 个空闲描述符：请求头、状态各一个，两个数据段至少能装下一个扇区
+static void vblk_issue_part(struct virtio_blk* vb) {
+    struct request* rq = vb->cur_rq;
+    bool is_write = rq->op == REQ_WRITE;
+    uint16_t head = vblk_begin_req(vb, rq, is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, rq->lba + rq->secs_done);
+
+    // 留一个描述符给状态字节
+    uint32_t max_segs = vb->free_cnt - 1;
+    if (max_segs > vb->seg_max) max_segs = vb->seg_max;
+    uint16_t last = head, prev = head;
+    uint32_t segs = 0, bytes = 0, last_end = 0;
+    uint32_t idx = rq->vec_idx, off = rq->vec_off;
+    while (idx < vb->cmd_vec_cnt) {
+        // vec 里是内核虚拟地址，一页之内的物理地址才保证连续
+        struct io_vec* v = &vb->cmd_vec[idx];
+        uint32_t vaddr = (uint32_t)v->base + off;
+        uint32_t chunk = PG_SIZE - (vaddr & 0xfff);
+        if (chunk > v->len - off) chunk = v->len - off;
+        uint32_t paddr = addr_v2p(vaddr);
+
+        if (segs > 0 && paddr == last_end && vb->desc[last].len + chunk <= vb->size_max) {
+            vb->desc[last].len += chunk;
+        } else {
+            if (segs == max_segs) break;
+            uint16_t id = vblk_alloc_desc(vb);
+            vb->desc[last].flags |= VRING_DESC_F_NEXT;
+            vb->desc[last].next = id;
+            vb->desc[id].addr = paddr;
+            vb->desc[id].len = chunk;
+            vb->desc[id].flags = is_write ? 0 : VRING_DESC_F_WRITE;
+            prev = last;
+            last = id;
+            segs++;
+        }
+        last_end = paddr + chunk;
+        bytes += chunk;
+        off += chunk;
+        if (off == v->len) {
+            idx++;
+            off = 0;
+        }
+    }
+
+    // 请求只能以扇区为单位，去掉末尾不满一个扇区的部分
+    // 游标总在扇区边界上，多出来的字节都属于最后一个 vec，不会超过最后一段的长度
+    uint32_t extra = bytes % SECTOR_SIZE;
+    if (extra != 0) {
+        bytes -= extra;
+        if (vb->desc[last].len > extra) {
+            vb->desc[last].len -= extra;
+        } else {
+            vblk_free_desc(vb, last);
+            last = prev;
+        }
+    }
+    ASSERT(bytes > 0);
+    vblk_end_req(vb, head, last);
+
+    vblk_advance(vb, rq, bytes);
+    rq->secs_done += bytes / SECTOR_SIZE;
+    rq->parts++;
+    if (rq->secs_done == rq->cmd_secs) {
+        vb->cur_rq = NULL;
+    }
+}
+
+// 从调度器取出命令发给设备，是磁盘的 start_io，调用者已经关中断
+// 设备支持多个请求同时执行，只要还有空闲的描述符就继续发
+static void virtio_blk_start_io(struct disk* hd) {
+    struct virtio_blk* vb = hd->driver_data;
+    struct request* flush_done = NULL;
+    bool added = false;
+    while (true) {
+        if (vb->cur_rq == NULL) {
+            // FLUSH 不能和其他请求同时执行
+            // 调度器保证它之前提交的写都已经发出，这里再等发出去的请求全部完成，它执行期间也不再发新请求
+            if (vb->flush_rq != NULL) break;
+            struct request* rq = elv_next(hd);
+            if (rq == NULL) break;
+            if (rq->op == REQ_FLUSH) {
+                vb->flush_rq = rq;
+                break;
+            }
+            vblk_begin_cmd(vb, rq);
+        }
+        if (vb->free_cnt < 4) break;
+        vblk_issue_part(vb);
+        added = true;
+    }
+    if (vb->flush_rq != NULL && vb->inflight == 0) {
+        if (vb->features & VIRTIO_BLK_F_FLUSH) {
+            uint16_t head = vblk_begin_req(vb, vb->flush_rq, VIRTIO_BLK_T_FLUSH, 0);
+            vblk_end_req(vb, head, head);
+            added = true;
+        } else {
+            // 没有写缓存的设备，写完成时数据就已经落盘了
+            flush_done = vb->flush_rq;
+            vb->flush_rq = NULL;
+        }
+    }
+    if (added) {
+        vblk_notify(vb);
+    }
+    if (flush_done != NULL) {
+        ide_complete(flush_done, 0);
+    }
+}
+
+// 处理 used 环里设备完成的请求
+// 先让设备开始执行新的请求，再通知提交者
+static void vblk_intr(struct virtio_blk* vb) {
+    struct dlist finished;
+    dlist_init(&finished);
+    while (vb->last_used != vb->used->idx) {
+        // 先看到设备写的 idx，再读它写的环和状态
+        virtio_barrier();
+        uint16_t head = vb->used->ring[vb->last_used % vb->num].id;
+        vb->last_used++;
+        struct virtio_blk_req* req = &vb->reqs[head];
+        struct request* rq = req->rq;
+        if (req->status != VIRTIO_BLK_S_OK) {
+            printk("%s: request at sector %d failed, status %d\n", vb->disk->name, (uint32_t)req->hdr.sector, req->status);
+            rq->status = -EIO;
+        }
+        vblk_free_chain(vb, head);
+        vb->inflight--;
+
+        if (rq == vb->flush_rq) {
+            vb->flush_rq = NULL;
+            dlist_push_back(&finished, &rq->queue_tag);
+        } else if (--rq->parts == 0 && rq != vb->cur_rq) {
+            // 一条命令拆成的请求全部完成，任何一个出错整条命令都算失败
+            dlist_push_back(&finished, &rq->queue_tag);
+        }
+    }
+    virtio_blk_start_io(vb->disk);
+    while (!dlist_empty(&finished)) {
+        struct request* rq = member_to_entry(struct request, queue_tag, dlist_pop_front(&finished));
+        ide_complete(rq, rq->status);
+    }
+}
+
+// 中断线可能和别的 PCI 设备共用，读 ISR 看是不是我们的中断，读的同时也撤销了中断
+static void intr_handler_virtio_blk(uint8_t irq_no) {
+    for (uint32_t i = 0; i < vblk_dev_cnt; i++) {
+        struct virtio_blk* vb = vblk_devs[i];
+        if (vb->irq_no != irq_no) continue;
+        // 8259A 是边沿触发的，处理期间设备又完成了请求的话不会再来一次中断，所以要处理到 ISR 为 0
+        while (inb(vb->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE) {
+            vblk_intr(vb);
+        }
+    }
+}
+
+// 初始化设备和它唯一的 virtqueue，失败时把设备标记为 FAILED
+static bool vblk_setup(struct virtio_blk* vb) {
+    uint16_t iobase = vb->iobase;
+    // 写 0 复位设备，然后告诉它我们认识它、能驱动它
+    outb(iobase + VIRTIO_PCI_STATUS, 0);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t host_features = inl(iobase + VIRTIO_PCI_HOST_FEATURES);
+    vb->features = host_features & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_FLUSH);
+    outl(iobase + VIRTIO_PCI_GUEST_FEATURES, vb->features);
+
+    outw(iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+    vb->num = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+    if (vb->num < 4 || inl(iobase + VIRTIO_PCI_QUEUE_PFN) != 0) {
+        printk("virtio-blk: queue 0 unavailable\n");
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    // 请求头、状态各占一个描述符，其余的都可以用来放数据
+    vb->seg_max = vb->num - 2;
+    if (vb->features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = inl(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max >= 2 && seg_max < vb->seg_max) vb->seg_max = seg_max;
+    }
+    // 一页之内的数据总是放在一段里，size_max 比一页还小的设备我们当作没有限制
+    vb->size_max = VIRTIO_BLK_DEFAULT_SIZE_MAX;
+    if (vb->features & VIRTIO_BLK_F_SIZE_MAX) {
+        uint32_t size_max = inl(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_SIZE_MAX);
+        if (size_max >= PG_SIZE) vb->size_max = size_max;
+    }
+
+    // 描述符表、avail 环和 used 环放在物理连续的页里，把起始页号告诉设备
+    uint32_t ring_pages = DIV_ROUND_UP(VRING_SIZE(vb->num), PG_SIZE);
+    uint32_t reqs_pages = DIV_ROUND_UP(sizeof(struct virtio_blk_req) * vb->num, PG_SIZE);
+    uint8_t* ring = get_kernel_pages(ring_pages);
+    vb->reqs = get_kernel_pages(reqs_pages);
+    vb->merge_vec = kmalloc(sizeof(struct io_vec) * ELV_MAX_MERGE_VECS);
+    if (ring == NULL || vb->reqs == NULL || vb->merge_vec == NULL) {
+        printk("virtio-blk: out of memory for queue 0\n");
+        if (ring != NULL) mfree_page(PF_KERNEL, ring, ring_pages);
+        if (vb->reqs != NULL) mfree_page(PF_KERNEL, vb->reqs, reqs_pages);
+        if (vb->merge_vec != NULL) kfree(vb->merge_vec);
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    vb->desc = (struct vring_desc*)ring;
+    vb->avail = (struct vring_avail*)(ring + sizeof(struct vring_desc) * vb->num);
+    vb->used = (struct vring_used*)(ring + VRING_USED_OFFSET(vb->num));
+    for (uint16_t i = 0; i < vb->num - 1; i++) {
+        vb->desc[i].next = i + 1;
+    }
+    vb->free_head = 0;
+    vb->free_cnt = vb->num;
+    vb->last_used = 0;
+    vb->inflight = 0;
+    vb->cur_rq = NULL;
+    vb->flush_rq = NULL;
+    outl(iobase + VIRTIO_PCI_QUEUE_PFN, addr_v2p((uint32_t)ring) >> 12);
+    return true;
+}
+
+static int virtio_blk_probe(struct pci_dev* dev) {
+    printk("VirtIO Block Driver: Probing device 0x%x:0x%x.%d\n", dev->bus, dev->slot, dev->func);
+    if (vblk_dev_cnt == VIRTIO_BLK_MAX_DEVS) {
+        return -1;
+    }
+
+    // legacy 接口的寄存器在 BAR0 的 I/O 端口里
+    uint32_t bar0 = pci_read_config(dev->bus, dev->slot, dev->func, PCI_BAR0_OFFSET);
+    uint32_t irq_line = pci_read_config(dev->bus, dev->slot, dev->func, PCI_INTERRUPT_LINE_OFFSET) & 0xff;
+    if (!(bar0 & PCI_BAR_IO)) {
+        printk("virtio-blk Error: BAR0 0x%x is not an I/O BAR.\n", bar0);
+        return -1;
+    }
+    if (irq_line >= 16) {
+        printk("virtio-blk Error: no legacy IRQ assigned.\n");
+        return -1;
+    }
+    dev->bar[0] = bar0;
+    dev->irq_line = irq_line;
+
+    // 允许设备响应端口访问、用 DMA 读写 virtqueue，并且允许它发出 INTx 中断
+    uint32_t cmd = pci_read_config(dev->bus, dev->slot, dev->func, PCI_CMD_REG_OFFSET);
+    cmd = (cmd | PCI_COMMAND_IO | PCI_COMMAND_MASTER) & ~PCI_COMMAND_INTERRUPT_DISABLE;
+    pci_write_config(dev->bus, dev->slot, dev->func, PCI_CMD_REG_OFFSET, cmd);
+
+    struct virtio_blk* vb = kmalloc(sizeof(struct virtio_blk));
+    if (vb == NULL) {
+        printk("virtio-blk Error: out of memory.\n");
+        return -1;
+    }
+    vb->iobase = bar0 & 0xFFFC;
+    vb->irq_no = 0x20 + irq_line;
+    if (!vblk_setup(vb)) {
+        kfree(vb);
+        return -1;
+    }
+
+    struct disk* hd = kmalloc(sizeof(struct disk));
+    if (hd == NULL) {
+        printk("virtio-blk Error: out of memory.\n");
+        goto fail;
+    }
+    disk_init(hd);
+    uint32_t cap_lo = inl(vb->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY);
+    uint32_t cap_hi = inl(vb->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4);
+    // 我们的 lba 只有 32 位，更大的部分用不到
+    hd->total_sectors = cap_hi != 0 ? 0xffffffff : cap_lo;
+    hd->lba48 = true;
+    hd->multi_secs = 1;
+    hd->max_secs = MAX_SECS_PER_CMD_EXT;
+    hd->my_channel = NULL;
+    hd->dev_no = vblk_dev_cnt;
+    hd->start_io = virtio_blk_start_io;
+    hd->driver_data = vb;
+    vb->disk = hd;
+
+    // 中断线可能和别的 PCI 设备共用，注册成功之后才让中断处理函数看到这个设备
+    if (pci_request_irq(irq_line, intr_handler_virtio_blk) != 0) {
+        printk("virtio-blk Error: cannot use IRQ %d.\n", irq_line);
+        kfree(hd);
+        goto fail;
+    }
+    vblk_devs[vblk_dev_cnt++] = vb;
+    outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    // 扫描分区表要读盘，必须在中断打开之后
+    int32_t disk_idx = disk_alloc_idx();
+    if (disk_idx < 0) {
+        printk("virtio-blk: too many disks, device ignored\n");
+        return -1;
+    }
+    disk_register(hd, disk_idx);
+    printk("virtio-blk: %s, %dMB, queue size %d, %d segments per request%s\n", hd->name,
+            hd->total_sectors / 2048, vb->num, vb->seg_max, (vb->features & VIRTIO_BLK_F_FLUSH) ? ", write cache" : "");
+    return 0;
+
+fail:
+    // 复位让设备忘掉 virtqueue 的地址，然后才能收回这些页
+    outb(vb->iobase + VIRTIO_PCI_STATUS, 0);
+    outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+    mfree_page(PF_KERNEL, vb->desc, DIV_ROUND_UP(VRING_SIZE(vb->num), PG_SIZE));
+    mfree_page(PF_KERNEL, vb->reqs, DIV_ROUND_UP(sizeof(struct virtio_blk_req) * vb->num, PG_SIZE));
+    kfree(vb->merge_vec);
+    kfree(vb);
+    return -1;
+}
+
+void virtio_blk_pci_driver_init() {
+    dlist_push_back(&pci_drivers_list, &virtio_blk_pci_driver.driver_tag);
+}
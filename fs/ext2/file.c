@@ -159,10 +159,68 @@ static int32_t ext2_readdir(struct inode* inode UNUSED, struct file* file, struc
     return -1;
 }
 
+// O_DIRECT 读，物理上连续的块合并成一次 bdirect_io，数据直接读到用户缓冲区
+// 文件末尾不足一个扇区的部分也按整扇区读，但返回值和 fd_pos 只算到 i_size
+static int32_t ext2_file_direct_read(struct inode* inode, struct file* file, char* buf, int32_t count) {
+    struct partition* part = get_part_by_rdev(inode->i_dev);
+    struct super_block* sb = inode->i_sb;
+    uint32_t block_size = sb->s_block_size;
+
+    if (file->fd_pos % SECTOR_SIZE || count % SECTOR_SIZE || (uint32_t)buf % SECTOR_SIZE) {
+        return -EINVAL;
+    }
+    if (file->fd_pos >= inode->i_size) {
+        return 0;
+    }
+    uint32_t size = count;
+    if (file->fd_pos + count > inode->i_size) {
+        size = inode->i_size - file->fd_pos;
+    }
+    uint32_t xfer = DIV_ROUND_UP(size, SECTOR_SIZE) * SECTOR_SIZE;
+
+    uint8_t* dst = (uint8_t*)buf;
+    uint32_t done = 0;
+    while (done < xfer) {
+        uint32_t block_idx = (file->fd_pos + done) / block_size;
+        uint32_t offset_in_block = (file->fd_pos + done) % block_size;
+        uint32_t n = block_size - offset_in_block;
+        if (n > xfer - done) n = xfer - done;
+
+        uint32_t phys_block = inode->i_op->bmap(inode, block_idx);
+        if (phys_block == 0) {
+            // 空洞直接填 0
+            memset(dst, 0, n);
+            dst += n;
+            done += n;
+            continue;
+        }
+        // 向后合并物理上连续的块，bdirect_io 会自己按单条命令的上限拆分
+        uint32_t blk_cnt = 1;
+        while (done + n < xfer &&
+               (uint32_t)inode->i_op->bmap(inode, block_idx + blk_cnt) == phys_block + blk_cnt) {
+            uint32_t more = xfer - done - n;
+            n += (more < block_size) ? more : block_size;
+            blk_cnt++;
+        }
+
+        uint32_t lba = PART_LBA(part, BLOCK_TO_SECTOR(sb, phys_block) + offset_in_block / SECTOR_SIZE);
+        int32_t ret = bdirect_io(part, lba, dst, n / SECTOR_SIZE, false);
+        if (ret < 0) return ret;
+        dst += n;
+        done += n;
+    }
+
+    file->fd_pos += size;
+    return size;
+}
+
 // read 操作确实会改变atime，但是它不会里面同步回去，因此只有在进行write操作时才会写回去
 // 例如我们先cat，后echo，后面那个echo会把前面那个cat改变的atime写回去，但是我们要是先echo，后cat，这个时间就不会写回去了
 // 这点先需要注意一下，以后需要改进，目前就先这样吧
 static int32_t ext2_file_read(struct inode* inode, struct file* file, char* buf, int32_t count) {
+    if (file->fd_flag & O_DIRECT) {
+        return ext2_file_direct_read(inode, file, buf, count);
+    }
     struct partition* part = get_part_by_rdev(inode->i_dev);
     struct super_block* sb = inode->i_sb;
     
@@ -180,40 +238,61 @@ static int32_t ext2_file_read(struct inode* inode, struct file* file, char* buf,
         return 0; 
     }
 
-    // 申请一个块大小的缓冲区，用于处理非块对齐的读取
-    uint8_t* io_buf = kmalloc(block_size);
-    if (!io_buf) return -ENOMEM;
-
     uint32_t bytes_read = 0;
     uint32_t size_left = size;
     uint8_t* buf_dst = (uint8_t*)buf;
+    // 分区在挂载时已经通过 set_blocksize 把缓存块大小设成了文件系统的块大小
+    // 因此每个缓存块正好对应一个 ext2 块，数据直接从缓存块拷到用户缓冲区，不再经过 io_buf 中转
+    struct buffer_head* bhs[MAX_GANG_BLKS];
 
     while (bytes_read < size) {
         // 计算当前逻辑块号和块内偏移
         uint32_t block_idx = file->fd_pos / block_size;
         uint32_t offset_in_block = file->fd_pos % block_size;
-        
-        // 计算当前这轮循环能读多少字节
-        uint32_t sec_left_in_block = block_size - offset_in_block;
-        uint32_t chunk_size = (size_left < sec_left_in_block) ? size_left : sec_left_in_block;
 
         // 利用 bmap 找到物理块号
         uint32_t phys_block = inode->i_op->bmap(inode, block_idx);
 
         if (phys_block == 0) {
             // Ext2 支持空洞文件（Sparse File），如果块号为 0，填充 0
+            uint32_t sec_left_in_block = block_size - offset_in_block;
+            uint32_t chunk_size = (size_left < sec_left_in_block) ? size_left : sec_left_in_block;
             memset(buf_dst, 0, chunk_size);
-        } else {
-            // 读取整个块到 io_buf
-            partition_read(part, BLOCK_TO_SECTOR(sb, phys_block), io_buf, block_size / SECTOR_SIZE);
-            memcpy(buf_dst, io_buf + offset_in_block, chunk_size);
+            buf_dst += chunk_size;
+            file->fd_pos += chunk_size;
+            bytes_read += chunk_size;
+            size_left -= chunk_size;
+            continue;
         }
 
-        // 更新状态
-        buf_dst += chunk_size;
-        file->fd_pos += chunk_size;
-        bytes_read += chunk_size;
-        size_left -= chunk_size;
+        // 向后查找物理上连续的块，合并成一次 gang 读，未命中的块可以一次 io 全部读进缓存
+        uint32_t blk_cnt = 1;
+        uint32_t span = block_size - offset_in_block;
+        while (span < size_left && blk_cnt < MAX_GANG_BLKS &&
+               (uint32_t)inode->i_op->bmap(inode, block_idx + blk_cnt) == phys_block + blk_cnt) {
+            span += block_size;
+            blk_cnt++;
+        }
+
+        // 读出错时返回已经读到的部分，一点都没读到才报错
+        if (partition_bread_gang(part, BLOCK_TO_SECTOR(sb, phys_block), blk_cnt * (block_size / SECTOR_SIZE), bhs) == 0) {
+            return bytes_read != 0 ? (int32_t)bytes_read : -EIO;
+        }
+        uint32_t chunk_left = (size_left < span) ? size_left : span;
+        for (uint32_t i = 0; i < blk_cnt; i++) {
+            uint32_t n = block_size - offset_in_block;
+            if (n > chunk_left) n = chunk_left;
+            memcpy(buf_dst, bhs[i]->b_data + offset_in_block, n);
+            offset_in_block = 0;
+
+            // 更新状态
+            buf_dst += n;
+            file->fd_pos += n;
+            bytes_read += n;
+            size_left -= n;
+            chunk_left -= n;
+        }
+        brelse_gang(bhs, blk_cnt);
     }
 
     // 只有当真正读到了数据（bytes_read > 0）时才更新
@@ -225,7 +304,6 @@ static int32_t ext2_file_read(struct inode* inode, struct file* file, char* buf,
     //     // 等到 inode 周期性同步或者文件关闭时再写回磁盘。
     // }
 
-    kfree(io_buf);
     return bytes_read;
 }
 
@@ -275,8 +353,109 @@ static int32_t ext2_generic_lseek(struct inode* inode, struct file* pf, int32_t
     return pf->fd_pos;
 }
 
+// 给文件分配一个新块并挂到 inode 上，磁盘满时返回 0
+static uint32_t ext2_direct_alloc_block(struct inode* inode) {
+    int32_t phys_block = ext2_resource_alloc(inode->i_sb, 0, EXT2_BLOCK_BITMAP);
+    if (phys_block == -1) {
+        return 0;
+    }
+    if (ext2_append_block_to_inode(inode, phys_block) < 0) {
+        PANIC("fail to ext2_append_block_to_inode");
+    }
+    return phys_block;
+}
+
+// O_DIRECT 写，物理上连续的块合并成一次 bdirect_io，数据直接从用户缓冲区写到磁盘
+// 新分配的块如果只写了一部分，剩下的部分必须是 0，这种块仍然走缓存补零后整块写入
+static int32_t ext2_file_direct_write(struct inode* inode, struct file* file, char* buf, int32_t count) {
+    struct super_block* sb = inode->i_sb;
+    struct partition* part = get_part_by_rdev(inode->i_dev);
+    uint32_t block_size = sb->s_block_size;
+
+    if (file->fd_pos % SECTOR_SIZE || count % SECTOR_SIZE || (uint32_t)buf % SECTOR_SIZE) {
+        return -EINVAL;
+    }
+
+    uint8_t* io_buf = NULL;
+    uint8_t* src = (uint8_t*)buf;
+    uint32_t bytes_written = 0;
+    int32_t ret = 0;
+    while (bytes_written < (uint32_t)count) {
+        uint32_t size_left = count - bytes_written;
+        uint32_t block_idx = file->fd_pos / block_size;
+        uint32_t offset_in_block = file->fd_pos % block_size;
+        uint32_t n = block_size - offset_in_block;
+        if (n > size_left) n = size_left;
+
+        uint32_t phys_block = inode->i_op->bmap(inode, block_idx);
+        if (phys_block == 0) {
+            phys_block = ext2_direct_alloc_block(inode);
+            if (phys_block == 0) {
+                break;
+            }
+            if (n != block_size) {
+                if (io_buf == NULL) {
+                    io_buf = kmalloc(block_size);
+                    if (io_buf == NULL) {
+                        ret = -ENOMEM;
+                        break;
+                    }
+                }
+                memset(io_buf, 0, block_size);
+                memcpy(io_buf + offset_in_block, src, n);
+                partition_write(part, BLOCK_TO_SECTOR(sb, phys_block), io_buf, block_size / SECTOR_SIZE);
+                goto advance;
+            }
+        }
+
+        // 向后合并物理上连续的块，已经存在的块直接覆盖，不存在的整块就地分配
+        // 新分配的块不连续时它已经挂到了 inode 上，下一轮 bmap 会找到它
+        uint32_t blk_cnt = 1;
+        while (n < size_left) {
+            uint32_t next = inode->i_op->bmap(inode, block_idx + blk_cnt);
+            if (next == 0) {
+                if (size_left - n < block_size) break;
+                next = ext2_direct_alloc_block(inode);
+                if (next == 0) break;
+            }
+            if (next != phys_block + blk_cnt) break;
+            uint32_t more = size_left - n;
+            n += (more < block_size) ? more : block_size;
+            blk_cnt++;
+        }
+
+        uint32_t lba = PART_LBA(part, BLOCK_TO_SECTOR(sb, phys_block) + offset_in_block / SECTOR_SIZE);
+        ret = bdirect_io(part, lba, src, n / SECTOR_SIZE, true);
+        if (ret < 0) {
+            break;
+        }
+
+advance:
+        file->fd_pos += n;
+        if (file->fd_pos > inode->i_size) {
+            inode->i_size = file->fd_pos;
+        }
+        src += n;
+        bytes_written += n;
+    }
+
+    // 与缓冲写一样同步元数据，新分配的块和 i_size 都要落到 inode 上
+    sb->s_op->write_inode(inode);
+    ext2_sync_gdt(sb);
+    sb->s_op->write_super(sb);
+
+    if (io_buf) kfree(io_buf);
+    if (bytes_written == 0 && ret < 0) {
+        return ret;
+    }
+    return bytes_written;
+}
+
 static int32_t ext2_file_write(struct inode* inode, struct file* file,char* buf,int32_t count) {
     ASSERT(inode == file->fd_inode);
+    if (file->fd_flag & O_DIRECT) {
+        return ext2_file_direct_write(inode, file, buf, count);
+    }
     struct super_block* sb = inode->i_sb;
     struct partition* part = get_part_by_rdev(inode->i_dev);
     uint32_t block_size = sb->s_block_size;
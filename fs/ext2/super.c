@@ -9,6 +9,7 @@
 #include <unitype.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 
 static struct super_block * ext2_read_super(struct super_block *sb, void *data UNUSED, int silent) {
 
@@ -53,6 +54,14 @@ static struct super_block * ext2_read_super(struct super_block *sb, void *data U
     sb->s_magic = raw->s_magic;
     sb->s_root_ino = 2; // Ext2 根目录固定为 Inode 2
 
+    // 让 ide 缓存以文件系统块为单位缓存该分区，一个 ext2 块只对应一个 buffer_head
+    // 分区上还有块被别人引用（比如正在通过设备文件读写）时返回 -EBUSY
+    int32_t err = set_blocksize(part, sb->s_block_size);
+    if (err < 0) {
+        if (!silent && err != -EBUSY) printk("VFS: unsupported ext2 block size %d\n", sb->s_block_size);
+        return NULL;
+    }
+
     // 缓存块组描述符表 (GDT)
     // 计算 GDT 总字节大小
     uint32_t gdt_size = sb->ext2_info.group_desc_cnt * sizeof(struct ext2_group_desc);
@@ -122,7 +131,11 @@ static void ext2_read_inode(struct inode* inode) {
     uint32_t off_in_sec = byte_offset % SECTOR_SIZE;
 
     struct buffer_head* bh = bread(part, sec_lba);
-    char* inode_buf = (char*) bh->b_data;
+    if (bh == NULL) {
+        printk("ext2_read_inode: can't read inode %d\n", i_no);
+        return;
+    }
+    char* inode_buf = (char*) bh_sector_data(bh, PART_LBA(part, sec_lba));
 
     // 读取磁盘数据
     // char* inode_buf = (char*)kmalloc(SECTOR_SIZE);
@@ -203,7 +216,11 @@ static void ext2_write_inode(struct inode* inode) {
     uint32_t off_in_sec = byte_offset % SECTOR_SIZE;
 
     struct buffer_head* bh = bread(part, sec_lba);
-    char* io_buf = (char*) bh->b_data;
+    if (bh == NULL) {
+        printk("ext2_write_inode: can't read inode %d\n", i_no);
+        return;
+    }
+    char* io_buf = (char*) bh_sector_data(bh, PART_LBA(part, sec_lba));
 
     // Read-Modify-Write (RMW) 过程
     // 即使 Ext2 不会跨扇区（因为 ext2 的 inode 的大小是128或者256，不会跨扇区）
@@ -277,6 +294,8 @@ static void ext2_write_super(struct super_block *sb) {
 }
 
 static void ext2_put_super(struct super_block *sb) {
+    // 卸载后分区恢复按扇区缓存，顺便把该分区残留的脏块刷回磁盘
+    set_blocksize(get_part_by_rdev(sb->s_dev), SECTOR_SIZE);
     if (sb->ext2_info.group_desc) {
         kfree(sb->ext2_info.group_desc);
         sb->ext2_info.group_desc = NULL;
@@ -324,9 +343,74 @@ void ext2_sync_gdt(struct super_block *sb) {
     partition_write(part, gdt_lba, ext2_info->group_desc, DIV_ROUND_UP(gdt_size, SECTOR_SIZE));
 }
 
+// 递归写回间接块 phys_block 以及它下面的各级间接块，level 为该块的间接层数
+// 一级间接块下面挂的是数据块，数据块由 fsync 按 extent 写回，这里不再读它
+static int32_t ext2_sync_indirect(struct super_block *sb, uint32_t phys_block, uint8_t level) {
+    if (phys_block == 0) return 0;
+
+    struct partition *part = get_part_by_rdev(sb->s_dev);
+    uint32_t bsize = sb->s_block_size;
+    uint32_t pnts = bsize / 4;
+
+    bflush(part, PART_LBA(part, BLOCK_TO_SECTOR(sb, phys_block)), bsize / SECTOR_SIZE);
+    if (level == 1) return 0;
+
+    uint32_t *buf = kmalloc(bsize);
+    if (!buf) return -ENOMEM;
+
+    int32_t err = partition_read(part, BLOCK_TO_SECTOR(sb, phys_block), buf, bsize / SECTOR_SIZE);
+    if (err < 0) goto out;
+
+    for (uint32_t i = 0; i < pnts; i++) {
+        err = ext2_sync_indirect(sb, buf[i], level - 1);
+        if (err < 0) goto out;
+    }
+    err = 0;
+out:
+    kfree(buf);
+    return err;
+}
+
+// fsync 用，写回该 inode 自己的元数据
+// inode 所在扇区和它的各级间接块是精确定位的
+// 位图则要写回所有块组的：截断释放掉的块已经不在 i_block 里了，没法从 inode 反查它们属于哪个组
+// bflush 只写缓存里脏的块，其他块组的位图没被改过就不会产生 I/O
+static int32_t ext2_sync_inode(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct ext2_sb_info *ext2_info = &sb->ext2_info;
+    struct partition *part = get_part_by_rdev(sb->s_dev);
+    uint32_t sects_per_block = sb->s_block_size / SECTOR_SIZE;
+
+    // inode 所在扇区，计算方式同 ext2_write_inode
+    uint32_t group = (inode->i_no - 1) / ext2_info->sb_raw.s_inodes_per_group;
+    uint32_t index = (inode->i_no - 1) % ext2_info->sb_raw.s_inodes_per_group;
+    uint32_t sec_lba = BLOCK_TO_SECTOR(sb, ext2_info->group_desc[group].bg_inode_table)
+                     + index * sizeof(struct ext2_inode) / SECTOR_SIZE;
+    bflush(part, PART_LBA(part, sec_lba), 1);
+
+    // i_block[12..14] 分别是一、二、三级间接块
+    for (uint8_t level = 1; level <= 3; level++) {
+        int32_t err = ext2_sync_indirect(sb, inode->ext2_i.i_block[11 + level], level);
+        if (err < 0) return err;
+    }
+
+    for (uint32_t g = 0; g < ext2_info->group_desc_cnt; g++) {
+        bflush(part, PART_LBA(part, BLOCK_TO_SECTOR(sb, ext2_info->group_desc[g].bg_block_bitmap)), sects_per_block);
+        bflush(part, PART_LBA(part, BLOCK_TO_SECTOR(sb, ext2_info->group_desc[g].bg_inode_bitmap)), sects_per_block);
+    }
+
+    // 块组描述符和超级块里的空闲计数，位置同 ext2_sync_gdt 和 ext2_write_super
+    uint32_t gdt_block = (sb->s_block_size == 1024) ? 2 : 1;
+    uint32_t gdt_size = ext2_info->group_desc_cnt * sizeof(struct ext2_group_desc);
+    bflush(part, PART_LBA(part, BLOCK_TO_SECTOR(sb, gdt_block)), DIV_ROUND_UP(gdt_size, SECTOR_SIZE));
+    bflush(part, PART_LBA(part, 2), 2);
+    return 0;
+}
+
 struct super_operations ext2_super_ops = {
     .read_inode  = ext2_read_inode,
     .write_inode = ext2_write_inode, 
+    .sync_inode  = ext2_sync_inode,
     .put_inode   = NULL, // 我们使用直写式缓存，不做延迟写，所以此处为NULL
     .put_super   = ext2_put_super,
     .write_super = ext2_write_super,
@@ -8,6 +8,7 @@
 #include <fifo.h>
 #include <tty.h>
 #include <ide.h>
+#include <ide_buffer.h>
 #include <sifs_file.h>
 #include <device.h>
 #include <debug.h>
@@ -159,3 +160,182 @@ int32_t file_mmap(struct file* file, uint32_t addr, uint32_t len, uint32_t prot,
 	update_time(file->fd_inode, ATIME);
     return file->f_op->mmap(file->fd_inode, file, addr, len, prot, flags, offset);
 }
+
+typedef void (*extent_handler)(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+
+// 把文件区间 [offset, offset + len) 映射成分区上物理连续的扇区段，对每一段调用 fn（lba 是绝对地址）
+// 块设备文件的映射是恒等的；普通文件通过 bmap 逐块查找，块大小就是分区的缓存块大小
+// 挂载时 set_blocksize 已经让它与文件系统的块大小一致了
+// 文件系统没有实现 bmap 时直接跳过，空洞也直接跳过
+static void file_for_each_extent(struct file* file, uint32_t offset, uint32_t len, extent_handler fn) {
+	struct inode* inode = file->fd_inode;
+	if (len == 0) return;
+
+	if (inode->i_type == FT_BLOCK_SPECIAL) {
+		struct partition* part = get_part_by_rdev(inode->i_rdev);
+		if (part == NULL || offset >= part->sec_cnt * SECTOR_SIZE) return;
+		uint32_t start = offset / SECTOR_SIZE;
+		uint32_t end = DIV_ROUND_UP(offset + len, SECTOR_SIZE);
+		if (end > part->sec_cnt) end = part->sec_cnt;
+		fn(part, PART_LBA(part, start), end - start);
+		return;
+	}
+
+	if (inode->i_type != FT_REGULAR || inode->i_op == NULL || inode->i_op->bmap == NULL) return;
+	struct partition* part = get_part_by_rdev(inode->i_dev);
+	if (part == NULL) return;
+	uint32_t blk_size = part->blk_size;
+	uint32_t spb = blk_size / SECTOR_SIZE;
+	uint32_t blk_idx = offset / blk_size;
+	uint32_t end_idx = DIV_ROUND_UP(offset + len, blk_size);
+
+	// 合并物理上连续的块，[run_start, run_start + run_len) 是当前这一段的物理块号
+	uint32_t run_start = 0, run_len = 0;
+	for (; blk_idx < end_idx; blk_idx++) {
+		uint32_t phys = (uint32_t)inode->i_op->bmap(inode, blk_idx);
+		if (run_len != 0 && phys == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len != 0) {
+			fn(part, PART_LBA(part, run_start * spb), run_len * spb);
+		}
+		run_start = phys;
+		run_len = (phys != 0);
+	}
+	if (run_len != 0) {
+		fn(part, PART_LBA(part, run_start * spb), run_len * spb);
+	}
+}
+
+// 文件的可读范围，普通文件是 i_size，块设备是分区大小
+static uint32_t file_readable_size(struct inode* inode) {
+	if (inode->i_type == FT_BLOCK_SPECIAL) {
+		struct partition* part = get_part_by_rdev(inode->i_rdev);
+		return part == NULL ? 0 : part->sec_cnt * SECTOR_SIZE;
+	}
+	return inode->i_size;
+}
+
+// 流式读的 drop-behind
+// 顺序读超过 DROP_BEHIND_SIZE 或者设置了 POSIX_FADV_NOREUSE 时，读过的数据很可能不会再被用到
+// 把已经整块读完的部分挪到缓存替换策略的冷端，下一次腾空间时先淘汰它们，而不是挤掉其他进程的热数据
+// 缓存块最大 4KB，只处理按 PG_SIZE 对齐的部分就不会动到末尾只读了一半的块，读到文件末尾时例外
+static void file_drop_behind(struct file* file, uint32_t pos, uint32_t end) {
+	struct file_ra_state* ra = &file->f_ra;
+	if (ra->advice != POSIX_FADV_NOREUSE && ra->seq_bytes < DROP_BEHIND_SIZE) return;
+
+	uint32_t start = pos & ~(PG_SIZE - 1);
+	uint32_t stop = end >= file_readable_size(file->fd_inode) ? end : (end & ~(PG_SIZE - 1));
+	if (start < stop) {
+		file_for_each_extent(file, start, stop - start, bdemote);
+	}
+}
+
+// 在一次成功读取 [pos, pos + count) 之后调用，维护预读窗口并提交异步预读
+// 本次从上一次读完的位置接着读，就认为是顺序读，预读窗口从 RA_INIT_SIZE 开始每次翻倍，直到 RA_MAX_SIZE
+// 否则认为是随机读，窗口清零
+// 为了不在每次小读取时都提交一个很小的预读请求，只有当已经预读的部分剩下不到半个窗口时，才一次性补满整个窗口
+void file_readahead(struct file* file, uint32_t pos, uint32_t count) {
+	struct file_ra_state* ra = &file->f_ra;
+	uint32_t end = pos + count;
+	bool sequential = (pos == ra->prev_pos);
+	ra->prev_pos = end;
+	ra->seq_bytes = sequential ? ra->seq_bytes + count : count;
+	file_drop_behind(file, pos, end);
+
+	if (ra->advice == POSIX_FADV_RANDOM || count == 0) return;
+	if (!sequential) {
+		ra->size = 0;
+		ra->ra_end = 0;
+		return;
+	}
+
+	if (ra->advice == POSIX_FADV_SEQUENTIAL) {
+		ra->size = RA_MAX_SIZE;
+	} else if (ra->size == 0) {
+		ra->size = RA_INIT_SIZE;
+	} else if (ra->size < RA_MAX_SIZE) {
+		ra->size *= 2;
+	}
+
+	if (ra->ra_end > end && ra->ra_end - end >= ra->size / 2) return;
+
+	uint32_t start = ra->ra_end > end ? ra->ra_end : end;
+	uint32_t target = end + ra->size;
+	uint32_t limit = file_readable_size(file->fd_inode);
+	if (target > limit) target = limit;
+	if (start >= target) return;
+	ra->ra_end = target;
+	file_for_each_extent(file, start, target - start, breada);
+}
+
+// posix_fadvise 的实现，提示不影响正确性，所以不支持的文件类型直接忽略
+// len 为 0 表示一直到文件末尾
+int32_t file_fadvise(struct file* file, uint32_t offset, uint32_t len, uint32_t advice) {
+	struct file_ra_state* ra = &file->f_ra;
+	if (len == 0) {
+		uint32_t size = file_readable_size(file->fd_inode);
+		len = size > offset ? size - offset : 0;
+	}
+
+	switch (advice) {
+		case POSIX_FADV_NORMAL:
+		case POSIX_FADV_RANDOM:
+		case POSIX_FADV_SEQUENTIAL:
+			ra->advice = advice;
+			ra->size = 0;
+			ra->ra_end = 0;
+			return 0;
+		case POSIX_FADV_WILLNEED:
+			file_for_each_extent(file, offset, len, breada);
+			return 0;
+		case POSIX_FADV_DONTNEED:
+			// 只丢弃干净的块，脏块还是交给 sync 线程去写回
+			file_for_each_extent(file, offset, len, bdrop);
+			return 0;
+		case POSIX_FADV_NOREUSE:
+			// 之后读过的块都挪到缓存的冷端，见 file_drop_behind
+			ra->advice = advice;
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
+// fsync/fdatasync 的实现，返回时文件的数据（fsync 还包括元数据）已经持久化到磁盘上
+// 先同步写回文件的数据块，再发一次 FLUSH CACHE 让磁盘把写缓存写到盘片上
+// inode 每次修改后都已经写进了缓存，但 inode、间接块、位图、组描述符散落在分区各处
+// 缓存层并不知道哪些元数据块属于这个文件，由文件系统的 sync_inode 逐个写回，分区里其他文件的脏块不受影响
+// fdatasync 只有在文件大小变了的时候才写回元数据，否则之后读不到新追加的数据
+int32_t file_fsync(struct file* file, bool datasync) {
+	struct inode* inode = file->fd_inode;
+	struct partition* part;
+
+	if (inode->i_type == FT_BLOCK_SPECIAL) {
+		// 块设备没有元数据，写回整个分区就够了
+		part = get_part_by_rdev(inode->i_rdev);
+		if (part == NULL) return -ENODEV;
+		bflush(part, part->start_lba, part->sec_cnt);
+	} else if (inode->i_type == FT_REGULAR || inode->i_type == FT_DIRECTORY) {
+		part = get_part_by_rdev(inode->i_dev);
+		if (part == NULL) return -EINVAL;
+		file_for_each_extent(file, 0, inode->i_size, bflush);
+		// 目录的内容就是元数据
+		if (!datasync || inode->i_type == FT_DIRECTORY || inode->i_synced_size != inode->i_size) {
+			struct super_operations* s_op = inode->i_sb->s_op;
+			if (s_op->sync_inode != NULL) {
+				int32_t err = s_op->sync_inode(inode);
+				if (err < 0) return err;
+			} else {
+				bflush(part, part->start_lba, part->sec_cnt);
+			}
+			inode->i_synced_size = inode->i_size;
+		}
+	} else {
+		return -EINVAL;
+	}
+
+	// 写回出错时数据没有落盘，要报告给调用者
+	return bflush_cache(part->my_disk);
+}
@@ -145,44 +145,40 @@ void filesys_init() {
     register_filesystem(&sifs_fs_type);
     register_filesystem(&ext2_fs_type);
 
-    uint8_t channel_no = 0, dev_no = 0;
     bool first_flag = true;
     char default_part[MAX_DISK_NAME_LEN] = {0};
 
     printk("Searching filesystem......\n");
     // 检查第一个有效分区里面是否有文件系统
     // 有就用，没有就为其初始化一个sifs文件系统
-    while (channel_no < channel_cnt) {
-        dev_no = 0;
-        while (dev_no < 2) {
-            struct disk* hd = &channels[channel_no].devices[dev_no];
-            if (!hd->name[0]) { dev_no++; continue; } 
-
-            struct partition* part = hd->prim_parts;
-            uint8_t part_idx = 0;
-            while (part_idx < 12) {
-                if (part_idx == 4) part = hd->logic_parts;
-                // 如果一个分区的扇区数为0，那么它就是个无效的扇区，跳过
-                if (part->sec_cnt != 0) {
-
-                    if(has_fs(part)==-1){
-                        printk("Formatting %s's partition %s ......\n", hd->name, part->name);
-                        sifs_format(part);
-                    }
-                    // 记录第一个有效分区的名字，准备挂载
-                    if (first_flag) {
-                        strcpy(default_part, part->name);
-                        first_flag = false;
-                    }
-                    // 我们只默认格式化识别到的第一个分区
-                    goto mnt;
+    // ide 磁盘排在 disk_list 的前面，其他驱动发现的磁盘不会抢走原来的根分区
+    struct dlist_elem* disk_elem = disk_list.head.next;
+    while (disk_elem != &disk_list.tail) {
+        struct disk* hd = member_to_entry(struct disk, disk_tag, disk_elem);
+
+        struct partition* part = hd->prim_parts;
+        uint8_t part_idx = 0;
+        while (part_idx < 12) {
+            if (part_idx == 4) part = hd->logic_parts;
+            // 如果一个分区的扇区数为0，那么它就是个无效的扇区，跳过
+            if (part->sec_cnt != 0) {
+
+                if(has_fs(part)==-1){
+                    printk("Formatting %s's partition %s ......\n", hd->name, part->name);
+                    sifs_format(part);
+                }
+                // 记录第一个有效分区的名字，准备挂载
+                if (first_flag) {
+                    strcpy(default_part, part->name);
+                    first_flag = false;
                 }
-                part_idx++;
-                part++;
+                // 我们只默认格式化识别到的第一个分区
+                goto mnt;
             }
-            dev_no++;
+            part_idx++;
+            part++;
         }
-        channel_no++;
+        disk_elem = disk_elem->next;
     }
 
 mnt:
@@ -278,6 +274,18 @@ int32_t sys_open(const char* _pathname,int32_t flags){
 		return -ENOENT;
 	}
 
+    // 只有块设备和 ext2 的普通文件实现了直接 io，其他文件带 O_DIRECT 打开直接报错
+    // 要在创建和截断之前检查，否则返回错误时文件已经被建出来或者被清空了
+    // 新建的文件是父目录所在文件系统里的普通文件
+    if (flags & O_DIRECT) {
+        enum file_types type = found ? searched_record.file_type : FT_REGULAR;
+        bool on_ext2 = searched_record.parent_inode->i_sb->s_magic == EXT2_MAGIC_NUMBER;
+        if (type != FT_BLOCK_SPECIAL && !(type == FT_REGULAR && on_ext2)) {
+            inode_close(searched_record.parent_inode);
+            return -EINVAL;
+        }
+    }
+
     int32_t final_inode_no = -1;
 
     // 只有在文件真的不存在 且 要求创建时才走创建分支
@@ -502,7 +510,13 @@ int32_t sys_read(int32_t fd, void* buf, uint32_t count) {
         // atime 的修改通常只停留在内存中，
         // 等到 inode 周期性同步或者文件关闭时再写回磁盘。
         update_time(inode,ATIME);
-        return rd_file->f_op->read(rd_file->fd_inode,rd_file,buf,count);
+        uint32_t pos = rd_file->fd_pos;
+        int32_t ret = rd_file->f_op->read(rd_file->fd_inode,rd_file,buf,count);
+        // 普通文件和块设备在读完后根据访问模式提交异步预读
+        if (ret > 0 && (type == FT_REGULAR || type == FT_BLOCK_SPECIAL)) {
+            file_readahead(rd_file, pos, ret);
+        }
+        return ret;
     }else{
         printk("sys_write: type %x cannot write!\n", type);
         return -EINVAL;
@@ -1436,17 +1450,14 @@ void make_dev_nodes(void) {
     sys_symlink(target, "/dev/tty");
 
     // 动态创建磁盘母盘节点 (sda, sdb...)
-	uint8_t c,d;
-    for (c = 0; c < channel_cnt; c++) {
-        for (d = 0; d < DISK_NUM_IN_CHANNEL; d++) {
-            struct disk* hd = &channels[c].devices[d];
-            if (hd->my_channel != NULL && hd->dev_no < 2) { 
-                char dev_name[32];
-                sprintf(dev_name,"/dev/%s", hd->name);
-                sys_mknod(dev_name, FT_BLOCK_SPECIAL, hd->i_rdev);
-				printk("/dev/%s rdev: %x\n",hd->name,hd->i_rdev);
-            }
-        }
+    struct dlist_elem* disk_elem = disk_list.head.next;
+    while (disk_elem != &disk_list.tail) {
+        struct disk* hd = member_to_entry(struct disk, disk_tag, disk_elem);
+        char dev_name[32];
+        sprintf(dev_name,"/dev/%s", hd->name);
+        sys_mknod(dev_name, FT_BLOCK_SPECIAL, hd->i_rdev);
+		printk("/dev/%s rdev: %x\n",hd->name,hd->i_rdev);
+        disk_elem = disk_elem->next;
     }
 
     // 遍历分区链表，创建分区节点 (sda1, sda5...)
@@ -1630,102 +1641,91 @@ static int32_t probe_fs_unmounted(struct partition* part, struct statfs* st) {
     return -1;
 }
 
-void sys_disk_info() {
-    uint8_t channel_idx;
-    printk("disk number: %d\n", disk_num);
-
-    // 磁盘容量单位预处理，打印磁盘的总览信息
-    char** granulars = kmalloc(sizeof(char*) * disk_num);
-    uint8_t* div_cnts = kmalloc(sizeof(uint8_t) * disk_num);
-    ASSERT(granulars!=NULL);
-    ASSERT(div_cnts!=NULL);
-    memset(div_cnts, 0, disk_num);
-    char* units[] = {"B", "KB", "MB", "GB", "TB"};
-    for (int i = 0; i < disk_num; i++) {
-        uint32_t temp_size = disk_size[i];
-        while (temp_size >= 1024) {
-            temp_size /= 1024;
-            div_cnts[i]++;
-        }
-        granulars[i] = (div_cnts[i] < 5) ? units[div_cnts[i]] : "OVR!";
+// 把磁盘容量换算成合适的单位，扇区数乘以 512 可能超出 32 位，所以从 KB 开始算
+static const char* disk_capacity(struct disk* hd, uint32_t* size) {
+    static char* units[] = {"KB", "MB", "GB", "TB"};
+    uint32_t unit_idx = 0;
+    *size = hd->total_sectors / 2;
+    while (*size >= 1024 && unit_idx < 3) {
+        *size /= 1024;
+        unit_idx++;
     }
+    return units[unit_idx];
+}
+
+void sys_disk_info() {
+    printk("disk number: %d\n", dlist_len(&disk_list));
 
     // 打印磁盘基本容量
-    for (channel_idx = 0; channel_idx < CHANNEL_NUM; channel_idx++) {
-        for (uint8_t ide_idx = 0; ide_idx < DEVICE_NUM_PER_CHANNEL; ide_idx++) {
-            struct disk* hd = &channels[channel_idx].devices[ide_idx];
-            if (!hd->name[0]) continue;
-            uint8_t d_idx = channel_idx * DISK_NUM_IN_CHANNEL + ide_idx;
-            uint32_t display_size = disk_size[d_idx];
-            for(int j=0; j < div_cnts[d_idx]; j++) display_size /= 1024;
-            printk("%s\t%d%s\n", hd->name, display_size, granulars[d_idx]);
-        }
+    struct dlist_elem* disk_elem = disk_list.head.next;
+    while (disk_elem != &disk_list.tail) {
+        struct disk* hd = member_to_entry(struct disk, disk_tag, disk_elem);
+        uint32_t display_size;
+        const char* granular = disk_capacity(hd, &display_size);
+        printk("%s\t%d%s\n", hd->name, display_size, granular);
+        disk_elem = disk_elem->next;
     }
 
     printk("partition\tformat\t512B-blocks\tused\tavailable\n");
 
     // 遍历硬件结构体打印详细信息
-    for (channel_idx = 0; channel_idx < CHANNEL_NUM; channel_idx++) {
-        for (uint8_t device_idx = 0; device_idx < DEVICE_NUM_PER_CHANNEL; device_idx++) {
-            struct disk* hd = &channels[channel_idx].devices[device_idx];
-            if (!hd->name[0]) continue;
-
-            // 检查该磁盘是否有分区
-            bool has_partition = false;
-            for (uint8_t i = 0; i < PRIM_PARTS_NUM; i++) {
-                if (hd->prim_parts[i].name[0]) { has_partition = true; break; }
-            }
-
-            if (has_partition) {
-                for (int type = 0; type < 2; type++) {
-                    int limit = (type == 0) ? PRIM_PARTS_NUM : LOGIC_PARTS_NUM;
-                    for (int p_idx = 0; p_idx < limit; p_idx++) {
-                        struct partition* part = (type == 0) ? &hd->prim_parts[p_idx] : &hd->logic_parts[p_idx];
-                        if (!part->name[0]) continue;
-
-                        struct statfs st = {0};
-                        bool fs_ready = false;
+    disk_elem = disk_list.head.next;
+    while (disk_elem != &disk_list.tail) {
+        struct disk* hd = member_to_entry(struct disk, disk_tag, disk_elem);
+        disk_elem = disk_elem->next;
+
+        // 检查该磁盘是否有分区
+        bool has_partition = false;
+        for (uint8_t i = 0; i < PRIM_PARTS_NUM; i++) {
+            if (hd->prim_parts[i].name[0]) { has_partition = true; break; }
+        }
 
-                        if (part->sb != NULL && part->sb->s_op && part->sb->s_op->statfs) {
-                            //  已挂载，直接调用 VFS 接口
-                            part->sb->s_op->statfs(part->sb, &st);
+        if (has_partition) {
+            for (int type = 0; type < 2; type++) {
+                int limit = (type == 0) ? PRIM_PARTS_NUM : LOGIC_PARTS_NUM;
+                for (int p_idx = 0; p_idx < limit; p_idx++) {
+                    struct partition* part = (type == 0) ? &hd->prim_parts[p_idx] : &hd->logic_parts[p_idx];
+                    if (!part->name[0]) continue;
+
+                    struct statfs st = {0};
+                    bool fs_ready = false;
+
+                    if (part->sb != NULL && part->sb->s_op && part->sb->s_op->statfs) {
+                        //  已挂载，直接调用 VFS 接口
+                        part->sb->s_op->statfs(part->sb, &st);
+                        fs_ready = true;
+                    } else {
+                        // 未挂载，尝试手动识别超级块
+                        if (probe_fs_unmounted(part, &st) == 0) {
                             fs_ready = true;
-                        } else {
-                            // 未挂载，尝试手动识别超级块
-                            if (probe_fs_unmounted(part, &st) == 0) {
-                                fs_ready = true;
-                            }
                         }
+                    }
 
-                        if (!fs_ready) {
-                            printk("%s(%c)\t-\t-\t-\t-\n", part->name, (type == 0 ? 'P' : 'L'));
-                        } else {
-                            // 统一计算（此处我们将所有单位统一转化为 512B 块进行显示）
-                            uint32_t ratio = st.f_bsize / 512;
-                            uint32_t total_512 = st.f_blocks * ratio;
-                            uint32_t free_512 = st.f_bfree * ratio;
-                            uint32_t used_512 = total_512 - free_512;
-
-                            char root_flag = ' ';
-                            if (root_part != NULL && !strcmp(root_part->name, part->name)) root_flag = '*';
-
-                            printk("%s(%c)%c\t%x\t%d\t%d\t%d\n", 
-                                   part->name, (type == 0 ? 'P' : 'L'), root_flag,
-                                   st.f_type, total_512, used_512, free_512);
-                        }
+                    if (!fs_ready) {
+                        printk("%s(%c)\t-\t-\t-\t-\n", part->name, (type == 0 ? 'P' : 'L'));
+                    } else {
+                        // 统一计算（此处我们将所有单位统一转化为 512B 块进行显示）
+                        uint32_t ratio = st.f_bsize / 512;
+                        uint32_t total_512 = st.f_blocks * ratio;
+                        uint32_t free_512 = st.f_bfree * ratio;
+                        uint32_t used_512 = total_512 - free_512;
+
+                        char root_flag = ' ';
+                        if (root_part != NULL && !strcmp(root_part->name, part->name)) root_flag = '*';
+
+                        printk("%s(%c)%c\t%x\t%d\t%d\t%d\n", 
+                               part->name, (type == 0 ? 'P' : 'L'), root_flag,
+                               st.f_type, total_512, used_512, free_512);
                     }
                 }
-            } else {
-                // Raw Disk 处理
-                uint8_t d_idx = channel_idx * DISK_NUM_IN_CHANNEL + device_idx;
-                uint32_t d_size = disk_size[d_idx];
-                for(int j=0; j < div_cnts[d_idx]; j++) d_size /= 1024;
-                printk("%s(R)\t-\t-\t-\t%d%s\n", hd->name, d_size, granulars[d_idx]);
             }
+        } else {
+            // Raw Disk 处理
+            uint32_t d_size;
+            const char* granular = disk_capacity(hd, &d_size);
+            printk("%s(R)\t-\t-\t-\t%d%s\n", hd->name, d_size, granular);
         }
     }
-    kfree(granulars);
-    kfree(div_cnts);
 }
 
 int32_t sys_symlink(const char* target, const char* linkpath) {
@@ -1981,6 +1981,39 @@ int32_t sys_ftruncate(int32_t fd, int32_t length) {
     return do_truncate(inode, length);
 }
 
+// 文件访问模式提示，具体的处理见 file_fadvise
+int32_t sys_fadvise(int32_t fd, uint32_t offset, uint32_t len, uint32_t advice) {
+    struct task_struct* cur = get_running_task_struct();
+    if (fd < 0 || fd >= MAX_FILES_OPEN_PER_PROC || cur->file_table->fd_table[fd].global_fd_idx == -1) {
+        return -EBADF;
+    }
+    struct file* f = &file_table[cur->file_table->fd_table[fd].global_fd_idx];
+    enum file_types type = f->fd_inode->i_type;
+    if (type == FT_PIPE || type == FT_FIFO) {
+        return -ESPIPE;
+    }
+    return file_fadvise(f, offset, len, advice);
+}
+
+static int32_t do_fsync(int32_t fd, bool datasync) {
+    struct task_struct* cur = get_running_task_struct();
+    if (fd < 0 || fd >= MAX_FILES_OPEN_PER_PROC || cur->file_table->fd_table[fd].global_fd_idx == -1) {
+        return -EBADF;
+    }
+    struct file* f = &file_table[cur->file_table->fd_table[fd].global_fd_idx];
+    return file_fsync(f, datasync);
+}
+
+// 把文件的数据和元数据写到磁盘上，写完才返回
+int32_t sys_fsync(int32_t fd) {
+    return do_fsync(fd, false);
+}
+
+// 只保证数据落盘，文件大小没变时不写回元数据
+int32_t sys_fdatasync(int32_t fd) {
+    return do_fsync(fd, true);
+}
+
 int32_t sys_link(const char* _oldpath, const char* _newpath) {
     if (_oldpath == NULL || _newpath == NULL) return -EFAULT;
 
@@ -2076,11 +2109,11 @@ int32_t sys_swapon(const char* _pathname){
         return -EINVAL;
     }
     part = get_part_by_rdev(inode->i_rdev);
-    do_swapon(part);
-    printk("swap on partition %s done!\n",part->name);
+    int32_t err = do_swapon(part);
+    if (err == 0) printk("swap on partition %s done!\n",part->name);
     inode_close(inode);
     inode_close(record.parent_inode);
-    return 0;
+    return err;
 }
 
 int32_t sys_swapoff(const char* _pathname){
@@ -2111,9 +2144,9 @@ int32_t sys_swapoff(const char* _pathname){
         return -EINVAL;
     }
     part = get_part_by_rdev(inode->i_rdev);
-    do_swapoff(part);
-    printk("swap off partition %s done!\n",part->name);
+    int32_t err = do_swapoff(part);
+    if (err == 0) printk("swap off partition %s done!\n",part->name);
     inode_close(inode);
     inode_close(record.parent_inode);
-    return 0;
+    return err;
 }
\ No newline at end of file
@@ -45,6 +45,12 @@ static uint32_t inode_hash(void* arg) {
     return val * HASH_GOLDEN_RATIO_32;
 }
 
+static uint32_t inode_elem_hash(struct dlist_elem* pelem) {
+    struct inode* i = member_to_entry(struct inode, hash_tag, pelem);
+    struct inode_key ik = {i->i_dev, i->i_no};
+    return inode_hash(&ik);
+}
+
 // 匹配条件，用于处理同一个 bucket 中的冲突项
 static bool inode_condition(struct dlist_elem* pelem, void* arg) {
     struct inode_key* ik = (struct inode_key*)arg;
@@ -106,21 +112,22 @@ void inode_cache_init() {
 
     lock_init(&inode_global_cache.lock);
     
-    hash_init(&inode_global_cache.hash_table, BUCKET_NR, inode_hash, inode_condition);
+    hash_init(&inode_global_cache.hash_table, BUCKET_NR, inode_hash, inode_elem_hash, inode_condition);
     dlist_init(&inode_global_cache.lru_list);
 }
 
+// 调用者需要持有 inode_global_cache.lock 并且刚刚确认过这个 inode 不在缓存中
 int32_t inode_register_to_cache(struct inode* inode){
     lock_acquire(&inode_global_cache.lock);
 
     struct inode_key ik = {inode->i_dev, inode->i_no};
 
-    // 真正插入
-    hash_insert(&inode_global_cache.hash_table, &ik, &inode->hash_tag);
+    // 真正插入，调用者已经做过 double check，不需要再扫一遍桶去重
+    hash_add(&inode_global_cache.hash_table, &ik, &inode->hash_tag);
     dlist_push_back(&inode_global_cache.lru_list, &inode->lru_tag);
 
     // 检查是否溢出，若移除则要从lru中淘汰一个inode
-    if (inode_global_cache.hash_table.elem_nr > MAX_INODE_CACHE_SIZE) {
+    if (hash_elem_nr(&inode_global_cache.hash_table) > MAX_INODE_CACHE_SIZE) {
         // 从 LRU 队首开始找，直到找到一个可以被淘汰的（i_open_cnts == 0）
         struct dlist_elem* pelem = inode_global_cache.lru_list.head.next;
         while (pelem != &inode_global_cache.lru_list.tail) {
@@ -217,13 +217,6 @@ static int32_t sifs_file_read(struct inode* inode UNUSED, struct file* file,char
 			return -1;
 		}
 	}
-	uint8_t *io_buf = kmalloc(SIFS_BLOCK_SIZE);
-	
-	if(io_buf==NULL){
-		printk("file_read: kmalloc for io_buf failed!\n");
-		return -1;
-	} 
-	
 	uint32_t* all_blocks_addr = (uint32_t*)kmalloc(TOTAL_BLOCK_COUNT*ADDR_BYTES_32BIT);
 
 	// printk("file_read:::all_blocks_addr addr: %x\n",all_blocks_addr);
@@ -283,29 +276,46 @@ static int32_t sifs_file_read(struct inode* inode UNUSED, struct file* file,char
 		}
 	}
 
-	uint32_t sec_idx,sec_lba,sec_off_bytes,sec_left_bytes,chunk_size;
+	// sifs 的块就是一个扇区，分区的缓存块大小保持默认的 SECTOR_SIZE
+	// 因此每个缓存块正好对应一个 sifs 块，数据直接从缓存块拷到用户缓冲区
+	ASSERT(part->blk_size==SIFS_BLOCK_SIZE);
+	struct buffer_head* bhs[MAX_GANG_BLKS];
+	uint32_t sec_idx,sec_lba,sec_off_bytes,sec_cnt,span,chunk_size;
 	uint32_t bytes_read = 0;
 	while(bytes_read<size){
 		sec_idx = file->fd_pos/SIFS_BLOCK_SIZE;
 		sec_lba = all_blocks_addr[sec_idx];
 		sec_off_bytes = file->fd_pos%SIFS_BLOCK_SIZE;
-		sec_left_bytes = SIFS_BLOCK_SIZE-sec_off_bytes;
-		chunk_size = size_left<sec_left_bytes?size_left:sec_left_bytes;
 		ASSERT(sec_idx < TOTAL_BLOCK_COUNT);
-		memset(io_buf,0,SIFS_BLOCK_SIZE);
-		
-		partition_read(part,sec_lba,io_buf,1);
 
-		memcpy(buf_dst,io_buf+sec_off_bytes,chunk_size);
-		buf_dst+=chunk_size;
-		file->fd_pos+=chunk_size;
-		bytes_read+=chunk_size;
-		size_left-=chunk_size;
+		// 向后合并物理上连续的扇区，一次 gang 读全部拿到
+		sec_cnt = 1;
+		span = SIFS_BLOCK_SIZE-sec_off_bytes;
+		while(span<size_left&&sec_cnt<MAX_GANG_BLKS&&all_blocks_addr[sec_idx+sec_cnt]==sec_lba+sec_cnt){
+			span+=SIFS_BLOCK_SIZE;
+			sec_cnt++;
+		}
+
+		// 读出错时返回已经读到的部分，一点都没读到才报错
+		if(partition_bread_gang(part,sec_lba,sec_cnt,bhs)==0){
+			kfree(all_blocks_addr);
+			return bytes_read!=0?(int32_t)bytes_read:-EIO;
+		}
+		for(uint32_t i=0;i<sec_cnt;i++){
+			chunk_size = SIFS_BLOCK_SIZE-sec_off_bytes;
+			if(chunk_size>size_left) chunk_size = size_left;
+			memcpy(buf_dst,bhs[i]->b_data+sec_off_bytes,chunk_size);
+			sec_off_bytes = 0;
+			buf_dst+=chunk_size;
+			file->fd_pos+=chunk_size;
+			bytes_read+=chunk_size;
+			size_left-=chunk_size;
+		}
+		brelse_gang(bhs,sec_cnt);
 	}
 
 	
 	kfree(all_blocks_addr);
-	kfree(io_buf);
 
 	return bytes_read;
 }
@@ -483,6 +483,25 @@ static int32_t sifs_create(struct inode *dir, char *name, int len, int mode UNUS
     return inode_no; // 成功
 }
 
+// 逻辑块号转物理块号，sifs 的块就是一个扇区，返回的是分区内的相对 lba
+// 块不存在（空洞或超出文件最大块数）时返回 0
+static int32_t sifs_bmap(struct inode* inode, int32_t idx) {
+    if (idx < 0 || idx >= TOTAL_BLOCK_COUNT) return 0;
+    if (idx < DIRECT_INDEX_BLOCK) return inode->sifs_i.i_sectors[idx];
+
+    // 一级间接块，里面存放的是后续块的地址
+    uint32_t table_lba = inode->sifs_i.i_sectors[DIRECT_INDEX_BLOCK];
+    if (table_lba == 0) return 0;
+    struct partition* part = get_part_by_rdev(inode->i_dev);
+    struct buffer_head* bh = bread(part, table_lba);
+    // 间接块读不出来时当作块不存在
+    if (bh == NULL) return 0;
+    uint32_t* table = (uint32_t*)bh_sector_data(bh, PART_LBA(part, table_lba));
+    uint32_t addr = table[idx - DIRECT_INDEX_BLOCK];
+    brelse(bh);
+    return addr;
+}
+
 // 普通文件的 Inode 操作集
 struct inode_operations sifs_file_inode_operations = {
     .default_file_ops = &sifs_file_file_operations,
@@ -493,7 +512,7 @@ struct inode_operations sifs_file_inode_operations = {
     .rmdir      = NULL,
     .mknod      = NULL,
     .rename     = NULL,
-    .bmap       = NULL,      // 后期实现
+    .bmap       = sifs_bmap,
     .truncate   = NULL,
     .symlink    = NULL, 
     .readlink   = NULL,
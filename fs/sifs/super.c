@@ -399,10 +399,28 @@ void sifs_inode_delete(struct partition* part,uint32_t inode_no,void* io_buf){
 	
 }
 
+// fsync 用，写回该 inode 自己的元数据：inode 所在扇区、一级间接块和两张位图
+// 位图整张交给 bflush，释放掉的块已经不在 i_sectors 里了，只有被改过的脏扇区才会真的写盘
+static int32_t sifs_sync_inode(struct inode *inode){
+	struct partition* part = get_part_by_rdev(inode->i_dev);
+	struct sifs_super_block* sb_raw = &part->sb->sifs_info.sb_raw;
+	struct inode_position inode_pos;
+	inode_locate(part,inode->i_no,&inode_pos);
+
+	bflush(part,PART_LBA(part,inode_pos.sec_lba),inode_pos.two_sec?2:1);
+	if(inode->sifs_i.i_sectors[12]!=0){
+		bflush(part,PART_LBA(part,inode->sifs_i.i_sectors[12]),1);
+	}
+	bflush(part,PART_LBA(part,sb_raw->block_bitmap_lba),sb_raw->block_bitmap_sects);
+	bflush(part,PART_LBA(part,sb_raw->inode_bitmap_lba),sb_raw->inode_bitmap_sects);
+	return 0;
+}
+
 // 这些函数全都是通过sifs_super_ops导出的，因此全部声明成static
 struct super_operations sifs_super_ops = {
     .read_inode  = sifs_read_inode,
     .write_inode = sifs_write_inode, 
+    .sync_inode  = sifs_sync_inode,
     .put_inode   = NULL, // 由于我们采用强制同步的方式，没有延迟写，因此直接在write_inode中就做完所有操作了，暂时不需要put_inode
     .put_super   = sifs_put_super, // 对应释放位图内存的逻辑
     .write_super = NULL, // 我们sifs的super_block里面的字段都是初始化时直接填好的，之后不会再变，因此我们不需要同步内存超级块的操作
@@ -21,6 +21,7 @@
 #include <unitype.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <ide_buffer.h>
 
 // 基于 i386 Linux 0x80 中断的参数约定
 // 强制转换成 uint32_t 是为了防止在进行地址运算或逻辑判断时产生符号位扩展的意外。
@@ -302,7 +303,7 @@ static int32_t do_madvise(struct intr_stack* stack UNUSED){
 static int32_t do_open(struct intr_stack* stack){
     const char* path = (const char*)ARG1(stack);
     uint32_t linux_flags = ARG2(stack);
-    uint8_t kernel_flags = 0;
+    uint32_t kernel_flags = 0;
 
     // 转换读写模式 (Linux 的 RDONLY 是 0，必须特殊处理)
     uint32_t mode = linux_flags & 3; // 取低 2 位
@@ -316,6 +317,7 @@ static int32_t do_open(struct intr_stack* stack){
     if (linux_flags & 0x200) kernel_flags |= O_TRUNC;  // Linux 0x200 -> 16
     if (linux_flags & 0x400) kernel_flags |= O_APPEND; // Linux 0x400 -> 32
     if (linux_flags & 0x800)  kernel_flags |= O_NONBLOCK; // 
+    if (linux_flags & 0x4000) kernel_flags |= O_DIRECT; // Linux i386 的 O_DIRECT 是 040000
 
     return sys_open(path, kernel_flags);
 }
@@ -555,6 +557,7 @@ static int32_t do_fcntl(struct intr_stack* stack) {
             if (kflags & O_NONBLOCK) linux_flags |= 0x800;
             if (kflags & O_CREATE)   linux_flags |= 0x40;
             if (kflags & O_TRUNC)    linux_flags |= 0x200;
+            if (kflags & O_DIRECT)   linux_flags |= 0x4000;
 
             return (int32_t)linux_flags;
         }
@@ -790,6 +793,29 @@ static int32_t do_ftruncate64(struct intr_stack* stack) {
     return sys_ftruncate(fd, (int32_t)length);   
 }
 
+// musl 的 posix_fadvise 在 i386 上走 fadvise64_64
+// ebx: fd, ecx/edx: offset 的低/高 32 位, esi/edi: len 的低/高 32 位, ebp: advice
+// 我们的文件大小都在 32 位以内，高 32 位直接忽略
+static int32_t do_fadvise64_64(struct intr_stack* stack) {
+    return sys_fadvise((int32_t)ARG1(stack),
+                        (uint32_t)ARG2(stack),
+                        (uint32_t)ARG4(stack),
+                        (uint32_t)ARG6(stack));
+}
+
+static int32_t do_fsync(struct intr_stack* stack) {
+    return sys_fsync((int32_t)ARG1(stack));
+}
+
+static int32_t do_fdatasync(struct intr_stack* stack) {
+    return sys_fdatasync((int32_t)ARG1(stack));
+}
+
+static int32_t do_sync(struct intr_stack* stack UNUSED) {
+    sys_sync();
+    return 0;
+}
+
 void musl_syscall_intrcpt_init(){
     for (int i = 0; i < NR_syscalls; i++) {
         musl_syscall_table[i] = do_default;
@@ -845,6 +871,10 @@ void musl_syscall_intrcpt_init(){
     musl_syscall_table[__NR_rename] = do_rename;
     musl_syscall_table[__NR_truncate64] = do_truncate64;
     musl_syscall_table[__NR_ftruncate64] = do_ftruncate64;
+    musl_syscall_table[__NR_fadvise64_64] = do_fadvise64_64;
+    musl_syscall_table[__NR_fsync] = do_fsync;
+    musl_syscall_table[__NR_fdatasync] = do_fdatasync;
+    musl_syscall_table[__NR_sync] = do_sync;
 }
 
 // 根据 i386 Linux ABI:
@@ -0,0 +1,193 @@
+#ifndef __INCLUDE_MAGICBOX_AHCI_H
+#define __INCLUDE_MAGICBOX_AHCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct disk;
+struct request;
+
+// AHCI (Advanced Host Controller Interface) 是 SATA 控制器的标准接口，PCI 类代码为 01h 06h 01h
+// 控制器的寄存器通过 BAR5（ABAR）映射在内存空间里，前 0x100 字节是全局寄存器，之后每个端口 0x80 字节
+// 每个端口连接一个 SATA 设备，有自己的命令列表：最多 32 个命令槽，驱动填好一个槽后把 PxCI 的对应位置 1 就发出了命令
+// 支持 NCQ（Native Command Queuing）的磁盘可以同时接收最多 32 条读写命令，自己决定执行顺序，每完成一条就报告一次
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_HOSTS 4
+// ABAR 的大小：全局寄存器加上 32 个端口的寄存器
+#define AHCI_ABAR_SIZE (0x100 + AHCI_MAX_PORTS * 0x80)
+
+// 全局寄存器 CAP
+#define HBA_CAP_S64A (1 << 31)  // 支持 64 位地址
+#define HBA_CAP_SNCQ (1 << 30)  // 支持 NCQ
+#define HBA_CAP_SSS  (1 << 27)  // 支持逐个端口地启动磁盘（Staggered Spin-up）
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) // 每个端口的命令槽数
+// 全局寄存器 GHC
+#define HBA_GHC_AE (1U << 31)   // 使用 AHCI 模式，否则控制器表现为传统的 IDE 控制器
+#define HBA_GHC_IE (1 << 1)     // 允许控制器发出中断
+
+// 端口寄存器 PxCMD
+#define HBA_PxCMD_ST  (1 << 0)  // 开始处理命令列表
+#define HBA_PxCMD_SUD (1 << 1)  // 启动磁盘
+#define HBA_PxCMD_POD (1 << 2)  // 给冷插拔的设备上电
+#define HBA_PxCMD_FRE (1 << 4)  // 允许接收设备发来的 FIS
+#define HBA_PxCMD_FR  (1 << 14) // FIS 接收引擎正在运行
+#define HBA_PxCMD_CR  (1 << 15) // 命令列表引擎正在运行
+// 端口寄存器 PxIS/PxIE
+#define HBA_PxIS_DHRS (1 << 0)  // 收到 D2H Register FIS，非 NCQ 命令完成
+#define HBA_PxIS_PSS  (1 << 1)  // 收到 PIO Setup FIS
+#define HBA_PxIS_SDBS (1 << 3)  // 收到 Set Device Bits FIS，NCQ 命令完成
+#define HBA_PxIS_DPS  (1 << 5)  // 一个带 I 位的 PRD 传输完了
+#define HBA_PxIS_IFS  (1 << 27) // 接口致命错误
+#define HBA_PxIS_HBDS (1 << 28) // 控制器访问内存出错
+#define HBA_PxIS_HBFS (1 << 29) // 控制器致命错误
+#define HBA_PxIS_TFES (1 << 30) // 磁盘报告了错误（状态寄存器的 ERR 位）
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+// PxSSTS 的 DET 字段为 3 说明连着设备，并且已经和它建立了通信
+#define HBA_PxSSTS_DET(ssts) ((ssts) & 0xf)
+#define HBA_DET_PRESENT 3
+// PxSIG 是设备在上电后发来的第一个 FIS 里的签名
+#define SATA_SIG_ATA 0x00000101
+
+// FIS 的类型
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_CMD (1 << 7)    // H2D Register FIS 的 C 位，1 表示这是命令而不是设备控制
+// NCQ 读写命令，扇区数放在 feature 寄存器里，命令槽号放在扇区数寄存器的高 5 位
+#define CMD_READ_FPDMA_QUEUED 0x60
+#define CMD_WRITE_FPDMA_QUEUED 0x61
+
+// 端口的寄存器，位于 ABAR + 0x100 + port * 0x80
+struct hba_port {
+	uint32_t clb;       // 0x00 命令列表的物理地址，1KB 对齐
+	uint32_t clbu;      // 0x04 高 32 位
+	uint32_t fb;        // 0x08 接收 FIS 区域的物理地址，256 字节对齐
+	uint32_t fbu;       // 0x0C
+	uint32_t is;        // 0x10 中断状态，写 1 清除
+	uint32_t ie;        // 0x14 中断使能
+	uint32_t cmd;       // 0x18 命令和状态
+	uint32_t rsv0;      // 0x1C
+	uint32_t tfd;       // 0x20 磁盘的状态和错误寄存器
+	uint32_t sig;       // 0x24 设备签名
+	uint32_t ssts;      // 0x28 SATA 链路状态
+	uint32_t sctl;      // 0x2C SATA 链路控制
+	uint32_t serr;      // 0x30 SATA 链路错误，写 1 清除
+	uint32_t sact;      // 0x34 已经发出、还没完成的 NCQ 命令槽
+	uint32_t ci;        // 0x38 已经发出、控制器还没处理完的命令槽
+	uint32_t sntf;      // 0x3C
+	uint32_t fbs;       // 0x40
+	uint32_t rsv1[11];  // 0x44 ~ 0x6F
+	uint32_t vendor[4]; // 0x70 ~ 0x7F
+};
+
+// 控制器的全局寄存器，位于 ABAR 开头
+struct hba_mem {
+	uint32_t cap;       // 0x00 控制器的能力
+	uint32_t ghc;       // 0x04 全局控制
+	uint32_t is;        // 0x08 各个端口的中断汇总，写 1 清除
+	uint32_t pi;        // 0x0C 实现了哪些端口
+	uint32_t vs;        // 0x10 版本
+	uint32_t ccc_ctl;   // 0x14
+	uint32_t ccc_pts;   // 0x18
+	uint32_t em_loc;    // 0x1C
+	uint32_t em_ctl;    // 0x20
+	uint32_t cap2;      // 0x24
+	uint32_t bohc;      // 0x28
+	uint8_t rsv[0x100 - 0x2C];
+	struct hba_port ports[AHCI_MAX_PORTS];
+};
+
+// 命令列表中的一项，每个命令槽一个，32 字节
+struct hba_cmd_header {
+	// DW0
+	uint8_t cfl:5;      // 命令 FIS 的长度，以双字为单位
+	uint8_t atapi:1;
+	uint8_t write:1;    // 1 表示数据从内存流向设备
+	uint8_t prefetch:1;
+	uint8_t reset:1;
+	uint8_t bist:1;
+	uint8_t clear_busy:1;
+	uint8_t rsv0:1;
+	uint8_t pmp:4;
+	uint16_t prdtl;     // PRD 表的项数
+	// DW1
+	volatile uint32_t prdbc; // 已经传输的字节数，由控制器填写
+	// DW2, DW3
+	uint32_t ctba;      // 命令表的物理地址，128 字节对齐
+	uint32_t ctbau;
+	// DW4 ~ DW7
+	uint32_t rsv1[4];
+} __attribute__ ((packed));
+
+// PRD 表的一项，一项最多描述 4MB 的物理连续内存
+struct hba_prdt_entry {
+	uint32_t dba;       // 数据的物理地址，必须 2 字节对齐
+	uint32_t dbau;
+	uint32_t rsv0;
+	uint32_t dbc:22;    // 字节数减 1，必须是奇数（字节数是偶数）
+	uint32_t rsv1:9;
+	uint32_t i:1;       // 这一项传输完成后发中断
+} __attribute__ ((packed));
+
+// H2D Register FIS，相当于把 IDE 的各个命令寄存器打包发给设备
+struct fis_reg_h2d {
+	uint8_t fis_type;   // FIS_TYPE_REG_H2D
+	uint8_t flags;      // 最高位是 C 位，低 4 位是端口倍增器的端口号
+	uint8_t command;
+	uint8_t featurel;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t device;
+	uint8_t lba3;
+	uint8_t lba4;
+	uint8_t lba5;
+	uint8_t featureh;
+	uint8_t countl;
+	uint8_t counth;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t rsv[4];
+} __attribute__ ((packed));
+
+// 命令表的大小是两页，除去 0x80 字节的头部都用来放 PRD 表
+// 一条命令最多 IDE_MAX_VECS 段、MAX_SECS_PER_CMD_EXT 个扇区，每段每跨一页多占一项，最坏也只要不到 400 项
+#define AHCI_CMD_TABLE_PAGES 2
+#define AHCI_PRDT_ENTRIES ((AHCI_CMD_TABLE_PAGES * 4096 - 0x80) / sizeof(struct hba_prdt_entry))
+
+struct hba_cmd_table {
+	uint8_t cfis[64];   // 命令 FIS
+	uint8_t acmd[16];   // ATAPI 命令
+	uint8_t rsv[48];
+	struct hba_prdt_entry prdt[AHCI_PRDT_ENTRIES];
+} __attribute__ ((packed));
+
+struct ahci_host;
+
+// 一个连着 SATA 磁盘的端口
+// 除了初始化阶段，这些字段都由关中断保护
+struct ahci_port {
+	struct ahci_host* host;
+	volatile struct hba_port* regs;
+	uint8_t port_no;
+	struct hba_cmd_header* cmd_list; // 命令列表，和接收 FIS 区域共用一页
+	struct hba_cmd_table* cmd_tables[AHCI_MAX_SLOTS];
+	uint32_t slot_cnt;       // 可以同时发出的命令数，不支持 NCQ 时为 1
+	bool ncq;                // 读写命令使用 READ/WRITE FPDMA QUEUED
+	uint32_t issued;         // 已经发出还没完成的命令槽
+	struct request* slot_rq[AHCI_MAX_SLOTS]; // 每个命令槽上的命令头
+	struct request* flush_rq; // 正在等待或者正在执行的 FLUSH CACHE，它不能和其他命令同时执行
+	struct disk* disk;
+};
+
+// 一个 AHCI 控制器
+struct ahci_host {
+	volatile struct hba_mem* abar;
+	uint8_t irq_no;          // 中断向量号
+	uint32_t cap;
+	struct ahci_port* ports[AHCI_MAX_PORTS];
+};
+
+extern void ahci_pci_driver_init(void);
+
+#endif
@@ -75,5 +75,6 @@ extern bool page_is_allocated(struct page* pg);
 extern struct page* get_buddy_page(struct buddy_pool* bpool, struct page* pg, uint32_t order);
 extern struct page* palloc_pages(struct buddy_pool* bpool, uint32_t order);
 extern void buddy_init(struct buddy_pool* bpool, uint32_t start_addr, uint32_t size, struct page* page_base);
+extern uint32_t buddy_free_bytes(struct buddy_pool* bpool);
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef __INCLUDE_MAGICBOX_BUFFER_POLICY_H
+#define __INCLUDE_MAGICBOX_BUFFER_POLICY_H
+
+#include <stdint.h>
+#include <dlist.h>
+
+struct buffer_head;
+
+// 一个策略最多使用的可淘汰队列数
+#define BUFFER_MAX_QUEUES 2
+
+// ide 缓存的替换策略
+// 策略只管理没有被引用的块，块被引用时从队列上摘下来，引用计数降为 0 时再挂回去
+// 这样队首的块一定可以淘汰，选择牺牲者是 O(1) 的，不需要跳过正在使用的块
+// 所有的回调都在持有 lru_lock 时调用，块的 lru_tag 由策略使用
+struct buffer_policy {
+	const char* name;
+	void (*init)(void);
+	// 新块进入缓存，此时它已经被引用了，不挂到任何可淘汰队列上
+	void (*insert)(struct buffer_head* bh);
+	// 引用计数从 0 变成 1，把块从可淘汰队列上摘下来
+	void (*pin)(struct buffer_head* bh);
+	// 引用计数降为 0，把块挂到可淘汰队列上
+	void (*unpin)(struct buffer_head* bh);
+	// 块被淘汰，此时它在可淘汰队列上
+	void (*evict)(struct buffer_head* bh);
+	// 把可淘汰队列上的块挪到冷端，下一次优先淘汰它，用于流式读的 drop-behind
+	void (*demote)(struct buffer_head* bh);
+	// 按照淘汰的优先顺序给出所有的可淘汰队列，返回队列数
+	uint32_t (*victim_queues)(struct dlist** queues);
+};
+
+extern struct buffer_policy buffer_policy_lru;
+extern struct buffer_policy buffer_policy_2q;
+
+#endif
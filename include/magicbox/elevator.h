@@ -0,0 +1,36 @@
+#ifndef __INCLUDE_MAGICBOX_ELEVATOR_H
+#define __INCLUDE_MAGICBOX_ELEVATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <dlist.h>
+
+struct disk;
+struct request;
+
+// 读请求和写请求在队列中最多等待的 tick 数（5ms 一个 tick），超时的请求不再按 lba 排队，直接发出
+// 读通常有进程在同步地等，所以期限比写短得多
+#define ELV_READ_EXPIRE 100
+#define ELV_WRITE_EXPIRE 1000
+// 读写都在排队时优先发读请求，但连续发了这么多个读之后必须发一个写，防止写被饿死
+#define ELV_WRITES_STARVED 2
+// 合并后的一条命令最多包含的 io_vec 段数，每个通道有一个这么大的数组用来拼接各个请求的 io_vec
+#define ELV_MAX_MERGE_VECS 128
+
+// 每个磁盘一个的 I/O 调度器（deadline + C-LOOK）
+// 请求在发给磁盘之前先在这里排队，相邻的请求合并成一条命令，按磁头移动的方向依次发出
+// 进程上下文和中断处理程序都会访问它，所有的函数都要在关中断时调用
+struct elevator {
+	struct dlist sort[2];  // 排队中的读/写请求，按 lba 升序，下标是 REQ_READ/REQ_WRITE
+	struct dlist fifo[2];  // 同样的请求，按提交顺序排列，队首最老
+	struct dlist flushes;  // 等待中的 FLUSH CACHE，必须等它之前提交的写都发出去之后才能发
+	uint32_t next_lba;     // 上一条命令结束的位置，C-LOOK 从这里继续向后扫
+	uint32_t seq;          // 下一个请求的提交序号
+	uint32_t writes_starved; // 有写请求在等时，连续发出的读请求数
+};
+
+extern void elv_init(struct elevator* e);
+extern void elv_add(struct disk* hd, struct request* rq);
+extern struct request* elv_next(struct disk* hd);
+
+#endif
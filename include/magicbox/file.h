@@ -2,6 +2,7 @@
 #define __INCLUDE_MAGICBOX_FILE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 struct partition;
 struct file;
@@ -9,6 +10,9 @@ struct file;
 extern int32_t file_close(struct file* file);
 extern int32_t file_open(struct partition* part, uint32_t inode_no,int32_t flag);
 extern int32_t file_mmap(struct file* file, uint32_t addr, uint32_t len, uint32_t prot, uint32_t flags, uint32_t offset);
+extern void file_readahead(struct file* file, uint32_t pos, uint32_t count);
+extern int32_t file_fadvise(struct file* file, uint32_t offset, uint32_t len, uint32_t advice);
+extern int32_t file_fsync(struct file* file, bool datasync);
 
 
 #endif
@@ -40,6 +40,9 @@ extern int32_t sys_access(const char* pathname, int mode);
 extern int32_t sys_readlink(const char* path, char* buf, int32_t bufsize);
 extern int32_t sys_truncate(const char* path, int32_t length);
 extern int32_t sys_ftruncate(int32_t fd, int32_t length);
+extern int32_t sys_fadvise(int32_t fd, uint32_t offset, uint32_t len, uint32_t advice);
+extern int32_t sys_fsync(int32_t fd);
+extern int32_t sys_fdatasync(int32_t fd);
 extern int32_t sys_link(const char* _oldpath, const char* _newpath);
 extern int32_t sys_swapon(const char* _pathname);
 extern int32_t sys_swapoff(const char* _pathname);
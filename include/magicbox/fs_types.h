@@ -49,6 +49,8 @@ struct inode{
 	// 否则会影响在这个文件之后的其他文件的查找，这里的道理也类似
 	uint32_t i_size;
 	uint32_t i_blocks; // 占用块数（512B 扇区为单位）
+	// 上一次 fsync/fdatasync 时的 i_size，fdatasync 发现文件大小变了才需要写回元数据
+	uint32_t i_synced_size;
 	uint32_t i_rdev; // 这个 inode 表示哪一个设备（针对设备inode使用，存储该 inode 代表的设备号，r 表示 raw，即原始设备）
 	uint32_t i_no;
 	uint32_t i_dev; // 这个 inode 存在哪个持久化设备上
@@ -81,6 +83,30 @@ struct inode{
 	};
 };
 
+// 顺序读时预读窗口的初始大小和最大大小（字节）
+#define RA_INIT_SIZE (16*1024)
+#define RA_MAX_SIZE (128*1024)
+// 顺序读超过这么多字节就认为是流式读（备份、校验整个大文件），读过的块不再留在缓存的热端
+#define DROP_BEHIND_SIZE (512*1024)
+
+// posix_fadvise 的访问模式提示，数值与 Linux 一致
+#define POSIX_FADV_NORMAL     0
+#define POSIX_FADV_RANDOM     1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED   3
+#define POSIX_FADV_DONTNEED   4
+#define POSIX_FADV_NOREUSE    5
+
+// 每个打开文件的预读状态，由 file_ra_next 维护
+// 文件表项在分配时会被整体清零，因此全 0 就是初始状态
+struct file_ra_state {
+	uint32_t prev_pos; // 上一次读取结束的位置，下一次从这里开始读就认为是顺序读
+	uint32_t size;     // 当前预读窗口的字节数，每次顺序读翻倍，直到 RA_MAX_SIZE
+	uint32_t ra_end;   // 已经提交过预读的位置，避免重复提交同一段
+	uint32_t advice;   // posix_fadvise 设置的访问模式
+	uint32_t seq_bytes; // 当前这一段连续顺序读的字节数，用来识别流式读
+};
+
 struct file{
 	uint32_t fd_pos;
 	int32_t fd_flag;
@@ -91,6 +117,7 @@ struct file{
 	// 通过多设置一个 f_count，将inode的生命周期管理和file的生命周期管理分开了
 	uint32_t f_count;     
 	struct file_operations* f_op; // 指向该文件的具体操作集
+	struct file_ra_state f_ra; // 预读状态
 };
 
 // 用于 vfs，抽象文件操作
@@ -176,6 +203,9 @@ struct super_operations {
 	// 同步元数据。把内存中被修改过的 inode 属性（比如刚 write 完，文件变大了）写回磁盘。
 	// 这就是当前系统中一直手动调用的 inode_sync 的规范写法。
 	void (*write_inode) (struct inode *);
+	// 写回该 inode 自己的元数据块（inode 所在扇区、间接块、位图、组描述符等），供 fsync 使用
+	// 只把缓存里这些块的脏数据写到磁盘，不发 FLUSH CACHE，也不写回分区里其他文件的数据，失败时返回负的错误码
+	int32_t (*sync_inode) (struct inode *);
 	// 释放。当 Inode 的引用计数降为 0，准备从内存中销毁时调用。可以在这里做一些收尾工作。
 	void (*put_inode) (struct inode *);
 	// 卸载（Umount）时调用。负责释放该文件系统占用的所有内核资源，关闭磁盘驱动
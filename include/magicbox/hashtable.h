@@ -11,21 +11,49 @@
 #define HASH_GOLDEN_RATIO_64 0x9E3779B97F4A7C15
 
 typedef uint32_t (*hash_callback)(void* arg);
+// 根据表中的元素计算它的哈希值，必须与 hash_callback 对该元素的 key 算出的值相同
+// 扩容缩容时要把元素搬到新的桶里，这时手上只有元素没有 key
+typedef uint32_t (*hash_elem_callback)(struct dlist_elem* pelem);
+
+// 一组桶的统计和迁移进度
+// 桶 i 属于第 i % stripe_nr 组，只有操作这一组的桶时才会修改它
+struct hash_stripe {
+	uint32_t elem_nr;    // 这一组桶中的元素个数
+	uint32_t rehash_idx; // 这一组中下一个要迁移的旧桶
+};
 
 // 为了实现机制和策略分离，我们的hashtable类里面不加锁
 // 并发安全性应该由哈希表的调用者保证
+// 桶数总是 2 的幂，元素太多或者太少时换一张新表，元素在之后的每次操作中逐桶从旧表搬到新表，不会一次性停顿
+// 迁移期间查找要同时看旧表和新表对应的桶
+//
+// 调用者可以把桶分成 stripe_nr 组，每组用一把锁保护（stripe_nr 是 2 的幂，且不超过桶数）
+// 因为新旧两张表的桶数都是 stripe_nr 的倍数，同一个元素在新旧表中所在的桶属于同一组
+// 每次操作只会迁移 key 所在的那一组的旧桶，所以只需要持有这一组的锁
+// 换表（hash_resize）会动所有的桶，分组的哈希表需要调用者拿齐所有组的锁后自己调用
+// 不分组的哈希表（stripe_nr 为 1）在插入和删除时自动换表
 struct hashtable{
 	struct dlist* buckets; // bucket 数组，用于存放所有的桶
 	uint32_t bucket_nr;
-	uint32_t elem_nr;
+	struct dlist* old_buckets; // 迁移中的旧表，不在迁移时为 NULL
+	uint32_t old_bucket_nr;
+	uint32_t min_bucket_nr;    // 缩容的下限，即初始化时的桶数
+	uint32_t stripe_nr;
+	struct hash_stripe* stripes;
 	hash_callback hash_func; // 用于计算backet索引
+	hash_elem_callback elem_hash; // 用于迁移时计算元素的新桶
 	func_condition condition; // 用于bucket内的元素查找
 };
 
-extern void hash_free(struct hashtable *hash); 
+extern void hash_free(struct hashtable *hash);
 extern void hash_remove(struct hashtable *hash, struct dlist_elem* pelem);
 extern void hash_insert(struct hashtable *hash, void *arg, struct dlist_elem* pelem);
+extern void hash_add(struct hashtable *hash, void *arg, struct dlist_elem* pelem);
 extern struct dlist_elem* hash_find(struct hashtable *hash, void *arg);
-extern void hash_init(struct hashtable *hash,uint32_t bucket_nr, hash_callback hash_func, func_condition condition);
+extern uint32_t hash_elem_nr(struct hashtable *hash);
+extern bool hash_resize_needed(struct hashtable *hash);
+extern void hash_resize(struct hashtable *hash);
+extern void hash_init(struct hashtable *hash,uint32_t bucket_nr, hash_callback hash_func, hash_elem_callback elem_hash, func_condition condition);
+extern void hash_init_striped(struct hashtable *hash, uint32_t bucket_nr, uint32_t stripe_nr, hash_callback hash_func, hash_elem_callback elem_hash, func_condition condition);
 
-#endif
\ No newline at end of file
+#endif
@@ -3,11 +3,13 @@
 #include <stdint.h>
 #include <dlist.h>
 #include <bitmap.h>
+#include <rbtree.h>
 #include <sync.h>
 #include <stdbool.h>
 #include <fs_types.h>
 #include <ide_buffer.h>
 #include <ide_dma.h>
+#include <elevator.h>
 
 #define reg_data(channel) (channel->port_base+0)
 #define reg_error(channel) (channel->port_base+1)
@@ -26,6 +28,7 @@
 #define BIT_ALT_STAT_BSY 0x80
 #define BIT_ALT_STAT_DRDY 0x40
 #define BIF_ALT_STAT_DRQ 0x8
+#define BIT_STAT_ERR 0x1
 #define BIT_DEV_MBS 0xa0 // 10100000, these bits are always set to 1
 #define BIT_DEV_LBA 0x40 // use LBA instead of CHS
 #define BIT_DEV_DEV 0x10 // 0 is master 1 is slave
@@ -43,13 +46,33 @@
 #define CMD_READ_MULTIPLE 0xC4 // 多扇区读取指令
 #define CMD_WRITE_MULTIPLE 0xC5  // 多扇区写入指令
 
-#define max_lba ((80*1024*1024/512)-1) // only surport 80MB disk
+#define CMD_FLUSH_CACHE 0xE7 // 把磁盘写缓存中的数据写到盘片上
+
+// LBA48 版本的命令，起始 lba 和扇区数都是两个字节两个字节地写进寄存器
+#define CMD_READ_SECTOR_EXT 0x24
+#define CMD_WRITE_SECTOR_EXT 0x34
+#define CMD_DMA_READ_EXT 0x25
+#define CMD_DMA_WRITE_EXT 0x35
+#define CMD_READ_MULTIPLE_EXT 0x29
+#define CMD_WRITE_MULTIPLE_EXT 0x39
+#define CMD_FLUSH_CACHE_EXT 0xEA
+
+// LBA28 命令能寻址的扇区数，超过这个范围的扇区只能用 LBA48 命令访问
+#define LBA28_MAX_SECTORS (1 << 28)
 
 // the number of the disk is stored in this addr by BIOS 
 #define BIOS_DISK_NUM_ADDR 0x475
 #define DISK_PARAM_ADDR 0x501
 
 #define BUSY_WAIT_TIME_LIMIT 30*1000
+// 在中断中等待磁盘要 PIO 写数据时最多轮询状态寄存器的次数，每次 in 指令大约 1 微秒
+#define PIO_DRQ_SPINS 100000
+// 不超过这么多扇区的同步读写不睡眠等中断，而是自旋轮询磁盘状态等它完成
+// 模拟的磁盘读一个元数据块只要几十微秒，比一次中断加两次进程切换还快
+#define IDE_POLL_MAX_SECS 8
+// 每个磁盘轮询预算（轮询次数）的范围，预算随最近几次轮询实际用的次数调整
+#define IDE_POLL_SPINS_MIN 256
+#define IDE_POLL_SPINS_MAX 8192
 
 #define CHANNEL_NUM 2
 #define MAX_DISK_NAME_LEN 8
@@ -57,25 +80,40 @@
 #define PRIM_PARTS_NUM 4
 #define LOGIC_PARTS_NUM 8
 #define DEVICE_NUM_PER_CHANNEL 2
+// 系统中最多的磁盘数，前 CHANNEL_NUM * DEVICE_NUM_PER_CHANNEL 个编号留给 ide 磁盘
+// 第 i 个磁盘叫 sd('a'+i)（驱动自己起了名字的除外，比如 ram0），设备号是 MAKEDEV(3, i * 16)
+#define MAX_DISK_CNT 16
 #define START_BYTE_PARTITION_TABLE 446
 #define END_BYTE_PARTITION_TABLE 509
-// 每轮读写操作连续读取的扇区数
-// 设置 8 或 16。必须是 2 的幂，但不能超过硬盘支持的最大值（IDENTIFY Word 47，通常是16）
-#define SECTORS_PER_OP_BLOCK 16
+// 一条 LBA28 读写命令最多传输的扇区数，扇区数寄存器写 0 表示 256 个扇区
+// 这也是所有磁盘都能接受的单条命令大小，每个磁盘实际的上限见 disk->max_secs
+#define MAX_SECS_PER_CMD 256
+// 支持 LBA48 的磁盘一条命令最多传输的扇区数（512KB）
+// LBA48 的扇区数寄存器有 16 位，真正的限制是每个通道一页、512 项的 PRD 表
+#define MAX_SECS_PER_CMD_EXT 1024
+// 一条命令最多的 io_vec 段数
+// DMA 时每段至少占一个 PRD 条目，段内每跨一页再多占一个，256 段加上 512KB 最多跨越的 129 页仍然放得下 PRD 表
+#define IDE_MAX_VECS 256
 
 // 统一的逻辑地址转物理地址宏
 #define PART_LBA(part, logic_lba) ((part)->start_lba + (logic_lba))
 
 // 封装后的读取宏
 #define partition_read(part, logic_lba, buf, count) \
-    bread_multi((part)->my_disk, PART_LBA(part, logic_lba), (buf), (count))
+    bread_multi((part), PART_LBA(part, logic_lba), (buf), (count))
 
 // 封装后的写入宏
 #define partition_write(part, logic_lba, buf, count) \
-    bwrite_multi((part)->my_disk, PART_LBA(part, logic_lba), (buf), (count))
+    bwrite_multi((part), PART_LBA(part, logic_lba), (buf), (count))
 
-// struct buffer_head* _bread(struct disk* dev, uint32_t lba)
-#define bread(part, logic_lba) _bread((part)->my_disk, PART_LBA(part, logic_lba))
+// struct buffer_head* _bread(struct partition* part, uint32_t lba)
+// 返回的是包含 logic_lba 的整个缓存块，扇区数据需要用 bh_sector_data 定位
+#define bread(part, logic_lba) _bread((part), PART_LBA(part, logic_lba))
+
+// uint32_t bread_gang(struct partition* part, uint32_t start_lba, uint32_t sec_cnt, struct buffer_head** bhs)
+// 返回覆盖这段扇区的所有缓存块，用完后需要 brelse_gang
+#define partition_bread_gang(part, logic_lba, count, bhs) \
+    bread_gang((part), PART_LBA(part, logic_lba), (count), (bhs))
 
 // 对于第一块盘 sda：i_rdev 是 0x0300。
 // sda1 就是 0x0300 + 1 = 0x0301。
@@ -84,11 +122,80 @@
 // sdb1 就是 0x0310 + 1 = 0x0311。
 // sdb5 就是 0x0310 + 5 = 0x0315。
 
+// 分散/聚集 I/O 的一段内存，len 以字节为单位，必须是扇区大小的整数倍
+// 多个 io_vec 按顺序首尾相接，对应磁盘上连续的一段扇区
+struct io_vec {
+	void* base;
+	uint32_t len;
+};
+
+// 请求的类型
+#define REQ_READ 0
+#define REQ_WRITE 1
+#define REQ_FLUSH 2 // FLUSH CACHE，不传输数据，lba 和 vec 不使用
+
+struct request;
+typedef void (*rq_end_io)(struct request* rq);
+
+// 提交给 ide 通道的一个异步请求
+// 提交者填好 disk、op、lba、vec、vec_cnt、end_io 和 private，ide_submit 之后立即返回
+// 请求先在磁盘的调度器里排队，与相邻的请求合并，再由通道一条一条地发给磁盘，由磁盘中断推进和完成
+// 请求完成时在中断上下文中调用 end_io，此时 status 为 0 表示成功，-EIO 表示出错
+// end_io 中不能睡眠也不能拿锁，一般只做计数和 sema_signal；end_io 返回后驱动不会再访问 rq
+// vec 描述的内存必须是内核地址：请求可能在别的进程的上下文中开始和完成，用户地址在那时不一定有效
+struct request {
+	struct disk* disk;
+	uint8_t op;
+	uint32_t lba;
+	struct io_vec* vec;
+	uint32_t vec_cnt;
+	rq_end_io end_io;
+	void* private;
+	int32_t status;
+
+	// 以下字段由驱动使用
+	uint32_t sec_cnt;
+	uint32_t start;      // 提交时的 ticks，用于统计延迟
+	uint32_t secs_done;  // PIO 已经传输的扇区数，virtio 已经发出的扇区数
+	uint32_t vec_idx;    // 在命令的 io_vec 中的游标
+	uint32_t vec_off;
+	uint32_t parts;      // 命令被驱动拆成几个请求发出时，还没完成的请求数
+	struct dlist_elem queue_tag; // 调度器的 sort 队列，或者 rq_batch 的 plug 队列
+
+	// 以下字段由调度器使用
+	// 首尾相接的请求合并成一条命令，命令头记录整条命令的扇区数和段数，其余的请求按 lba 顺序挂在 merge_next 上
+	struct dlist_elem fifo_tag;
+	uint32_t seq;        // 提交序号，用于给 FLUSH CACHE 排序
+	uint32_t deadline;   // 超过这个 tick 还没发出就不再按 lba 排队
+	struct request* merge_next;
+	struct request* merge_tail;
+	uint32_t cmd_secs;
+	uint32_t cmd_vecs;
+};
+
+// 一组请求的完成计数，最后一个请求完成时唤醒等待的进程
+// 用法：rq_batch_init，然后对每个请求调用 rq_batch_submit，最后 rq_batch_wait
+// 不想等待时在 init 之后填上 end_io，最后调用 rq_batch_commit，整批完成时在中断上下文中调用 end_io，要求同 request 的 end_io
+// 提交之前先 rq_batch_plug，请求就会先攒在 batch 里，unplug（或者 wait）时一次性交给调度器
+// 这样同一批里相邻的请求一定能合并，调度器也能一次看到整批请求再排序，而不是第一个请求一来就发给磁盘
+struct rq_batch {
+	uint32_t pending;   // 未完成的请求数，再加上提交者自己持有的 1
+	int32_t status;     // 任意一个请求出错时记下它的错误码
+	struct semaphore done;
+	bool plugged;
+	struct dlist plug_list; // 攒着还没有交给调度器的请求，只有提交者自己访问
+	void (*end_io)(struct rq_batch* batch); // 为 NULL 时完成后唤醒 rq_batch_wait
+	void* private;
+};
+
 // disk partition
 struct partition{
 	uint32_t start_lba;
 	uint32_t sec_cnt;
 	uint32_t i_rdev; // 逻辑设备号，用于在vfs中注册时使用
+	// 该分区在 ide 缓存中的块大小，默认是一个扇区
+	// 挂载文件系统时会通过 set_blocksize 改成文件系统的块大小
+	uint32_t blk_size;
 	struct disk* my_disk; // disk that the partition belongs
 	struct dlist_elem part_tag; // be used in the queue
 	char name[8]; // partition name
@@ -104,28 +211,75 @@ struct partition{
 
 struct disk{
 	char name[8]; // disk name
-	struct ide_channel* my_channel; // ide channel that this disk belongs
+	struct ide_channel* my_channel; // ide channel that this disk belongs，不是 ide 磁盘时为 NULL
 	uint8_t dev_no; // master ide is 0, slave is 1
+	struct dlist_elem disk_tag; // 挂在 disk_list 上
+	// 调度器里有了新的请求时调用，驱动从 elv_next 取出命令发给磁盘，调用者已经关中断
+	// ide 磁盘同一时刻只能执行一条命令，ahci 等控制器则可以一次发出多条
+	void (*start_io)(struct disk* hd);
+	// 检查磁盘上正在执行的命令，已经完成的话代替中断推进或者完成它，调用者已经关中断
+	// 为 NULL 时同步请求总是睡眠等中断
+	void (*poll)(struct disk* hd);
+	uint32_t poll_spins; // 同步请求轮询的预算，超出后退回去睡眠等中断
+	void* driver_data; // 驱动的私有数据，ide 磁盘不使用
 	struct partition prim_parts[4]; // the max number of primary partition is 4
 	struct partition logic_parts[8]; // we only support 8 logic partition
 	// 全盘分区，用于管理没有逻辑分区的裸盘，或者直接绕过分区来对磁盘进行操作
 	// 这个分区跨越整个磁盘（从 LBA 0 到最大 LBA）。
 	struct partition all_disk_part; 
+	// 整盘设备文件是否允许写入，有分区表的磁盘不允许，以免写坏分区表和其他分区
+	// 没有分区表的磁盘（比如 RAM 磁盘）只能在整盘上 mkfs
+	bool whole_disk_writable;
 	uint32_t i_rdev; // 逻辑设备号，用于在vfs中注册时使用
 	uint32_t total_sectors;
-	struct dlist dirty_lists[2]; // 用于挂载脏扇区头，以便延迟写回
-	int32_t active_dirty_idx; // 当前活跃队列的索引 (0 或 1)
-    struct lock lists_lock; // 保护该分区队列切换的锁
+	// 以下由 IDENTIFY 的结果决定
+	bool lba48;          // 支持并开启了 LBA48，可以访问 128GB 以后的扇区、一条命令传输 256 个以上的扇区
+	uint32_t max_secs;   // 一条读写命令最多传输的扇区数
+	uint32_t multi_secs; // PIO 每次中断传输的扇区数（READ/WRITE MULTIPLE 的块大小），1 表示不支持多扇区模式
+	// 该磁盘上所有的脏块，按 b_blocknr 升序组织成红黑树，以便延迟写回时直接按顺序合并 io
+	struct rb_root dirty_tree;
+	struct lock dirty_lock; // 保护脏块树、dirty_list、dirty_bytes 和 throttle_waiters 的锁
+	struct dlist dirty_list; // 同样是所有的脏块，按变脏的先后顺序排列，队首的块最老
+	uint32_t dirty_bytes;    // 脏块的总字节数
+	// 该磁盘专属的写回线程，不同磁盘（尤其是不同通道上的磁盘）的写回互不影响
+	struct task_struct* wb_thread;
+	uint32_t throttle_waiters;       // 因为脏数据太多而被限流的写进程数
+	struct semaphore throttle_wait;  // 写回线程每写完一批就唤醒所有被限流的进程
+
+	// 写回的完成跟踪
+	// 从脏块树上摘下脏块直到把它们写到磁盘，整个过程都持有 wb_lock
+	// 因此拿到 wb_lock 就说明之前被摘走的脏块都已经写完了，fsync 不会漏掉正在被别人写回的块
+	// 拿 wb_lock 时不能持有任何缓存的锁
+	struct lock wb_lock;
+	uint32_t wb_seq;          // 已经完成的写回批次数，由 wb_lock 保护
+	int32_t wb_error;         // 写回失败时记下的错误，由下一次 bflush_cache 报告并清零，由 wb_lock 保护
+	struct buffer_head** wb_batch; // 写回时使用的数组，由 wb_lock 保护，第一次写回时申请
+	struct io_vec* wb_vec;
+	struct request* wb_rqs;
+	// FLUSH CACHE 的组提交
+	// 多个进程同时 fsync 时只需要发一次 FLUSH CACHE，它会覆盖在它之前完成的所有写回
+	struct lock flush_lock;
+	uint32_t flushed_seq;     // 最近一次 FLUSH CACHE 发出时的 wb_seq，由 flush_lock 保护
+	// 命令数、扇区数和延迟直方图，与缓存的统计一样不加锁
+	struct disk_stats stats;
+	// 发给这个磁盘的请求在这里排队
+	struct elevator elv;
 };
 
 struct ide_channel{
 	char name[8]; // name of ata channel
 	uint16_t port_base; // the beginning number of the channel port
 	uint8_t irq_no; // interrpt number used by this channel
-	struct lock lock; // channel lock, only one thread can access this channel
 	bool expecting_intr; // whether this channel is waiting the disk intr
-	// when I/O operation occurs, proc can use this semaphore to block itself
+	// 初始化阶段的命令（IDENTIFY、SET MULTIPLE）不经过请求队列，发出后睡在这个信号量上等中断
 	struct semaphore wait_disk; // is used to block and wakeup the driver prog
+	// 两个磁盘的请求在各自的调度器里排队，通道空闲时轮流从它们那里取出下一条命令
+	// 进程上下文和中断处理程序都会修改这些字段，由关中断保护
+	struct request* cur_rq; // 正在磁盘上执行的命令头，通道空闲时为 NULL
+	uint8_t next_dev;       // 下一次先看哪个磁盘的调度器
+	struct io_vec* cmd_vec; // 正在执行的命令的 io_vec，合并过的命令指向 merge_vec
+	uint32_t cmd_vec_cnt;
+	struct io_vec merge_vec[ELV_MAX_MERGE_VECS];
 	struct disk devices[DEVICE_NUM_PER_CHANNEL]; // a channel has two disk, one for master channel, one for slave channel
 
 	// DMA 属于通道控制器
@@ -140,19 +294,36 @@ struct ide_channel{
     uint32_t prd_table_phys;    // 物理地址，用于写到 BMBA 寄存器
 };
 
-extern void ide_write(struct disk* hd,uint32_t lba,void* buf,uint32_t sec_cnt);
-extern void ide_read(struct disk* hd,uint32_t lba,void* buf,uint32_t sec_cnt);
+extern int32_t ide_write(struct disk* hd,uint32_t lba,void* buf,uint32_t sec_cnt);
+extern int32_t ide_write_vec(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt);
+extern int32_t ide_read(struct disk* hd,uint32_t lba,void* buf,uint32_t sec_cnt);
+extern int32_t ide_read_vec(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt);
+extern int32_t ide_flush(struct disk* hd);
+extern void ide_submit(struct request* rq);
+extern void ide_complete(struct request* rq, int32_t status);
+extern void ide_end_cmd(struct request* rq, int32_t status);
+extern void rq_batch_init(struct rq_batch* batch);
+extern void rq_batch_submit(struct rq_batch* batch, struct request* rq);
+extern void rq_batch_plug(struct rq_batch* batch);
+extern void rq_batch_unplug(struct rq_batch* batch);
+extern int32_t rq_batch_wait(struct rq_batch* batch);
+extern int32_t rq_batch_wait_disk(struct rq_batch* batch, struct disk* hd, uint32_t sec_cnt);
+extern void rq_batch_commit(struct rq_batch* batch);
 extern void ide_init(void);
+extern void disk_init(struct disk* hd);
+extern int32_t disk_alloc_idx(void);
+extern void disk_register(struct disk* hd, uint32_t disk_idx);
 extern void intr_handler_hd(uint8_t irq_no);
 extern void sys_readraw(const char* disk_name,uint32_t lba,const char* filename,uint32_t file_size);
 extern struct partition* get_part_by_rdev(uint32_t rdev);
 extern void select_disk(struct disk* hd);
-extern void select_sector(struct disk* hd,uint32_t lba,uint8_t sec_cnt);
+extern bool select_sector(struct disk* hd,uint32_t lba,uint32_t sec_cnt);
 extern void cmd_out(struct ide_channel* channel,uint8_t cmd);
 
 extern struct ide_channel channels[2];
 extern uint8_t channel_cnt;
 extern struct dlist partition_list;
+extern struct dlist disk_list;
 extern uint32_t* disk_size;
 extern uint8_t disk_num;
 struct file_operations ide_file_operations;
@@ -7,49 +7,121 @@
 #include <dlist.h>
 #include <sync.h>
 #include <hashtable.h>
+#include <rbtree.h>
+#include <buffer_policy.h>
+#include <blkstat.h>
 
 struct disk;
+struct partition;
 
-// 缓存率，我们设置成 10%，总内存中会有 10% 的内存被用作磁盘缓存
+// 缓存率，我们设置成 10%，启动时总内存中会有 10% 的内存被用作磁盘缓存
+// 之后缓存的目标容量会根据内核内存池的空闲情况动态伸缩
 #define BUFFER_RATE 10
+
+// 水位线，以目标容量 max_size 的十分之几表示
+// 超过软水位时唤醒写回线程在后台刷脏，不阻塞当前进程
+// 超过硬水位时在当前进程中同步淘汰
+#define BUFFER_SOFT_WMARK 8
+#define BUFFER_HARD_WMARK 9
+
+// 脏数据的比例，以目标容量 max_size 的百分之几表示
+// 所有磁盘的脏数据超过后台比例时，写回线程不再只写过期的块，而是把整个磁盘写一遍
+// 超过限流比例时，写进程要睡眠等待自己磁盘的写回线程写完一批，让写回赶在 getblk 走到硬水位的同步淘汰之前
+#define DIRTY_BACKGROUND_RATIO 10
+#define DIRTY_RATIO 40
+// 块变脏之后最多在内存中停留的时间，写回线程醒来的周期（毫秒）
+#define DIRTY_EXPIRE_MS 1000
+#define DIRTY_WRITEBACK_MS 250
+// 哈希表的初始桶数，也是缩容的下限，哈希表会随着缓存块数自动扩容缩容
 // 由于要使用黄金分割乘法hash，因此选取2的幂次作为hash_size
-// 我们的malloc函数，当申请内存大于1024B时，会直接分配一个页的内存给该进程
-// 哈希表中会有一个dlist数组，每一个dlist元素的大小是16字节
-// 128*16=4KB，刚好占满一个页（我们经过改进后，将 arena 的元数据从 payload 中移除了，因此一个页 4KB 是全都可用的）
-// 防止后面出现莫名其妙的问题
+// 每一个dlist元素的大小是16字节，256*16=4KB，刚好占满一个页
 #define HASH_SIZE 256  
+
+// 哈希桶锁的个数，桶 i 由第 i % BUFFER_LOCK_NR 把锁保护
+// 必须是 2 的幂并且不超过 HASH_SIZE，这样同一个桶里的块总是由同一把锁保护
+#define BUFFER_LOCK_NR 64
+
+// 缓存替换策略，编译时选择，可选 buffer_policy_lru 和 buffer_policy_2q
+#define BUFFER_POLICY buffer_policy_2q
+
+// 缓存块支持的最大大小，与页大小一致
+// 缓存块的大小由分区上挂载的文件系统决定，只能是 512B/1KB/2KB/4KB
+#define MAX_BLK_SIZE 4096
+
+// 一次 bread_gang 最多返回的缓存块数
+// 按最大的 4KB 块算，一次最多读 128 个扇区，不会超过 8 位的扇区计数
+#define MAX_GANG_BLKS 16
+
 struct buffer_head {
-    uint32_t b_blocknr;     // 对应的磁盘 LBA 地址（扇区号）
+    uint32_t b_blocknr;     // 缓存块起始扇区对应的磁盘绝对 LBA 地址
     struct disk* b_dev;     // 属于哪个磁盘设备
+    uint32_t b_size;        // 缓存块的字节数，等于所属分区的 blk_size
 
-    bool b_dirty;           // 脏位：内存已被修改，尚未同步到磁盘
+    bool b_dirty;           // 脏位：内存已被修改，尚未同步到磁盘，由所属磁盘的 dirty_lock 保护
     bool b_valid;           // 有效位：内存数据是否已从磁盘读入（如果是空的则为false）
-    uint32_t b_ref_count;   // 引用计数：有多少个进程正在使用这个块（防止被意外回收）
+    uint32_t b_ref_count;   // 引用计数：有多少个进程正在使用这个块（防止被意外回收），由桶锁保护
 
-    uint8_t *b_data;           // 指向 512 字节内存空间的指针
+    uint8_t *b_data;           // 指向 b_size 字节内存空间的指针
 
     // 我们希望每一次对元素在LRU链表中的操作都不要影响到其在hash表中的位置
     // 因此我们需要将hash_tag和lru_tag分开
-    struct dlist_elem lru_tag; // 哈希表节点：用于根据 (dev, lba) 快速找到块
-    struct dlist_elem hash_tag;  // LRU节点：用于当缓冲区满时，决定踢掉哪个“最老”的块
-    struct dlist_elem dirty_tag; // 用于延迟写回，挂在脏队列上 
+    struct dlist_elem lru_tag; // 替换策略的队列节点：用于当缓冲区满时，决定踢掉哪个块
+    struct dlist_elem hash_tag;  // 哈希表节点：用于根据 (dev, lba) 快速找到块
+    uint8_t b_queue;           // 替换策略使用，记录块属于策略的哪个队列
+    struct rb_node dirty_node; // 用于延迟写回，挂在所属磁盘的脏块树上
+    struct dlist_elem dirty_tag; // 按变脏的先后顺序挂在所属磁盘的 dirty_list 上
+    uint32_t b_dirtied_at;     // 从干净变脏时的 ticks，由 dirty_lock 保护
+    // io 锁，读盘填充数据或者用新数据覆盖整块时持有
+    // 多个进程同时未命中同一个块时，只有第一个拿到锁的进程去读盘，其他进程睡在锁上，醒来后块已经有效，直接复用
+    // 拿 io 锁时不能持有任何缓存的锁，持有它时可以去拿缓存的锁
+    struct lock b_io_lock;
 };
 
 struct ide_buffer {
-    uint32_t max_blk_num; // 最大的缓存块数
+    // 缓存块大小不再固定，因此容量按字节统计
+    uint32_t max_size; // 缓存当前的目标容量，在 [min_size, cap_size] 之间动态调整
+    uint32_t min_size; // 内存再紧张也会保留的容量
+    uint32_t cap_size; // 内存再空闲也不会超过的容量
+    uint32_t cur_size; // 当前缓存块占用的字节数
     uint32_t cur_blk_num; // 当前的缓存块数
-    uint32_t buf_blk_size; // 缓存块的大小
-    struct lock lock;                // 覆盖整个buffer的锁
+    uint32_t waiters; // 因为所有块都在被引用而睡眠等待 brelse 的进程数
+    struct semaphore free_wait; // 有块的引用计数降为 0 时用来唤醒等待者
+    // 锁的顺序：桶锁 -> 磁盘的 dirty_lock -> lru_lock
+    // 反方向拿锁的地方（从替换策略的队列或脏块树出发找块）只能用 lock_try_acquire
+    struct lock lru_lock;            // 保护替换策略的队列以及上面的容量统计和 waiters
+    struct lock bucket_locks[BUFFER_LOCK_NR]; // 哈希桶锁，保护桶内的链表和块的引用计数
     struct hashtable hash_table;     // hash表，用于快速查询和索引
-    struct dlist lru_list;           // LRU 队列（其实就是一个 dlist）
+    struct buffer_policy* policy;    // 替换策略
+    // 统计计数，只用来观察缓存的行为，各处在不同的锁下累加，不额外加锁，偶尔丢一次累加也无所谓
+    struct buffer_stats stats;
 };
 
+// 缓存块中 lba（绝对 lba）这个扇区的数据地址
+// bread 返回的是包含该扇区的整个缓存块，调用者需要用它来定位到具体的扇区
+#define bh_sector_data(bh, lba) ((bh)->b_data + ((lba) - (bh)->b_blocknr) * SECTOR_SIZE)
+
 extern void ide_buffer_init(void);
-extern struct buffer_head* _bread(struct disk* dev, uint32_t lba);
+extern void buffer_pool_init(void);
+extern struct buffer_head* bh_alloc(uint32_t size);
+extern void bh_free(struct buffer_head* bh);
+extern uint32_t buffer_pool_shrink(void);
+extern struct buffer_head* _bread(struct partition* part, uint32_t lba);
 extern void bwrite(struct buffer_head* bh);
 extern void brelse(struct buffer_head* bh);
-extern void bread_multi(struct disk* dev, uint32_t start_lba,void* out_buf , uint32_t sec_cnt);
-extern void bwrite_multi(struct disk* dev, uint32_t start_lba, void* src_buf, uint32_t sec_cnt);
-extern void sync_ide_buffer(void *arg UNUSED);
+extern uint32_t bread_gang(struct partition* part, uint32_t start_lba, uint32_t sec_cnt, struct buffer_head** bhs);
+extern void brelse_gang(struct buffer_head** bhs, uint32_t cnt);
+extern int32_t bread_multi(struct partition* part, uint32_t start_lba,void* out_buf , uint32_t sec_cnt);
+extern int32_t bwrite_multi(struct partition* part, uint32_t start_lba, void* src_buf, uint32_t sec_cnt);
+extern int32_t set_blocksize(struct partition* part, uint32_t size);
+extern bool blk_size_conflict(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+extern void breada(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+extern void bdrop(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+extern void bdemote(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+extern void bflush(struct partition* part, uint32_t start_lba, uint32_t sec_cnt);
+extern int32_t bdirect_io(struct partition* part, uint32_t start_lba, void* buf, uint32_t sec_cnt, bool is_write);
+extern int32_t bflush_cache(struct disk* dev);
+extern void readahead_ide_buffer(void* arg UNUSED);
+extern void ide_writeback_init(void);
+extern void ide_buffer_get_stats(struct disk* dev, struct blk_stats* st);
 extern void sys_sync(void);
 #endif
\ No newline at end of file
@@ -2,8 +2,11 @@
 #define __INCLUDE_MAGICBOX_IDE_DMA_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 struct disk;
+struct ide_channel;
+struct io_vec;
 
 #define PRD_EOT 0x8000  // End of Table: 1000 0000 0000 0000
 
@@ -35,7 +38,8 @@ struct prd {
 };
 
 extern void ide_pci_driver_init(void);
-extern void ide_read_dma(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
-extern void ide_write_dma(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
+extern bool ide_dma_done(struct ide_channel* chan);
+extern uint8_t ide_dma_finish(struct ide_channel* chan);
+extern void ide_dma_start(struct disk* hd, uint32_t lba, struct io_vec* vec, uint32_t vec_cnt, uint32_t sec_cnt, bool is_write);
 
 #endif
\ No newline at end of file
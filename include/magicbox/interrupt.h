@@ -23,4 +23,5 @@ extern enum intr_status intr_disable(void);
 extern enum intr_status intr_set_status(enum intr_status status);
 extern enum intr_status intr_get_status(void);
 extern void register_handler(uint8_t vec_no,intr_handler_addr function);
+extern void pic_enable_irq(uint8_t irq);
 #endif
\ No newline at end of file
@@ -13,6 +13,8 @@
 #define PG_RW_W 2
 #define PG_US_S 0
 #define PG_US_U 4
+#define PG_PWT 0x08 // 第 3 位，写直达 (Page Write-Through)
+#define PG_PCD 0x10 // 第 4 位，禁用缓存 (Page Cache Disable)，设备寄存器必须绕过 cpu 缓存访问
 #define PG_A 0x20   // 第 5 位，访问位 (Accessed)
 #define PG_D 0x40   // 第 6 位，脏位 (Dirty)
 // 16Bytes 32,64,128,256,512,1024 
@@ -92,6 +94,14 @@ struct mem_block_desc{
 	struct dlist free_list;
 };
 
+// 内存回收回调，内核内存池分配失败时依次调用，让持有可回收内存的子系统（例如磁盘缓存）吐出一部分内存
+// shrink 的参数是期望释放的字节数，返回实际释放的字节数
+// shrink 可能在持有内核内存池锁的情况下被调用，因此它不能睡眠等待其他可能在 kmalloc/kfree 时被持有的锁
+struct shrinker {
+	uint32_t (*shrink)(uint32_t bytes);
+	struct dlist_elem shrinker_tag;
+};
+
 struct mm_struct {
     uint32_t* pgdir;             // 页面目录表物理/虚拟指针 (原 task_struct->pgdir)
 	// 挂载该进程管理的 vm_area
@@ -143,6 +153,7 @@ extern void* mapping_v2p(uint32_t vaddr ,uint32_t paddr);
 extern uint32_t addr_v2p(uint32_t vaddr);
 extern void* kmap(uint32_t paddr);
 extern void kunmap(void* vaddr);
+extern void* ioremap(uint32_t paddr, uint32_t size);
 extern bool paddr_is_lowmem(uint32_t paddr);
 extern bool vaddr_is_directmap(uint32_t vaddr);
 extern bool vaddr_is_kmap(uint32_t vaddr);
@@ -156,6 +167,8 @@ extern void* palloc(struct buddy_pool* m_pool) ;
 
 
 extern void* kmalloc(uint32_t size);
+extern void register_shrinker(struct shrinker* s);
+extern uint32_t shrink_kernel_memory(uint32_t bytes);
 extern void kfree(void* ptr);
 
 
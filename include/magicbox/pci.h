@@ -19,6 +19,7 @@
 #define PCI_BAR3_OFFSET         0x1c
 #define PCI_BAR4_OFFSET         0x20
 #define PCI_BAR5_OFFSET         0x24
+#define PCI_INTERRUPT_LINE_OFFSET 0x3c // 低 8 位是 BIOS 分配给设备的 8259A 中断线
 
 // PCI COMMAND 寄存器位掩码
 #define PCI_COMMAND_IO          0x01  // 允许 I/O 访问
@@ -26,6 +27,9 @@
 #define PCI_COMMAND_MASTER      0x04  // 允许 Bus Master，将这位置为 1 就可以允许窃取 CPU 的总线周期
 #define PCI_COMMAND_INTERRUPT_DISABLE 0x400 // 禁用中断
 
+// BAR 的 bit 0：1 表示 I/O 空间，0 表示内存空间
+#define PCI_BAR_IO              0x01
+
 // PCI 协议规定每个系统支持 256 条总线，每条总线 32 个设备/插槽 (slot)，每个设备最多 8 个功能。
 // 虽然理论上有 256 条总线，但大多数个人电脑往往只有 Bus 0 有设备，或者只有少数几条总线。
 // 例如 Bus 0, Slot 1, Func 1：在 QEMU 中，这通常就是 IDE 控制器。
@@ -51,6 +55,12 @@ struct pci_dev {
     uint32_t irq_line;  // 中断号
 };
 
+// PCI 设备的中断处理函数，参数是中断向量号
+// INTx 中断线可能被几个设备共用，处理函数要先检查自己的设备有没有发中断，没有就直接返回
+typedef void (*pci_irq_handler)(uint8_t vec_no);
+// 一条中断线上最多挂的处理函数数
+#define PCI_IRQ_SHARED_MAX 4
+
 // ID 匹配表
 struct pci_device_id {
     uint32_t vendor_id;
@@ -76,6 +86,7 @@ extern uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t
 extern void pci_write_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val);
 extern void pci_check_device(uint8_t bus, uint8_t slot);
 extern void pci_init(void);
+extern int pci_request_irq(uint8_t irq_line, pci_irq_handler handler);
 
 extern struct dlist pci_drivers_list;
 
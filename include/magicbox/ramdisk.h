@@ -0,0 +1,34 @@
+#ifndef __INCLUDE_MAGICBOX_RAMDISK_H
+#define __INCLUDE_MAGICBOX_RAMDISK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ide.h>
+
+// 用内核内存模拟的磁盘 /dev/ramN，开机时是空的（全 0），没有分区表，整个磁盘就是一个设备
+// 可以直接 mkfs.ext2 /dev/ram0 然后挂载，或者 swapon，读写都是内存拷贝，没有磁盘中断和寻道
+// 内容只在内存里，关机就没了
+
+// 磁盘个数和每个磁盘的大小，可以在编译时用 make RAMDISK_CNT=2 RAMDISK_SIZE_MB=32 修改，个数为 0 就不创建
+#ifndef RAMDISK_CNT
+#define RAMDISK_CNT 1
+#endif
+#ifndef RAMDISK_SIZE_MB
+#define RAMDISK_SIZE_MB 16
+#endif
+#define RAMDISK_MAX_CNT 4
+
+// 数据按块分配，每块是物理连续的若干页，块与块之间不必相邻
+#define RAMDISK_CHUNK_PAGES 16
+#define RAMDISK_CHUNK_SIZE (RAMDISK_CHUNK_PAGES * 4096)
+
+struct ramdisk {
+	uint8_t** chunks;
+	uint32_t chunk_cnt;
+	bool busy;          // 正在 start_io 里处理请求，end_io 中又提交的请求留给外层的循环处理
+	struct disk disk;
+};
+
+extern void ramdisk_init(void);
+
+#endif
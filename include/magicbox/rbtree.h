@@ -0,0 +1,51 @@
+#ifndef __INCLUDE_MAGICBOX_RBTREE_H
+#define __INCLUDE_MAGICBOX_RBTREE_H
+#include <global.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// 侵入式红黑树，用法与 dlist 相同，把 rb_node 嵌入到宿主结构体中，再用 member_to_entry 还原
+// 与 hashtable 一样，红黑树内部不加锁，并发安全性由调用者保证
+// 树本身不知道如何比较两个节点，查找和插入时的下降过程由调用者自己写：
+//     struct rb_node** link = &root->rb_node, *parent = NULL;
+//     while (*link) { parent = *link; link = key < KEY(parent) ? &parent->rb_left : &parent->rb_right; }
+//     rb_link_node(node, parent, link);
+//     rb_insert_color(node, root);
+// 这样比传入比较回调更快，也可以很方便地实现 lower_bound 之类的查找
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+struct rb_node {
+	struct rb_node* rb_parent;
+	struct rb_node* rb_left;
+	struct rb_node* rb_right;
+	uint32_t rb_color;
+};
+
+struct rb_root {
+	struct rb_node* rb_node;
+};
+
+#define RB_ROOT_INIT (struct rb_root) { NULL }
+#define rb_empty(root) ((root)->rb_node == NULL)
+// 不在任何树中的节点的 parent 指向自己，用来代替 dlist_is_linked 判断节点是否在树中
+#define rb_clear_node(node) ((node)->rb_parent = (node))
+#define rb_is_linked(node) ((node)->rb_parent != (node))
+
+// 把新节点挂到 parent 下面的 link 位置，之后必须调用 rb_insert_color 重新平衡
+static inline void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link) {
+	node->rb_parent = parent;
+	node->rb_left = node->rb_right = NULL;
+	node->rb_color = RB_RED;
+	*link = node;
+}
+
+extern void rb_insert_color(struct rb_node* node, struct rb_root* root);
+// 从树中摘除节点，摘除后节点处于 rb_clear_node 的状态
+extern void rb_erase(struct rb_node* node, struct rb_root* root);
+extern struct rb_node* rb_first(struct rb_root* root);
+extern struct rb_node* rb_last(struct rb_root* root);
+extern struct rb_node* rb_next(struct rb_node* node);
+extern struct rb_node* rb_prev(struct rb_node* node);
+#endif
@@ -2,6 +2,7 @@
 #define __INCLUDE_MAGICBOX_SWAP_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <bitmap.h>
 #include <sync.h>
 #include <dlist.h>
@@ -10,6 +11,7 @@
 
 struct task_struct;
 struct partition;
+struct page;
 
 struct swap_info {
     struct partition* part; // 引用你现有的分区结构
@@ -23,9 +25,11 @@ struct swap_info {
 extern void copy_page_tables(struct task_struct* from,struct task_struct* to,void* page_buf);
 extern void swap_page(uint32_t err_code,void* err_vaddr);
 extern void write_protect(uint32_t err_code,void* err_vaddr);
+extern int32_t pin_user_pages(uint32_t vaddr, uint32_t len, bool for_write, struct page** pages);
+extern void unpin_user_pages(struct page** pages, uint32_t cnt);
 extern void swap_init(void);
-extern void do_swapon(struct partition* part);
-extern void do_swapoff(struct partition* part);
+extern int32_t do_swapon(struct partition* part);
+extern int32_t do_swapoff(struct partition* part);
 extern void free_swap_slot(uint32_t pte_val);
 extern uint32_t alloc_swap_slot(int32_t* status);
 #endif
\ No newline at end of file
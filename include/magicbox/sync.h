@@ -22,5 +22,8 @@ extern void sema_wait(struct semaphore* psema);
 extern void sema_signal(struct semaphore* psema);
 extern bool sema_try_wait(struct semaphore* psema);
 extern void lock_acquire(struct lock* plock);
+extern bool lock_try_acquire(struct lock* plock);
 extern void lock_release(struct lock* plock);
+extern void lock_disown(struct lock* plock);
+extern void lock_release_disowned(struct lock* plock);
 #endif
\ No newline at end of file
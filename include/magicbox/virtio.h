@@ -0,0 +1,77 @@
+#ifndef __INCLUDE_MAGICBOX_VIRTIO_H
+#define __INCLUDE_MAGICBOX_VIRTIO_H
+
+#include <stdint.h>
+
+// virtio 是虚拟机给客户机准备的半虚拟化设备接口，QEMU 的 virtio 设备的 PCI 厂商号都是 0x1AF4
+// 我们使用 legacy（virtio 0.9.5）接口：寄存器都在 BAR0 的 I/O 端口里，和 IDE 一样用 in/out 访问
+// 但一次 I/O 只需要写一次通知寄存器，数据和命令都通过共享内存中的 virtqueue 传递，不用反复地访问端口
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+// legacy 接口的寄存器，相对于 BAR0 的 I/O 端口
+#define VIRTIO_PCI_HOST_FEATURES  0x00 // 32 位，设备支持的特性
+#define VIRTIO_PCI_GUEST_FEATURES 0x04 // 32 位，驱动要使用的特性
+#define VIRTIO_PCI_QUEUE_PFN      0x08 // 32 位，virtqueue 的物理页号
+#define VIRTIO_PCI_QUEUE_NUM      0x0C // 16 位，virtqueue 的大小，由设备决定
+#define VIRTIO_PCI_QUEUE_SEL      0x0E // 16 位，选择要操作的 virtqueue
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10 // 16 位，写入 virtqueue 的编号，通知设备有新的请求
+#define VIRTIO_PCI_STATUS         0x12 // 8 位，设备状态
+#define VIRTIO_PCI_ISR            0x13 // 8 位，中断状态，读取后清零并撤销中断
+#define VIRTIO_PCI_CONFIG         0x14 // 设备相关的配置从这里开始（没有启用 MSI-X 时）
+
+// 设备状态，驱动按顺序依次置位
+#define VIRTIO_STATUS_ACKNOWLEDGE 1   // 发现了设备
+#define VIRTIO_STATUS_DRIVER      2   // 有驱动可以驱动它
+#define VIRTIO_STATUS_DRIVER_OK   4   // 驱动初始化完成，设备可以开始工作
+#define VIRTIO_STATUS_FAILED      128 // 驱动放弃了这个设备
+
+// ISR 的 bit 0：virtqueue 中有新完成的请求
+#define VIRTIO_ISR_QUEUE 1
+
+// legacy 接口中 virtqueue 的对齐，used 环从这个边界开始
+#define VIRTIO_PCI_VRING_ALIGN 4096
+
+// 描述符的标志
+#define VRING_DESC_F_NEXT  1 // next 字段有效，请求的下一段在 next 指向的描述符里
+#define VRING_DESC_F_WRITE 2 // 这段内存由设备写入，否则由设备读取
+// used 环的标志：设备暂时不需要通知
+#define VRING_USED_F_NO_NOTIFY 1
+
+// virtqueue 由三部分组成：描述符表、avail 环（驱动交给设备的请求）、used 环（设备完成的请求）
+// 一个请求是用 next 串起来的几个描述符，环里放的是第一个描述符的下标
+struct vring_desc {
+	uint64_t addr;  // 物理地址
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__ ((packed));
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;   // 驱动下一次要写的位置，只增不减，取模后才是下标
+	uint16_t ring[];
+} __attribute__ ((packed));
+
+struct vring_used_elem {
+	uint32_t id;    // 完成的请求的第一个描述符
+	uint32_t len;   // 设备写入的字节数
+} __attribute__ ((packed));
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;   // 设备下一次要写的位置
+	struct vring_used_elem ring[];
+} __attribute__ ((packed));
+
+// 驱动和设备通过共享内存交换请求，写描述符、写 avail 环、写 idx 的顺序不能被打乱
+// x86 不会把写和写、读和读重排，只需要阻止编译器重排
+#define virtio_barrier() asm volatile ("" : : : "memory")
+
+// 大小为 num 的 virtqueue 占用的字节数
+// 描述符表和 avail 环紧挨着，used 环从下一个 VIRTIO_PCI_VRING_ALIGN 边界开始
+#define VRING_USED_OFFSET(num) \
+	((sizeof(struct vring_desc) * (num) + sizeof(uint16_t) * (3 + (num)) + VIRTIO_PCI_VRING_ALIGN - 1) & ~(VIRTIO_PCI_VRING_ALIGN - 1))
+#define VRING_SIZE(num) \
+	(VRING_USED_OFFSET(num) + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * (num))
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __INCLUDE_MAGICBOX_VIRTIO_BLK_H
+#define __INCLUDE_MAGICBOX_VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <virtio.h>
+
+struct disk;
+struct request;
+struct io_vec;
+
+// legacy 接口的 virtio-blk 设备号，modern 设备（0x1042）不提供 I/O BAR，我们不支持
+#define VIRTIO_BLK_PCI_DEVICE 0x1001
+#define VIRTIO_BLK_MAX_DEVS 4
+
+// virtio-blk 的特性位
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1) // 配置中的 size_max 有效：每段内存最多的字节数
+#define VIRTIO_BLK_F_SEG_MAX  (1 << 2) // 配置中的 seg_max 有效：一个请求最多的数据段数
+#define VIRTIO_BLK_F_FLUSH    (1 << 9) // 设备有写缓存，支持 VIRTIO_BLK_T_FLUSH
+
+// 设备配置，相对于 VIRTIO_PCI_CONFIG
+#define VIRTIO_BLK_CFG_CAPACITY 0x00 // 64 位，以 512 字节为单位的容量
+#define VIRTIO_BLK_CFG_SIZE_MAX 0x08
+#define VIRTIO_BLK_CFG_SEG_MAX  0x0C
+
+// 请求的类型
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+// 请求完成后设备写入的状态
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+// 每个请求的第一段，由设备读取
+struct virtio_blk_outhdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__ ((packed));
+
+// 一个发给设备的请求，以它的第一个描述符的下标为编号，和描述符一样多
+// hdr 和 status 要被设备读写，整个数组放在物理连续的内核页里
+struct virtio_blk_req {
+	struct virtio_blk_outhdr hdr;
+	uint8_t status;
+	struct request* rq; // 这个请求属于哪条命令（调度器给出的命令头）
+};
+
+// 一个 virtio-blk 设备，只有一个 virtqueue
+// 除了初始化阶段，这些字段都由关中断保护
+struct virtio_blk {
+	uint16_t iobase;
+	uint8_t irq_no;
+	uint32_t features;       // 协商好的特性
+	uint16_t num;            // virtqueue 的大小
+	struct vring_desc* desc;
+	volatile struct vring_avail* avail;
+	volatile struct vring_used* used;
+	uint16_t free_head;      // 空闲描述符用 next 串成链表
+	uint16_t free_cnt;
+	uint16_t last_used;      // 下一个要处理的 used 环位置
+	uint32_t seg_max;        // 一个请求最多的数据段数
+	uint32_t size_max;       // 每段最多的字节数
+	struct virtio_blk_req* reqs;
+	uint32_t inflight;       // 已经发给设备还没完成的请求数
+	// 一条命令可能因为段数或者描述符不够被拆成几个请求，cur_rq 是还没有全部发出的命令
+	// 它的 io_vec 拼在 merge_vec 里，secs_done、vec_idx 和 vec_off 记录下一个请求从哪里开始
+	struct request* cur_rq;
+	struct io_vec* cmd_vec;
+	uint32_t cmd_vec_cnt;
+	struct io_vec* merge_vec;
+	struct request* flush_rq; // 正在等待或者正在执行的 FLUSH，它不能和其他请求同时执行
+	struct disk* disk;
+};
+
+extern void virtio_blk_pci_driver_init(void);
+
+#endif
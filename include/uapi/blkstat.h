@@ -0,0 +1,52 @@
+#ifndef __INCLUDE_UAPI_BLKSTAT_H
+#define __INCLUDE_UAPI_BLKSTAT_H
+
+#include <stdint.h>
+#include <ioctl.h>
+
+// 命令延迟直方图的桶数
+// 延迟以时钟中断的 tick 为单位（5ms 一个 tick），第 0 个桶是不到 1 个 tick 的命令
+// 第 i 个桶（i >= 1）是 [2^(i-1), 2^i) 个 tick 的命令，最后一个桶收纳所有更慢的命令
+#define BLK_LAT_BUCKETS 8
+
+// ide 缓存的统计，所有磁盘共用一个缓存，因此是全局的
+struct buffer_stats {
+	uint32_t hits;            // getblk 命中
+	uint32_t misses;          // getblk 未命中
+	uint32_t evictions;       // 在 getblk 中同步淘汰的干净块
+	uint32_t dirty_evictions; // 在 getblk 中同步淘汰的脏块，淘汰前要先写回
+	uint32_t wb_runs;         // 写回的批次数，每一批是磁盘上连续的一段，一条命令写完
+	uint32_t wb_blocks;       // 写回的块数
+	uint32_t wb_sectors;      // 写回的扇区数，wb_sectors / wb_runs 就是平均每批的长度
+	uint32_t read_dedups;     // 未命中后等别人正在进行的读盘完成、没有自己再读一次的块数
+	uint32_t demotions;       // 流式读之后被挪到替换策略冷端的块数
+};
+
+// 单个磁盘的统计
+struct disk_stats {
+	uint32_t read_cmds;
+	uint32_t write_cmds;
+	uint32_t flush_cmds;
+	uint32_t read_sectors;
+	uint32_t write_sectors;
+	uint32_t merges;     // 并进了别的请求、没有单独发命令的请求数
+	uint32_t lat_hist[BLK_LAT_BUCKETS]; // 读写命令从提交到完成的延迟，包括在通道上排队的时间
+	// 命令是怎么完成的：小的同步读写由提交者自旋轮询磁盘状态，其余的睡眠等中断
+	uint32_t polled_cmds;   // 轮询时完成的命令数
+	uint32_t intr_cmds;     // 在中断中完成的命令数，RAM 磁盘在提交时直接完成，两者都不算
+	uint32_t poll_timeouts; // 轮询超出预算、退回去睡眠等中断的同步请求数
+};
+
+// ioctl(fd, BLKSTAT, &st) 的返回值，fd 是 /dev/sdX 或者它的分区
+// 计数器只增不减，采样两次相减就是这段时间内的值
+struct blk_stats {
+	struct buffer_stats cache;
+	struct disk_stats disk;      // 设备文件所在的磁盘
+	uint32_t cache_bytes;        // 当前缓存块占用的字节数
+	uint32_t cache_max_bytes;    // 缓存当前的目标容量
+	uint32_t dirty_bytes;        // 该磁盘上的脏数据字节数
+};
+
+#define BLKSTAT _IOR(BLK_MAGIC, 0x80, struct blk_stats)
+
+#endif
@@ -86,7 +86,7 @@ extern int32_t read(int32_t fd,void* buf,uint32_t count);
 extern void putchar(char char_ascii);
 extern void clear(void);
 extern char* getcwd(char* buf,uint32_t size);
-extern int32_t open(char* pathname,uint8_t flag);
+extern int32_t open(char* pathname,int32_t flag);
 extern int32_t close(int32_t fd);
 extern int32_t lseek(int32_t fd,int32_t offset,uint8_t whence);
 extern int32_t unlink(const char* pathname);
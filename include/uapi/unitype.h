@@ -90,6 +90,9 @@ enum oflags{ // operation flags
 	// 加上O_EXCL则是只有在不存在时才创建，存在时报错不打开
 	O_EXCL = 64, 
     O_NONBLOCK = 128,
+	// 绕过 ide 缓存直接读写磁盘，只支持块设备和 ext2 的普通文件
+	// 缓冲区、文件位置和长度都必须按扇区对齐
+	O_DIRECT = 256,
 };
 
 enum whence{
@@ -28,6 +28,7 @@
 #include <syscall_intrcpt.h>
 #include <swap.h>
 #include <pci.h>
+#include <ramdisk.h>
 
 void init(void);
 void print_logo(void);
@@ -47,7 +48,6 @@ const char* init_envp[] = {
 
 struct task_struct* main_thread;
 struct task_struct* idle_thread;
-struct task_struct* sync_thread;
 
 void init(void) {
     // 先打开一个可读可写的控制台
@@ -213,10 +213,12 @@ static void after_init() {
     // intr_enable(); // ide_init will use the interrupt
     ide_init();
     pci_init();
+    ramdisk_init();
     swap_init();
-    // 启动 sync 内核线程，他会定期将脏块刷回磁盘
-    // 名称前面带下划线 _ 表示是一个内核线程
-    sync_thread = thread_start("_sync",32,sync_ide_buffer,NULL);
+    // 为每个磁盘启动写回线程，它们会按照脏块的过期时间和脏数据的比例将脏块刷回磁盘
+    ide_writeback_init();
+    // 启动预读线程，它在后台把顺序读的进程接下来要读的数据提前读进缓存
+    thread_start("_readahead",31,readahead_ide_buffer,NULL);
     time_init(); // 这里面会用到printk函数，因此放到此处
     filesys_init();
     make_dev_nodes();
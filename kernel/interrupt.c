@@ -110,6 +110,19 @@ static void pic_init(void){
     put_str("init pic done\n");
 }
 
+// 打开 8259A 上 irq 号中断的屏蔽，PCI 设备的中断线由 BIOS 分配，驱动探测到设备之后再打开
+// 从片上的中断还需要打开主片上级联用的 IRQ2，我们在 pic_init 里已经打开了
+void pic_enable_irq(uint8_t irq) {
+    ASSERT(irq < 16);
+    enum intr_status old = intr_disable();
+    if (irq < 8) {
+        outb(PIC_M_DATA, inb(PIC_M_DATA) & ~(1 << irq));
+    } else {
+        outb(PIC_S_DATA, inb(PIC_S_DATA) & ~(1 << (irq - 8)));
+    }
+    intr_set_status(old);
+}
+
 // default intr handler
 static void intr_handler_general(uint8_t intr_vec){
     if(intr_vec==0x27||intr_vec==0x2f){
@@ -1,10 +1,17 @@
 #include <vgacon.h>
 #include <init.h>
+#include <string.h>
+
+// 链接器给出的 .bss 起止地址
+extern char __bss_start[], _end[];
 
 int main(void) {
+   // loader 只按 p_filesz 拷贝各个段，不会把 .bss 清零
+   // 内核展开后的 .bss 会伸进 loader 暂存 ELF 文件的 0x60000，那里残留着文件的内容，所以这里先全部清零
+   memset(__bss_start, 0, _end - __bss_start);
    put_str("enter kernel\n");
    early_init();
 
    while(1);
    return 0;
-}
\ No newline at end of file
+}
@@ -5,52 +5,221 @@
 #include <stdbool.h>
 #include <debug.h>
 
-void hash_init(struct hashtable *hash,uint32_t bucket_nr, hash_callback hash_func, func_condition condition){
-	uint32_t bucket_idx;
+// 平均链长超过 HASH_MAX_LOAD 时扩容，元素数不到桶数的 1/HASH_SHRINK_DIV 时缩容
+#define HASH_MAX_LOAD 2
+#define HASH_SHRINK_DIV 8
+// 桶数的上限，65536 个桶的数组占 1MB
+#define HASH_MAX_BUCKET_NR (1 << 16)
+// 每次操作最多迁移一个非空旧桶，为了找到它最多跳过这么多个空桶
+#define HASH_REHASH_EMPTY_VISITS 10
+
+static uint32_t round_up_pow2(uint32_t x) {
+	uint32_t n = 1;
+	while (n < x) n <<= 1;
+	return n;
+}
+
+static struct dlist* alloc_buckets(uint32_t bucket_nr) {
+	struct dlist* buckets = (struct dlist*) kmalloc(bucket_nr*sizeof(struct dlist));
+	if (NULL == buckets) {
+		return NULL;
+	}
+	for (uint32_t bucket_idx = 0; bucket_idx < bucket_nr; bucket_idx++) {
+		dlist_init(&buckets[bucket_idx]);
+	}
+	return buckets;
+}
+
+void hash_init_striped(struct hashtable *hash, uint32_t bucket_nr, uint32_t stripe_nr, hash_callback hash_func, hash_elem_callback elem_hash, func_condition condition){
+	ASSERT(stripe_nr > 0 && (stripe_nr & (stripe_nr - 1)) == 0);
+	bucket_nr = round_up_pow2(bucket_nr);
+	if (bucket_nr < stripe_nr) bucket_nr = stripe_nr;
+
 	hash->bucket_nr = bucket_nr;
-	hash->buckets = (struct dlist*) kmalloc(bucket_nr*sizeof(struct dlist));
-	hash->elem_nr = 0;
+	hash->min_bucket_nr = bucket_nr;
+	hash->buckets = alloc_buckets(bucket_nr);
 	if(NULL==hash->buckets){
 		PANIC("hash->buckets is NULL!\n");
 	}
+	hash->old_buckets = NULL;
+	hash->old_bucket_nr = 0;
+	hash->stripe_nr = stripe_nr;
+	// kmalloc 出来的内存是清零的
+	hash->stripes = (struct hash_stripe*) kmalloc(stripe_nr * sizeof(struct hash_stripe));
+	if (NULL == hash->stripes) {
+		PANIC("hash->stripes is NULL!\n");
+	}
 	hash->hash_func = hash_func;
+	hash->elem_hash = elem_hash;
 	hash->condition = condition;
-	for(bucket_idx=0;bucket_idx<bucket_nr;bucket_idx++){
-		dlist_init(&hash->buckets[bucket_idx]);
+}
+
+void hash_init(struct hashtable *hash,uint32_t bucket_nr, hash_callback hash_func, hash_elem_callback elem_hash, func_condition condition){
+	hash_init_striped(hash, bucket_nr, 1, hash_func, elem_hash, condition);
+}
+
+static inline uint32_t get_stripe(struct hashtable* hash, uint32_t hval){
+	return hval & (hash->stripe_nr - 1);
+}
+
+uint32_t hash_elem_nr(struct hashtable *hash){
+	uint32_t elem_nr = 0;
+	for (uint32_t i = 0; i < hash->stripe_nr; i++) {
+		elem_nr += hash->stripes[i].elem_nr;
 	}
+	return elem_nr;
 }
 
-static inline uint32_t get_bucket(struct hashtable* hash,void* arg){
-	// 取模，防止溢出
-	return (hash->hash_func(arg)) % hash->bucket_nr;
+// 把旧桶 idx 中的元素全部搬到新表，新桶与旧桶属于同一组
+static void migrate_bucket(struct hashtable* hash, uint32_t idx){
+	struct dlist* old = &hash->old_buckets[idx];
+	while (!dlist_empty(old)) {
+		struct dlist_elem* pelem = dlist_pop_front(old);
+		uint32_t hval = hash->elem_hash(pelem);
+		dlist_push_back(&hash->buckets[hval & (hash->bucket_nr - 1)], pelem);
+	}
 }
 
+static void free_old_buckets(struct hashtable* hash){
+	kfree(hash->old_buckets);
+	hash->old_buckets = NULL;
+	hash->old_bucket_nr = 0;
+}
+
+// 渐进式迁移，从 stripe 这一组中搬走一个非空旧桶
+static void rehash_step(struct hashtable* hash, uint32_t stripe){
+	if (hash->old_buckets == NULL) return;
+	struct hash_stripe* st = &hash->stripes[stripe];
+	uint32_t empty_visits = HASH_REHASH_EMPTY_VISITS;
+	while (st->rehash_idx < hash->old_bucket_nr) {
+		uint32_t idx = st->rehash_idx;
+		st->rehash_idx += hash->stripe_nr;
+		if (!dlist_empty(&hash->old_buckets[idx])) {
+			migrate_bucket(hash, idx);
+			break;
+		}
+		if (--empty_visits == 0) break;
+	}
+	// 不分组时搬完就可以释放旧表了，分组时其他组可能还在用旧表，留给 hash_resize 释放
+	if (hash->stripe_nr == 1 && st->rehash_idx >= hash->old_bucket_nr) {
+		free_old_buckets(hash);
+	}
+}
+
+static struct dlist_elem* do_find(struct hashtable* hash, void* arg, uint32_t hval){
+	if (hash->old_buckets != NULL) {
+		struct dlist_elem* elem = dlist_traversal(&hash->old_buckets[hval & (hash->old_bucket_nr - 1)], hash->condition, arg);
+		if (elem != NULL) return elem;
+	}
+	return dlist_traversal(&hash->buckets[hval & (hash->bucket_nr - 1)], hash->condition, arg);
+}
+
+static void do_add(struct hashtable* hash, uint32_t hval, struct dlist_elem* pelem){
+	// 迁移期间新元素一律放进新表
+	dlist_push_back(&hash->buckets[hval & (hash->bucket_nr - 1)], pelem);
+	hash->stripes[get_stripe(hash, hval)].elem_nr++;
+}
+
+static void auto_resize(struct hashtable* hash){
+	if (hash->stripe_nr == 1 && hash_resize_needed(hash)) {
+		hash_resize(hash);
+	}
+}
 
 struct dlist_elem* hash_find(struct hashtable *hash, void *arg){
-	// 先获取桶索引，在此处强制取模一次，防止创建hash函数时忘记了
-	uint32_t bucket_idx = get_bucket(hash,arg);
-	// 到相应的桶中查找元素
-	struct dlist_elem* elem = dlist_traversal(&hash->buckets[bucket_idx], hash->condition, arg);
-	return elem;
+	uint32_t hval = hash->hash_func(arg);
+	rehash_step(hash, get_stripe(hash, hval));
+	return do_find(hash, arg, hval);
 }
 
+// 插入前检查 key 是否已经存在，存在就什么也不做
 void hash_insert(struct hashtable *hash, void *arg, struct dlist_elem* pelem){
-	uint32_t bucket_idx = get_bucket(hash,arg);
-	if(NULL!=dlist_traversal(&hash->buckets[bucket_idx],hash->condition,arg)){
+	uint32_t hval = hash->hash_func(arg);
+	rehash_step(hash, get_stripe(hash, hval));
+	if(NULL!=do_find(hash, arg, hval)){
 		return;
 	}
-	dlist_push_back(&hash->buckets[bucket_idx],pelem);
-	hash->elem_nr++;
+	do_add(hash, hval, pelem);
+	auto_resize(hash);
+}
+
+// 不检查重复直接插入，调用者需要保证 key 不在表中（比如刚刚在同一把锁下 hash_find 过）
+void hash_add(struct hashtable *hash, void *arg, struct dlist_elem* pelem){
+	uint32_t hval = hash->hash_func(arg);
+	rehash_step(hash, get_stripe(hash, hval));
+	do_add(hash, hval, pelem);
+	auto_resize(hash);
 }
 
-//  O(1) 版本的删除：直接剥离节点，不需要 Key，也不需要重新计算哈希
+//  O(1) 版本的删除：直接剥离节点，不需要 Key
+//  元素里的 key 仍然要完好，计数按组记录，需要用 elem_hash 算出它属于哪一组
 void hash_remove(struct hashtable *hash,struct dlist_elem* pelem) {
     if (pelem != NULL) {
+		uint32_t stripe = get_stripe(hash, hash->elem_hash(pelem));
         dlist_remove(pelem);
-		hash->elem_nr--;
+		hash->stripes[stripe].elem_nr--;
+		rehash_step(hash, stripe);
+		auto_resize(hash);
     }
 }
 
+// 按当前的元素个数算出合适的桶数
+static uint32_t resize_target(struct hashtable* hash){
+	uint32_t elem_nr = hash_elem_nr(hash);
+	uint32_t target = hash->bucket_nr;
+	if (elem_nr > hash->bucket_nr * HASH_MAX_LOAD) {
+		target = round_up_pow2(elem_nr);
+	} else if (elem_nr < hash->bucket_nr / HASH_SHRINK_DIV) {
+		target = round_up_pow2(elem_nr * 2);
+	}
+	if (target < hash->min_bucket_nr) target = hash->min_bucket_nr;
+	if (target > HASH_MAX_BUCKET_NR) target = HASH_MAX_BUCKET_NR;
+	return target;
+}
+
+// 是否需要调用 hash_resize
+// 分组的哈希表可以在不持有锁时调用它做粗略的判断，拿齐锁之后再调用一次确认
+bool hash_resize_needed(struct hashtable *hash){
+	if (hash->old_buckets != NULL) {
+		// 上一次迁移还没做完，新表又已经装满了
+		if (hash_elem_nr(hash) > hash->bucket_nr * HASH_MAX_LOAD) return true;
+		// 所有组都迁移完了，旧表可以释放了
+		for (uint32_t i = 0; i < hash->stripe_nr; i++) {
+			if (hash->stripes[i].rehash_idx < hash->old_bucket_nr) return false;
+		}
+		return true;
+	}
+	return resize_target(hash) != hash->bucket_nr;
+}
+
+// 换表，之后的操作会逐桶把元素搬到新表
+// 上一次的迁移还没做完时先把剩下的旧桶一次性搬完
+// 会动所有的桶，分组的哈希表需要调用者持有所有组的锁
+void hash_resize(struct hashtable *hash){
+	if (hash->old_buckets != NULL) {
+		for (uint32_t idx = 0; idx < hash->old_bucket_nr; idx++) {
+			migrate_bucket(hash, idx);
+		}
+		free_old_buckets(hash);
+	}
+
+	uint32_t target = resize_target(hash);
+	if (target == hash->bucket_nr) return;
+	// 申请不到内存就继续用现在的表，只是链长一些
+	struct dlist* buckets = alloc_buckets(target);
+	if (buckets == NULL) return;
+
+	hash->old_buckets = hash->buckets;
+	hash->old_bucket_nr = hash->bucket_nr;
+	hash->buckets = buckets;
+	hash->bucket_nr = target;
+	for (uint32_t i = 0; i < hash->stripe_nr; i++) {
+		hash->stripes[i].rehash_idx = i;
+	}
+}
+
 void hash_free(struct hashtable *hash){
 	if(NULL!=hash->buckets) kfree(hash->buckets);
+	if(NULL!=hash->old_buckets) kfree(hash->old_buckets);
+	if(NULL!=hash->stripes) kfree(hash->stripes);
 }
@@ -0,0 +1,270 @@
+#include <rbtree.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <debug.h>
+
+// 红黑树的五条性质：
+// 1. 节点是红色或黑色
+// 2. 根节点是黑色
+// 3. 叶子（NULL）是黑色
+// 4. 红色节点的两个孩子都是黑色
+// 5. 从任一节点到其所有叶子的路径上，黑色节点的数目相同
+// 插入和删除时通过旋转和变色来维护这些性质，保证树高不超过 2log(n+1)
+
+#define rb_is_red(node) ((node) != NULL && (node)->rb_color == RB_RED)
+#define rb_is_black(node) ((node) == NULL || (node)->rb_color == RB_BLACK)
+
+// 用 new 替换 old 在父节点中的位置
+static void rb_replace_child(struct rb_node* old, struct rb_node* new, struct rb_node* parent, struct rb_root* root) {
+	if (parent == NULL) {
+		root->rb_node = new;
+	} else if (parent->rb_left == old) {
+		parent->rb_left = new;
+	} else {
+		parent->rb_right = new;
+	}
+}
+
+// 左旋：node 的右孩子 right 顶替 node 的位置，node 变成 right 的左孩子
+// right 原来的左子树 b 变成 node 的右子树
+//   node(a, right(b, c))  -->  right(node(a, b), c)
+static void rb_rotate_left(struct rb_node* node, struct rb_root* root) {
+	struct rb_node* right = node->rb_right;
+	struct rb_node* parent = node->rb_parent;
+
+	node->rb_right = right->rb_left;
+	if (right->rb_left != NULL) {
+		right->rb_left->rb_parent = node;
+	}
+	right->rb_left = node;
+	right->rb_parent = parent;
+	rb_replace_child(node, right, parent, root);
+	node->rb_parent = right;
+}
+
+// 右旋，与左旋对称
+//   node(left(a, b), c)  -->  left(a, node(b, c))
+static void rb_rotate_right(struct rb_node* node, struct rb_root* root) {
+	struct rb_node* left = node->rb_left;
+	struct rb_node* parent = node->rb_parent;
+
+	node->rb_left = left->rb_right;
+	if (left->rb_right != NULL) {
+		left->rb_right->rb_parent = node;
+	}
+	left->rb_right = node;
+	left->rb_parent = parent;
+	rb_replace_child(node, left, parent, root);
+	node->rb_parent = left;
+}
+
+void rb_insert_color(struct rb_node* node, struct rb_root* root) {
+	struct rb_node* parent;
+	// 只有父节点也是红色时才违反性质 4
+	while ((parent = node->rb_parent) != NULL && parent->rb_color == RB_RED) {
+		// 父节点是红色，所以它一定不是根，祖父节点一定存在
+		struct rb_node* gparent = parent->rb_parent;
+		if (parent == gparent->rb_left) {
+			struct rb_node* uncle = gparent->rb_right;
+			if (rb_is_red(uncle)) {
+				// 叔叔是红色，父亲和叔叔变黑，祖父变红，问题上移到祖父
+				parent->rb_color = RB_BLACK;
+				uncle->rb_color = RB_BLACK;
+				gparent->rb_color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_right) {
+				// 先转成左左的形状
+				rb_rotate_left(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_color = RB_BLACK;
+			gparent->rb_color = RB_RED;
+			rb_rotate_right(gparent, root);
+		} else {
+			struct rb_node* uncle = gparent->rb_left;
+			if (rb_is_red(uncle)) {
+				parent->rb_color = RB_BLACK;
+				uncle->rb_color = RB_BLACK;
+				gparent->rb_color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_left) {
+				rb_rotate_right(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_color = RB_BLACK;
+			gparent->rb_color = RB_RED;
+			rb_rotate_left(gparent, root);
+		}
+	}
+	root->rb_node->rb_color = RB_BLACK;
+}
+
+// 删除了一个黑色节点后，child 所在的这条路径少了一个黑色节点，需要修复
+// child 可能是 NULL，所以同时传入它的父节点
+static void rb_erase_color(struct rb_node* child, struct rb_node* parent, struct rb_root* root) {
+	struct rb_node* sibling;
+	while (child != root->rb_node && rb_is_black(child)) {
+		if (parent->rb_left == child) {
+			sibling = parent->rb_right;
+			if (rb_is_red(sibling)) {
+				// 兄弟是红色，先转成兄弟是黑色的情况
+				sibling->rb_color = RB_BLACK;
+				parent->rb_color = RB_RED;
+				rb_rotate_left(parent, root);
+				sibling = parent->rb_right;
+			}
+			if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+				// 兄弟的孩子都是黑色，兄弟变红，问题上移到父节点
+				sibling->rb_color = RB_RED;
+				child = parent;
+				parent = child->rb_parent;
+				continue;
+			}
+			if (rb_is_black(sibling->rb_right)) {
+				sibling->rb_left->rb_color = RB_BLACK;
+				sibling->rb_color = RB_RED;
+				rb_rotate_right(sibling, root);
+				sibling = parent->rb_right;
+			}
+			sibling->rb_color = parent->rb_color;
+			parent->rb_color = RB_BLACK;
+			sibling->rb_right->rb_color = RB_BLACK;
+			rb_rotate_left(parent, root);
+			child = root->rb_node;
+			break;
+		} else {
+			sibling = parent->rb_left;
+			if (rb_is_red(sibling)) {
+				sibling->rb_color = RB_BLACK;
+				parent->rb_color = RB_RED;
+				rb_rotate_right(parent, root);
+				sibling = parent->rb_left;
+			}
+			if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+				sibling->rb_color = RB_RED;
+				child = parent;
+				parent = child->rb_parent;
+				continue;
+			}
+			if (rb_is_black(sibling->rb_left)) {
+				sibling->rb_right->rb_color = RB_BLACK;
+				sibling->rb_color = RB_RED;
+				rb_rotate_left(sibling, root);
+				sibling = parent->rb_left;
+			}
+			sibling->rb_color = parent->rb_color;
+			parent->rb_color = RB_BLACK;
+			sibling->rb_left->rb_color = RB_BLACK;
+			rb_rotate_right(parent, root);
+			child = root->rb_node;
+			break;
+		}
+	}
+	if (child != NULL) {
+		child->rb_color = RB_BLACK;
+	}
+}
+
+void rb_erase(struct rb_node* node, struct rb_root* root) {
+	ASSERT(rb_is_linked(node));
+	struct rb_node* child;
+	struct rb_node* parent;
+	uint32_t color;
+
+	if (node->rb_left != NULL && node->rb_right != NULL) {
+		// 有两个孩子，用中序后继 succ 顶替 node 的位置
+		// succ 没有左孩子，把它的右孩子接到它原来的位置上
+		struct rb_node* succ = node->rb_right;
+		while (succ->rb_left != NULL) {
+			succ = succ->rb_left;
+		}
+		child = succ->rb_right;
+		parent = succ->rb_parent;
+		color = succ->rb_color;
+
+		if (parent == node) {
+			parent = succ;
+		} else {
+			if (child != NULL) {
+				child->rb_parent = parent;
+			}
+			parent->rb_left = child;
+			succ->rb_right = node->rb_right;
+			node->rb_right->rb_parent = succ;
+		}
+		succ->rb_parent = node->rb_parent;
+		succ->rb_color = node->rb_color;
+		succ->rb_left = node->rb_left;
+		node->rb_left->rb_parent = succ;
+		rb_replace_child(node, succ, node->rb_parent, root);
+	} else {
+		child = node->rb_left != NULL ? node->rb_left : node->rb_right;
+		parent = node->rb_parent;
+		color = node->rb_color;
+		if (child != NULL) {
+			child->rb_parent = parent;
+		}
+		rb_replace_child(node, child, parent, root);
+	}
+
+	// 真正被摘掉的位置上原来是黑色节点时才需要修复
+	if (color == RB_BLACK) {
+		rb_erase_color(child, parent, root);
+	}
+	rb_clear_node(node);
+}
+
+struct rb_node* rb_first(struct rb_root* root) {
+	struct rb_node* node = root->rb_node;
+	if (node == NULL) return NULL;
+	while (node->rb_left != NULL) {
+		node = node->rb_left;
+	}
+	return node;
+}
+
+struct rb_node* rb_last(struct rb_root* root) {
+	struct rb_node* node = root->rb_node;
+	if (node == NULL) return NULL;
+	while (node->rb_right != NULL) {
+		node = node->rb_right;
+	}
+	return node;
+}
+
+// 中序后继：有右子树就是右子树的最左节点，否则向上找到第一个“从左边上来”的祖先
+struct rb_node* rb_next(struct rb_node* node) {
+	if (node->rb_right != NULL) {
+		node = node->rb_right;
+		while (node->rb_left != NULL) {
+			node = node->rb_left;
+		}
+		return node;
+	}
+	struct rb_node* parent;
+	while ((parent = node->rb_parent) != NULL && node == parent->rb_right) {
+		node = parent;
+	}
+	return parent;
+}
+
+struct rb_node* rb_prev(struct rb_node* node) {
+	if (node->rb_left != NULL) {
+		node = node->rb_left;
+		while (node->rb_right != NULL) {
+			node = node->rb_right;
+		}
+		return node;
+	}
+	struct rb_node* parent;
+	while ((parent = node->rb_parent) != NULL && node == parent->rb_left) {
+		node = parent;
+	}
+	return parent;
+}
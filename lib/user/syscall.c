@@ -120,7 +120,7 @@ char* getcwd(char* buf,uint32_t size){
 	return (char*)_syscall2(SYS_GETCWD,buf,size);
 }
 
-int32_t open(char* pathname,uint8_t flag){
+int32_t open(char* pathname,int32_t flag){
 	return _syscall2(SYS_OPEN,pathname,flag);
 }
 
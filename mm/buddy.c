@@ -1,6 +1,7 @@
 #include <buddy.h>
 #include <debug.h>
 #include <vgacon.h>
+#include <global.h>
 
 // 系统刚起来时，伙伴系统还没起来，global_pages 需要绕过伙伴系统特殊处理来存储
 void buddy_init(struct buddy_pool* bpool, uint32_t start_addr, uint32_t size, struct page* page_base) {
@@ -233,4 +234,13 @@ void pfree_pages(struct buddy_pool* bpool, struct page* pg, uint32_t order) {
     bpool->areas[k].nr_free++;
 
     lock_release(&bpool->lock);
-}
\ No newline at end of file
+}
+// 统计内存池中空闲的字节数
+// 只是一个估计值，不加锁，调用者拿到结果时它可能已经变了
+uint32_t buddy_free_bytes(struct buddy_pool* bpool) {
+    uint32_t pages = 0;
+    for (int i = 0; i < MAX_ORDER; i++) {
+        pages += bpool->areas[i].nr_free << i;
+    }
+    return pages * PG_SIZE;
+}
@@ -29,6 +29,8 @@ struct mem_block_desc k_block_descs[DESC_TYPE_CNT];
 static struct lock kmap_lock;
 static uint32_t kmap_slots[KMAP_SLOT_CNT];
 static uint32_t kernel_direct_map_limit = 0;
+// 所有注册的内存回收回调
+static struct dlist shrinker_list;
 
 uint32_t mem_bytes_total = 0;
 uint32_t total_pages = 0;
@@ -121,6 +123,7 @@ void mem_init(void){
 
 	mem_pool_init(mem_bytes_total);
 	block_desc_init(k_block_descs);
+	dlist_init(&shrinker_list);
 	put_str("mem_init done\n");
 }
 
@@ -302,6 +305,10 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
     // 这类结构必须要在一个能被内核随时都能访问到的区域中
     if (pf == PF_KERNEL) {
         struct page* first_pg = palloc_pages_exact(&kernel_pool, pg_cnt);
+        if (first_pg == NULL && shrink_kernel_memory(pg_cnt * PG_SIZE) > 0) {
+            // 让磁盘缓存等子系统吐出一些内存后再试一次
+            first_pg = palloc_pages_exact(&kernel_pool, pg_cnt);
+        }
         if (first_pg == NULL) {
             PANIC("malloc_page: kernel lowmem exhausted");
         }
@@ -518,6 +525,42 @@ void kunmap(void* _vaddr) {
     lock_release(&kmap_lock);
 }
 
+// 把设备的寄存器（PCI 设备 BAR 指向的 MMIO 区域）映射到内核的虚拟地址空间，返回 paddr 对应的虚拟地址
+// MMIO 区域在物理内存之外，不在直接映射区里，因此和高端内存一样借用 kmap 区域的连续几个空位
+// 对寄存器的读写会触发设备的动作，必须每次都真正地到达设备，所以页表项要禁用缓存
+// 驱动一直使用这些寄存器，映射不会被撤销
+void* ioremap(uint32_t paddr, uint32_t size) {
+    uint32_t offset = paddr & 0xfff;
+    uint32_t pg_cnt = DIV_ROUND_UP(offset + size, PG_SIZE);
+    paddr &= 0xfffff000;
+
+    lock_acquire(&kmap_lock);
+    uint32_t run = 0;
+    for (uint32_t idx = 0; idx < KMAP_SLOT_CNT; idx++) {
+        uint32_t vaddr = KERNEL_KMAP_START + idx * PG_SIZE;
+        if (kmap_slots[idx] != 0 || (*pte_ptr(vaddr) & PG_P_1)) {
+            run = 0;
+            continue;
+        }
+        if (++run < pg_cnt) {
+            continue;
+        }
+        // 找到了连续 pg_cnt 个空位 [idx - pg_cnt + 1, idx]
+        uint32_t first = idx + 1 - pg_cnt;
+        for (uint32_t i = 0; i < pg_cnt; i++) {
+            uint32_t va = KERNEL_KMAP_START + (first + i) * PG_SIZE;
+            *pte_ptr(va) = (paddr + i * PG_SIZE) | PG_PCD | PG_PWT | PG_P_1 | PG_RW_W | PG_US_S;
+            asm volatile ("invlpg %0" : : "m" (*(char*)va) : "memory");
+            kmap_slots[first + i] = paddr + i * PG_SIZE;
+        }
+        lock_release(&kmap_lock);
+        return (void*)(KERNEL_KMAP_START + first * PG_SIZE + offset);
+    }
+    lock_release(&kmap_lock);
+    PANIC("ioremap: no free kmap slots");
+    return NULL;
+}
+
 void block_desc_init(struct mem_block_desc* desc_array){
 	uint16_t desc_idx,block_size = 16;
 	for(desc_idx=0;desc_idx<DESC_TYPE_CNT;desc_idx++){
@@ -560,6 +603,25 @@ void* kmalloc(uint32_t size) {
     return do_alloc(size);
 }
 
+void register_shrinker(struct shrinker* s) {
+	enum intr_status old = intr_disable();
+	dlist_push_back(&shrinker_list, &s->shrinker_tag);
+	intr_set_status(old);
+}
+
+// 依次调用各个回收回调，直到释放的内存达到 bytes 或者所有回调都试过一遍
+// 返回总共释放的字节数
+uint32_t shrink_kernel_memory(uint32_t bytes) {
+	uint32_t freed = 0;
+	struct dlist_elem* pelem = shrinker_list.head.next;
+	while (pelem != &shrinker_list.tail && freed < bytes) {
+		struct shrinker* s = member_to_entry(struct shrinker, shrinker_tag, pelem);
+		freed += s->shrink(bytes - freed);
+		pelem = pelem->next;
+	}
+	return freed;
+}
+
 // the granularity of size is 1byte 
 // do_malloc 和 do_free 现在专门给内核使用，用户态的malloc逻辑我们已经提取出去了
 static void* do_alloc(uint32_t size){
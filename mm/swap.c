@@ -24,8 +24,8 @@ struct swap_info* swap_table[MAX_SWAP_DEVICES+1];
 struct lock swap_lock;
 
 static void* swap_out(void);
-static void swap_write(uint32_t pte_val, void* buf);
-static void swap_read(uint32_t pte_val, void* buf);
+static int32_t swap_write(uint32_t pte_val, void* buf);
+static int32_t swap_read(uint32_t pte_val, void* buf);
 static bool swap_in(uint32_t* pte_ptr, uint32_t page_vaddr, struct vm_area* vma);
 
 void swap_init(){
@@ -405,6 +405,62 @@ void write_protect(uint32_t err_code, void* err_vaddr) {
 	intr_set_status(_old);
 }
 
+// 直接 io 之前调用，把当前进程 [vaddr, vaddr + len) 涉及的用户页都调入内存，并增加它们的引用计数
+// swap 只会换出引用计数为 1 的页，这样 io 期间这些页就不会被换出去，DMA 用的物理地址一直有效
+// DMA 直接写物理页，不经过页表的写保护，for_write（磁盘写入内存）时还要先把写时复制的页复制出来
+// 否则数据会被写进和别的进程共享的页里
+// pin 住的页按顺序放进 pages，返回页数，之后用 unpin_user_pages 放开
+// 缓冲区不在任何 vma 中，或者要写入只读的段时返回 -1，此时已经 pin 住的页会被放开
+int32_t pin_user_pages(uint32_t vaddr, uint32_t len, bool for_write, struct page** pages) {
+    struct task_struct* cur = get_running_task_struct();
+    int32_t cnt = 0;
+    for (uint32_t page = vaddr & 0xfffff000; page < vaddr + len; page += PG_SIZE) {
+        struct vm_area* vma = find_vma(cur, page);
+        if (vma == NULL || (for_write && !(vma->vma_flags & VM_WRITE))) {
+            unpin_user_pages(pages, cnt);
+            return -1;
+        }
+        while (1) {
+            enum intr_status old = intr_disable();
+            uint32_t* pte = get_pte_ptr(cur->mm->pgdir, page);
+            if (pte != NULL && (*pte & PG_P_1)) {
+                if (for_write && !(*pte & PG_RW_W)) {
+                    // 与用户态写入时一样走写保护的处理，共享的页会被复制出来
+                    intr_set_status(old);
+                    write_protect(0, (void*)page);
+                    continue;
+                }
+                struct page* pg = ADDR_TO_PAGE(global_pages, *pte & 0xfffff000);
+                pg->ref_count++;
+                pages[cnt++] = pg;
+                intr_set_status(old);
+                break;
+            }
+            intr_set_status(old);
+            // 不在内存中（懒加载或者已经被换出），读一下触发缺页，由 swap_page 把它调进来
+            (void)*(volatile uint8_t*)page;
+        }
+    }
+    return cnt;
+}
+
+// 与 pin_user_pages 配对，io 完成后放开这些页
+// 通常进程在 io 期间阻塞在系统调用中，引用计数减掉之后至少还剩 1，直接减就行
+// 只有同一地址空间的其他线程在 io 期间触发了写时复制，我们才会是最后一个引用者，这时交给 pfree 释放
+void unpin_user_pages(struct page** pages, uint32_t cnt) {
+    enum intr_status old = intr_disable();
+    for (uint32_t i = 0; i < cnt; i++) {
+        struct page* pg = pages[i];
+        ASSERT(pg->ref_count > 0);
+        if (pg->ref_count == 1) {
+            pfree(PAGE_TO_ADDR(&user_pool, pg));
+        } else {
+            pg->ref_count--;
+        }
+    }
+    intr_set_status(old);
+}
+
 static int32_t get_swap_info_by_part(struct partition* part) {
     for (int i = 1; i <= MAX_SWAP_DEVICES; i++) {
         if (swap_table[i] && swap_table[i]->part == part) {
@@ -423,20 +479,21 @@ static int32_t alloc_swap_dev_slot(void){
     return -1;
 }
 
-void do_swapon(struct partition* part) {
+// 成功返回 0，设备已经是交换设备或者没有空闲的交换设备槽位时返回 -EBUSY，分区正忙时返回 set_blocksize 的错误
+int32_t do_swapon(struct partition* part) {
     lock_acquire(&swap_lock);
 
     if (get_swap_info_by_part(part) > 0) {
         printk("do_swapon: Device %s already mounted as a swap device.\n", part->name);
         lock_release(&swap_lock);
-        return;
+        return -EBUSY;
     }
 
     int32_t dev_id = alloc_swap_dev_slot();
     if(dev_id<0){
         printk("do_swapon: fail to swapon! no more free swap dev slot\n");
         lock_release(&swap_lock);
-        return;
+        return -EBUSY;
     }
 
     struct swap_info* si = (struct swap_info*)kmalloc(sizeof(struct swap_info));
@@ -464,6 +521,18 @@ void do_swapon(struct partition* part) {
 
     bitmap_init(&si->slot_bitmap);
 
+    // swap 总是以页为单位读写，让缓存以 4KB 为块大小来缓存这个分区
+    // 分区正被别人使用时（例如作为块设备打开着）不能改块大小，也就不能用作交换分区
+    // 此时 si 还没有放进 swap_table，不会有人用到它，直接释放即可
+    int32_t err = set_blocksize(part, PG_SIZE);
+    if (err < 0) {
+        printk("do_swapon: %s is in use, fail to swapon\n", part->name);
+        kfree(si->slot_bitmap.bits);
+        kfree(si);
+        lock_release(&swap_lock);
+        return err;
+    }
+
     ASSERT(dev_id <= MAX_SWAP_DEVICES && dev_id >= 1);
     
     si->dev_id = dev_id;
@@ -471,6 +540,7 @@ void do_swapon(struct partition* part) {
 
     printk("do_swapon: %s enabled as swap device %d, slot count: %d\n", part->name, si->dev_id, si->slot_cnt);
     lock_release(&swap_lock);
+    return 0;
 }
 
 // 目前的设计中，只要有正在使用的 slot，那么我们就拒绝卸载这个 swap 设备
@@ -479,14 +549,15 @@ void do_swapon(struct partition* part) {
 // 等到 slot 全部为空了再进行卸载，这么做需要额外考虑一下在 swapoff 的过程中，如果用户又重新 swapon 了这个设备该怎么办
 // 这时可能需要重新恢复这个设备的写权限，让其可以重新写入数据
 // 由于这个交互比较麻烦，目前先直接拒绝卸载，对于目前的使用场景来说已经足够了
-void do_swapoff(struct partition* part) {
+// 成功返回 0，分区不是交换设备时返回 -EINVAL，还有 slot 在使用或者块大小改不回去时返回 -EBUSY
+int32_t do_swapoff(struct partition* part) {
     lock_acquire(&swap_lock);
     
     int32_t dev_id = get_swap_info_by_part(part);
     if (dev_id < 0) {
         printk("swapoff: swap device not found\n");
         lock_release(&swap_lock);
-        return;
+        return -EINVAL;
     } 
 
     struct swap_info* si = swap_table[dev_id]; 
@@ -496,9 +567,18 @@ void do_swapoff(struct partition* part) {
         printk("swapoff: %s is busy (%d slots in use). Clean up tasks or wait.\n", 
                part->name, si->used_slots);
         lock_release(&swap_lock);
-        return;
+        return -EBUSY;
     } 
 
+    // 先把块大小改回去，改不了就保持交换分区开着，整个 swapoff 失败
+    // 持有 swap_lock，此时不会有换入换出在访问这个分区
+    int32_t err = set_blocksize(part, SECTOR_SIZE);
+    if (err < 0) {
+        printk("swapoff: %s is in use, fail to restore block size\n", part->name);
+        lock_release(&swap_lock);
+        return err;
+    }
+
     ASSERT(dev_id == si->dev_id);
     // 彻底释放资源
     swap_table[dev_id] = NULL;
@@ -507,6 +587,7 @@ void do_swapoff(struct partition* part) {
     printk("swapoff: %s unmounted successfully.\n", part->name);
     
     lock_release(&swap_lock);
+    return 0;
 }
 
 // 返回编码后的 PTE 值 (slot_idx << 4 | dev_id << 1)
@@ -715,8 +796,15 @@ static void* swap_out(void) {
         // 我们直接使用 kmap 来建立一个临时映射
         // 将这个物理地址临时绑定到一个高端128MB 的虚拟地址上，操作完了再释放这个虚拟地址
         void* kaddr = kmap((uint32_t)phys_addr);
-        swap_write(swap_pte, kaddr);
+        int32_t err = swap_write(swap_pte, kaddr);
         kunmap(kaddr);
+        if (err != 0) {
+            // 没写进去，页还留在内存里，映射不动
+            printk("swap_out: fail to write slot 0x%x!\n", swap_pte);
+            free_swap_slot(swap_pte);
+            lock_release(&swap_lock);
+            return NULL;
+        }
         
         // 我们直接将刚刚构造好的新 pte 条目存到相应的 pte 中
         // 这样的话，在访问这个虚拟地址时，硬件会发现 P 位为 0 并触发缺页中断
@@ -783,8 +871,15 @@ static bool swap_in(uint32_t* pte_ptr, uint32_t page_vaddr, struct vm_area* vma)
 
     // 从磁盘换入数据，利用 kmap 来防止用户的地址是一个大于 1GB 的地址
     void* kaddr = kmap((uint32_t)page_paddr);
-    swap_read(pte_val, kaddr);
+    int32_t err = swap_read(pte_val, kaddr);
     kunmap(kaddr);
+    if (err != 0) {
+        // 槽位保留，页表项不动，由调用者按段错误处理
+        pfree((uint32_t)page_paddr);
+        lock_release(&swap_lock);
+        printk("swap_in: fail to read slot 0x%x!\n", pte_val);
+        return false;
+    }
 
     // 释放磁盘槽位
     free_swap_slot(pte_val);
@@ -804,7 +899,7 @@ static bool swap_in(uint32_t* pte_ptr, uint32_t page_vaddr, struct vm_area* vma)
     return true;
 }
 
-static void swap_read(uint32_t pte_val, void* buf) {
+static int32_t swap_read(uint32_t pte_val, void* buf) {
     uint8_t dev_id = (pte_val >> 1) & 0x07;
     uint32_t slot_idx = pte_val >> 4;
     struct swap_info* si = swap_table[dev_id];
@@ -812,10 +907,10 @@ static void swap_read(uint32_t pte_val, void* buf) {
     // 一个 Slot 占 8 个扇区 (4KB / 512B)
     uint32_t logic_lba = slot_idx * 8; 
 
-    partition_read(si->part, logic_lba, buf, 8);
+    return partition_read(si->part, logic_lba, buf, 8);
 }
 
-static void swap_write(uint32_t pte_val, void* buf) {
+static int32_t swap_write(uint32_t pte_val, void* buf) {
     uint8_t dev_id = (pte_val >> 1) & 0x07;
     uint32_t slot_idx = pte_val >> 4;
     struct swap_info* si = swap_table[dev_id];
@@ -827,5 +922,5 @@ static void swap_write(uint32_t pte_val, void* buf) {
     // 一个 Slot 占 8 个扇区 (4KB / 512B)
     uint32_t logic_lba = slot_idx * 8; 
 
-    partition_write(si->part, logic_lba, buf, 8);
+    return partition_write(si->part, logic_lba, buf, 8);
 }
\ No newline at end of file
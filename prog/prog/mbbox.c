@@ -10,6 +10,7 @@
 #include <sifs_sb.h>
 #include <sifs_inode.h>
 #include <sifs_fs.h>
+#include <blkstat.h>
 
 #define CAT_BUF_SIZE 512
 
@@ -532,7 +533,10 @@ int do_swapon(int argc,char** argv){
         printf("usage: swapon <filename>\n");
         return -1;
     }
-    swapon(argv[1]);
+    if (swapon(argv[1]) < 0) {
+        printf("swapon: fail to swapon %s\n", argv[1]);
+        return -1;
+    }
     return 0;
 } 
 
@@ -541,7 +545,92 @@ int do_swapoff(int argc,char** argv){
         printf("usage: swapoff <filename>\n");
         return -1;
     }
-    swapoff(argv[1]);
+    if (swapoff(argv[1]) < 0) {
+        printf("swapoff: fail to swapoff %s\n", argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// field 在两次采样之间的增量，换算成每秒
+#define PER_SEC(now, prev, field, ms) (((now).field - (prev).field) * 1000 / (ms))
+
+static void iostat_print(char* dev, struct blk_stats* now, struct blk_stats* prev, uint32_t ms) {
+    struct buffer_stats* c = &now->cache;
+    struct buffer_stats* pc = &prev->cache;
+    uint32_t hits = c->hits - pc->hits;
+    uint32_t misses = c->misses - pc->misses;
+    uint32_t runs = c->wb_runs - pc->wb_runs;
+
+    printf("%s: rKB/s %d wKB/s %d r/s %d w/s %d merged %d flush %d\n", dev,
+           PER_SEC(now->disk, prev->disk, read_sectors, ms) / 2,
+           PER_SEC(now->disk, prev->disk, write_sectors, ms) / 2,
+           PER_SEC(now->disk, prev->disk, read_cmds, ms),
+           PER_SEC(now->disk, prev->disk, write_cmds, ms),
+           now->disk.merges - prev->disk.merges,
+           now->disk.flush_cmds - prev->disk.flush_cmds);
+    printf("  cache: hit %d miss %d hit-rate %d/100 read-dedup %d drop-behind %d evict %d dirty-evict %d size %dKB/%dKB dirty %dKB\n",
+           hits, misses, hits + misses == 0 ? 0 : hits * 100 / (hits + misses), c->read_dedups - pc->read_dedups,
+           c->demotions - pc->demotions,
+           c->evictions - pc->evictions, c->dirty_evictions - pc->dirty_evictions,
+           now->cache_bytes / 1024, now->cache_max_bytes / 1024, now->dirty_bytes / 1024);
+    printf("  writeback: runs %d blocks %d avg-run %d sectors\n",
+           runs, c->wb_blocks - pc->wb_blocks, runs == 0 ? 0 : (c->wb_sectors - pc->wb_sectors) / runs);
+    printf("  completion: polled %d intr %d poll-timeout %d\n",
+           now->disk.polled_cmds - prev->disk.polled_cmds,
+           now->disk.intr_cmds - prev->disk.intr_cmds,
+           now->disk.poll_timeouts - prev->disk.poll_timeouts);
+    // 直方图的桶以 tick（5ms）为单位，这里换算成毫秒
+    printf("  latency(ms):");
+    for (int i = 0; i < BLK_LAT_BUCKETS; i++) {
+        uint32_t n = now->disk.lat_hist[i] - prev->disk.lat_hist[i];
+        if (i == 0) {
+            printf(" <5:%d", n);
+        } else if (i == BLK_LAT_BUCKETS - 1) {
+            printf(" >=%d:%d", 5 << (i - 1), n);
+        } else {
+            printf(" %d-%d:%d", 5 << (i - 1), (5 << i) - 1, n);
+        }
+    }
+    printf("\n");
+}
+
+// iostat [dev] [interval_ms [count]]
+// 不给间隔时输出开机以来的累计值，否则每隔 interval_ms 输出一次这段时间内的增量
+int do_iostat(int argc, char** argv) {
+    char* dev = argc >= 2 ? argv[1] : "/dev/sda";
+    uint32_t ms = argc >= 3 ? atoi(argv[2]) : 0;
+    int32_t count = argc >= 4 ? atoi(argv[3]) : -1;
+
+    int32_t fd = open(dev, O_RDONLY);
+    if (fd < 0) {
+        printf("iostat: fail to open %s\n", dev);
+        printf("usage: iostat [dev] [interval_ms [count]]\n");
+        return -1;
+    }
+
+    struct blk_stats prev = {0};
+    struct blk_stats now;
+    if (ioctl(fd, BLKSTAT, (uint32_t)&now) < 0) {
+        printf("iostat: %s is not a disk\n", dev);
+        close(fd);
+        return -1;
+    }
+    if (ms == 0) {
+        // 累计值按一秒的间隔输出，每秒的速率就是总量
+        iostat_print(dev, &now, &prev, 1000);
+        close(fd);
+        return 0;
+    }
+
+    while (count != 0) {
+        prev = now;
+        msleep(ms);
+        ioctl(fd, BLKSTAT, (uint32_t)&now);
+        iostat_print(dev, &now, &prev, ms);
+        if (count > 0) count--;
+    }
+    close(fd);
     return 0;
 }
 
@@ -559,7 +648,7 @@ int main(int argc, char** argv) {
     if (strcmp(applet_name, "mbbox") == 0) {
         if (argc < 2) {
             printf("MBBox - Usage: mbbox <command> [args]\n");
-            printf("Functions: mount, umount, ps, df, cat, echo, hd, mkfs.ext2, mkfs.sifs\n");
+            printf("Functions: mount, umount, ps, df, cat, echo, hd, iostat, mkfs.ext2, mkfs.sifs\n");
             return 1;
         }
         applet_name = argv[1];
@@ -581,6 +670,7 @@ int main(int argc, char** argv) {
     if (strcmp(applet_name, "sync") == 0)   ret = do_sync(sub_argc, sub_argv);
     if (strcmp(applet_name, "swapon") == 0) ret = do_swapon(sub_argc, sub_argv);
     if (strcmp(applet_name, "swapoff") == 0) ret = do_swapoff(sub_argc, sub_argv);
+    if (strcmp(applet_name, "iostat") == 0) ret = do_iostat(sub_argc, sub_argv);
     if (strcmp(applet_name, "mkfs.ext2") == 0)     ret = do_mkfs_ext2(sub_argc, sub_argv);
     if (strcmp(applet_name, "mkfs.sifs") == 0)     ret = do_mkfs_sifs(sub_argc, sub_argv);
 
@@ -54,6 +54,22 @@ void lock_acquire(struct lock* plock){
 	}
 }
 
+// 尝试获取锁，拿不到立刻返回 false，不阻塞
+// 用在不能睡眠等待锁的地方，例如持有别的锁时反过来去拿这把锁，等待可能造成死锁
+bool lock_try_acquire(struct lock* plock) {
+	if (plock->holder == get_running_task_struct()) {
+		plock->holder_repeat_nr++;
+		return true;
+	}
+	if (!sema_try_wait(&plock->semaphore)) {
+		return false;
+	}
+	plock->holder = get_running_task_struct();
+	ASSERT(plock->holder_repeat_nr == 0);
+	plock->holder_repeat_nr = 1;
+	return true;
+}
+
 void lock_release(struct lock* plock){
 	ASSERT(plock->holder==get_running_task_struct());
 	if(plock->holder_repeat_nr>1){
@@ -66,6 +82,20 @@ void lock_release(struct lock* plock){
 	sema_signal(&plock->semaphore);
 }
 
+// 当前进程不再作为锁的持有者，锁仍然处于被持有的状态，之后由 lock_release_disowned 放开
+// 用于把锁交给异步 io：提交者拿着锁发出请求后就去做别的事，请求完成时在中断里放开锁
+void lock_disown(struct lock* plock) {
+	ASSERT(plock->holder == get_running_task_struct() && plock->holder_repeat_nr == 1);
+	plock->holder = NULL;
+	plock->holder_repeat_nr = 0;
+}
+
+// 放开一把被 lock_disown 过的锁，可以在中断上下文中调用
+void lock_release_disowned(struct lock* plock) {
+	ASSERT(plock->holder == NULL);
+	sema_signal(&plock->semaphore);
+}
+
 // 尝试获取信号量，如果拿不到，立刻返回 false，不阻塞
 bool sema_try_wait(struct semaphore* psema) {
     enum intr_status old_status = intr_disable();